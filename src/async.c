@@ -0,0 +1,457 @@
+/* async.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "async.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+static const int ZERO = 0;
+
+#define MONGO_ASYNC_BUFFER_SIZE 16384
+#define MONGO_ASYNC_MAX_EVENTS 64
+
+/* Event loop */
+
+int mongo_async_loop_init( mongo_async_loop* loop ) {
+    loop->pending = 0;
+    loop->epfd = epoll_create( MONGO_ASYNC_MAX_EVENTS );
+
+    return loop->epfd == -1 ? MONGO_ERROR : MONGO_OK;
+}
+
+void mongo_async_loop_destroy( mongo_async_loop* loop ) {
+    if( loop->epfd != -1 )
+        close( loop->epfd );
+    loop->epfd = -1;
+}
+
+static int mongo_async_watch( mongo_async_conn* aconn, int op ) {
+    struct epoll_event ev;
+
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN | ( aconn->writing ? EPOLLOUT : 0 );
+    ev.data.ptr = aconn;
+
+    return epoll_ctl( aconn->loop->epfd, op, aconn->conn->sock, &ev );
+}
+
+/* Complete an operation and free it. */
+static void mongo_async_complete( mongo_async_conn* aconn, mongo_async_op* op,
+    int status, const mongo_reply* reply ) {
+
+    aconn->loop->pending--;
+    if( op->cb )
+        op->cb( aconn, status, reply, op->arg );
+    free( op );
+}
+
+/* Fail every operation in flight, e.g. after a socket error. */
+static void mongo_async_fail_all( mongo_async_conn* aconn ) {
+    mongo_async_op* op;
+
+    aconn->wbuf_len = aconn->wbuf_sent = 0;
+    aconn->rbuf_len = 0;
+
+    while( ( op = aconn->ops ) != NULL ) {
+        aconn->ops = op->next;
+        mongo_async_complete( aconn, op, MONGO_ERROR, NULL );
+    }
+    aconn->ops_tail = NULL;
+}
+
+/* Take the connection out of the loop for good and fail what is in
+ * flight; later operations fail at once with the same error. */
+static void mongo_async_conn_error( mongo_async_conn* aconn, int err ) {
+    aconn->conn->err = err;
+    aconn->dead = 1;
+    aconn->writing = 0;
+    epoll_ctl( aconn->loop->epfd, EPOLL_CTL_DEL, aconn->conn->sock, NULL );
+    mongo_async_fail_all( aconn );
+}
+
+static void mongo_async_io_error( mongo_async_conn* aconn ) {
+    mongo_async_conn_error( aconn, MONGO_IO_ERROR );
+}
+
+/* Unlink the in-flight operation with the given request id. */
+static mongo_async_op* mongo_async_take( mongo_async_conn* aconn, int id ) {
+    mongo_async_op* op = aconn->ops;
+    mongo_async_op* prev = NULL;
+
+    while( op && op->id != id ) {
+        prev = op;
+        op = op->next;
+    }
+
+    if( !op )
+        return NULL;
+
+    if( prev )
+        prev->next = op->next;
+    else
+        aconn->ops = op->next;
+    if( aconn->ops_tail == op )
+        aconn->ops_tail = prev;
+
+    return op;
+}
+
+/* Complete reply-less operations whose bytes have all been written. */
+static void mongo_async_complete_writes( mongo_async_conn* aconn ) {
+    mongo_async_op* op;
+
+    /* A callback may queue, complete or fail other operations, so
+     * rescan from the head after each one. */
+    do {
+        for( op = aconn->ops; op; op = op->next )
+            if( op->write_end >= 0 && op->write_end <= aconn->wbuf_sent )
+                break;
+        if( op ) {
+            mongo_async_take( aconn, op->id );
+            mongo_async_complete( aconn, op, MONGO_OK, NULL );
+        }
+    } while( op );
+}
+
+static void mongo_async_flush( mongo_async_conn* aconn ) {
+    while( aconn->wbuf_sent < aconn->wbuf_len ) {
+        int sent = send( aconn->conn->sock, aconn->wbuf + aconn->wbuf_sent,
+                         aconn->wbuf_len - aconn->wbuf_sent, 0 );
+        if( sent == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            mongo_async_io_error( aconn );
+            return;
+        }
+        aconn->wbuf_sent += sent;
+    }
+
+    mongo_async_complete_writes( aconn );
+    if( aconn->dead )
+        return;
+
+    /* Everything written: reply-less ops have completed, so the
+     * buffer can start over. */
+    if( aconn->wbuf_sent == aconn->wbuf_len ) {
+        aconn->wbuf_len = aconn->wbuf_sent = 0;
+
+        if( aconn->writing ) {
+            aconn->writing = 0;
+            if( mongo_async_watch( aconn, EPOLL_CTL_MOD ) == -1 )
+                mongo_async_io_error( aconn );
+        }
+    }
+    else if( !aconn->writing ) {
+        aconn->writing = 1;
+        if( mongo_async_watch( aconn, EPOLL_CTL_MOD ) == -1 )
+            mongo_async_io_error( aconn );
+    }
+}
+
+/* Convert a complete reply in place to native endianness. */
+static mongo_reply* mongo_async_native_reply( char* data ) {
+    mongo_reply* reply = (mongo_reply*)data;
+    mongo_header head;
+    mongo_reply_fields fields;
+
+    bson_little_endian32( &head.len, &reply->head.len );
+    bson_little_endian32( &head.id, &reply->head.id );
+    bson_little_endian32( &head.responseTo, &reply->head.responseTo );
+    bson_little_endian32( &head.op, &reply->head.op );
+    bson_little_endian32( &fields.flag, &reply->fields.flag );
+    bson_little_endian64( &fields.cursorID, &reply->fields.cursorID );
+    bson_little_endian32( &fields.start, &reply->fields.start );
+    bson_little_endian32( &fields.num, &reply->fields.num );
+
+    reply->head = head;
+    reply->fields = fields;
+
+    return reply;
+}
+
+static void mongo_async_read( mongo_async_conn* aconn ) {
+    const int hlen = sizeof( mongo_header ) + sizeof( mongo_reply_fields );
+    int consumed = 0;
+    int closed = 0;
+    int len;
+
+    while( 1 ) {
+        int got;
+
+        if( aconn->rbuf_len == aconn->rbuf_size ) {
+            aconn->rbuf_size *= 2;
+            aconn->rbuf = bson_realloc( aconn->rbuf, aconn->rbuf_size );
+        }
+
+        got = recv( aconn->conn->sock, aconn->rbuf + aconn->rbuf_len,
+                    aconn->rbuf_size - aconn->rbuf_len, 0 );
+        if( got == -1 && errno == EINTR )
+            continue;
+        if( got == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            break;
+        if( got <= 0 ) {
+            closed = 1;
+            break;
+        }
+        aconn->rbuf_len += got;
+    }
+
+    /* Dispatch every complete reply in the buffer. */
+    while( aconn->rbuf_len - consumed >= hlen ) {
+        mongo_reply* reply;
+        mongo_async_op* op;
+
+        bson_little_endian32( &len, aconn->rbuf + consumed );
+        if( len < hlen || len > 64*1024*1024 ) {
+            mongo_async_conn_error( aconn, MONGO_READ_SIZE_ERROR );
+            return;
+        }
+        if( aconn->rbuf_len - consumed < len )
+            break;
+
+        reply = mongo_async_native_reply( aconn->rbuf + consumed );
+        consumed += len;
+
+        op = mongo_async_take( aconn, reply->head.responseTo );
+        if( op )
+            mongo_async_complete( aconn, op, MONGO_OK, reply );
+    }
+
+    if( consumed ) {
+        memmove( aconn->rbuf, aconn->rbuf + consumed, aconn->rbuf_len - consumed );
+        aconn->rbuf_len -= consumed;
+    }
+
+    /* Replies that arrived before the connection closed are delivered
+     * above; only the requests still outstanding fail. */
+    if( closed )
+        mongo_async_io_error( aconn );
+}
+
+int mongo_async_loop_run_once( mongo_async_loop* loop, int timeout_ms ) {
+    struct epoll_event events[MONGO_ASYNC_MAX_EVENTS];
+    int n, i;
+
+    n = epoll_wait( loop->epfd, events, MONGO_ASYNC_MAX_EVENTS, timeout_ms );
+    if( n == -1 )
+        return errno == EINTR ? 0 : MONGO_ERROR;
+
+    for( i=0; i<n; i++ ) {
+        mongo_async_conn* aconn = (mongo_async_conn*)events[i].data.ptr;
+
+        if( events[i].events & ( EPOLLERR | EPOLLHUP ) && !( events[i].events & EPOLLIN ) ) {
+            mongo_async_io_error( aconn );
+            continue;
+        }
+        if( events[i].events & EPOLLOUT )
+            mongo_async_flush( aconn );
+        if( events[i].events & EPOLLIN && !aconn->dead )
+            mongo_async_read( aconn );
+    }
+
+    return n;
+}
+
+int mongo_async_loop_run( mongo_async_loop* loop ) {
+    while( loop->pending > 0 ) {
+        if( mongo_async_loop_run_once( loop, -1 ) == MONGO_ERROR )
+            return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* Connections */
+
+int mongo_async_conn_init( mongo_async_conn* aconn, mongo_async_loop* loop,
+    mongo_connection* conn ) {
+
+    aconn->conn = conn;
+    aconn->loop = loop;
+    aconn->ops = aconn->ops_tail = NULL;
+    aconn->writing = 0;
+    aconn->dead = 0;
+
+    aconn->wbuf_size = MONGO_ASYNC_BUFFER_SIZE;
+    aconn->wbuf = bson_malloc( aconn->wbuf_size );
+    aconn->wbuf_len = aconn->wbuf_sent = 0;
+
+    aconn->rbuf_size = MONGO_ASYNC_BUFFER_SIZE;
+    aconn->rbuf = bson_malloc( aconn->rbuf_size );
+    aconn->rbuf_len = 0;
+
+    /* Hand over anything the blocking path had already read ahead. */
+    if( conn->rbuf_end > conn->rbuf_start ) {
+        int buffered = conn->rbuf_end - conn->rbuf_start;
+        while( aconn->rbuf_size < buffered )
+            aconn->rbuf_size *= 2;
+        aconn->rbuf = bson_realloc( aconn->rbuf, aconn->rbuf_size );
+        memcpy( aconn->rbuf, conn->rbuf + conn->rbuf_start, buffered );
+        aconn->rbuf_len = buffered;
+        conn->rbuf_start = conn->rbuf_end = 0;
+    }
+
+    if( mongo_socket_set_blocking( conn->sock, 0 ) != MONGO_OK ||
+        mongo_async_watch( aconn, EPOLL_CTL_ADD ) == -1 ) {
+
+        conn->err = MONGO_IO_ERROR;
+        free( aconn->wbuf );
+        free( aconn->rbuf );
+        aconn->wbuf = aconn->rbuf = NULL;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+void mongo_async_conn_destroy( mongo_async_conn* aconn ) {
+    aconn->dead = 1;
+    aconn->writing = 0;
+    epoll_ctl( aconn->loop->epfd, EPOLL_CTL_DEL, aconn->conn->sock, NULL );
+    mongo_async_fail_all( aconn );
+
+    /* Back to the mode the blocking path expects. */
+    mongo_conn_set_io_mode( aconn->conn );
+
+    free( aconn->wbuf );
+    free( aconn->rbuf );
+    aconn->wbuf = aconn->rbuf = NULL;
+}
+
+/* Copy a finished message into the write buffer and track its operation. */
+static int mongo_async_queue( mongo_async_conn* aconn, mongo_msg* msg,
+    int expects_reply, mongo_async_cb cb, void* arg ) {
+
+    mongo_async_op* op;
+
+    /* conn->err still holds the error that killed the connection. */
+    if( aconn->dead ) {
+        mongo_msg_destroy( msg );
+        return MONGO_ERROR;
+    }
+
+    /* Let the loop batch everything queued before it next runs. */
+    if( !aconn->writing ) {
+        aconn->writing = 1;
+        if( mongo_async_watch( aconn, EPOLL_CTL_MOD ) == -1 ) {
+            mongo_msg_destroy( msg );
+            mongo_async_io_error( aconn );
+            return MONGO_ERROR;
+        }
+    }
+
+    if( aconn->wbuf_size - aconn->wbuf_len < msg->len ) {
+        while( aconn->wbuf_size - aconn->wbuf_len < msg->len )
+            aconn->wbuf_size *= 2;
+        aconn->wbuf = bson_realloc( aconn->wbuf, aconn->wbuf_size );
+    }
+
+    mongo_msg_copy( msg, aconn->wbuf + aconn->wbuf_len );
+    aconn->wbuf_len += msg->len;
+
+    op = (mongo_async_op*)bson_malloc( sizeof( mongo_async_op ) );
+    op->id = msg->id;
+    op->write_end = expects_reply ? -1 : aconn->wbuf_len;
+    op->cb = cb;
+    op->arg = arg;
+    op->next = NULL;
+
+    if( aconn->ops_tail )
+        aconn->ops_tail->next = op;
+    else
+        aconn->ops = op;
+    aconn->ops_tail = op;
+    aconn->loop->pending++;
+
+    mongo_msg_destroy( msg );
+
+    return MONGO_OK;
+}
+
+int mongo_async_find( mongo_async_conn* aconn, const char* ns, bson* query,
+    bson* fields, int nToReturn, int nToSkip, int options,
+    mongo_async_cb cb, void* arg ) {
+
+    mongo_msg msg;
+
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append32( &msg, &options );
+    mongo_msg_append_ref( &msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( &msg, &nToSkip );
+    mongo_msg_append32( &msg, &nToReturn );
+    mongo_msg_append_ref( &msg, query->data, bson_size( query ) );
+    if( fields )
+        mongo_msg_append_ref( &msg, fields->data, bson_size( fields ) );
+
+    return mongo_async_queue( aconn, &msg, 1, cb, arg );
+}
+
+int mongo_async_get_more( mongo_async_conn* aconn, const char* ns,
+    int64_t cursorID, int nToReturn, mongo_async_cb cb, void* arg ) {
+
+    mongo_msg msg;
+
+    mongo_msg_init( &msg, MONGO_OP_GET_MORE );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( &msg, &nToReturn );
+    mongo_msg_append64( &msg, &cursorID );
+
+    return mongo_async_queue( aconn, &msg, 1, cb, arg );
+}
+
+int mongo_async_insert( mongo_async_conn* aconn, const char* ns, bson* data,
+    mongo_async_cb cb, void* arg ) {
+
+    mongo_msg msg;
+
+    if( data->err & ( BSON_NOT_UTF8 | BSON_FIELD_HAS_DOT | BSON_FIELD_INIT_DOLLAR ) ) {
+        aconn->conn->err = MONGO_BSON_INVALID;
+        return MONGO_ERROR;
+    }
+
+    mongo_msg_init( &msg, MONGO_OP_INSERT );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append_ref( &msg, data->data, bson_size( data ) );
+
+    return mongo_async_queue( aconn, &msg, 0, cb, arg );
+}
+
+int mongo_async_run_command( mongo_async_conn* aconn, const char* db,
+    bson* command, mongo_async_cb cb, void* arg ) {
+
+    static const int MINUS_ONE = -1;
+    mongo_msg msg;
+    int sl = strlen( db );
+
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, db, sl );
+    mongo_msg_append_ref( &msg, ".$cmd", 6 );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append32( &msg, &MINUS_ONE );
+    mongo_msg_append_ref( &msg, command->data, bson_size( command ) );
+
+    return mongo_async_queue( aconn, &msg, 1, cb, arg );
+}
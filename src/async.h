@@ -0,0 +1,159 @@
+/**
+ * @file async.h
+ * @brief Non-blocking, event-loop-driven requests (Linux epoll).
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_ASYNC_H_
+#define _MONGO_ASYNC_H_
+
+#include "mongo.h"
+
+MONGO_EXTERN_C_START
+
+struct mongo_async_conn;
+
+/**
+ * Completion callback for asynchronous operations.
+ *
+ * @param aconn the connection the operation ran on.
+ * @param status MONGO_OK, or MONGO_ERROR with aconn->conn->err set.
+ * @param reply the server's reply, or NULL for operations that have no
+ *     reply (inserts complete once written). The reply is only valid for
+ *     the duration of the callback.
+ * @param arg the argument given when the operation was queued.
+ */
+typedef void (*mongo_async_cb)( struct mongo_async_conn* aconn, int status,
+    const mongo_reply* reply, void* arg );
+
+typedef struct mongo_async_op {
+    int id;                      /**< Request id; replies are matched on responseTo. */
+    int write_end;               /**< For reply-less ops, wbuf offset that completes them. */
+    mongo_async_cb cb;
+    void* arg;
+    struct mongo_async_op* next;
+} mongo_async_op;
+
+typedef struct {
+    int epfd;          /**< epoll descriptor. */
+    int pending;       /**< Operations in flight across all connections. */
+} mongo_async_loop;
+
+typedef struct mongo_async_conn {
+    mongo_connection* conn;    /**< Connection is *not* owned by the async connection. */
+    mongo_async_loop* loop;
+
+    char* wbuf;                /**< Serialized messages waiting to be written. */
+    int wbuf_len;
+    int wbuf_sent;
+    int wbuf_size;
+
+    char* rbuf;                /**< Partially received replies. */
+    int rbuf_len;
+    int rbuf_size;
+
+    mongo_async_op* ops;       /**< Operations in flight, oldest first. */
+    mongo_async_op* ops_tail;
+    int writing;               /**< Whether EPOLLOUT is currently requested. */
+    int dead;                  /**< Set once the socket failed; see conn->err. */
+} mongo_async_conn;
+
+/**
+ * Create an event loop.
+ *
+ * @return MONGO_OK or MONGO_ERROR if epoll is unavailable.
+ */
+int mongo_async_loop_init( mongo_async_loop* loop );
+
+/**
+ * Destroy an event loop. All attached connections must have been
+ * destroyed first.
+ */
+void mongo_async_loop_destroy( mongo_async_loop* loop );
+
+/**
+ * Wait for socket events and dispatch completions.
+ *
+ * @param loop the event loop.
+ * @param timeout_ms how long to wait for events; -1 waits forever.
+ *
+ * @return the number of sockets that had events, or MONGO_ERROR.
+ */
+int mongo_async_loop_run_once( mongo_async_loop* loop, int timeout_ms );
+
+/**
+ * Run the loop until no operations are in flight.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mongo_async_loop_run( mongo_async_loop* loop );
+
+/**
+ * Attach a connected mongo_connection to an event loop. The socket is
+ * switched to non-blocking mode until mongo_async_conn_destroy.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_async_conn_init( mongo_async_conn* aconn, mongo_async_loop* loop,
+    mongo_connection* conn );
+
+/**
+ * Detach from the loop. Operations still in flight complete with
+ * MONGO_ERROR. The connection is left in blocking mode, but it should be
+ * reconnected if operations were cancelled, since their replies may
+ * still arrive.
+ */
+void mongo_async_conn_destroy( mongo_async_conn* aconn );
+
+/**
+ * Queue a query. The callback receives the first batch.
+ *
+ * The arguments follow mongo_find. The query and fields are copied, so
+ * they may be destroyed as soon as this function returns.
+ *
+ * @return MONGO_OK.
+ */
+int mongo_async_find( mongo_async_conn* aconn, const char* ns, bson* query,
+    bson* fields, int nToReturn, int nToSkip, int options,
+    mongo_async_cb cb, void* arg );
+
+/**
+ * Queue an OP_GET_MORE for an open cursor.
+ *
+ * @param cursorID the cursor id from a previous reply.
+ * @param nToReturn the batch size, or 0 for the server default.
+ */
+int mongo_async_get_more( mongo_async_conn* aconn, const char* ns,
+    int64_t cursorID, int nToReturn, mongo_async_cb cb, void* arg );
+
+/**
+ * Queue an insert. The callback runs with a NULL reply once the message
+ * has been handed to the kernel.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the document is not valid for insert.
+ */
+int mongo_async_insert( mongo_async_conn* aconn, const char* ns, bson* data,
+    mongo_async_cb cb, void* arg );
+
+/**
+ * Queue a command. The callback receives a reply with a single document.
+ */
+int mongo_async_run_command( mongo_async_conn* aconn, const char* db,
+    bson* command, mongo_async_cb cb, void* arg );
+
+MONGO_EXTERN_C_END
+#endif
@@ -755,6 +755,130 @@ int bson_append_finish_object( bson_buffer * b ){
     return BSON_OK;
 }
 
+/* ----------------------------
+   TEMPLATES
+   ------------------------------ */
+
+/* Find the value at a dotted path, descending into objects and arrays. */
+static const char * bson_template_find( const char * data, const char * path, bson_type * type ){
+    bson_iterator it;
+    const char * dot = strchr( path, '.' );
+    size_t len = dot ? (size_t)( dot - path ) : strlen( path );
+
+    bson_iterator_init( &it, data );
+    while( bson_iterator_next( &it ) ){
+        const char * key = bson_iterator_key( &it );
+        if ( strncmp( key, path, len ) != 0 || key[len] )
+            continue;
+        if ( !dot ){
+            *type = bson_iterator_type( &it );
+            return bson_iterator_value( &it );
+        }
+        if ( bson_iterator_type( &it ) == BSON_OBJECT || bson_iterator_type( &it ) == BSON_ARRAY )
+            return bson_template_find( bson_iterator_value( &it ), dot + 1, type );
+        return NULL;
+    }
+    return NULL;
+}
+
+int bson_template_init( bson_template * t, const bson * doc ){
+    bson_copy( &t->doc, doc );
+    t->slots = NULL;
+    t->num_slots = 0;
+    return BSON_OK;
+}
+
+int bson_template_add_slot( bson_template * t, const char * path ){
+    bson_type type = BSON_EOO;
+    const char * value = bson_template_find( t->doc.data, path, &type );
+
+    if ( !value )
+        return BSON_ERROR;
+
+    switch ( type ){
+    case BSON_INT: case BSON_LONG: case BSON_DOUBLE: case BSON_DATE:
+    case BSON_OID: case BSON_BOOL: case BSON_TIMESTAMP:
+        break;
+    default:
+        return BSON_ERROR;
+    }
+
+    t->slots = (bson_template_slot*)bson_realloc( t->slots,
+        ( t->num_slots + 1 ) * sizeof( bson_template_slot ) );
+    t->slots[t->num_slots].offset = (int)( value - t->doc.data );
+    t->slots[t->num_slots].type = type;
+
+    return t->num_slots++;
+}
+
+void bson_template_copy( const bson_template * t, bson * out ){
+    bson_copy( out, &t->doc );
+}
+
+void bson_template_destroy( bson_template * t ){
+    bson_destroy( &t->doc );
+    free( t->slots );
+    t->slots = NULL;
+    t->num_slots = 0;
+}
+
+/* Where to write a value of the given type, or NULL on a mismatch. */
+static char * bson_template_value( const bson_template * t, bson * doc, int slot, bson_type type ){
+    if ( slot < 0 || slot >= t->num_slots || t->slots[slot].type != type )
+        return NULL;
+    return doc->data + t->slots[slot].offset;
+}
+
+int bson_template_set_int( const bson_template * t, bson * doc, int slot, int i ){
+    char * value = bson_template_value( t, doc, slot, BSON_INT );
+    if ( !value ) return BSON_ERROR;
+    bson_little_endian32( value, &i );
+    return BSON_OK;
+}
+
+int bson_template_set_long( const bson_template * t, bson * doc, int slot, int64_t i ){
+    char * value = bson_template_value( t, doc, slot, BSON_LONG );
+    if ( !value ) return BSON_ERROR;
+    bson_little_endian64( value, &i );
+    return BSON_OK;
+}
+
+int bson_template_set_double( const bson_template * t, bson * doc, int slot, double d ){
+    char * value = bson_template_value( t, doc, slot, BSON_DOUBLE );
+    if ( !value ) return BSON_ERROR;
+    bson_little_endian64( value, &d );
+    return BSON_OK;
+}
+
+int bson_template_set_date( const bson_template * t, bson * doc, int slot, bson_date_t millis ){
+    char * value = bson_template_value( t, doc, slot, BSON_DATE );
+    if ( !value ) return BSON_ERROR;
+    bson_little_endian64( value, &millis );
+    return BSON_OK;
+}
+
+int bson_template_set_oid( const bson_template * t, bson * doc, int slot, const bson_oid_t * oid ){
+    char * value = bson_template_value( t, doc, slot, BSON_OID );
+    if ( !value ) return BSON_ERROR;
+    memcpy( value, oid, 12 );
+    return BSON_OK;
+}
+
+int bson_template_set_bool( const bson_template * t, bson * doc, int slot, bson_bool_t v ){
+    char * value = bson_template_value( t, doc, slot, BSON_BOOL );
+    if ( !value ) return BSON_ERROR;
+    *value = v != 0;
+    return BSON_OK;
+}
+
+int bson_template_set_timestamp( const bson_template * t, bson * doc, int slot, bson_timestamp_t * ts ){
+    char * value = bson_template_value( t, doc, slot, BSON_TIMESTAMP );
+    if ( !value ) return BSON_ERROR;
+    bson_little_endian32( value, &ts->i );
+    bson_little_endian32( value + 4, &ts->t );
+    return BSON_OK;
+}
+
 void* bson_malloc(int size){
     void* p = malloc(size);
     bson_fatal_msg(!!p, "malloc() failed");
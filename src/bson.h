@@ -111,6 +111,17 @@ typedef struct {
   int t; /* time in seconds */
 } bson_timestamp_t;
 
+typedef struct {
+    int offset;     /**< Where the slot's value starts in the document. */
+    bson_type type; /**< Type of the value, which fixes its width. */
+} bson_template_slot;
+
+typedef struct {
+    bson doc;                  /**< The document, with the values last written in place. */
+    bson_template_slot* slots;
+    int num_slots;
+} bson_template;
+
 
 /* ----------------------------
    READING
@@ -868,6 +879,70 @@ int bson_append_finish_object( bson_buffer * b );
 void bson_numstr(char* str, int i);
 void bson_incnumstr(char* str);
 
+/* ----------------------------
+   TEMPLATES
+   ------------------------------ */
+
+/**
+ * Make a template from a document built once with placeholder values.
+ * Slots then name the fixed-width values that change between uses, which
+ * are written over without re-encoding or re-validating the document.
+ *
+ * @param t the bson_template to initialize.
+ * @param doc the document, which is copied.
+ *
+ * @return BSON_OK.
+ */
+int bson_template_init( bson_template * t, const bson * doc );
+
+/**
+ * Make the value at a dotted path, such as "ts.$gt", a slot.
+ *
+ * @param t the bson_template.
+ * @param path the field's key, with the keys of enclosing objects and
+ *     arrays before it, separated by '.'.
+ *
+ * @return the slot's index, for the bson_template_set functions, or
+ *     BSON_ERROR if there is no such field or its value is not an int,
+ *     long, double, date, oid, bool or timestamp.
+ */
+int bson_template_add_slot( bson_template * t, const char * path );
+
+/**
+ * Copy the template's document, with the values last written in place,
+ * so that it can be patched without changing the template.
+ *
+ * @param t the bson_template.
+ * @param out the copy, to be freed with bson_destroy.
+ */
+void bson_template_copy( const bson_template * t, bson * out );
+
+/**
+ * Free the template's document and slots.
+ *
+ * @param t the bson_template.
+ */
+void bson_template_destroy( bson_template * t );
+
+/**
+ * Write a value into a slot of the template's own document, t->doc, or
+ * of a copy of it. The value's type must match the slot's.
+ *
+ * @param t the bson_template.
+ * @param doc t->doc or a copy from bson_template_copy.
+ * @param slot an index from bson_template_add_slot.
+ *
+ * @return BSON_OK or BSON_ERROR if the slot doesn't exist or holds a
+ *     value of a different type.
+ */
+int bson_template_set_int( const bson_template * t, bson * doc, int slot, int i );
+int bson_template_set_long( const bson_template * t, bson * doc, int slot, int64_t i );
+int bson_template_set_double( const bson_template * t, bson * doc, int slot, double d );
+int bson_template_set_date( const bson_template * t, bson * doc, int slot, bson_date_t millis );
+int bson_template_set_oid( const bson_template * t, bson * doc, int slot, const bson_oid_t * oid );
+int bson_template_set_bool( const bson_template * t, bson * doc, int slot, bson_bool_t v );
+int bson_template_set_timestamp( const bson_template * t, bson * doc, int slot, bson_timestamp_t * ts );
+
 
 /* ------------------------------
    ERROR HANDLING - also used in mongo code
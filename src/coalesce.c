@@ -0,0 +1,248 @@
+/* coalesce.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/* clock_gettime and pthread_cond_timedwait */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "coalesce.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const int ZERO = 0;
+
+void mongo_coalescer_init( mongo_coalescer* c, mongo_connection* conn, const char* ns ) {
+    const char* dot = strchr( ns, '.' );
+    int db_len = dot ? dot - ns : (int)strlen( ns );
+
+    c->conn = conn;
+    c->ns = (char*)bson_malloc( strlen( ns ) + 1 );
+    strcpy( c->ns, ns );
+    c->db = (char*)bson_malloc( db_len + 1 );
+    memcpy( c->db, ns, db_len );
+    c->db[db_len] = '\0';
+
+    c->buf = NULL;
+    c->buf_len = 0;
+    c->buf_size = 0;
+    c->count = 0;
+    c->oldest_usec = 0;
+
+    c->max_bytes = 64 * 1024;
+    c->max_docs = 1000;
+    c->max_delay_ms = 0;
+
+    mongo_mutex_init( &c->mutex );
+    mongo_cond_init( &c->cond );
+    c->running = 0;
+    c->stopping = 0;
+
+    c->flushes = 0;
+    c->flushed_docs = 0;
+    c->err = 0;
+}
+
+void mongo_coalescer_set_limits( mongo_coalescer* c, int max_bytes,
+    int max_docs, int max_delay_ms ) {
+
+    mongo_mutex_lock( &c->mutex );
+    c->max_bytes = max_bytes;
+    c->max_docs = max_docs;
+    c->max_delay_ms = max_delay_ms;
+    mongo_cond_signal( &c->cond );
+    mongo_mutex_unlock( &c->mutex );
+}
+
+/* Send the buffered documents as one OP_INSERT. Called with the lock held. */
+static int mongo_coalescer_flush_locked( mongo_coalescer* c ) {
+    mongo_msg msg;
+    int res;
+
+    if( !c->count )
+        return MONGO_OK;
+
+    mongo_msg_init( &msg, MONGO_OP_INSERT );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, c->ns, strlen( c->ns ) + 1 );
+    mongo_msg_append_ref( &msg, c->buf, c->buf_len );
+
+    res = mongo_msg_send( c->conn, &msg );
+    if( res == MONGO_OK ) {
+        c->flushes++;
+        c->flushed_docs += c->count;
+    }
+    else
+        c->err = c->conn->err;
+
+    /* Unacknowledged writes are not retried. */
+    c->buf_len = 0;
+    c->count = 0;
+
+    return res;
+}
+
+int mongo_coalescer_insert( mongo_coalescer* c, bson* doc ) {
+    int len = bson_size( doc );
+    int res = MONGO_OK;
+    int64_t now;
+
+    mongo_mutex_lock( &c->mutex );
+
+    if( doc->err & ( BSON_NOT_UTF8 | BSON_FIELD_HAS_DOT | BSON_FIELD_INIT_DOLLAR ) ) {
+        c->err = MONGO_BSON_INVALID;
+        mongo_mutex_unlock( &c->mutex );
+        return MONGO_ERROR;
+    }
+
+    /* Keep the message under the server's limit, when it is known. */
+    if( c->count && c->conn->max_msg_size &&
+        c->buf_len + len + 64 + (int)strlen( c->ns ) > c->conn->max_msg_size )
+        res = mongo_coalescer_flush_locked( c );
+
+    if( c->buf_size - c->buf_len < len ) {
+        if( !c->buf_size )
+            c->buf_size = 4096;
+        while( c->buf_size - c->buf_len < len )
+            c->buf_size *= 2;
+        c->buf = (char*)bson_realloc( c->buf, c->buf_size );
+    }
+
+    memcpy( c->buf + c->buf_len, doc->data, len );
+    c->buf_len += len;
+
+    now = c->max_delay_ms ? mongo_now_usec() : 0;
+    if( c->count++ == 0 ) {
+        c->oldest_usec = now;
+        if( c->running )
+            mongo_cond_signal( &c->cond );
+    }
+
+    if( c->buf_len >= c->max_bytes || c->count >= c->max_docs ||
+        ( c->max_delay_ms && now - c->oldest_usec >= (int64_t)c->max_delay_ms * 1000 ) ) {
+        if( mongo_coalescer_flush_locked( c ) != MONGO_OK )
+            res = MONGO_ERROR;
+    }
+
+    mongo_mutex_unlock( &c->mutex );
+    return res;
+}
+
+int mongo_coalescer_flush( mongo_coalescer* c ) {
+    int res;
+
+    mongo_mutex_lock( &c->mutex );
+    res = mongo_coalescer_flush_locked( c );
+    mongo_mutex_unlock( &c->mutex );
+
+    return res;
+}
+
+int mongo_coalescer_barrier( mongo_coalescer* c ) {
+    int res;
+
+    mongo_mutex_lock( &c->mutex );
+    res = mongo_coalescer_flush_locked( c );
+    if( res == MONGO_OK )
+        res = mongo_cmd_get_last_error( c->conn, c->db, NULL );
+    mongo_mutex_unlock( &c->mutex );
+
+    return res;
+}
+
+/* Wait on the condition for at most usec microseconds. */
+static void mongo_coalescer_wait( mongo_coalescer* c, int64_t usec ) {
+#ifdef _WIN32
+    SleepConditionVariableCS( &c->cond, &c->mutex, (DWORD)( usec / 1000 + 1 ) );
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec += ( usec % 1000000 ) * 1000;
+    if( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( &c->cond, &c->mutex, &ts );
+#endif
+}
+
+static void* mongo_coalescer_run( void* arg ) {
+    mongo_coalescer* c = (mongo_coalescer*)arg;
+    int64_t remaining;
+
+    mongo_mutex_lock( &c->mutex );
+    while( !c->stopping ) {
+        if( !c->count || !c->max_delay_ms ) {
+            mongo_cond_wait( &c->cond, &c->mutex );
+            continue;
+        }
+
+        remaining = c->oldest_usec + (int64_t)c->max_delay_ms * 1000 - mongo_now_usec();
+        if( remaining <= 0 )
+            mongo_coalescer_flush_locked( c );
+        else
+            mongo_coalescer_wait( c, remaining );
+    }
+    mongo_mutex_unlock( &c->mutex );
+
+    return NULL;
+}
+
+int mongo_coalescer_start( mongo_coalescer* c ) {
+    if( c->running )
+        return MONGO_OK;
+
+    c->stopping = 0;
+    c->running = 1;
+    if( mongo_thread_create( &c->thread, mongo_coalescer_run, c ) != 0 ) {
+        c->running = 0;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_coalescer_stop( mongo_coalescer* c ) {
+    if( c->running ) {
+        mongo_mutex_lock( &c->mutex );
+        c->stopping = 1;
+        mongo_cond_signal( &c->cond );
+        mongo_mutex_unlock( &c->mutex );
+
+        mongo_thread_join( c->thread );
+        c->running = 0;
+    }
+
+    return mongo_coalescer_flush( c );
+}
+
+void mongo_coalescer_destroy( mongo_coalescer* c ) {
+    mongo_coalescer_stop( c );
+
+    free( c->ns );
+    free( c->db );
+    free( c->buf );
+    c->ns = c->db = c->buf = NULL;
+    c->buf_len = c->buf_size = 0;
+
+    mongo_cond_destroy( &c->cond );
+    mongo_mutex_destroy( &c->mutex );
+}
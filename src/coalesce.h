@@ -0,0 +1,132 @@
+/**
+ * @file coalesce.h
+ * @brief Write-behind buffering of fire-and-forget inserts.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_COALESCE_H_
+#define _MONGO_COALESCE_H_
+
+#include "mongo.h"
+#include "thread.h"
+
+MONGO_EXTERN_C_START
+
+typedef struct {
+    mongo_connection* conn;  /**< connection is *not* owned by the coalescer */
+    char* ns;
+    char* db;                /**< Database part of ns, for getlasterror. */
+
+    char* buf;               /**< Buffered documents, back to back. */
+    int buf_len;
+    int buf_size;
+    int count;               /**< Documents in buf. */
+    int64_t oldest_usec;     /**< When the first buffered document was added. */
+
+    int max_bytes;           /**< Flush once this many bytes are buffered. */
+    int max_docs;            /**< Flush once this many documents are buffered. */
+    int max_delay_ms;        /**< Flush documents buffered this long; 0 disables. */
+
+    mongo_mutex_t mutex;
+    mongo_cond_t cond;
+    mongo_thread_t thread;
+    int running;             /**< Whether the flush thread is running. */
+    int stopping;
+
+    int64_t flushes;         /**< OP_INSERT messages written. */
+    int64_t flushed_docs;    /**< Documents written. */
+    int err;                 /**< conn->err from the most recent failed flush. */
+} mongo_coalescer;
+
+/**
+ * Initialize a write-behind buffer for unacknowledged inserts into one
+ * namespace. Buffered documents go out together in a single OP_INSERT,
+ * so a stream of small inserts costs one syscall per batch instead of
+ * one per document.
+ *
+ * By default a batch is flushed at 64KB or 1000 documents.
+ *
+ * @param c a mongo_coalescer object.
+ * @param conn the connection to write on.
+ * @param ns the namespace.
+ */
+void mongo_coalescer_init( mongo_coalescer* c, mongo_connection* conn, const char* ns );
+
+/**
+ * Set the flush thresholds.
+ *
+ * @param c a mongo_coalescer object.
+ * @param max_bytes flush once this many bytes are buffered.
+ * @param max_docs flush once this many documents are buffered.
+ * @param max_delay_ms flush documents that have been buffered this long,
+ *     or 0 for no deadline. Without a flush thread the deadline is only
+ *     checked when a document is added.
+ */
+void mongo_coalescer_set_limits( mongo_coalescer* c, int max_bytes,
+    int max_docs, int max_delay_ms );
+
+/**
+ * Start a thread that flushes buffered documents when their deadline
+ * passes. While it runs, the connection belongs to the coalescer: use it
+ * only through mongo_coalescer_barrier until mongo_coalescer_stop.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the thread could not be created.
+ */
+int mongo_coalescer_start( mongo_coalescer* c );
+
+/**
+ * Flush and stop the flush thread.
+ *
+ * @return the result of the final flush.
+ */
+int mongo_coalescer_stop( mongo_coalescer* c );
+
+/**
+ * Buffer an insert. The document is copied. May be called from several
+ * threads.
+ *
+ * @return MONGO_OK, or MONGO_ERROR with c->err set if the document is
+ *     not valid for insert or a flush this call triggered failed.
+ */
+int mongo_coalescer_insert( mongo_coalescer* c, bson* doc );
+
+/**
+ * Write every buffered document now. Call this before any acknowledged
+ * operation on the same connection, so that the operation is ordered
+ * after the buffered inserts.
+ *
+ * @return MONGO_OK or MONGO_ERROR with c->err set.
+ */
+int mongo_coalescer_flush( mongo_coalescer* c );
+
+/**
+ * Flush, then run getlasterror on the connection to wait for the server
+ * to apply everything written so far.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the flush failed, the getlasterror
+ *     could not be run (see conn->err) or the server reported an error
+ *     (see conn->lasterrcode and conn->lasterrstr).
+ */
+int mongo_coalescer_barrier( mongo_coalescer* c );
+
+/**
+ * Stop the flush thread if one is running, flush, and free the buffer.
+ */
+void mongo_coalescer_destroy( mongo_coalescer* c );
+
+MONGO_EXTERN_C_END
+#endif
@@ -18,6 +18,9 @@
 #include "mongo.h"
 #include "net.h"
 #include "md5.h"
+#include "monitor.h"
+#include "uring.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,15 +33,202 @@
 static const int ZERO = 0;
 static const int ONE = 1;
 
+/* Smallest reply allocation; storage grows by doubling from here. */
+#define MONGO_REPLY_MIN_SIZE 4096
+
+/* Replies larger than this are freed rather than kept for reuse. */
+#define MONGO_SPARE_REPLY_MAX (8*1024*1024)
+
+/* Assumed when the server's ismaster doesn't report its limits. */
+#define MONGO_DEFAULT_MAX_BSON_SIZE (4*1024*1024)
+
+/* Most messages a bulk write puts in flight per round trip. */
+#define MONGO_BULK_GROUP 64
+
+/* Defaults for when mongo_cursor_destroy sends queued cursor ids itself. */
+#define MONGO_KILL_CURSORS_BATCH 64
+#define MONGO_KILL_CURSORS_DELAY_MS 1000
+
+/* Operation deadlines. While op_timeout_ms is set the socket is
+ * non-blocking, and a request together with the reading of its reply must
+ * finish within op_timeout_ms in all, however slowly the bytes arrive. */
+
+int mongo_conn_remaining_ms( mongo_connection * conn ){
+    int64_t remaining;
+
+    if( !conn->op_timeout_ms )
+        return -1;
+
+    if( !conn->op_deadline )
+        conn->op_deadline = mongo_now_usec() + (int64_t)conn->op_timeout_ms * 1000;
+
+    remaining = conn->op_deadline - mongo_now_usec();
+    return remaining > 0 ? (int)( ( remaining + 999 ) / 1000 ) : 0;
+}
+
+void mongo_conn_timed_out( mongo_connection * conn ){
+    mongo_close_socket( conn->sock );
+    conn->sock = -1;
+    conn->connected = 0;
+    conn->rbuf_start = conn->rbuf_end = 0;
+    conn->prefetch_cursor = NULL;
+    conn->op_deadline = 0;
+    conn->err = MONGO_OP_TIMEOUT;
+
+    if( conn->ops )
+        mongo_ops_failed( conn );
+}
+
+int mongo_conn_set_io_mode( mongo_connection * conn ){
+    return mongo_socket_set_blocking( conn->sock, !conn->op_timeout_ms || conn->uring );
+}
+
+/* Record a socket error, unless the deadline passed and the connection
+ * was already closed with MONGO_OP_TIMEOUT. */
+static int mongo_io_error( mongo_connection * conn ){
+    if( conn->sock != -1 )
+        conn->err = MONGO_IO_ERROR;
+    return MONGO_ERROR;
+}
+
+static int mongo_io_would_block( mongo_connection * conn ){
+    if( !conn->op_timeout_ms )
+        return 0;
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Wait for the socket to become ready before the operation's deadline. */
+static int mongo_io_wait( mongo_connection * conn, int for_write ){
+    int remaining, res;
+
+    do {
+        if( ( remaining = mongo_conn_remaining_ms( conn ) ) == 0 ) {
+            mongo_conn_timed_out( conn );
+            return MONGO_ERROR;
+        }
+        res = mongo_socket_wait( conn->sock, for_write, remaining );
+    } while( res == 0 || ( res == -1 && errno == EINTR ) );
+
+    return res < 0 ? mongo_io_error( conn ) : MONGO_OK;
+}
+
+/* Statistics, operation hooks and wire capture. Nothing is timed, looked
+ * up or copied unless conn->stats or conn->trace is set or hooks are. */
+
+static int mongo_observed( mongo_connection * conn ){
+    return conn->stats || conn->trace || mongo_ops_hooked();
+}
+
+/* Record a request about to be written. */
+static void mongo_observe_send( mongo_connection * conn, int op, int id,
+    const char* ns, const char* query, int len ){
+
+    if( conn->stats )
+        mongo_stats_record_send( conn->stats, op, ns, len );
+    if( mongo_ops_hooked() )
+        mongo_ops_started( conn, op, id, ns, query, len );
+}
+
+/* Every op that names a namespace stores it after the header and one
+ * int32; a query's document follows the namespace, skip and limit. */
+static int mongo_op_has_ns( int op ){
+    return op != MONGO_OP_MSG && op != MONGO_OP_KILL_CURSORS;
+}
+
+static const char* mongo_query_doc( const char* ns ){
+    return ns + strlen( ns ) + 1 + 8;
+}
+
+/* As mongo_observe_send, for a message serialized in buf. */
+static void mongo_observe_serialized( mongo_connection * conn, const char* buf ){
+    const char* ns = NULL;
+    int len, id, op;
+
+    bson_little_endian32( &len, buf );
+    bson_little_endian32( &id, buf + 4 );
+    bson_little_endian32( &op, buf + 12 );
+    if( mongo_op_has_ns( op ) )
+        ns = buf + 20;
+
+    if( conn->trace ) {
+        mongo_iovec iov;
+        iov.iov_base = (void*)buf;
+        iov.iov_len = len;
+        mongo_trace_record( conn, &iov, 1 );
+    }
+
+    mongo_observe_send( conn, op, id, ns, op == MONGO_OP_QUERY ? mongo_query_doc( ns ) : NULL, len );
+}
+
+/* The byte at offset in a mongo_msg. Fields the builder appends by
+ * reference, like the namespace and documents, sit whole in one iovec. */
+static const char* mongo_msg_at( mongo_msg *msg, int offset ){
+    int i;
+
+    for( i=0; i<msg->iov_count; i++ ) {
+        if( offset < (int)msg->iov[i].iov_len )
+            return (const char*)msg->iov[i].iov_base + offset;
+        offset -= msg->iov[i].iov_len;
+    }
+    return NULL;
+}
+
+/* As mongo_observe_send, for a mongo_msg. Call before the write consumes
+ * the iovecs. */
+static void mongo_observe_msg( mongo_connection * conn, mongo_msg *msg ){
+    const char* ns = NULL;
+    const char* query = NULL;
+    int op;
+
+    bson_little_endian32( &op, msg->scratch + 12 );
+    if( mongo_op_has_ns( op ) ) {
+        ns = mongo_msg_at( msg, 20 );
+        if( op == MONGO_OP_QUERY )
+            query = mongo_msg_at( msg, 20 + strlen( ns ) + 1 + 8 );
+    }
+
+    if( conn->trace )
+        mongo_trace_record( conn, msg->iov, msg->iov_count );
+
+    mongo_observe_send( conn, op, msg->id, ns, query, msg->len );
+}
+
+/* Record a write that began at start. A reply expected next is timed
+ * from then. */
+static void mongo_observe_written( mongo_connection * conn, int64_t start, int reply_follows, int res ){
+    if( conn->stats ) {
+        mongo_histogram_record( &conn->stats->send, mongo_now_usec() - start );
+        conn->stats->request_start = reply_follows && res == MONGO_OK ? start : 0;
+    }
+    if( conn->ops )
+        mongo_ops_written( conn, res, reply_follows );
+}
+
 /* Wire protocol. */
 
 static int looping_write(mongo_connection * conn, const void* buf, int len){
     const char* cbuf = buf;
+
+    if (conn->uring){
+        mongo_iovec iov;
+        iov.iov_base = (void*)buf;
+        iov.iov_len = len;
+        return mongo_uring_writev(conn, &iov, 1, 0);
+    }
+
     while (len){
         int sent = send(conn->sock, cbuf, len, 0);
         if (sent == -1) {
-           conn->err = MONGO_IO_ERROR;
-           return MONGO_ERROR;
+            if (mongo_io_would_block(conn)) {
+                if (mongo_io_wait(conn, 1) != MONGO_OK)
+                    return MONGO_ERROR;
+                continue;
+            }
+            return mongo_io_error(conn);
         }
         cbuf += sent;
         len -= sent;
@@ -47,14 +237,63 @@ static int looping_write(mongo_connection * conn, const void* buf, int len){
     return MONGO_OK;
 }
 
+/* With io_uring, a write whose reply is read next waits to be submitted
+ * together with that read. */
+static int looping_writev(mongo_connection * conn, mongo_iovec* iov, int count, int reply_follows){
+#ifdef _WIN32
+    int i;
+#endif
+
+    if (conn->uring)
+        return mongo_uring_writev(conn, iov, count, reply_follows);
+
+#ifdef _WIN32
+    for (i=0; i<count; i++){
+        if (looping_write(conn, iov[i].iov_base, iov[i].iov_len) != MONGO_OK)
+            return MONGO_ERROR;
+    }
+#else
+    while (count){
+        int sent = writev(conn->sock, iov, count > MONGO_IOV_MAX ? MONGO_IOV_MAX : count);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (mongo_io_would_block(conn)) {
+                if (mongo_io_wait(conn, 1) != MONGO_OK)
+                    return MONGO_ERROR;
+                continue;
+            }
+            return mongo_io_error(conn);
+        }
+
+        /* Skip the iovecs that were written completely,
+         * then trim the one that was written partially. */
+        while (count && sent >= (int)iov->iov_len){
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count){
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+#endif
+
+    return MONGO_OK;
+}
+
 static int looping_read(mongo_connection * conn, void* buf, int len){
     char* cbuf = buf;
     while (len){
-        int sent = recv(conn->sock, cbuf, len, 0);
-        if (sent == 0 || sent == -1) {
-            conn->err = MONGO_IO_ERROR;
-            return MONGO_ERROR;
+        int sent = conn->uring ? mongo_uring_recv(conn, cbuf, len) : recv(conn->sock, cbuf, len, 0);
+        if (sent == -1 && !conn->uring && mongo_io_would_block(conn)) {
+            if (mongo_io_wait(conn, 0) != MONGO_OK)
+                return MONGO_ERROR;
+            continue;
         }
+        if (sent == 0 || sent == -1)
+            return mongo_io_error(conn);
         cbuf += sent;
         len -= sent;
     }
@@ -80,19 +319,42 @@ mongo_message * mongo_message_create( int len , int id , int responseTo , int op
 /* Always calls free(mm) */
 int mongo_message_send(mongo_connection * conn, mongo_message* mm){
     mongo_header head; /* little endian */
+    int64_t start = 0;
+    int observed;
     int res;
     bson_little_endian32(&head.len, &mm->head.len);
     bson_little_endian32(&head.id, &mm->head.id);
     bson_little_endian32(&head.responseTo, &mm->head.responseTo);
     bson_little_endian32(&head.op, &mm->head.op);
 
+    if( ( observed = mongo_observed( conn ) ) ) {
+        const char* ns = mongo_op_has_ns( mm->head.op ) ? &mm->data + 4 : NULL;
+        start = mongo_now_usec();
+        if( conn->trace ) {
+            mongo_iovec iov[2];
+            iov[0].iov_base = &head;
+            iov[0].iov_len = sizeof( head );
+            iov[1].iov_base = &mm->data;
+            iov[1].iov_len = mm->head.len - sizeof( head );
+            mongo_trace_record( conn, iov, 2 );
+        }
+        mongo_observe_send( conn, mm->head.op, mm->head.id, ns,
+            mm->head.op == MONGO_OP_QUERY ? mongo_query_doc( ns ) : NULL, mm->head.len );
+    }
+
     res = looping_write(conn, &head, sizeof(head));
     if( res != MONGO_OK ) {
+        conn->op_deadline = 0;
+        if( observed )
+            mongo_observe_written( conn, start, 0, res );
         free( mm );
         return res;
     }
 
     res = looping_write(conn, &mm->data, mm->head.len - sizeof(head));
+    conn->op_deadline = 0;
+    if( observed )
+        mongo_observe_written( conn, start, 0, res );
     if( res != MONGO_OK ) {
         free( mm );
         return res;
@@ -102,22 +364,328 @@ int mongo_message_send(mongo_connection * conn, mongo_message* mm){
     return MONGO_OK;
 }
 
-int mongo_read_response( mongo_connection * conn, mongo_reply** reply ){
+/* Request ids come from a process-wide counter so that replies can be
+ * matched on responseTo, even with many requests in flight. 0 is
+ * skipped when the counter wraps, since a responseTo of 0 matches any
+ * reply. */
+static int mongo_next_request_id( void ){
+#if defined(_WIN32)
+    static volatile LONG next_id = 0;
+#else
+    static int next_id = 0;
+#endif
+    int id;
+
+    do {
+#if defined(_WIN32)
+        id = (int)InterlockedIncrement( &next_id ) & 0x7fffffff;
+#elif defined(__GNUC__)
+        id = __sync_add_and_fetch( &next_id, 1 ) & 0x7fffffff;
+#else
+        id = ++next_id & 0x7fffffff;
+#endif
+    } while( !id );
+
+    return id;
+}
+
+void mongo_msg_init( mongo_msg *msg, int op ){
+    int id = mongo_next_request_id();
+
+    msg->iov = msg->inline_iov;
+    msg->iov_count = 0;
+    msg->iov_alloc = MONGO_MSG_INLINE_IOV;
+    msg->scratch_len = 0;
+    msg->len = 0;
+    msg->id = id;
+
+    mongo_msg_append32( msg, &ZERO ); /* length, set by mongo_msg_finish */
+    mongo_msg_append32( msg, &id );
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append32( msg, &op );
+}
+
+static mongo_iovec* mongo_msg_next_iov( mongo_msg *msg ){
+    if( msg->iov_count == msg->iov_alloc ) {
+        msg->iov_alloc *= 2;
+        if( msg->iov == msg->inline_iov ) {
+            msg->iov = bson_malloc( msg->iov_alloc * sizeof( mongo_iovec ) );
+            memcpy( msg->iov, msg->inline_iov, sizeof( msg->inline_iov ) );
+        }
+        else
+            msg->iov = bson_realloc( msg->iov, msg->iov_alloc * sizeof( mongo_iovec ) );
+    }
+
+    return &msg->iov[msg->iov_count++];
+}
+
+static char* mongo_msg_scratch( mongo_msg *msg, int len ){
+    char *start = msg->scratch + msg->scratch_len;
+    mongo_iovec *last = msg->iov_count ? &msg->iov[msg->iov_count - 1] : NULL;
+
+    bson_fatal_msg( msg->scratch_len + len <= MONGO_MSG_SCRATCH_SIZE,
+        "message scratch space exhausted" );
+
+    /* Grow the previous iovec when it already ends at the scratch cursor. */
+    if( last && (char*)last->iov_base + last->iov_len == start )
+        last->iov_len += len;
+    else {
+        last = mongo_msg_next_iov( msg );
+        last->iov_base = start;
+        last->iov_len = len;
+    }
+
+    msg->scratch_len += len;
+    msg->len += len;
+    return start;
+}
+
+void mongo_msg_append32( mongo_msg *msg, const void *data ){
+    bson_little_endian32( mongo_msg_scratch( msg, 4 ), data );
+}
+
+void mongo_msg_append64( mongo_msg *msg, const void *data ){
+    bson_little_endian64( mongo_msg_scratch( msg, 8 ), data );
+}
+
+void mongo_msg_append_ref( mongo_msg *msg, const void *data, int len ){
+    mongo_iovec *iov;
+
+    if( len <= 0 )
+        return;
+
+    iov = mongo_msg_next_iov( msg );
+    iov->iov_base = (void*)data;
+    iov->iov_len = len;
+    msg->len += len;
+}
+
+void mongo_msg_finish( mongo_msg *msg ){
+    bson_little_endian32( msg->scratch, &msg->len );
+}
+
+void mongo_msg_destroy( mongo_msg *msg ){
+    if( msg->iov != msg->inline_iov )
+        free( msg->iov );
+    msg->iov = msg->inline_iov;
+    msg->iov_count = 0;
+}
+
+void mongo_msg_copy( mongo_msg *msg, char *out ){
+    int i;
+
+    mongo_msg_finish( msg );
+    for( i=0; i<msg->iov_count; i++ ) {
+        memcpy( out, msg->iov[i].iov_base, msg->iov[i].iov_len );
+        out += msg->iov[i].iov_len;
+    }
+}
+
+/* Send and destroy count messages, behind an OP_KILL_CURSORS for any
+ * cursor ids queued on the connection. Set reply_follows when the caller
+ * reads the reply before returning. */
+static int mongo_msg_write( mongo_connection *conn, mongo_msg *msgs, int count,
+    int reply_follows ){
+
+    mongo_msg kill;
+    mongo_iovec *iov;
+    int64_t start = 0;
+    int observed;
+    int killing = conn->dead_cursor_count;
+    int total = 0;
+    int i, res;
+
+    if( !count && !killing )
+        return MONGO_OK;
+
+    if( ( observed = mongo_observed( conn ) ) )
+        start = mongo_now_usec();
+
+    if( count == 1 && !killing ) {
+        mongo_msg_finish( msgs );
+        if( observed )
+            mongo_observe_msg( conn, msgs );
+        res = looping_writev( conn, msgs->iov, msgs->iov_count, reply_follows );
+        if( observed )
+            mongo_observe_written( conn, start, reply_follows, res );
+        mongo_msg_destroy( msgs );
+        if( !reply_follows || res != MONGO_OK )
+            conn->op_deadline = 0;
+        return res;
+    }
+
+    if( killing ) {
+        mongo_msg_init( &kill, MONGO_OP_KILL_CURSORS );
+        mongo_msg_append32( &kill, &ZERO );
+        mongo_msg_append32( &kill, &killing );
+        mongo_msg_append_ref( &kill, conn->dead_cursors, killing * sizeof( int64_t ) );
+        mongo_msg_finish( &kill );
+        total = kill.iov_count;
+    }
+
+    for( i=0; i<count; i++ ) {
+        mongo_msg_finish( &msgs[i] );
+        total += msgs[i].iov_count;
+    }
+
+    iov = (mongo_iovec*)bson_malloc( total * sizeof( mongo_iovec ) );
+    total = 0;
+    if( killing ) {
+        memcpy( iov, kill.iov, kill.iov_count * sizeof( mongo_iovec ) );
+        total = kill.iov_count;
+    }
+    for( i=0; i<count; i++ ) {
+        memcpy( iov + total, msgs[i].iov, msgs[i].iov_count * sizeof( mongo_iovec ) );
+        total += msgs[i].iov_count;
+    }
+
+    if( observed ) {
+        if( killing )
+            mongo_observe_msg( conn, &kill );
+        for( i=0; i<count; i++ )
+            mongo_observe_msg( conn, &msgs[i] );
+    }
+
+    res = looping_writev( conn, iov, total, reply_follows );
+    if( observed )
+        mongo_observe_written( conn, start, reply_follows, res );
+
+    free( iov );
+    for( i=0; i<count; i++ )
+        mongo_msg_destroy( &msgs[i] );
+
+    /* Sent or not, the ids go: a failed write leaves the connection to be
+     * reconnected, and the server times such cursors out on its own. */
+    if( killing ) {
+        mongo_msg_destroy( &kill );
+        conn->dead_cursor_count = 0;
+    }
+
+    /* Otherwise the read of the reply finishes the operation. */
+    if( !reply_follows || res != MONGO_OK )
+        conn->op_deadline = 0;
+
+    return res;
+}
+
+int mongo_msg_send( mongo_connection *conn, mongo_msg *msg ){
+    return mongo_msg_write( conn, msg, 1, 0 );
+}
+
+int mongo_msg_send_many( mongo_connection *conn, mongo_msg *msgs, int count ){
+    return mongo_msg_write( conn, msgs, count, 0 );
+}
+
+int mongo_conn_flush_kill_cursors( mongo_connection *conn ){
+    return mongo_msg_write( conn, NULL, 0, 0 );
+}
+
+void mongo_conn_set_kill_cursors_batch( mongo_connection *conn, int max_ids, int max_delay_ms ){
+    conn->kill_cursors_batch = max_ids > 1 ? max_ids : 1;
+    conn->kill_cursors_delay_ms = max_delay_ms > 0 ? max_delay_ms : 0;
+}
+
+/* Queue the id of a destroyed cursor. It goes out ahead of the next
+ * message, unless the batch is full or has waited long enough. */
+static int mongo_queue_kill_cursor( mongo_connection *conn, int64_t id ){
+    int64_t now = mongo_now_usec();
+
+    if( conn->dead_cursor_count == conn->dead_cursor_alloc ) {
+        conn->dead_cursor_alloc = conn->dead_cursor_alloc ? 2 * conn->dead_cursor_alloc : 16;
+        conn->dead_cursors = (int64_t*)bson_realloc( conn->dead_cursors,
+            conn->dead_cursor_alloc * sizeof( int64_t ) );
+    }
+
+    if( !conn->dead_cursor_count )
+        conn->dead_cursor_since = now;
+    bson_little_endian64( &conn->dead_cursors[conn->dead_cursor_count++], &id );
+
+    if( conn->dead_cursor_count >= conn->kill_cursors_batch ||
+        now - conn->dead_cursor_since >= (int64_t)conn->kill_cursors_delay_ms * 1000 )
+        return mongo_conn_flush_kill_cursors( conn );
+
+    return MONGO_OK;
+}
+
+/* Make sure at least len bytes are buffered, reading ahead as much
+ * as the buffer can hold so that one recv usually covers the header,
+ * the reply fields and the start of the documents. */
+static int mongo_fill_read_buffer( mongo_connection * conn, int len ){
+    if( !conn->rbuf ) {
+        conn->rbuf = bson_malloc( MONGO_READ_BUFFER_SIZE );
+        conn->rbuf_start = conn->rbuf_end = 0;
+    }
+
+    if( conn->rbuf_start == conn->rbuf_end )
+        conn->rbuf_start = conn->rbuf_end = 0;
+    else if( MONGO_READ_BUFFER_SIZE - conn->rbuf_start < len ) {
+        memmove( conn->rbuf, conn->rbuf + conn->rbuf_start, conn->rbuf_end - conn->rbuf_start );
+        conn->rbuf_end -= conn->rbuf_start;
+        conn->rbuf_start = 0;
+    }
+
+    while( conn->rbuf_end - conn->rbuf_start < len ) {
+        int got;
+        if( conn->uring )
+            got = mongo_uring_recv( conn, conn->rbuf + conn->rbuf_end,
+                                    MONGO_READ_BUFFER_SIZE - conn->rbuf_end );
+        else
+            got = recv( conn->sock, conn->rbuf + conn->rbuf_end,
+                        MONGO_READ_BUFFER_SIZE - conn->rbuf_end, 0 );
+        if( got == -1 && !conn->uring && ( errno == EINTR || mongo_io_would_block( conn ) ) ) {
+            if( errno != EINTR && mongo_io_wait( conn, 0 ) != MONGO_OK )
+                return MONGO_ERROR;
+            continue;
+        }
+        if( got == 0 || got == -1 )
+            return mongo_io_error( conn );
+        conn->rbuf_end += got;
+    }
+
+    return MONGO_OK;
+}
+
+/* Read one reply into *reply, reusing its storage of *size bytes and
+ * growing it geometrically when the reply does not fit. */
+static int mongo_read_one_reply( mongo_connection * conn, mongo_reply** reply, int* size ){
     mongo_header head; /* header from network */
     mongo_reply_fields fields; /* header from network */
     mongo_reply * out; /* native endian */
+    const int hlen = sizeof( head ) + sizeof( fields );
     unsigned int len;
-    int res;
+    int buffered;
+    int64_t start = 0, wait = 0;
+
+    if( conn->stats )
+        start = mongo_now_usec();
+
+    if( mongo_fill_read_buffer( conn, hlen ) != MONGO_OK )
+        return MONGO_ERROR;
 
-    looping_read(conn, &head, sizeof(head));
-    looping_read(conn, &fields, sizeof(fields));
+    if( conn->stats )
+        wait = mongo_now_usec() - start;
+
+    memcpy( &head, conn->rbuf + conn->rbuf_start, sizeof( head ) );
+    memcpy( &fields, conn->rbuf + conn->rbuf_start + sizeof( head ), sizeof( fields ) );
+    conn->rbuf_start += hlen;
 
     bson_little_endian32(&len, &head.len);
 
-    if (len < sizeof(head)+sizeof(fields) || len > 64*1024*1024)
-        return MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+    if (len < sizeof(head)+sizeof(fields) || len > 64*1024*1024) {
+        conn->err = MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+        return MONGO_ERROR;
+    }
+
+    if( !*reply || *size < (int)len ) {
+        int new_size = *size > MONGO_REPLY_MIN_SIZE ? *size : MONGO_REPLY_MIN_SIZE;
+        while( new_size < (int)len )
+            new_size *= 2;
 
-    out = (mongo_reply*)bson_malloc(len);
+        free( *reply );
+        *reply = (mongo_reply*)bson_malloc( new_size );
+        *size = new_size;
+    }
+    out = *reply;
 
     out->head.len = len;
     bson_little_endian32(&out->head.id, &head.id);
@@ -129,13 +697,118 @@ int mongo_read_response( mongo_connection * conn, mongo_reply** reply ){
     bson_little_endian32(&out->fields.start, &fields.start);
     bson_little_endian32(&out->fields.num, &fields.num);
 
-    res = looping_read(conn, &out->objs, len-sizeof(head)-sizeof(fields));
-    if( res != MONGO_OK ) {
-        free(out);
-        return res;
+    /* Take whatever was read ahead, then read the rest in place. */
+    len -= hlen;
+    buffered = conn->rbuf_end - conn->rbuf_start;
+    if( buffered > (int)len )
+        buffered = len;
+
+    memcpy( &out->objs, conn->rbuf + conn->rbuf_start, buffered );
+    conn->rbuf_start += buffered;
+
+    if( conn->stats && buffered < (int)len )
+        start = mongo_now_usec();
+
+    if( looping_read( conn, &out->objs + buffered, len - buffered ) != MONGO_OK ) {
+        out->fields.cursorID = 0;
+        out->fields.num = 0;
+        return MONGO_ERROR;
+    }
+
+    if( conn->stats ) {
+        if( buffered < (int)len )
+            wait += mongo_now_usec() - start;
+        mongo_histogram_record( &conn->stats->wait, wait );
+        mongo_stats_record_reply( conn->stats, out->head.len );
+    }
+    if( conn->ops )
+        mongo_ops_replied( conn, out->head.responseTo, out->head.len );
+    if( conn->trace ) {
+        mongo_iovec iov[3];
+        iov[0].iov_base = &head;
+        iov[0].iov_len = sizeof( head );
+        iov[1].iov_base = &fields;
+        iov[1].iov_len = sizeof( fields );
+        iov[2].iov_base = &out->objs;
+        iov[2].iov_len = len;
+        mongo_trace_record( conn, iov, 3 );
+    }
+
+    return MONGO_OK;
+}
+
+/* Read the reply to request id responseTo, or the next reply when
+ * responseTo is 0; any other reply is MONGO_RESPONSE_MISMATCH. */
+static int mongo_read_matching_reply( mongo_connection * conn, mongo_reply** reply,
+    int* size, int responseTo ){
+    mongo_cursor* prefetching;
+    mongo_reply* tmp;
+    int tmp_size;
+
+    while( 1 ) {
+        if( mongo_read_one_reply( conn, reply, size ) != MONGO_OK )
+            return MONGO_ERROR;
+
+        /* A cursor's prefetched batch that arrives ahead of the reply we are
+         * after is handed to that cursor by swapping buffers. */
+        prefetching = conn->prefetch_cursor;
+        if( prefetching && responseTo != prefetching->prefetch_id &&
+            (*reply)->head.responseTo == prefetching->prefetch_id ) {
+            tmp = prefetching->next_reply;
+            tmp_size = prefetching->next_reply_size;
+            prefetching->next_reply = *reply;
+            prefetching->next_reply_size = *size;
+            prefetching->prefetch_ready = 1;
+            conn->prefetch_cursor = NULL;
+            *reply = tmp;
+            *size = tmp_size;
+            continue;
+        }
+
+        break;
+    }
+
+    /* The reply we are after may still be on its way, and would be
+     * taken for the answer to the next request. */
+    if( responseTo && (*reply)->head.responseTo != responseTo ) {
+        mongo_disconnect( conn );
+        conn->err = MONGO_RESPONSE_MISMATCH;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+static int mongo_read_reply( mongo_connection * conn, mongo_reply** reply, int* size,
+    int responseTo ){
+    int res = mongo_read_matching_reply( conn, reply, size, responseTo );
+
+    /* The operation is over, whichever way it ended. */
+    conn->op_deadline = 0;
+
+    /* Requests still awaiting replies won't get them on this stream. */
+    if( res != MONGO_OK && conn->ops )
+        mongo_ops_failed( conn );
+
+    if( conn->stats && conn->stats->request_start ) {
+        if( res == MONGO_OK )
+            mongo_histogram_record( &conn->stats->round_trip,
+                                    mongo_now_usec() - conn->stats->request_start );
+        conn->stats->request_start = 0;
     }
 
-    *reply = out;
+    return res;
+}
+
+int mongo_read_response( mongo_connection * conn, mongo_reply** reply ){
+    int size = 0;
+
+    *reply = NULL;
+    if( mongo_read_reply( conn, reply, &size, 0 ) != MONGO_OK ) {
+        free( *reply );
+        *reply = NULL;
+        return MONGO_ERROR;
+    }
 
     return MONGO_OK;
 }
@@ -159,41 +832,106 @@ char * mongo_data_append64( char * start , const void * data){
 
 /* Connection API */
 
-int mongo_connect( mongo_connection * conn , const char * host, int port ){
-    conn->replset = NULL;
+/* Remember the server's size limits, from an ismaster reply, for
+ * splitting bulk writes. */
+static void mongo_record_limits( mongo_connection * conn, bson * ismaster ){
+    bson_iterator it;
 
-    conn->primary = bson_malloc( sizeof( mongo_host_port ) );
+    if( bson_find( &it, ismaster, "maxBsonObjectSize" ) )
+        conn->max_bson_size = bson_iterator_int( &it );
+    else
+        conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
 
-    strncpy( conn->primary->host, host, strlen( host ) + 1 );
-    conn->primary->port = port;
-    conn->primary->next = NULL;
+    if( bson_find( &it, ismaster, "maxMessageSizeBytes" ) )
+        conn->max_msg_size = bson_iterator_int( &it );
+    else
+        conn->max_msg_size = 2 * conn->max_bson_size;
+}
+
+static void mongo_init_conn_state( mongo_connection * conn ){
+    conn->sock = -1;
+    conn->connected = 0;
     conn->conn_timeout_ms = 0;
+    conn->op_timeout_ms = 0;
 
     conn->err = 0;
     conn->errstr = NULL;
     conn->lasterrcode = 0;
     conn->lasterrstr = NULL;
 
+    conn->rbuf = NULL;
+    conn->rbuf_start = 0;
+    conn->rbuf_end = 0;
+    conn->uring = NULL;
+    conn->op_deadline = 0;
+    conn->dead_cursors = NULL;
+    conn->dead_cursor_count = 0;
+    conn->dead_cursor_alloc = 0;
+    conn->dead_cursor_since = 0;
+    conn->kill_cursors_batch = MONGO_KILL_CURSORS_BATCH;
+    conn->kill_cursors_delay_ms = MONGO_KILL_CURSORS_DELAY_MS;
+    conn->stats = NULL;
+    conn->ops = NULL;
+    conn->trace = NULL;
+    conn->trace_conn = 0;
+    conn->spare_reply = NULL;
+    conn->spare_reply_size = 0;
+    conn->prefetch_cursor = NULL;
+    conn->max_bson_size = 0;
+    conn->max_msg_size = 0;
+}
+
+int mongo_connect( mongo_connection * conn , const char * host, int port ){
+    mongo_init_conn_state( conn );
+    conn->replset = NULL;
+
+    conn->primary = bson_malloc( sizeof( mongo_host_port ) );
+
+    strncpy( conn->primary->host, host, strlen( host ) + 1 );
+    conn->primary->port = port;
+    conn->primary->next = NULL;
+
     return mongo_socket_connect(conn, host, port);
 }
 
+void mongo_conn_adopt_socket( mongo_connection * conn, int sock,
+    const char * host, int port ){
+
+    int len = strlen( host );
+
+    mongo_init_conn_state( conn );
+    conn->replset = NULL;
+
+    conn->primary = bson_malloc( sizeof( mongo_host_port ) );
+    if( len >= (int)sizeof( conn->primary->host ) )
+        len = sizeof( conn->primary->host ) - 1;
+    memcpy( conn->primary->host, host, len );
+    conn->primary->host[len] = '\0';
+    conn->primary->port = port;
+    conn->primary->next = NULL;
+
+    conn->sock = sock;
+    conn->connected = 1;
+    mongo_socket_set_blocking( sock, 1 );
+}
+
 void mongo_replset_init_conn( mongo_connection* conn, const char* name ) {
+    mongo_init_conn_state( conn );
     conn->replset = bson_malloc( sizeof( mongo_replset ) );
     conn->replset->primary_connected = 0;
+    conn->replset->primary_rtt_usec = 0;
     conn->replset->seeds = NULL;
     conn->replset->hosts = NULL;
+    conn->replset->read_secondaries = 0;
+    conn->replset->latency_window_ms = 0;
+    conn->replset->secondaries = NULL;
+    conn->replset->next_read = 0;
+    conn->replset->monitor = NULL;
     conn->replset->name = (char *)bson_malloc( strlen( name ) + 1 );
     memcpy( conn->replset->name, name, strlen( name ) + 1  );
 
     conn->primary = bson_malloc( sizeof( mongo_host_port ) );
-
-    conn->conn_timeout_ms = 0;
-
-    conn->err = 0;
-    conn->errstr = NULL;
-    conn->lasterrcode = 0;
-    conn->lasterrstr = NULL;
-}
+}
 
 static void mongo_replset_add_node( mongo_host_port** list, const char* host, int port ) {
     mongo_host_port* host_port = bson_malloc( sizeof( mongo_host_port ) );
@@ -211,6 +949,13 @@ static void mongo_replset_add_node( mongo_host_port** list, const char* host, in
     }
 }
 
+static int mongo_host_list_contains( mongo_host_port* list, const char* host, int port ) {
+    for( ; list; list = list->next )
+        if( list->port == port && strcmp( list->host, host ) == 0 )
+            return 1;
+    return 0;
+}
+
 static void mongo_replset_free_list( mongo_host_port** list ) {
     mongo_host_port* node = *list;
     mongo_host_port* prev;
@@ -228,7 +973,7 @@ void mongo_replset_add_seed(mongo_connection* conn, const char* host, int port)
     mongo_replset_add_node( &conn->replset->seeds, host, port );
 }
 
-static void mongo_parse_host( const char *host_string, mongo_host_port *host_port ) {
+void mongo_parse_host( const char *host_string, mongo_host_port *host_port ) {
     int len, idx, split;
     len = split = idx = 0;
 
@@ -242,6 +987,15 @@ static void mongo_parse_host( const char *host_string, mongo_host_port *host_por
         len++;
     }
 
+    /* A Unix domain socket path has no port. */
+    if( host_string[0] == '/' )
+        split = 0;
+
+    if( len >= (int)sizeof( host_port->host ) )
+        len = sizeof( host_port->host ) - 1;
+    if( split >= len )
+        split = 0;
+
     /* If 'split' is set, we know the that port exists;
      * Otherwise, we set the default port. */
     idx = split ? split : len;
@@ -253,170 +1007,627 @@ static void mongo_parse_host( const char *host_string, mongo_host_port *host_por
         host_port->port = 27017;
 }
 
-static void mongo_replset_check_seed( mongo_connection* conn ) {
-    bson out;
-    bson hosts;
-    const char* data;
-    bson_iterator it;
-    bson_iterator it_sub;
-    const char* host_string;
-    mongo_host_port *host_port = NULL;
+/* Fold a new round-trip sample into a member's average. */
+static void mongo_update_rtt( int* avg, int sample ){
+    *avg = *avg ? ( 4 * *avg + sample ) / 5 : sample;
+}
 
-    out.data = NULL;
-    out.owned = 1;
+/* Take over a connected socket to a secondary. */
+static void mongo_replset_add_secondary( mongo_connection* conn, mongo_host_port* node,
+    int sock, int rtt, bson* ismaster ) {
 
-    hosts.data = NULL;
-    hosts.owned = 1;
+    mongo_secondary* secondary = (mongo_secondary*)bson_malloc( sizeof( mongo_secondary ) );
+    mongo_connection* sconn = (mongo_connection*)bson_malloc( sizeof( mongo_connection ) );
 
-    if( mongo_simple_int_command(conn, "admin", "ismaster", 1, &out) == MONGO_OK ) {
+    mongo_conn_adopt_socket( sconn, sock, node->host, node->port );
+    mongo_record_limits( sconn, ismaster );
+    mongo_conn_set_timeout( sconn, conn->op_timeout_ms );
 
-        if( bson_find( &it, &out, "hosts" ) ) {
-            data = bson_iterator_value( &it );
-            bson_iterator_init( &it_sub, data );
+    secondary->conn = sconn;
+    secondary->rtt_usec = rtt;
+    secondary->next = conn->replset->secondaries;
+    conn->replset->secondaries = secondary;
+}
 
-            /* Iterate over host list, adding each host to the
-             * connection's host list. */
-            while( bson_iterator_next( &it_sub ) ) {
-                host_string = bson_iterator_string( &it_sub );
+static void mongo_secondary_free( mongo_secondary* secondary ){
+    mongo_destroy( secondary->conn );
+    free( secondary->conn );
+    free( secondary );
+}
 
-                host_port = bson_malloc( sizeof( mongo_host_port ) );
-                mongo_parse_host( host_string, host_port );
+static void mongo_replset_close_secondaries( mongo_replset* replset ){
+    mongo_secondary* secondary;
 
-                if( host_port ) {
-                    mongo_replset_add_node( &conn->replset->hosts,
-                        host_port->host, host_port->port );
+    while( replset->secondaries ) {
+        secondary = replset->secondaries;
+        replset->secondaries = secondary->next;
+        mongo_secondary_free( secondary );
+    }
+}
 
-                    free( host_port );
-                    host_port = NULL;
-                }
-            }
-        }
+/* Replica set discovery. Every seed, and every host the members report,
+ * is connected to without blocking and sent an ismaster as soon as its
+ * connect completes, so a dead node costs nothing while the others
+ * answer. All probes share a single deadline; once the primary has
+ * answered, each member still outstanding also gets a round-trip budget. */
+
+/* Discovery deadline when conn_timeout_ms is not set. */
+#define MONGO_PROBE_TIMEOUT_MS 10000
+
+/* Slack added to a member's round-trip budget for connecting and
+ * scheduling delays. */
+#define MONGO_PROBE_GRACE_MS 50
+
+/* Largest ismaster reply a probe will accept. */
+#define MONGO_PROBE_MAX_REPLY (1024*1024)
+
+enum mongo_probe_state {
+    MONGO_PROBE_CONNECTING,
+    MONGO_PROBE_WAITING,   /* ismaster sent, reading the reply */
+    MONGO_PROBE_DONE,
+    MONGO_PROBE_FAILED
+};
+
+typedef struct {
+    mongo_host_port node;
+    int sock;
+    int next_addr;      /* the member's address to fall back to */
+    int state;
+    int ready;          /* the socket polled writable or readable */
+    int id;             /* request id of the ismaster */
+    int64_t start_usec; /* when the connect began */
+    int64_t sent_usec;
+    char* buf;          /* reply received so far */
+    int len;
+    int size;
+} mongo_probe;
+
+typedef struct {
+    mongo_connection* conn;
+    mongo_probe* probes;
+    int count;
+    int alloc;
+    int primary;        /* index of the primary's probe, or -1 */
+    int primary_rtt;
+    int fastest;        /* round trip of the fastest secondary, or -1 */
+    int answered;       /* members that replied with our set name */
+    int bad_set_name;
+    int64_t deadline;
+} mongo_discovery;
+
+/* {ismaster: 1} */
+static const char mongo_ismaster_cmd[] =
+    "\x13\x00\x00\x00\x10ismaster\x00\x01\x00\x00\x00\x00";
+
+/* List a member, unless it is listed already. Returns its probe, not
+ * yet started, or NULL. */
+static mongo_probe* mongo_discovery_list( mongo_discovery* d, const char* host, int port ){
+    mongo_probe* probe;
+    int i;
+
+    for( i=0; i < d->count; i++ )
+        if( d->probes[i].node.port == port && strcmp( d->probes[i].node.host, host ) == 0 )
+            return NULL;
+
+    if( d->count == d->alloc ) {
+        d->alloc = d->alloc ? 2 * d->alloc : 8;
+        d->probes = (mongo_probe*)bson_realloc( d->probes, d->alloc * sizeof( mongo_probe ) );
     }
 
-    bson_destroy( &out );
-    bson_destroy( &hosts );
-    mongo_close_socket( conn->sock );
-    conn->sock = 0;
-    conn->connected = 0;
+    probe = &d->probes[d->count++];
+    strncpy( probe->node.host, host, sizeof( probe->node.host ) - 1 );
+    probe->node.host[sizeof( probe->node.host ) - 1] = '\0';
+    probe->node.port = port;
+    probe->node.next = NULL;
+    probe->ready = 0;
+    probe->buf = NULL;
+    probe->len = probe->size = 0;
+    probe->sock = -1;
+    probe->next_addr = 0;
+    probe->state = MONGO_PROBE_DONE;
+
+    return probe;
+}
+
+static void mongo_discovery_add( mongo_discovery* d, const char* host, int port ){
+    mongo_probe* probe = mongo_discovery_list( d, host, port );
+
+    if( !probe )
+        return;
 
+    probe->start_usec = mongo_now_usec();
+
+    if( mongo_socket_connect_start( host, port, &probe->next_addr, &probe->sock ) == MONGO_OK )
+        probe->state = MONGO_PROBE_CONNECTING;
+    else
+        probe->state = MONGO_PROBE_FAILED;
 }
 
-/* Find out whether the current connected node is master, and
- * verify that the node's replica set name matched the provided name
- */
-static int mongo_replset_check_host( mongo_connection* conn ) {
+static void mongo_probe_close( mongo_probe* probe, int state ){
+    if( probe->state == MONGO_PROBE_CONNECTING || probe->state == MONGO_PROBE_WAITING )
+        mongo_close_socket( probe->sock );
+    free( probe->buf );
+    probe->buf = NULL;
+    probe->state = state;
+}
 
+/* The connect completed: send the ismaster. */
+static void mongo_probe_send( mongo_probe* probe ){
+    mongo_msg msg;
+    char out[64];
+
+    if( mongo_socket_connect_finish( probe->sock ) != MONGO_OK ) {
+        /* Keep connecting, to the member's next address if it has one. */
+        mongo_close_socket( probe->sock );
+        if( mongo_socket_connect_start( probe->node.host, probe->node.port,
+                                        &probe->next_addr, &probe->sock ) != MONGO_OK )
+            probe->state = MONGO_PROBE_FAILED;
+        return;
+    }
+
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, "admin.$cmd", 11 );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append32( &msg, &ONE );
+    mongo_msg_append_ref( &msg, mongo_ismaster_cmd, sizeof( mongo_ismaster_cmd ) - 1 );
+    mongo_msg_copy( &msg, out );
+    probe->id = msg.id;
+    probe->sent_usec = mongo_now_usec();
+
+    /* A fresh socket's send buffer always has room for this. */
+    if( send( probe->sock, out, msg.len, 0 ) != msg.len )
+        mongo_probe_close( probe, MONGO_PROBE_FAILED );
+    else
+        probe->state = MONGO_PROBE_WAITING;
+
+    mongo_msg_destroy( &msg );
+}
+
+/* Record a member's ismaster: learn the hosts it reports and whether it
+ * is the primary. */
+static void mongo_probe_parse( mongo_discovery* d, int index ){
+    mongo_replset* replset = d->conn->replset;
+    mongo_reply* reply = (mongo_reply*)d->probes[index].buf;
+    int rtt = (int)( mongo_now_usec() - d->probes[index].sent_usec );
+    mongo_host_port host_port;
+    bson_iterator it, it_sub;
     bson out;
-    bson_iterator it;
-    bson_bool_t ismaster = 0;
-    const char* set_name;
+    int responseTo, num;
+
+    /* The reply is still in wire order. */
+    bson_little_endian32( &responseTo, &reply->head.responseTo );
+    bson_little_endian32( &num, &reply->fields.num );
+
+    if( responseTo != d->probes[index].id || num < 1 ) {
+        mongo_probe_close( &d->probes[index], MONGO_PROBE_FAILED );
+        return;
+    }
 
-    out.data = NULL;
-    out.owned = 1;
+    bson_init( &out, &reply->objs, 0 );
 
-    if (mongo_simple_int_command(conn, "admin", "ismaster", 1, &out) == MONGO_OK) {
-        if( bson_find(&it, &out, "ismaster") )
-            ismaster = bson_iterator_bool( &it );
+    if( bson_find( &it, &out, "setName" ) != BSON_STRING ||
+        strcmp( bson_iterator_string( &it ), replset->name ) != 0 ) {
+        d->bad_set_name = 1;
+        mongo_probe_close( &d->probes[index], MONGO_PROBE_FAILED );
+        return;
+    }
 
-        if( bson_find( &it, &out, "setName" ) ) {
-            set_name = bson_iterator_string( &it );
-            if( strcmp( set_name, conn->replset->name ) != 0 ) {
-                bson_destroy( &out );
-                conn->err = MONGO_CONN_BAD_SET_NAME;
-                return MONGO_ERROR;
-            }
+    d->answered++;
+
+    if( bson_find( &it, &out, "hosts" ) ) {
+        bson_iterator_init( &it_sub, bson_iterator_value( &it ) );
+        while( bson_iterator_next( &it_sub ) ) {
+            mongo_parse_host( bson_iterator_string( &it_sub ), &host_port );
+            if( !mongo_host_list_contains( replset->hosts, host_port.host, host_port.port ) )
+                mongo_replset_add_node( &replset->hosts, host_port.host, host_port.port );
+            mongo_discovery_add( d, host_port.host, host_port.port );
         }
     }
 
-    bson_destroy( &out );
+    /* Index afresh: mongo_discovery_add may have moved the probes. */
+    if( bson_find( &it, &out, "ismaster" ) && bson_iterator_bool( &it ) && d->primary < 0 ) {
+        d->primary = index;
+        d->primary_rtt = rtt;
+        mongo_record_limits( d->conn, &out );
+        d->probes[index].state = MONGO_PROBE_DONE;
+    }
+    else if( replset->read_secondaries &&
+             bson_find( &it, &out, "secondary" ) && bson_iterator_bool( &it ) ) {
+        if( d->fastest < 0 || rtt < d->fastest )
+            d->fastest = rtt;
+        mongo_replset_add_secondary( d->conn, &d->probes[index].node,
+            d->probes[index].sock, rtt, &out );
+        free( d->probes[index].buf );
+        d->probes[index].buf = NULL;
+        d->probes[index].state = MONGO_PROBE_DONE;
+    }
+    else
+        mongo_probe_close( &d->probes[index], MONGO_PROBE_DONE );
+}
 
-    if(ismaster) {
-        conn->replset->primary_connected = 1;
+/* Read whatever has arrived of the ismaster reply. */
+static void mongo_probe_recv( mongo_discovery* d, int index ){
+    mongo_probe* probe = &d->probes[index];
+    int total = 0;
+    int n;
+
+    if( !probe->buf ) {
+        probe->size = MONGO_REPLY_MIN_SIZE;
+        probe->buf = (char*)bson_malloc( probe->size );
     }
-    else {
-        mongo_close_socket( conn->sock );
+
+    n = recv( probe->sock, probe->buf + probe->len, probe->size - probe->len, 0 );
+    if( n <= 0 ) {
+        mongo_probe_close( probe, MONGO_PROBE_FAILED );
+        return;
     }
+    probe->len += n;
 
-    return MONGO_OK;
+    if( probe->len < 4 )
+        return;
+
+    bson_little_endian32( &total, probe->buf );
+    if( total < (int)sizeof( mongo_header ) + (int)sizeof( mongo_reply_fields ) + 5 ||
+        total > MONGO_PROBE_MAX_REPLY ) {
+        mongo_probe_close( probe, MONGO_PROBE_FAILED );
+        return;
+    }
+
+    if( total > probe->size ) {
+        probe->size = total;
+        probe->buf = (char*)bson_realloc( probe->buf, total );
+    }
+
+    if( probe->len >= total )
+        mongo_probe_parse( d, index );
 }
 
-int mongo_replset_connect(mongo_connection* conn) {
+/* How long a member may take to answer once the primary is known.
+ * Reads only go to secondaries within the latency window of the fastest
+ * one, so a member slower than that is of no use; until a secondary
+ * answers, the primary's round trip stands in for the fastest. */
+static int64_t mongo_discovery_budget( mongo_discovery* d ){
+    int rtt = d->fastest >= 0 ? d->fastest : d->primary_rtt;
 
-    int res = 0;
-    mongo_host_port* node;
+    return rtt + (int64_t)( d->conn->replset->latency_window_ms + MONGO_PROBE_GRACE_MS ) * 1000;
+}
 
-    conn->sock = 0;
-    conn->connected = 0;
+/* Wait until some probe can make progress, marking those that can. */
+static int mongo_discovery_poll( mongo_discovery* d, int timeout_ms ){
+    mongo_probe* probe;
+    int i, n;
+#ifdef _WIN32
+    fd_set rset, wset;
+    struct timeval tv;
 
-    /* First iterate over the seed nodes to get the canonical list of hosts
-     * from the replica set. Break out once we have a host list.
-     */
-    node = conn->replset->seeds;
-    while( node != NULL ) {
-        res = mongo_socket_connect( conn, (const char*)&node->host, node->port );
-        if( res != MONGO_OK )
-            return MONGO_ERROR;
+    FD_ZERO( &rset );
+    FD_ZERO( &wset );
+    for( i=0; i < d->count; i++ ) {
+        probe = &d->probes[i];
+        if( probe->state == MONGO_PROBE_CONNECTING )
+            FD_SET( probe->sock, &wset );
+        else if( probe->state == MONGO_PROBE_WAITING )
+            FD_SET( probe->sock, &rset );
+    }
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = ( timeout_ms % 1000 ) * 1000;
+    if( ( n = select( 0, &rset, &wset, NULL, &tv ) ) <= 0 )
+        return n;
+
+    for( i=0; i < d->count; i++ ) {
+        probe = &d->probes[i];
+        probe->ready = ( probe->state == MONGO_PROBE_CONNECTING && FD_ISSET( probe->sock, &wset ) ) ||
+                       ( probe->state == MONGO_PROBE_WAITING && FD_ISSET( probe->sock, &rset ) );
+    }
+#else
+    struct pollfd* fds = (struct pollfd*)bson_malloc( d->count * sizeof( struct pollfd ) );
+
+    for( i=0; i < d->count; i++ ) {
+        probe = &d->probes[i];
+        fds[i].fd = -1;
+        fds[i].events = 0;
+        fds[i].revents = 0;
+        if( probe->state == MONGO_PROBE_CONNECTING ) {
+            fds[i].fd = probe->sock;
+            fds[i].events = POLLOUT;
+        }
+        else if( probe->state == MONGO_PROBE_WAITING ) {
+            fds[i].fd = probe->sock;
+            fds[i].events = POLLIN;
+        }
+    }
+
+    n = poll( fds, d->count, timeout_ms );
 
-        mongo_replset_check_seed( conn );
+    for( i=0; i < d->count; i++ )
+        d->probes[i].ready = n > 0 && fds[i].revents != 0;
 
-        if( conn->replset->hosts )
+    free( fds );
+#endif
+
+    return n;
+}
+
+/* Run the probes until the primary is found, or with read_secondaries
+ * until every member has answered or run out of time. */
+static void mongo_discovery_run( mongo_discovery* d ){
+    mongo_probe* probe;
+    int64_t now, wait_until, expires;
+    int active;
+    int count;
+    int i;
+
+    d->deadline = mongo_now_usec() + (int64_t)( d->conn->conn_timeout_ms ?
+        d->conn->conn_timeout_ms : MONGO_PROBE_TIMEOUT_MS ) * 1000;
+
+    /* Once the primary is known, carry on only to collect secondaries. */
+    while( d->primary < 0 || d->conn->replset->read_secondaries ) {
+        now = mongo_now_usec();
+        if( now >= d->deadline )
             break;
 
-        node = node->next;
+        wait_until = d->deadline;
+        active = 0;
+        for( i=0; i < d->count; i++ ) {
+            probe = &d->probes[i];
+            if( probe->state != MONGO_PROBE_CONNECTING &&
+                probe->state != MONGO_PROBE_WAITING )
+                continue;
+
+            /* An unreachable member must not hold up the others. */
+            if( d->primary >= 0 ) {
+                expires = probe->start_usec + mongo_discovery_budget( d );
+                if( now >= expires ) {
+                    mongo_probe_close( probe, MONGO_PROBE_FAILED );
+                    continue;
+                }
+                if( expires < wait_until )
+                    wait_until = expires;
+            }
+            active++;
+        }
+        if( !active )
+            break;
+
+        if( mongo_discovery_poll( d, (int)( ( wait_until - now + 999 ) / 1000 ) ) < 0 )
+            break;
+
+        /* Probes added while parsing are picked up on the next pass. */
+        count = d->count;
+        for( i=0; i < count; i++ ) {
+            probe = &d->probes[i];
+            if( !probe->ready )
+                continue;
+            if( probe->state == MONGO_PROBE_CONNECTING )
+                mongo_probe_send( probe );
+            else if( probe->state == MONGO_PROBE_WAITING )
+                mongo_probe_recv( d, i );
+        }
     }
+}
 
-    /* Iterate over the host list, checking for the primary node. */
-    if( !conn->replset->hosts ) {
-        conn->err = MONGO_CONN_CANNOT_FIND_PRIMARY;
-        return MONGO_ERROR;
+int mongo_replset_connect(mongo_connection* conn) {
+    mongo_discovery d;
+    mongo_host_port* node;
+    mongo_probe* probe;
+    int i;
+
+    conn->sock = -1;
+    conn->connected = 0;
+    conn->rbuf_start = conn->rbuf_end = 0;
+    mongo_replset_close_secondaries( conn->replset );
+
+    d.conn = conn;
+    d.probes = NULL;
+    d.count = d.alloc = 0;
+    d.primary = -1;
+    d.fastest = -1;
+    d.answered = 0;
+    d.bad_set_name = 0;
+
+    /* Hosts known from an earlier connection are probed with the seeds. */
+    for( node = conn->replset->seeds; node; node = node->next )
+        mongo_discovery_add( &d, node->host, node->port );
+    for( node = conn->replset->hosts; node; node = node->next )
+        mongo_discovery_add( &d, node->host, node->port );
+
+    mongo_discovery_run( &d );
+
+    for( i=0; i < d.count; i++ )
+        if( i != d.primary )
+            mongo_probe_close( &d.probes[i], MONGO_PROBE_FAILED );
+
+    if( d.primary >= 0 ) {
+        probe = &d.probes[d.primary];
+        free( probe->buf );
+
+        conn->sock = probe->sock;
+        mongo_conn_set_io_mode( conn );
+        conn->connected = 1;
+        conn->replset->primary_connected = 1;
+        conn->replset->primary_rtt_usec = d.primary_rtt;
+
+        strcpy( conn->primary->host, probe->node.host );
+        conn->primary->port = probe->node.port;
+        conn->primary->next = NULL;
     }
     else {
-        node = conn->replset->hosts;
+        mongo_replset_close_secondaries( conn->replset );
 
-        while( node != NULL ) {
-            res = mongo_socket_connect( conn, (const char*)&node->host, node->port );
+        if( d.bad_set_name )
+            conn->err = MONGO_CONN_BAD_SET_NAME;
+        else if( d.answered )
+            conn->err = MONGO_CONN_CANNOT_FIND_PRIMARY;
+        else
+            conn->err = MONGO_CONN_FAIL;
+    }
 
-            if( res == MONGO_OK ) {
-                if( mongo_replset_check_host( conn ) != MONGO_OK )
-                    return MONGO_ERROR;
+    free( d.probes );
 
-                /* Primary found, so return. */
-                else if( conn->replset->primary_connected )
-                     return MONGO_OK;
+    return d.primary >= 0 ? MONGO_OK : MONGO_ERROR;
+}
 
-                /* No primary, so close the connection. */
-                else {
-                    mongo_close_socket( conn->sock );
-                    conn->sock = 0;
-                    conn->connected = 0;
-                }
-            }
+void mongo_replset_set_read_secondaries( mongo_connection* conn, int latency_window_ms ) {
+    conn->replset->read_secondaries = 1;
+    conn->replset->latency_window_ms = latency_window_ms;
+}
+
+/* Run ismaster, timing the round trip. Returns whether the node answered. */
+static int mongo_ping_ismaster( mongo_connection* conn, bson* out, int* rtt ){
+    int64_t start = mongo_now_usec();
+
+    if( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) != MONGO_OK )
+        return 0;
+
+    *rtt = (int)( mongo_now_usec() - start );
+    return 1;
+}
 
-            node = node->next;
+/* Probe the known members that have no open connection, adding those
+ * that have come back, or become, secondaries. */
+static void mongo_replset_reprobe( mongo_connection* conn ){
+    mongo_replset* replset = conn->replset;
+    mongo_secondary* secondary;
+    mongo_host_port* node;
+    mongo_discovery d;
+    int i;
+
+    d.conn = conn;
+    d.probes = NULL;
+    d.count = d.alloc = 0;
+    d.fastest = -1;
+    d.answered = 0;
+    d.bad_set_name = 0;
+
+    /* The primary and the open secondaries are listed as done. */
+    mongo_discovery_list( &d, conn->primary->host, conn->primary->port );
+    d.primary = 0;
+    d.primary_rtt = replset->primary_rtt_usec;
+    for( secondary = replset->secondaries; secondary; secondary = secondary->next ) {
+        mongo_discovery_list( &d, secondary->conn->primary->host, secondary->conn->primary->port );
+        if( d.fastest < 0 || secondary->rtt_usec < d.fastest )
+            d.fastest = secondary->rtt_usec;
+    }
+
+    for( node = replset->hosts; node; node = node->next )
+        mongo_discovery_add( &d, node->host, node->port );
+
+    mongo_discovery_run( &d );
+
+    for( i=0; i < d.count; i++ )
+        mongo_probe_close( &d.probes[i], MONGO_PROBE_FAILED );
+    free( d.probes );
+}
+
+int mongo_replset_ping( mongo_connection* conn ) {
+    mongo_secondary** link = &conn->replset->secondaries;
+    mongo_secondary* secondary;
+    bson_iterator it;
+    bson out;
+    int rtt = 0;
+    int keep;
+
+    if( !mongo_ping_ismaster( conn, &out, &rtt ) )
+        return MONGO_ERROR;
+
+    keep = bson_find( &it, &out, "ismaster" ) && bson_iterator_bool( &it );
+    bson_destroy( &out );
+    if( !keep ) {
+        conn->err = MONGO_CONN_NOT_MASTER;
+        return MONGO_ERROR;
+    }
+    mongo_update_rtt( &conn->replset->primary_rtt_usec, rtt );
+
+    while( ( secondary = *link ) != NULL ) {
+        keep = 0;
+        if( mongo_ping_ismaster( secondary->conn, &out, &rtt ) ) {
+            keep = bson_find( &it, &out, "secondary" ) && bson_iterator_bool( &it );
+            bson_destroy( &out );
+        }
+
+        if( keep ) {
+            mongo_update_rtt( &secondary->rtt_usec, rtt );
+            link = &secondary->next;
+        }
+        else {
+            *link = secondary->next;
+            mongo_secondary_free( secondary );
         }
     }
 
+    if( conn->replset->read_secondaries )
+        mongo_replset_reprobe( conn );
 
-    conn->err = MONGO_CONN_CANNOT_FIND_PRIMARY;
-    return MONGO_ERROR;
+    return MONGO_OK;
+}
+
+/* Pick the connection for a MONGO_SLAVE_OK read: one of the secondaries
+ * within the latency window of the fastest, in turn. */
+static mongo_connection* mongo_replset_read_conn( mongo_connection* conn ){
+    mongo_replset* replset = conn->replset;
+    mongo_secondary* secondary;
+    int fastest = -1;
+    int eligible = 0;
+    int pick;
+
+    for( secondary = replset->secondaries; secondary; secondary = secondary->next )
+        if( fastest < 0 || secondary->rtt_usec < fastest )
+            fastest = secondary->rtt_usec;
+
+    if( fastest < 0 )
+        return conn;
+
+    for( secondary = replset->secondaries; secondary; secondary = secondary->next )
+        if( secondary->rtt_usec <= fastest + replset->latency_window_ms * 1000 )
+            eligible++;
+
+    pick = replset->next_read++ % eligible;
+    if( replset->next_read >= eligible )
+        replset->next_read = 0;
+
+    for( secondary = replset->secondaries; secondary; secondary = secondary->next )
+        if( secondary->rtt_usec <= fastest + replset->latency_window_ms * 1000 && pick-- == 0 )
+            break;
+
+    return secondary->conn;
+}
+
+/* A secondary that failed a read is closed; later reads use the others. */
+static void mongo_replset_drop_secondary( mongo_connection* conn, mongo_connection* sconn ){
+    mongo_secondary** link = &conn->replset->secondaries;
+    mongo_secondary* secondary;
+
+    while( ( secondary = *link ) != NULL ) {
+        if( secondary->conn == sconn ) {
+            *link = secondary->next;
+            mongo_secondary_free( secondary );
+            return;
+        }
+        link = &secondary->next;
+    }
 }
 
 int mongo_conn_set_timeout( mongo_connection *conn, int millis ) {
-    struct timeval tv;
-    tv.tv_sec = millis / 1000;
-    tv.tv_usec = (millis % 1000) * 1000;
+    mongo_secondary* secondary;
+    int res = MONGO_OK;
+
+    conn->op_timeout_ms = millis > 0 ? millis : 0;
+    conn->op_deadline = 0;
 
-    if (setsockopt( conn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) ) == -1) {
+    if( conn->connected && mongo_conn_set_io_mode( conn ) != MONGO_OK ) {
         conn->err = MONGO_IO_ERROR;
-        return MONGO_ERROR;
+        res = MONGO_ERROR;
     }
 
-    if (setsockopt( conn->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) ) == -1) {
-        conn->err = MONGO_IO_ERROR;
-        return MONGO_ERROR;
+    /* Slave-ok reads are held to the same deadline. */
+    if( conn->replset ) {
+        for( secondary = conn->replset->secondaries; secondary; secondary = secondary->next )
+            mongo_conn_set_timeout( secondary->conn, millis );
     }
 
-    return MONGO_OK;
+    return res;
 }
 
 int mongo_reconnect( mongo_connection * conn ){
@@ -427,6 +1638,13 @@ int mongo_reconnect( mongo_connection * conn ){
         conn->replset->primary_connected = 0;
         mongo_replset_free_list( &conn->replset->hosts );
         conn->replset->hosts = NULL;
+
+        /* A monitor usually knows the new primary already, which spares
+         * a discovery. Secondaries are only found by discovery. */
+        if( conn->replset->monitor && !conn->replset->read_secondaries &&
+            mongo_monitor_connect_primary( conn->replset->monitor, conn ) == MONGO_OK )
+            return MONGO_OK;
+
         res = mongo_replset_connect( conn );
         return res;
     }
@@ -442,18 +1660,35 @@ void mongo_disconnect( mongo_connection * conn ){
         conn->replset->primary_connected = 0;
         mongo_replset_free_list( &conn->replset->hosts );
         conn->replset->hosts = NULL;
+        mongo_replset_close_secondaries( conn->replset );
     }
 
+    /* Queued io_uring writes go out before the socket closes. */
+    if( conn->uring )
+        mongo_uring_drain( conn );
+
     mongo_close_socket( conn->sock );
 
-    conn->sock = 0;
+    conn->sock = -1;
     conn->connected = 0;
+    if( conn->ops )
+        mongo_ops_failed( conn );
+    conn->rbuf_start = conn->rbuf_end = 0;
+
+    /* An unread prefetch reply went down with the socket. */
+    conn->prefetch_cursor = NULL;
+
+    /* The next server may have different limits. */
+    conn->max_bson_size = 0;
+    conn->max_msg_size = 0;
 }
 
 void mongo_destroy( mongo_connection * conn ){
     mongo_disconnect( conn );
+    mongo_uring_detach( conn );
 
     if( conn->replset ) {
+        mongo_replset_close_secondaries( conn->replset );
         mongo_replset_free_list( &conn->replset->seeds );
         mongo_replset_free_list( &conn->replset->hosts );
         free( conn->replset->name );
@@ -464,6 +1699,18 @@ void mongo_destroy( mongo_connection * conn ){
     free( conn->primary );
     free( conn->errstr );
     free( conn->lasterrstr );
+    free( conn->rbuf );
+    free( conn->spare_reply );
+    free( conn->dead_cursors );
+    mongo_conn_disable_stats( conn );
+    free( conn->ops );
+    conn->ops = NULL;
+
+    conn->rbuf = NULL;
+    conn->dead_cursors = NULL;
+    conn->dead_cursor_count = conn->dead_cursor_alloc = 0;
+    conn->spare_reply = NULL;
+    conn->spare_reply_size = 0;
 
     conn->err = 0;
     conn->errstr = NULL;
@@ -496,217 +1743,632 @@ static int mongo_bson_valid( mongo_connection * conn, bson* bson, int write ) {
 
 /* MongoDB CRUD API */
 
-int mongo_insert_batch( mongo_connection * conn, const char * ns,
-    bson ** bsons, int count ) {
+/* {getlasterror: 1}, used when a safe write is given no write concern. */
+static const char mongo_default_gle[] =
+    "\x17\x00\x00\x00\x10getlasterror\x00\x01\x00\x00\x00\x00";
+
+/* Write "<db>.$cmd" for the namespace's database into buf, or into a
+ * new string if buf is too small. */
+static char* mongo_cmd_ns( const char* ns, char* buf, int size ){
+    const char* dot = strchr( ns, '.' );
+    int len = dot ? dot - ns : (int)strlen( ns );
+    char* out = len + 6 <= size ? buf : (char*)bson_malloc( len + 6 );
+
+    memcpy( out, ns, len );
+    strcpy( out + len, ".$cmd" );
+    return out;
+}
+
+/* Set on a reply when the query failed; the reply then holds only
+ * { $err: ..., code: ... }. */
+#define MONGO_REPLY_QUERY_FAILURE 2
+
+/* Classify a getlasterror reply. A getlasterror that failed itself, with
+ * the QueryFailure flag, a $err or ok other than 1, is MONGO_COMMAND_FAILED
+ * and a write the server rejected, with a string err, is MONGO_WRITE_ERROR;
+ * *errstr and *code then describe the error. Returns 0 for a write that
+ * was applied. */
+static int mongo_last_error_result( bson* out, int flags, const char** errstr, int* code ){
+    bson_iterator it;
+    int res = 0;
+
+    *errstr = NULL;
+    *code = 0;
+
+    if( bson_find( &it, out, "$err" ) == BSON_STRING ) {
+        *errstr = bson_iterator_string( &it );
+        res = MONGO_COMMAND_FAILED;
+    }
+    else if( ( flags & MONGO_REPLY_QUERY_FAILURE ) ||
+        !bson_find( &it, out, "ok" ) || !bson_iterator_bool( &it ) ) {
+        if( bson_find( &it, out, "errmsg" ) == BSON_STRING )
+            *errstr = bson_iterator_string( &it );
+        res = MONGO_COMMAND_FAILED;
+    }
+    else if( bson_find( &it, out, "err" ) == BSON_STRING ) {
+        *errstr = bson_iterator_string( &it );
+        res = MONGO_WRITE_ERROR;
+    }
+    else
+        return 0;
+
+    if( bson_find( &it, out, "code" ) != BSON_EOO )
+        *code = bson_iterator_int( &it );
+
+    return res;
+}
+
+/* Store a getlasterror result on the connection, and return it as
+ * mongo_last_error_result does. */
+static int mongo_parse_last_error( mongo_connection* conn, bson* out, int flags ){
+    const char* errstr;
+    int res = mongo_last_error_result( out, flags, &errstr, &conn->lasterrcode );
+
+    free( conn->lasterrstr );
+    conn->lasterrstr = NULL;
+
+    if( errstr ) {
+        conn->lasterrstr = (char *)bson_malloc( strlen( errstr ) + 1 );
+        strcpy( conn->lasterrstr, errstr );
+    }
+
+    return res;
+}
+
+/* Send a write in msgs[0] together with a getlasterror, in one writev,
+ * and wait for the result. The reply is read into the connection's
+ * spare reply storage. */
+static int mongo_write_acknowledged( mongo_connection* conn, mongo_msg* msgs,
+    const char* ns, mongo_write_concern* wc ){
+
+    char buf[128];
+    char* cmd_ns = mongo_cmd_ns( ns, buf, sizeof( buf ) );
+    bson cmd;
+    bson out;
+    int id, res;
+
+    if( !wc )
+        bson_init( &cmd, (char*)mongo_default_gle, 0 );
+    else {
+        if( !wc->cmd.data )
+            mongo_write_concern_finish( wc );
+        cmd = wc->cmd;
+    }
+
+    mongo_msg_init( &msgs[1], MONGO_OP_QUERY );
+    mongo_msg_append32( &msgs[1], &ZERO );
+    mongo_msg_append_ref( &msgs[1], cmd_ns, strlen( cmd_ns ) + 1 );
+    mongo_msg_append32( &msgs[1], &ZERO );
+    mongo_msg_append32( &msgs[1], &ONE );
+    mongo_msg_append_ref( &msgs[1], cmd.data, bson_size( &cmd ) );
+    id = msgs[1].id;
+
+    res = mongo_msg_write( conn, msgs, 2, 1 );
+    if( cmd_ns != buf )
+        free( cmd_ns );
+
+    if( res != MONGO_OK ||
+        mongo_read_reply( conn, &conn->spare_reply, &conn->spare_reply_size, id ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( conn->spare_reply->fields.num != 1 ) {
+        conn->err = MONGO_COMMAND_FAILED;
+        return MONGO_ERROR;
+    }
+
+    bson_init( &out, &conn->spare_reply->objs, 0 );
+    res = mongo_parse_last_error( conn, &out, conn->spare_reply->fields.flag );
+    if( res ) {
+        conn->err = res;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+void mongo_write_concern_init( mongo_write_concern* wc ){
+    wc->w = 1;
+    wc->wtimeout = 0;
+    wc->j = 0;
+    wc->fsync = 0;
+    wc->cmd.data = NULL;
+    wc->cmd.owned = 0;
+}
+
+void mongo_write_concern_finish( mongo_write_concern* wc ){
+    bson_buffer bb;
+
+    bson_destroy( &wc->cmd );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "getlasterror", 1 );
+    if( wc->w > 1 )
+        bson_append_int( &bb, "w", wc->w );
+    if( wc->wtimeout )
+        bson_append_int( &bb, "wtimeout", wc->wtimeout );
+    if( wc->j )
+        bson_append_bool( &bb, "j", 1 );
+    if( wc->fsync )
+        bson_append_bool( &bb, "fsync", 1 );
+    bson_from_buffer( &wc->cmd, &bb );
+}
+
+void mongo_write_concern_destroy( mongo_write_concern* wc ){
+    bson_destroy( &wc->cmd );
+    wc->cmd.data = NULL;
+}
+
+static int mongo_insert_msg( mongo_connection * conn, mongo_msg* msg,
+    const char * ns, bson ** bsons, int count ) {
 
-    int size =  16 + 4 + strlen( ns ) + 1;
     int i;
-    mongo_message * mm;
-    char* data;
 
     for(i=0; i<count; i++){
-        size += bson_size(bsons[i]);
         if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
             return MONGO_ERROR;
     }
 
-    mm = mongo_message_create( size , 0 , 0 , MONGO_OP_INSERT );
+    mongo_msg_init( msg, MONGO_OP_INSERT );
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append_ref( msg, ns, strlen( ns ) + 1 );
+
+    for(i=0; i<count; i++){
+        mongo_msg_append_ref( msg, bsons[i]->data, bson_size( bsons[i] ) );
+    }
+
+    return MONGO_OK;
+}
+
+static int mongo_update_msg( mongo_connection* conn, mongo_msg* msg,
+    const char* ns, const bson* cond, const bson* op, int flags ) {
+
+    /* Make sure that the op BSON is valid UTF-8.
+     * TODO: decide whether to check cond as well.
+     * */
+    if( mongo_bson_valid( conn, (bson *)op, 0 ) != MONGO_OK ) {
+        return MONGO_ERROR;
+    }
+
+    mongo_msg_init( msg, MONGO_OP_UPDATE );
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append_ref( msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( msg, &flags );
+    mongo_msg_append_ref( msg, cond->data, bson_size( cond ) );
+    mongo_msg_append_ref( msg, op->data, bson_size( op ) );
+
+    return MONGO_OK;
+}
+
+static void mongo_remove_msg( mongo_msg* msg, const char* ns, const bson* cond ) {
+    mongo_msg_init( msg, MONGO_OP_DELETE );
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append_ref( msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append_ref( msg, cond->data, bson_size( cond ) );
+}
+
+int mongo_insert_batch( mongo_connection * conn, const char * ns,
+    bson ** bsons, int count ) {
+
+    mongo_msg msg;
+
+    if( mongo_insert_msg( conn, &msg, ns, bsons, count ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_msg_send( conn, &msg );
+}
+
+int mongo_insert( mongo_connection * conn , const char * ns , bson * bson ) {
+    return mongo_insert_batch( conn, ns, &bson, 1 );
+}
+
+int mongo_update(mongo_connection* conn, const char* ns, const bson* cond,
+    const bson* op, int flags) {
+
+    mongo_msg msg;
+
+    if( mongo_update_msg( conn, &msg, ns, cond, op, flags ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_msg_send( conn, &msg );
+}
+
+int mongo_remove(mongo_connection* conn, const char* ns, const bson* cond){
+    mongo_msg msg;
+
+    mongo_remove_msg( &msg, ns, cond );
+    return mongo_msg_send( conn, &msg );
+}
+
+int mongo_insert_batch_safe( mongo_connection* conn, const char* ns,
+    bson** bsons, int count, mongo_write_concern* wc ) {
+
+    mongo_msg msgs[2];
+
+    if( mongo_insert_msg( conn, &msgs[0], ns, bsons, count ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_write_acknowledged( conn, msgs, ns, wc );
+}
+
+int mongo_insert_safe( mongo_connection* conn, const char* ns, bson* bson,
+    mongo_write_concern* wc ) {
+
+    return mongo_insert_batch_safe( conn, ns, &bson, 1, wc );
+}
+
+int mongo_update_safe( mongo_connection* conn, const char* ns, const bson* cond,
+    const bson* op, int flags, mongo_write_concern* wc ) {
+
+    mongo_msg msgs[2];
+
+    if( mongo_update_msg( conn, &msgs[0], ns, cond, op, flags ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_write_acknowledged( conn, msgs, ns, wc );
+}
+
+int mongo_remove_safe( mongo_connection* conn, const char* ns, const bson* cond,
+    mongo_write_concern* wc ) {
+
+    mongo_msg msgs[2];
+
+    mongo_remove_msg( &msgs[0], ns, cond );
+    return mongo_write_acknowledged( conn, msgs, ns, wc );
+}
+
+/* Hand the cursor's reply storage back to its connection for reuse. */
+static void mongo_release_reply( mongo_connection* conn, mongo_reply* reply, int size ){
+    if( reply && size <= MONGO_SPARE_REPLY_MAX && size > conn->spare_reply_size ) {
+        free( conn->spare_reply );
+        conn->spare_reply = reply;
+        conn->spare_reply_size = size;
+    }
+    else
+        free( reply );
+}
+
+static void mongo_cursor_release_reply( mongo_cursor* cursor ){
+    mongo_release_reply( cursor->conn, cursor->reply, cursor->reply_size );
+    mongo_release_reply( cursor->conn, cursor->next_reply, cursor->next_reply_size );
+
+    cursor->reply = NULL;
+    cursor->reply_size = 0;
+    cursor->next_reply = NULL;
+    cursor->next_reply_size = 0;
+}
+
+/* Report a failed query on a secondary against the caller's connection. */
+static void mongo_find_failed( mongo_connection* origin, mongo_connection* conn ){
+    if( conn == origin )
+        return;
+
+    origin->err = conn->err;
+    if( conn->err == MONGO_IO_ERROR || conn->err == MONGO_READ_SIZE_ERROR )
+        mongo_replset_drop_secondary( origin, conn );
+}
+
+/* Send an OP_QUERY the caller has built and start a cursor on its reply.
+ * sl is the length of ns, including the nul. */
+static mongo_cursor* mongo_query( mongo_connection* conn, mongo_msg* msg,
+    const char* ns, int sl, int nToReturn, int options ){
+
+    mongo_connection* origin = conn;
+    int res;
+    mongo_cursor * cursor;
+
+    if( ( options & MONGO_SLAVE_OK ) && conn->replset )
+        conn = mongo_replset_read_conn( conn );
+
+    res = mongo_msg_write( conn, msg, 1, 1 );
+    if(res != MONGO_OK){
+        mongo_find_failed( origin, conn );
+        return NULL;
+    }
+
+    cursor = (mongo_cursor*)bson_malloc(sizeof(mongo_cursor));
+    cursor->conn = conn;
+
+    /* Start from the reply storage of the last destroyed cursor. */
+    cursor->reply = conn->spare_reply;
+    cursor->reply_size = conn->spare_reply_size;
+    conn->spare_reply = NULL;
+    conn->spare_reply_size = 0;
+    cursor->next_reply = NULL;
+    cursor->next_reply_size = 0;
+    cursor->prefetch = -1;
+    cursor->prefetch_id = 0;
+    cursor->prefetch_ready = 0;
+    cursor->seen = 0;
+    cursor->limit = nToReturn < 0 ? -nToReturn : nToReturn;
+    cursor->batch_size = 0;
+    cursor->target_bytes = 0;
+
+    res = mongo_read_reply( conn, &cursor->reply, &cursor->reply_size, msg->id );
+    if( res != MONGO_OK ) {
+        mongo_cursor_release_reply( cursor );
+        free( cursor );
+        mongo_find_failed( origin, conn );
+        return NULL;
+    }
+    cursor->received = cursor->reply->fields.num;
+    cursor->returned = 0;
+
+    cursor->ns = bson_malloc(sl);
+    memcpy( (void*)cursor->ns, ns, sl );
+    cursor->current.data = NULL;
+    cursor->options = options;
+
+    return (mongo_cursor*)cursor;
+}
+
+mongo_cursor* mongo_find(mongo_connection* conn, const char* ns, bson* query,
+    bson* fields, int nToReturn, int nToSkip, int options) {
+
+    int sl = strlen( ns ) + 1;
+    mongo_msg msg;
+
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append32( &msg, &options );
+    mongo_msg_append_ref( &msg, ns, sl );
+    mongo_msg_append32( &msg, &nToSkip );
+    mongo_msg_append32( &msg, &nToReturn );
+    mongo_msg_append_ref( &msg, query->data, bson_size( query ) );
+    if ( fields )
+        mongo_msg_append_ref( &msg, fields->data, bson_size( fields ) );
+
+    return mongo_query( conn, &msg, ns, sl, nToReturn, options );
+}
+
+void mongo_prepare_find( mongo_prepared* p, const char* ns, bson* fields,
+    int nToReturn, int nToSkip, int options ){
+
+    char* out;
+
+    p->ns_len = strlen( ns ) + 1;
+    p->prefix_len = 4 + p->ns_len + 8;
+    p->prefix = out = (char*)bson_malloc( p->prefix_len );
+    p->nToReturn = nToReturn;
+    p->options = options;
+
+    bson_little_endian32( out, &options );
+    out += 4;
+    memcpy( out, ns, p->ns_len );
+    p->ns = out;
+    out += p->ns_len;
+    bson_little_endian32( out, &nToSkip );
+    bson_little_endian32( out + 4, &nToReturn );
+
+    if( fields )
+        bson_copy( &p->fields, fields );
+    else
+        bson_init( &p->fields, NULL, 0 );
+}
+
+void mongo_prepare_command( mongo_prepared* p, const char* db ){
+    int sl = strlen( db );
+    char* ns = (char*)bson_malloc( sl + 5 + 1 ); /* ".$cmd" + nul */
+
+    strcpy( ns, db );
+    strcpy( ns + sl, ".$cmd" );
+    mongo_prepare_find( p, ns, NULL, 1, 0, 0 );
+    free( ns );
+}
 
-    data = &mm->data;
-    data = mongo_data_append32(data, &ZERO);
-    data = mongo_data_append(data, ns, strlen(ns) + 1);
+mongo_cursor* mongo_prepared_find( mongo_connection* conn, mongo_prepared* p, bson* query ){
+    mongo_msg msg;
 
-    for(i=0; i<count; i++){
-        data = mongo_data_append(data, bsons[i]->data, bson_size( bsons[i] ) );
-    }
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append_ref( &msg, p->prefix, p->prefix_len );
+    mongo_msg_append_ref( &msg, query->data, bson_size( query ) );
+    if( p->fields.data )
+        mongo_msg_append_ref( &msg, p->fields.data, bson_size( &p->fields ) );
 
-    return mongo_message_send(conn, mm);
+    return mongo_query( conn, &msg, p->ns, p->ns_len, p->nToReturn, p->options );
 }
 
-int mongo_insert( mongo_connection * conn , const char * ns , bson * bson ) {
-
-    char* data;
-    mongo_message* mm;
+int mongo_prepared_command( mongo_connection* conn, mongo_prepared* p, bson* command, bson* out ){
+    mongo_cursor* cursor = mongo_prepared_find( conn, p, command );
 
-    /* Make sure that BSON is valid for insert. */
-    if( mongo_bson_valid( conn, bson, 1 ) != MONGO_OK ) {
-        return MONGO_ERROR;
+    if( cursor && mongo_cursor_next( cursor ) == MONGO_OK ){
+        bson_copy( out, &cursor->current );
+        mongo_cursor_destroy( cursor );
+        return MONGO_OK;
     }
 
-    mm = mongo_message_create( 16 /* header */
-                              + 4 /* ZERO */
-                              + strlen(ns)
-                              + 1 + bson_size(bson)
-                              , 0, 0, MONGO_OP_INSERT);
-
-    data = &mm->data;
-    data = mongo_data_append32(data, &ZERO);
-    data = mongo_data_append(data, ns, strlen(ns) + 1);
-    data = mongo_data_append(data, bson->data, bson_size(bson));
+    mongo_cursor_destroy( cursor );
+    return MONGO_ERROR;
+}
 
-    return mongo_message_send(conn, mm);
+void mongo_prepared_destroy( mongo_prepared* p ){
+    free( p->prefix );
+    bson_destroy( &p->fields );
+    p->prefix = NULL;
 }
 
-int mongo_update(mongo_connection* conn, const char* ns, const bson* cond,
-    const bson* op, int flags) {
+int mongo_find_one(mongo_connection* conn, const char* ns, bson* query,
+    bson* fields, bson* out) {
 
-    char* data;
-    mongo_message* mm;
+    mongo_cursor* cursor = mongo_find(conn, ns, query, fields, 1, 0, 0);
 
-    /* Make sure that the op BSON is valid UTF-8.
-     * TODO: decide whether to check cond as well.
-     * */
-    if( mongo_bson_valid( conn, (bson *)op, 0 ) != MONGO_OK ) {
+    if (cursor && mongo_cursor_next(cursor) == MONGO_OK){
+        bson_copy(out, &cursor->current);
+        mongo_cursor_destroy(cursor);
+        return MONGO_OK;
+    } else{
+        mongo_cursor_destroy(cursor);
         return MONGO_ERROR;
     }
+}
+
+/* Whether the server may still hold documents for this cursor. */
+static int mongo_cursor_has_more( mongo_cursor* cursor ){
+    return cursor->reply->fields.cursorID &&
+        ( !cursor->limit || cursor->received < cursor->limit );
+}
 
-    mm = mongo_message_create( 16 /* header */
-                              + 4  /* ZERO */
-                              + strlen(ns) + 1
-                              + 4  /* flags */
-                              + bson_size(cond)
-                              + bson_size(op)
-                              , 0 , 0 , MONGO_OP_UPDATE );
+static int mongo_cursor_batch_size( mongo_cursor* cursor ){
+    int n = cursor->batch_size;
+    int num = cursor->reply->fields.num;
+    int remaining;
+
+    if( cursor->target_bytes && num > 0 ) {
+        int avg = ( cursor->reply->head.len - (int)sizeof( mongo_header ) -
+                    (int)sizeof( mongo_reply_fields ) ) / num;
+        int fit = cursor->target_bytes / ( avg > 0 ? avg : 1 );
+
+        /* Grow toward the target as the application keeps consuming, so a
+         * scan abandoned after a few documents never pulls a large batch. */
+        n = num < fit / 2 ? num * 2 : fit;
+        if( n < 1 )
+            n = 1;
+    }
 
-    data = &mm->data;
-    data = mongo_data_append32(data, &ZERO);
-    data = mongo_data_append(data, ns, strlen(ns) + 1);
-    data = mongo_data_append32(data, &flags);
-    data = mongo_data_append(data, cond->data, bson_size(cond));
-    data = mongo_data_append(data, op->data, bson_size(op));
+    if( cursor->limit ) {
+        remaining = cursor->limit - cursor->received;
+        if( !n || n > remaining )
+            n = remaining;
+    }
 
-    return mongo_message_send(conn, mm);
+    return n;
 }
 
-int mongo_remove(mongo_connection* conn, const char* ns, const bson* cond){
-    char * data;
-    mongo_message * mm = mongo_message_create( 16 /* header */
-                                             + 4  /* ZERO */
-                                             + strlen(ns) + 1
-                                             + 4  /* ZERO */
-                                             + bson_size(cond)
-                                             , 0 , 0 , MONGO_OP_DELETE );
+/* Set reply_follows when the reply is read straight after. */
+static int mongo_cursor_send_get_more( mongo_cursor* cursor, int* id, int reply_follows ){
+    mongo_msg msg;
+    int n = mongo_cursor_batch_size( cursor );
 
-    data = &mm->data;
-    data = mongo_data_append32(data, &ZERO);
-    data = mongo_data_append(data, ns, strlen(ns) + 1);
-    data = mongo_data_append32(data, &ZERO);
-    data = mongo_data_append(data, cond->data, bson_size(cond));
+    mongo_msg_init( &msg, MONGO_OP_GET_MORE );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, cursor->ns, strlen( cursor->ns ) + 1 );
+    mongo_msg_append32( &msg, &n );
+    mongo_msg_append64( &msg, &cursor->reply->fields.cursorID );
 
-    return mongo_message_send(conn, mm);
+    *id = msg.id;
+    return mongo_msg_write( cursor->conn, &msg, 1, reply_follows );
 }
 
-mongo_cursor* mongo_find(mongo_connection* conn, const char* ns, bson* query,
-    bson* fields, int nToReturn, int nToSkip, int options) {
+/* Wait for the prefetched batch, unless another read already set it
+ * aside, and make it the current one. */
+static int mongo_cursor_take_prefetch( mongo_cursor* cursor ){
+    mongo_connection* conn = cursor->conn;
+    mongo_reply* tmp;
+    int tmp_size;
+
+    if( !cursor->prefetch_ready ) {
+        if( conn->prefetch_cursor != cursor ) {
+            /* The connection was closed before the reply arrived. */
+            cursor->prefetch_id = 0;
+            cursor->err = MONGO_CURSOR_INVALID;
+            return MONGO_ERROR;
+        }
 
-    int sl;
-    int res;
-    mongo_cursor * cursor;
-    char * data;
-    mongo_message * mm = mongo_message_create( 16 + /* header */
-                                               4 + /*  options */
-                                               strlen( ns ) + 1 + /* ns */
-                                               4 + 4 + /* skip,return */
-                                               bson_size( query ) +
-                                               bson_size( fields ) ,
-                                               0 , 0 , MONGO_OP_QUERY );
-
-    data = &mm->data;
-    data = mongo_data_append32( data , &options );
-    data = mongo_data_append( data , ns , strlen( ns ) + 1 );
-    data = mongo_data_append32( data , &nToSkip );
-    data = mongo_data_append32( data , &nToReturn );
-    data = mongo_data_append( data , query->data , bson_size( query ) );
-    if ( fields )
-        data = mongo_data_append( data , fields->data , bson_size( fields ) );
+        conn->prefetch_cursor = NULL;
+        if( mongo_read_reply( conn, &cursor->next_reply, &cursor->next_reply_size,
+                              cursor->prefetch_id ) != MONGO_OK ) {
+            cursor->prefetch_id = 0;
+            return MONGO_ERROR;
+        }
+    }
 
-    bson_fatal_msg( (data == ((char*)mm) + mm->head.len), "query building fail!" );
+    tmp = cursor->reply;
+    tmp_size = cursor->reply_size;
+    cursor->reply = cursor->next_reply;
+    cursor->reply_size = cursor->next_reply_size;
+    cursor->next_reply = tmp;
+    cursor->next_reply_size = tmp_size;
+    cursor->prefetch_id = 0;
+    cursor->prefetch_ready = 0;
 
-    res = mongo_message_send( conn , mm );
-    if(res != MONGO_OK){
-        return NULL;
-    }
+    return MONGO_OK;
+}
 
-    cursor = (mongo_cursor*)bson_malloc(sizeof(mongo_cursor));
+static void mongo_cursor_prefetch( mongo_cursor* cursor ){
+    int id;
 
-    res = mongo_read_response( conn, (mongo_reply **)&(cursor->reply) );
-    if( res != MONGO_OK ) {
-        free( cursor );
-        return NULL;
-    }
+    if( cursor->prefetch < 0 || cursor->prefetch_id || cursor->options & MONGO_EXHAUST ||
+        !mongo_cursor_has_more( cursor ) || cursor->conn->prefetch_cursor ||
+        cursor->seen * 100 < cursor->prefetch * cursor->reply->fields.num )
+        return;
 
-    sl = strlen(ns)+1;
-    cursor->ns = bson_malloc(sl);
-    if (!cursor->ns){
-        free(cursor->reply);
-        free( cursor );
-        return NULL;
+    /* On failure the regular get_more at the end of the batch reports it. */
+    if( mongo_cursor_send_get_more( cursor, &id, 0 ) == MONGO_OK ) {
+        cursor->prefetch_id = id;
+        cursor->conn->prefetch_cursor = cursor;
     }
-    memcpy( (void*)cursor->ns, ns, sl );
-    cursor->conn = conn;
-    cursor->current.data = NULL;
-    cursor->options = options;
+}
 
-    return (mongo_cursor*)cursor;
+void mongo_cursor_set_prefetch( mongo_cursor* cursor, int percent ){
+    cursor->prefetch = percent > 100 ? 100 : percent;
 }
 
-int mongo_find_one(mongo_connection* conn, const char* ns, bson* query,
-    bson* fields, bson* out) {
+void mongo_cursor_set_batch_size( mongo_cursor* cursor, int batch_size ){
+    cursor->batch_size = batch_size > 0 ? batch_size : 0;
+}
 
-    mongo_cursor* cursor = mongo_find(conn, ns, query, fields, 1, 0, 0);
+void mongo_cursor_set_limit( mongo_cursor* cursor, int limit ){
+    cursor->limit = limit > 0 ? limit : 0;
+}
 
-    if (cursor && mongo_cursor_next(cursor) == MONGO_OK){
-        bson_copy(out, &cursor->current);
-        mongo_cursor_destroy(cursor);
-        return MONGO_OK;
-    } else{
-        mongo_cursor_destroy(cursor);
-        return MONGO_ERROR;
-    }
+void mongo_cursor_set_target_reply_size( mongo_cursor* cursor, int bytes ){
+    cursor->target_bytes = bytes > 0 ? bytes : 0;
 }
 
 int mongo_cursor_get_more(mongo_cursor* cursor){
     int res;
+    int id;
 
     if( ! cursor->reply ) {
         cursor->err = MONGO_CURSOR_INVALID;
         return MONGO_ERROR;
     }
-    else if( ! cursor->reply->fields.cursorID ) {
+    else if( cursor->options & MONGO_EXHAUST ) {
+        if( ! cursor->reply->fields.cursorID ) {
+            cursor->err = MONGO_CURSOR_EXHAUSTED;
+            return MONGO_ERROR;
+        }
+
+        /* The server streams every batch unasked; each one answers the
+         * reply before it. */
+        res = mongo_read_reply( cursor->conn, &cursor->reply, &cursor->reply_size,
+                                cursor->reply->head.id );
+        if( res != MONGO_OK ) {
+            /* The rest of the stream can't be skipped reliably. */
+            mongo_disconnect( cursor->conn );
+            cursor->reply->fields.cursorID = 0;
+            mongo_cursor_destroy(cursor);
+            return MONGO_ERROR;
+        }
+    }
+    else if( cursor->prefetch_id ) {
+        if( mongo_cursor_take_prefetch( cursor ) != MONGO_OK ) {
+            mongo_cursor_destroy(cursor);
+            return MONGO_ERROR;
+        }
+    }
+    else if( ! mongo_cursor_has_more( cursor ) ) {
         cursor->err = MONGO_CURSOR_EXHAUSTED;
         return MONGO_ERROR;
     }
     else {
-        char* data;
-        int sl = strlen(cursor->ns)+1;
-        mongo_message * mm = mongo_message_create(16 /*header*/
-                                                 +4 /*ZERO*/
-                                                 +sl
-                                                 +4 /*numToReturn*/
-                                                 +8 /*cursorID*/
-                                                 , 0, 0, MONGO_OP_GET_MORE);
-        data = &mm->data;
-        data = mongo_data_append32(data, &ZERO);
-        data = mongo_data_append(data, cursor->ns, sl);
-        data = mongo_data_append32(data, &ZERO);
-        data = mongo_data_append64(data, &cursor->reply->fields.cursorID);
-
-        free(cursor->reply);
-        res = mongo_message_send( cursor->conn, mm);
+        res = mongo_cursor_send_get_more( cursor, &id, 1 );
         if( res != MONGO_OK ) {
             mongo_cursor_destroy(cursor);
             return MONGO_ERROR;
         }
 
-        res = mongo_read_response( cursor->conn, &(cursor->reply) );
+        res = mongo_read_reply( cursor->conn, &cursor->reply, &cursor->reply_size, id );
         if( res != MONGO_OK ) {
             mongo_cursor_destroy(cursor);
             return MONGO_ERROR;
         }
-        cursor->current.data = NULL;
-
-        return MONGO_OK;
     }
+
+    cursor->received += cursor->reply->fields.num;
+    cursor->current.data = NULL;
+    cursor->seen = 0;
+
+    return MONGO_OK;
 }
 
 int mongo_cursor_next(mongo_cursor* cursor){
@@ -717,6 +2379,12 @@ int mongo_cursor_next(mongo_cursor* cursor){
     if( !cursor->reply )
         return MONGO_ERROR;
 
+    /* The first batch may hold more than a limit set after mongo_find. */
+    if( cursor->limit && cursor->returned >= cursor->limit ) {
+        cursor->err = MONGO_CURSOR_EXHAUSTED;
+        return MONGO_ERROR;
+    }
+
     /* no data */
     if ( cursor->reply->fields.num == 0 ) {
 
@@ -735,6 +2403,9 @@ int mongo_cursor_next(mongo_cursor* cursor){
     /* first */
     if (cursor->current.data == NULL){
         bson_init(&cursor->current, &cursor->reply->objs, 0);
+        cursor->seen = 1;
+        cursor->returned++;
+        mongo_cursor_prefetch( cursor );
         return MONGO_OK;
     }
 
@@ -753,10 +2424,14 @@ int mongo_cursor_next(mongo_cursor* cursor){
         }
 
         bson_init(&cursor->current, &cursor->reply->objs, 0);
+        cursor->seen = 1;
     } else {
         bson_init(&cursor->current, next_object, 0);
+        cursor->seen++;
     }
 
+    cursor->returned++;
+    mongo_cursor_prefetch( cursor );
     return MONGO_OK;
 }
 
@@ -765,28 +2440,500 @@ int mongo_cursor_destroy(mongo_cursor* cursor){
 
     if (!cursor) return result;
 
-    if (cursor->reply && cursor->reply->fields.cursorID){
-        mongo_connection* conn = cursor->conn;
-        mongo_message * mm = mongo_message_create(16 /*header*/
-                                                 +4 /*ZERO*/
-                                                 +4 /*numCursors*/
-                                                 +8 /*cursorID*/
-                                                 , 0, 0, MONGO_OP_KILL_CURSORS);
-        char* data = &mm->data;
-        data = mongo_data_append32(data, &ZERO);
-        data = mongo_data_append32(data, &ONE);
-        data = mongo_data_append64(data, &cursor->reply->fields.cursorID);
-
-        result = mongo_message_send(conn, mm);
+    /* Read an outstanding prefetch off the connection; its cursor id is
+     * the one still open on the server. */
+    if( cursor->prefetch_id && mongo_cursor_take_prefetch( cursor ) != MONGO_OK )
+        result = MONGO_ERROR;
+
+    /* An exhaust cursor can't be killed mid-stream: read off the remaining
+     * batches so the connection stays usable, or drop it if that fails. */
+    if( cursor->options & MONGO_EXHAUST ) {
+        while( cursor->reply && cursor->reply->fields.cursorID ) {
+            if( mongo_read_reply( cursor->conn, &cursor->reply, &cursor->reply_size,
+                                  cursor->reply->head.id ) != MONGO_OK ) {
+                mongo_disconnect( cursor->conn );
+                result = MONGO_ERROR;
+                break;
+            }
+        }
     }
+    else if (result == MONGO_OK && cursor->reply && cursor->reply->fields.cursorID)
+        result = mongo_queue_kill_cursor( cursor->conn, cursor->reply->fields.cursorID );
 
-    free(cursor->reply);
+    mongo_cursor_release_reply( cursor );
     free((void*)cursor->ns);
     free(cursor);
 
     return result;
 }
 
+/* Pipelining */
+
+void mongo_pipeline_init( mongo_pipeline* pipe, mongo_connection* conn ){
+    pipe->conn = conn;
+    pipe->buf = NULL;
+    pipe->buf_len = 0;
+    pipe->buf_size = 0;
+    pipe->ids = NULL;
+    pipe->replies = NULL;
+    pipe->reply_sizes = NULL;
+    pipe->count = 0;
+    pipe->alloc = 0;
+    pipe->flushed = 0;
+    pipe->received = 0;
+}
+
+/* Serialize a message onto the end of the pipeline buffer. */
+static int mongo_pipeline_queue( mongo_pipeline* pipe, mongo_msg* msg ){
+    if( pipe->count == pipe->alloc ) {
+        pipe->alloc = pipe->alloc ? pipe->alloc * 2 : 16;
+        pipe->ids = bson_realloc( pipe->ids, pipe->alloc * sizeof( int ) );
+        pipe->replies = bson_realloc( pipe->replies, pipe->alloc * sizeof( mongo_reply* ) );
+        pipe->reply_sizes = bson_realloc( pipe->reply_sizes, pipe->alloc * sizeof( int ) );
+    }
+
+    if( pipe->buf_size - pipe->buf_len < msg->len ) {
+        if( !pipe->buf_size )
+            pipe->buf_size = 1024;
+        while( pipe->buf_size - pipe->buf_len < msg->len )
+            pipe->buf_size *= 2;
+        pipe->buf = bson_realloc( pipe->buf, pipe->buf_size );
+    }
+
+    mongo_msg_copy( msg, pipe->buf + pipe->buf_len );
+    pipe->buf_len += msg->len;
+
+    pipe->ids[pipe->count] = msg->id;
+    pipe->replies[pipe->count] = NULL;
+    pipe->reply_sizes[pipe->count] = 0;
+    mongo_msg_destroy( msg );
+
+    return pipe->count++;
+}
+
+int mongo_pipeline_find( mongo_pipeline* pipe, const char* ns, bson* query,
+    bson* fields, int nToReturn, int nToSkip, int options ){
+
+    mongo_msg msg;
+
+    mongo_msg_init( &msg, MONGO_OP_QUERY );
+    mongo_msg_append32( &msg, &options );
+    mongo_msg_append_ref( &msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( &msg, &nToSkip );
+    mongo_msg_append32( &msg, &nToReturn );
+    mongo_msg_append_ref( &msg, query->data, bson_size( query ) );
+    if( fields )
+        mongo_msg_append_ref( &msg, fields->data, bson_size( fields ) );
+
+    return mongo_pipeline_queue( pipe, &msg );
+}
+
+int mongo_pipeline_get_more( mongo_pipeline* pipe, const char* ns,
+    int64_t cursorID, int nToReturn ){
+
+    mongo_msg msg;
+
+    mongo_msg_init( &msg, MONGO_OP_GET_MORE );
+    mongo_msg_append32( &msg, &ZERO );
+    mongo_msg_append_ref( &msg, ns, strlen( ns ) + 1 );
+    mongo_msg_append32( &msg, &nToReturn );
+    mongo_msg_append64( &msg, &cursorID );
+
+    return mongo_pipeline_queue( pipe, &msg );
+}
+
+int mongo_pipeline_flush( mongo_pipeline* pipe ){
+    int64_t start = 0;
+    int observed = 0;
+    int res = MONGO_OK;
+    int i, offset;
+
+    if( pipe->buf_len ) {
+        if( ( observed = mongo_observed( pipe->conn ) ) ) {
+            start = mongo_now_usec();
+            for( offset = 0; offset < pipe->buf_len; offset += i ) {
+                mongo_observe_serialized( pipe->conn, pipe->buf + offset );
+                bson_little_endian32( &i, pipe->buf + offset );
+            }
+        }
+        res = looping_write( pipe->conn, pipe->buf, pipe->buf_len );
+        if( observed )
+            mongo_observe_written( pipe->conn, start, 0, res );
+    }
+
+    pipe->conn->op_deadline = 0;
+    pipe->buf_len = 0;
+    if( res == MONGO_OK )
+        pipe->flushed = pipe->count;
+
+    return res;
+}
+
+/* Read one reply and file it under the request it answers. */
+static int mongo_pipeline_read_one( mongo_pipeline* pipe ){
+    mongo_reply* reply = NULL;
+    int size = 0;
+    int i;
+
+    if( mongo_read_reply( pipe->conn, &reply, &size, 0 ) != MONGO_OK ) {
+        free( reply );
+        return MONGO_ERROR;
+    }
+
+    for( i=0; i<pipe->flushed; i++ ) {
+        if( pipe->ids[i] == reply->head.responseTo && !pipe->replies[i] ) {
+            pipe->replies[i] = reply;
+            pipe->reply_sizes[i] = size;
+            pipe->received++;
+            return MONGO_OK;
+        }
+    }
+
+    free( reply );
+    mongo_disconnect( pipe->conn );
+    pipe->conn->err = MONGO_RESPONSE_MISMATCH;
+    return MONGO_ERROR;
+}
+
+int mongo_pipeline_reply( mongo_pipeline* pipe, int index, mongo_reply** reply ){
+    if( index < 0 || index >= pipe->flushed ) {
+        pipe->conn->err = MONGO_CONN_BAD_ARG;
+        return MONGO_ERROR;
+    }
+
+    while( !pipe->replies[index] ) {
+        if( mongo_pipeline_read_one( pipe ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    *reply = pipe->replies[index];
+    return MONGO_OK;
+}
+
+int mongo_pipeline_destroy( mongo_pipeline* pipe ){
+    int res = MONGO_OK;
+    int i;
+
+    /* Drain replies that were never collected so the connection's
+     * stream stays in step with its requests. */
+    while( pipe->received < pipe->flushed && res == MONGO_OK )
+        res = mongo_pipeline_read_one( pipe );
+
+    for( i=0; i<pipe->count; i++ )
+        free( pipe->replies[i] );
+
+    free( pipe->buf );
+    free( pipe->ids );
+    free( pipe->replies );
+    free( pipe->reply_sizes );
+    mongo_pipeline_init( pipe, pipe->conn );
+
+    return res;
+}
+
+/* Bulk writes */
+
+void mongo_bulk_init( mongo_bulk* bulk, mongo_connection* conn, const char* ns,
+    int ordered ){
+
+    bulk->conn = conn;
+    bulk->ns = (char*)bson_malloc( strlen( ns ) + 1 );
+    strcpy( bulk->ns, ns );
+    bulk->ordered = ordered;
+    bulk->buf = NULL;
+    bulk->buf_len = 0;
+    bulk->buf_size = 0;
+    bulk->ops = NULL;
+    bulk->count = 0;
+    bulk->alloc = 0;
+    bulk->n_inserted = 0;
+    bulk->n_matched = 0;
+    bulk->n_upserted = 0;
+    bulk->n_removed = 0;
+    bulk->errors = NULL;
+    bulk->n_errors = 0;
+    bulk->errors_alloc = 0;
+}
+
+/* Copy an operation's documents into the bulk so that callers can
+ * destroy them as soon as the operation is queued. */
+static int mongo_bulk_queue( mongo_bulk* bulk, int type, int flags,
+    const bson* first, const bson* second ){
+
+    mongo_bulk_op* op;
+    int len = bson_size( first ) + ( second ? bson_size( second ) : 0 );
+
+    if( bulk->count == bulk->alloc ) {
+        bulk->alloc = bulk->alloc ? bulk->alloc * 2 : 64;
+        bulk->ops = bson_realloc( bulk->ops, bulk->alloc * sizeof( mongo_bulk_op ) );
+    }
+
+    if( bulk->buf_size - bulk->buf_len < len ) {
+        if( !bulk->buf_size )
+            bulk->buf_size = 4096;
+        while( bulk->buf_size - bulk->buf_len < len )
+            bulk->buf_size *= 2;
+        bulk->buf = bson_realloc( bulk->buf, bulk->buf_size );
+    }
+
+    op = &bulk->ops[bulk->count];
+    op->type = type;
+    op->flags = flags;
+    op->offset = bulk->buf_len;
+    op->len = len;
+
+    memcpy( bulk->buf + bulk->buf_len, first->data, bson_size( first ) );
+    if( second )
+        memcpy( bulk->buf + bulk->buf_len + bson_size( first ), second->data, bson_size( second ) );
+    bulk->buf_len += len;
+
+    return bulk->count++;
+}
+
+int mongo_bulk_insert( mongo_bulk* bulk, bson* doc ){
+    if( mongo_bson_valid( bulk->conn, doc, 1 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_bulk_queue( bulk, MONGO_OP_INSERT, 0, doc, NULL );
+}
+
+int mongo_bulk_update( mongo_bulk* bulk, const bson* cond, const bson* op,
+    int flags ){
+
+    if( mongo_bson_valid( bulk->conn, (bson*)op, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_bulk_queue( bulk, MONGO_OP_UPDATE, flags, cond, op );
+}
+
+int mongo_bulk_remove( mongo_bulk* bulk, const bson* cond ){
+    return mongo_bulk_queue( bulk, MONGO_OP_DELETE, 0, cond, NULL );
+}
+
+static void mongo_bulk_add_error( mongo_bulk* bulk, int index, int count,
+    int code, const char* errstr ){
+
+    mongo_bulk_error* error;
+
+    if( bulk->n_errors == bulk->errors_alloc ) {
+        bulk->errors_alloc = bulk->errors_alloc ? bulk->errors_alloc * 2 : 8;
+        bulk->errors = bson_realloc( bulk->errors, bulk->errors_alloc * sizeof( mongo_bulk_error ) );
+    }
+
+    error = &bulk->errors[bulk->n_errors++];
+    error->index = index;
+    error->count = count;
+    error->code = code;
+    error->errstr = (char*)bson_malloc( strlen( errstr ) + 1 );
+    strcpy( error->errstr, errstr );
+}
+
+static void mongo_bulk_clear_results( mongo_bulk* bulk ){
+    int i;
+
+    for( i=0; i<bulk->n_errors; i++ )
+        free( bulk->errors[i].errstr );
+
+    bulk->n_errors = 0;
+    bulk->n_inserted = 0;
+    bulk->n_matched = 0;
+    bulk->n_upserted = 0;
+    bulk->n_removed = 0;
+}
+
+/* Size of an OP_INSERT, OP_UPDATE or OP_DELETE before its documents. */
+static int mongo_bulk_overhead( mongo_bulk* bulk, int type ){
+    int len = sizeof( mongo_header ) + 4 + strlen( bulk->ns ) + 1;
+    return type == MONGO_OP_INSERT ? len : len + 4;
+}
+
+/* Build the message starting at operation i. Consecutive inserts share
+ * an OP_INSERT for as long as it stays under the server's message size.
+ * Returns the number of operations the message covers. */
+static int mongo_bulk_build( mongo_bulk* bulk, mongo_msg* msg, int i ){
+    mongo_bulk_op* op = &bulk->ops[i];
+    int flags = bulk->ordered ? 0 : MONGO_INSERT_CONTINUE_ON_ERROR;
+    int len, n;
+
+    mongo_msg_init( msg, op->type );
+
+    if( op->type == MONGO_OP_INSERT ) {
+        mongo_msg_append32( msg, &flags );
+        mongo_msg_append_ref( msg, bulk->ns, strlen( bulk->ns ) + 1 );
+
+        len = mongo_bulk_overhead( bulk, MONGO_OP_INSERT );
+        for( n=0; i+n < bulk->count; n++, op++ ) {
+            if( op->type != MONGO_OP_INSERT || op->len > bulk->conn->max_bson_size ||
+                ( n && len + op->len > bulk->conn->max_msg_size ) )
+                break;
+            mongo_msg_append_ref( msg, bulk->buf + op->offset, op->len );
+            len += op->len;
+        }
+
+        return n;
+    }
+
+    mongo_msg_append32( msg, &ZERO );
+    mongo_msg_append_ref( msg, bulk->ns, strlen( bulk->ns ) + 1 );
+    mongo_msg_append32( msg, &op->flags );
+    mongo_msg_append_ref( msg, bulk->buf + op->offset, op->len );
+
+    return 1;
+}
+
+/* Tally the getlasterror reply for the operations [first, first + n). */
+static void mongo_bulk_record( mongo_bulk* bulk, int first, int n, mongo_reply* reply ){
+    int type = bulk->ops[first].type;
+    bson out;
+    bson_iterator it;
+    const char* errstr;
+    int code;
+    int affected = 0;
+
+    if( reply->fields.num != 1 ) {
+        mongo_bulk_add_error( bulk, first, n, 0, "no getlasterror reply" );
+        return;
+    }
+
+    bson_init( &out, &reply->objs, 0 );
+
+    if( mongo_last_error_result( &out, reply->fields.flag, &errstr, &code ) ) {
+        mongo_bulk_add_error( bulk, first, n, code, errstr ? errstr : "getlasterror failed" );
+        return;
+    }
+
+    if( bson_find( &it, &out, "n" ) )
+        affected = bson_iterator_int( &it );
+
+    if( type == MONGO_OP_INSERT )
+        bulk->n_inserted += n;
+    else if( type == MONGO_OP_DELETE )
+        bulk->n_removed += affected;
+    else if( bson_find( &it, &out, "upserted" ) )
+        bulk->n_upserted += affected;
+    else
+        bulk->n_matched += affected;
+}
+
+int mongo_bulk_execute( mongo_bulk* bulk ){
+    mongo_connection* conn = bulk->conn;
+    mongo_msg* msgs;
+    int first[MONGO_BULK_GROUP];
+    int covered[MONGO_BULK_GROUP];
+    int ids[MONGO_BULK_GROUP];
+    mongo_reply* reply = NULL;
+    int reply_size = 0;
+    char* cmd_ns;
+    bson gle;
+    bson_buffer bb;
+    int i = 0, n, m, sent, bytes;
+    int res = MONGO_OK;
+
+    mongo_bulk_clear_results( bulk );
+
+    if( !conn->max_bson_size )
+        mongo_cmd_ismaster( conn, NULL );
+    if( !conn->max_bson_size ) {
+        conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+        conn->max_msg_size = 2 * MONGO_DEFAULT_MAX_BSON_SIZE;
+    }
+
+    /* Each write is followed by a getlasterror on <db>.$cmd. */
+    cmd_ns = mongo_cmd_ns( bulk->ns, NULL, 0 );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "getlasterror", 1 );
+    bson_from_buffer( &gle, &bb );
+
+    msgs = (mongo_msg*)bson_malloc( 2 * MONGO_BULK_GROUP * sizeof( mongo_msg ) );
+
+    while( i < bulk->count && res == MONGO_OK ) {
+
+        /* Ordered writes wait for each message's result before the next
+         * is sent; unordered ones keep up to a message size in flight. */
+        m = 0;
+        bytes = 0;
+        while( i < bulk->count && m < MONGO_BULK_GROUP ) {
+            if( bulk->ops[i].len > conn->max_bson_size ) {
+                mongo_bulk_add_error( bulk, i, 1, 0, "document is larger than maxBsonObjectSize" );
+                i++;
+                if( bulk->ordered )
+                    break;
+                continue;
+            }
+
+            n = mongo_bulk_build( bulk, &msgs[2*m], i );
+            first[m] = i;
+            covered[m] = n;
+            i += n;
+            bytes += msgs[2*m].len;
+
+            mongo_msg_init( &msgs[2*m+1], MONGO_OP_QUERY );
+            mongo_msg_append32( &msgs[2*m+1], &ZERO );
+            mongo_msg_append_ref( &msgs[2*m+1], cmd_ns, strlen( cmd_ns ) + 1 );
+            mongo_msg_append32( &msgs[2*m+1], &ZERO );
+            mongo_msg_append32( &msgs[2*m+1], &ONE );
+            mongo_msg_append_ref( &msgs[2*m+1], gle.data, bson_size( &gle ) );
+            ids[m] = msgs[2*m+1].id;
+            m++;
+
+            if( bulk->ordered || bytes >= conn->max_msg_size )
+                break;
+        }
+
+        if( !m )
+            break;
+
+        if( mongo_msg_write( conn, msgs, 2*m, 1 ) != MONGO_OK ) {
+            res = MONGO_ERROR;
+            break;
+        }
+
+        for( sent=0; sent<m; sent++ ) {
+            if( mongo_read_reply( conn, &reply, &reply_size, ids[sent] ) != MONGO_OK ) {
+                /* The group's other replies are still on the socket. */
+                mongo_disconnect( conn );
+                res = MONGO_ERROR;
+                break;
+            }
+            mongo_bulk_record( bulk, first[sent], covered[sent], reply );
+        }
+
+        if( bulk->ordered && bulk->n_errors )
+            break;
+    }
+
+    free( msgs );
+    free( reply );
+    free( cmd_ns );
+    bson_destroy( &gle );
+
+    /* The queue is spent; results stay until the next execute. */
+    bulk->count = 0;
+    bulk->buf_len = 0;
+
+    if( res == MONGO_OK && bulk->n_errors ) {
+        conn->err = MONGO_WRITE_ERROR;
+        res = MONGO_ERROR;
+    }
+
+    return res;
+}
+
+void mongo_bulk_destroy( mongo_bulk* bulk ){
+    mongo_bulk_clear_results( bulk );
+
+    free( bulk->ns );
+    free( bulk->buf );
+    free( bulk->ops );
+    free( bulk->errors );
+    bulk->ns = NULL;
+    bulk->buf = NULL;
+    bulk->ops = NULL;
+    bulk->errors = NULL;
+    bulk->count = bulk->alloc = bulk->errors_alloc = 0;
+}
+
 /* MongoDB Helper Functions */
 
 int mongo_create_index(mongo_connection * conn, const char * ns, bson * key, int options, bson * out){
@@ -872,15 +3019,20 @@ int mongo_run_command(mongo_connection* conn, const char* db, bson* command,
     bson* out) {
 
     bson fields;
+    char buf[128];
     int sl = strlen(db);
-    char* ns = bson_malloc(sl + 5 + 1); /* ".$cmd" + nul */
+    char* ns = buf;
     int res;
 
-    strcpy(ns, db);
-    strcpy(ns+sl, ".$cmd");
+    if( sl + 5 + 1 > (int)sizeof( buf ) ) /* ".$cmd" + nul */
+        ns = bson_malloc(sl + 5 + 1);
+
+    memcpy(ns, db, sl);
+    memcpy(ns+sl, ".$cmd", 6);
 
     res = mongo_find_one(conn, ns, command, bson_empty(&fields), out);
-    free(ns);
+    if( ns != buf )
+        free(ns);
     return res;
 }
 
@@ -891,13 +3043,18 @@ int mongo_simple_int_command(mongo_connection * conn, const char * db,
     bson cmd;
     bson_buffer bb;
     bson_bool_t success = 0;
+    int ran = 0;
 
     bson_buffer_init(&bb);
     bson_append_int(&bb, cmdstr, arg);
     bson_from_buffer(&cmd, &bb);
 
+    /* Left empty if the command never gets a reply. */
+    bson_empty(&out);
+
     if( mongo_run_command(conn, db, &cmd, &out) == MONGO_OK ){
         bson_iterator it;
+        ran = 1;
         if(bson_find(&it, &out, "ok"))
             success = bson_iterator_bool(&it);
     }
@@ -912,7 +3069,9 @@ int mongo_simple_int_command(mongo_connection * conn, const char * db,
     if( success )
       return MONGO_OK;
     else {
-      conn->err = MONGO_COMMAND_FAILED;
+      /* A connection error, such as MONGO_OP_TIMEOUT, is kept. */
+      if( ran )
+          conn->err = MONGO_COMMAND_FAILED;
       return MONGO_ERROR;
     }
 }
@@ -929,6 +3088,8 @@ int mongo_simple_str_command(mongo_connection * conn, const char * db,
     bson_append_string(&bb, cmdstr, arg);
     bson_from_buffer(&cmd, &bb);
 
+    bson_empty(&out);
+
     if( mongo_run_command(conn, db, &cmd, &out) == MONGO_OK ) {
         bson_iterator it;
         if(bson_find(&it, &out, "ok"))
@@ -964,37 +3125,25 @@ static int mongo_cmd_get_error_helper(mongo_connection * conn, const char * db,
     bson * realout, const char * cmdtype) {
 
     bson out = {NULL,0};
-    bson_bool_t haserror = 0;
+    int res = MONGO_OK;
 
     /* Reset last error codes. */
     conn->lasterrcode = 0;
     free(conn->lasterrstr);
     conn->lasterrstr = NULL;
 
-    /* If there's an error, store its code and string in the connection object. */
-    if( mongo_simple_int_command(conn, db, cmdtype, 1, &out) == MONGO_OK ) {
-        bson_iterator it;
-        haserror = (bson_find(&it, &out, "err") != BSON_NULL);
-        if( haserror ) {
-             conn->lasterrstr = (char *)bson_malloc( bson_iterator_string_len( &it ) );
-             if( conn->lasterrstr ) {
-                 strcpy( conn->lasterrstr, bson_iterator_string( &it ) );
-             }
-
-            if( bson_find( &it, &out, "code" ) != BSON_NULL )
-                conn->lasterrcode = bson_iterator_int( &it );
-        }
-    }
+    /* If there's an error, store its code and string in the connection
+     * object. A command that could not be run is an error too. */
+    if( mongo_simple_int_command(conn, db, cmdtype, 1, &out) != MONGO_OK ||
+        mongo_parse_last_error( conn, &out, 0 ) )
+        res = MONGO_ERROR;
 
     if(realout)
         *realout = out; /* transfer of ownership */
     else
         bson_destroy(&out);
 
-    if( haserror )
-        return MONGO_ERROR;
-    else
-        return MONGO_OK;
+    return res;
 }
 
 int mongo_cmd_get_prev_error(mongo_connection * conn, const char * db, bson * out) {
@@ -1013,6 +3162,7 @@ bson_bool_t mongo_cmd_ismaster(mongo_connection * conn, bson * realout){
         bson_iterator it;
         bson_find(&it, &out, "ismaster");
         ismaster = bson_iterator_bool(&it);
+        mongo_record_limits( conn, &out );
     }
 
     if(realout)
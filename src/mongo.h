@@ -39,7 +39,10 @@ typedef enum mongo_error_t {
     MONGO_CURSOR_EXHAUSTED = 4, /**< The cursor has no more results. */
     MONGO_CURSOR_INVALID = 5,   /**< The cursor has timed out or is not recognized. */
     MONGO_CURSOR_PENDING = 6,   /**< Tailable cursor still alive but no data. */
-    MONGO_BSON_INVALID = 7      /**< BSON not valid for the specified op. */ 
+    MONGO_BSON_INVALID = 7,     /**< BSON not valid for the specified op. */
+    MONGO_RESPONSE_MISMATCH = 8, /**< The reply does not answer any request that was sent. */
+    MONGO_WRITE_ERROR = 9,      /**< The server rejected a safe write or writes in a bulk. */
+    MONGO_OP_TIMEOUT = 10       /**< An operation ran past op_timeout_ms; the connection was closed. */
 } mongo_error_t; 
 
 enum mongo_cursor_bitfield_t {
@@ -47,7 +50,7 @@ enum mongo_cursor_bitfield_t {
     MONGO_SLAVE_OK = (1<<2),          /**< Allow queries on a non-primary node. */
     MONGO_NO_CURSOR_TIMEOUT = (1<<4), /**< Disable cursor timeouts. */
     MONGO_AWAIT_DATA = (1<<5),        /**< Momentarily block for more data. */
-    MONGO_EXHAUST = (1<<6),           /**< Stream in multiple 'more' packages. */
+    MONGO_EXHAUST = (1<<6),           /**< Have the server stream every batch without get_more. */
     MONGO_PARTIAL = (1<<7)            /**< Allow reads even if a shard is down. */
 };
 
@@ -80,6 +83,7 @@ enum mongo_operations {
 
 static const int MONGO_UPDATE_UPSERT = 0x1;
 static const int MONGO_UPDATE_MULTI = 0x2;
+static const int MONGO_INSERT_CONTINUE_ON_ERROR = 0x1;
 
 #pragma pack(1)
 typedef struct {
@@ -114,14 +118,34 @@ typedef struct mongo_host_port {
     struct mongo_host_port* next;
 } mongo_host_port;
 
+struct mongo_connection;
+
+/* A secondary kept open for MONGO_SLAVE_OK reads. */
+typedef struct mongo_secondary {
+    struct mongo_connection* conn; /**< Connection to the member. */
+    int rtt_usec;                  /**< ismaster round-trip time, exponentially weighted. */
+    struct mongo_secondary* next;
+} mongo_secondary;
+
 typedef struct {
     mongo_host_port* seeds;        /**< List of seeds provided by the user. */
     mongo_host_port* hosts;        /**< List of host/ports given by the replica set */
     char* name;                    /**< Name of the replica set. */
     bson_bool_t primary_connected; /**< Primary node connection status. */
+    int primary_rtt_usec;          /**< Primary's ismaster round-trip time, exponentially weighted. */
+
+    bson_bool_t read_secondaries;  /**< Keep connections to secondaries for MONGO_SLAVE_OK reads. */
+    int latency_window_ms;         /**< Members this close to the fastest secondary share reads. */
+    mongo_secondary* secondaries;  /**< Open secondaries. */
+    int next_read;                 /**< Rotates reads across the members in the window. */
+
+    struct mongo_monitor* monitor; /**< Topology monitor, if one is attached; not owned. */
 } mongo_replset;
 
-typedef struct {
+struct mongo_cursor;
+struct mongo_uring_slot;
+
+typedef struct mongo_connection {
     mongo_host_port* primary;  /**< Primary connection info. */
     mongo_replset* replset;    /**< replset object if connected to a replica set. */
     int sock;                  /**< Socket file descriptor. */
@@ -134,10 +158,43 @@ typedef struct {
     char* errstr;              /**< String version of most recent driver error code. */
     int lasterrcode;           /**< getlasterror given by the server on calls. */
     char* lasterrstr;          /**< getlasterror string generated by server. */
+
+    char* rbuf;                /**< Read-ahead buffer for incoming replies. */
+    int rbuf_start;            /**< Offset of the first unconsumed byte in rbuf. */
+    int rbuf_end;              /**< Offset just past the last buffered byte in rbuf. */
+    mongo_reply* spare_reply;  /**< Reply storage recycled from destroyed cursors. */
+    int spare_reply_size;      /**< Allocated size of spare_reply. */
+    struct mongo_cursor* prefetch_cursor; /**< Cursor whose prefetch reply is still unread. */
+    int max_bson_size;         /**< Largest document the server accepts, or 0 until known. */
+    int max_msg_size;          /**< Largest message the server accepts, or 0 until known. */
+    struct mongo_uring_slot* uring; /**< io_uring transport, if attached; see uring.h. */
+    int64_t op_deadline;       /**< When the operation in progress times out, or 0. */
+    int64_t* dead_cursors;     /**< Ids awaiting OP_KILL_CURSORS, little endian. */
+    int dead_cursor_count;
+    int dead_cursor_alloc;
+    int64_t dead_cursor_since; /**< When the oldest queued id was queued. */
+    int kill_cursors_batch;    /**< Queued ids that make mongo_cursor_destroy send them. */
+    int kill_cursors_delay_ms; /**< Age of the oldest queued id that does the same. */
+    struct mongo_stats* stats; /**< Counters and histograms, if enabled; see stats.h. */
+    struct mongo_op_tracker* ops; /**< Requests awaiting replies, while operation hooks are set. */
+    struct mongo_trace* trace; /**< Capture of the messages sent and received, if set; see trace.h. */
+    int trace_conn;            /**< This connection's number in the trace. */
 } mongo_connection;
 
-typedef struct {
+typedef struct mongo_cursor {
     mongo_reply * reply; /**< reply is owned by cursor */
+    int reply_size;      /**< Allocated size of reply, reused across batches. */
+    mongo_reply * next_reply; /**< Second buffer, filled by a prefetched get_more. */
+    int next_reply_size;
+    int prefetch;        /**< Percent of a batch consumed before prefetching, or -1. */
+    int prefetch_id;     /**< Request id of the outstanding prefetch, or 0. */
+    int prefetch_ready;  /**< Whether next_reply holds the prefetched batch. */
+    int seen;            /**< Documents returned from the current batch. */
+    int limit;           /**< Most documents to return in all, or 0 for no limit. */
+    int batch_size;      /**< Documents to request per get_more, or 0 for the server default. */
+    int target_bytes;    /**< Reply size the adaptive batch size aims for, or 0. */
+    int received;        /**< Documents received in all batches so far. */
+    int returned;        /**< Documents returned by mongo_cursor_next so far. */
     mongo_connection * conn; /**< connection is *not* owned by cursor */
     const char* ns;    /**< owned by cursor */
     bson current;      /**< This cursor's current bson object. */
@@ -145,14 +202,81 @@ typedef struct {
     int options;       /**< Bitfield containing cursor options. */
 } mongo_cursor;
 
+typedef struct {
+    char* prefix;    /**< Serialized flags, namespace, skip and limit. */
+    int prefix_len;
+    const char* ns;  /**< Points into prefix. */
+    int ns_len;      /**< Including the nul. */
+    int nToReturn;
+    int options;
+    bson fields;     /**< Copy of the fields to return; empty for all. */
+} mongo_prepared;
+
+typedef struct {
+    mongo_connection* conn; /**< connection is *not* owned by the pipeline */
+    char* buf;              /**< Serialized messages awaiting a flush. */
+    int buf_len;
+    int buf_size;
+    int* ids;               /**< Request id of each queued message. */
+    mongo_reply** replies;  /**< Replies received so far, indexed like ids. */
+    int* reply_sizes;
+    int count;              /**< Messages queued. */
+    int alloc;
+    int flushed;            /**< Messages written to the connection. */
+    int received;           /**< Replies read from the connection. */
+} mongo_pipeline;
+
+typedef struct {
+    int w;        /**< Servers that must have the write; 1 for the primary alone. */
+    int wtimeout; /**< Milliseconds to wait for w servers, or 0 to wait forever. */
+    int j;        /**< Wait for the write to reach the journal. */
+    int fsync;    /**< Wait for the data files to be flushed. */
+    bson cmd;     /**< getlasterror command built by mongo_write_concern_finish. */
+} mongo_write_concern;
+
+typedef struct {
+    int type;               /**< MONGO_OP_INSERT, MONGO_OP_UPDATE or MONGO_OP_DELETE. */
+    int flags;              /**< Update flags. */
+    int offset;             /**< Offset of the operation's documents in the bulk buffer. */
+    int len;                /**< Combined length of the operation's documents. */
+} mongo_bulk_op;
+
+typedef struct {
+    int index;              /**< Index of the first operation the error applies to. */
+    int count;              /**< Operations covered: 1, or the inserts sent in one message. */
+    int code;               /**< Server error code, or 0 for errors found by the driver. */
+    char* errstr;           /**< Error message, owned by the bulk. */
+} mongo_bulk_error;
+
+typedef struct {
+    mongo_connection* conn; /**< connection is *not* owned by the bulk */
+    char* ns;
+    int ordered;            /**< Stop at the first failed write. */
+    char* buf;              /**< Copies of the queued documents. */
+    int buf_len;
+    int buf_size;
+    mongo_bulk_op* ops;     /**< Operations queued for the next execute. */
+    int count;
+    int alloc;
+
+    int n_inserted;         /**< Results of the last execute. */
+    int n_matched;
+    int n_upserted;
+    int n_removed;
+    mongo_bulk_error* errors;
+    int n_errors;
+    int errors_alloc;
+} mongo_bulk;
+
 /* Connection API */
 
 /**
  * Connect to a single MongoDB server.
  *
  * @param conn a mongo_connection object.
- * @param host a numerical network address or a network hostname.
- * @param port the port to connect to.
+ * @param host a numerical network address, a network hostname, or the
+ *     path of a Unix domain socket such as /tmp/mongodb-27017.sock.
+ * @param port the port to connect to; ignored for a socket path.
  *
  * @return MONGO_OK or MONGO_ERROR on failure. On failure, a constant of type
  *   mongo_conn_return will be set on the conn->err field.
@@ -173,7 +297,8 @@ void mongo_replset_init_conn( mongo_connection* conn, const char* name );
  * You must specify at least one seed node before connecting to a replica set.
  *
  * @param conn a mongo_connection object.
- * @param host a numerical network address or a network hostname.
+ * @param host a numerical network address, a network hostname, or the
+ *     path of a Unix domain socket.
  * @param port the port to connect to.
  */
 void mongo_replset_add_seed( mongo_connection* conn, const char* host, int port );
@@ -191,16 +316,83 @@ void mongo_replset_add_seed( mongo_connection* conn, const char* host, int port
  */
 int mongo_replset_connect( mongo_connection* conn );
 
+/**
+ * Keep connections to the replica set's secondaries, so that queries
+ * given MONGO_SLAVE_OK are read from them instead of the primary. Call
+ * this before mongo_replset_connect.
+ *
+ * A read goes to one of the secondaries whose round-trip time is within
+ * latency_window_ms of the fastest secondary's, in rotation. When no
+ * secondary is open, reads go to the primary.
+ *
+ * @param conn a mongo_connection object.
+ * @param latency_window_ms the latency window in milliseconds.
+ */
+void mongo_replset_set_read_secondaries( mongo_connection* conn, int latency_window_ms );
+
+/**
+ * Send ismaster to the primary and to every open secondary, updating
+ * their round-trip times. Secondaries that fail to answer, or are no
+ * longer secondaries, are closed. Known members without a connection
+ * are probed again, and opened if they are secondaries now.
+ *
+ * @param conn a mongo_connection object connected to a replica set.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the primary failed to answer
+ *     or is no longer primary (MONGO_CONN_NOT_MASTER).
+ */
+int mongo_replset_ping( mongo_connection* conn );
+
+/**
+ * Set how long resolved host addresses are cached, for all connections.
+ * Caching spares the resolver when many connections are opened, or
+ * reopened, to the same hosts. A host whose cached addresses all fail to
+ * connect is resolved again on the next attempt.
+ *
+ * @param ttl_ms the time to keep addresses, 60 seconds by default, or 0
+ *     to resolve on every connect.
+ */
+void mongo_set_dns_cache_ttl( int ttl_ms );
+
 /** Set a timeout for operations on this connection.
+ *
+ *  The timeout bounds each operation from the first byte of the request
+ *  to the last byte of the reply, however slowly the bytes arrive. The
+ *  socket is made non-blocking and waited on with poll. An operation that
+ *  runs out of time fails with MONGO_OP_TIMEOUT and closes the socket, so a
+ *  half-read reply can never be mistaken for the next one; the connection
+ *  must be reconnected, and a pool replaces it.
  *
  *  @param conn a mongo_connection object.
- *  @param millis timeout time in milliseconds.
+ *  @param millis timeout time in milliseconds, or 0 for none.
  *
  *  @return MONGO_OK. On error, return MONGO_ERROR and
  *    set the conn->err field.
  */
 int mongo_conn_set_timeout( mongo_connection *conn, int millis );
 
+/**
+ * Set when mongo_cursor_destroy sends the cursor ids it has queued.
+ * Queued ids otherwise go out in one OP_KILL_CURSORS ahead of the next
+ * message sent on the connection.
+ *
+ * @param conn a mongo_connection object.
+ * @param max_ids send once this many ids are queued; 1 sends each id
+ *     as its cursor is destroyed. The default is 64.
+ * @param max_delay_ms send once the oldest queued id has waited this
+ *     long. The default is 1000.
+ */
+void mongo_conn_set_kill_cursors_batch( mongo_connection *conn, int max_ids, int max_delay_ms );
+
+/**
+ * Send the queued cursor ids now, e.g. before a connection goes idle.
+ *
+ * @param conn a mongo_connection object.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_conn_flush_kill_cursors( mongo_connection *conn );
+
 /**
  * Try reconnecting to the server using the existing connection settings.
  *
@@ -290,6 +482,48 @@ int mongo_update(mongo_connection* conn, const char* ns, const bson* cond,
  */
 int mongo_remove(mongo_connection* conn, const char* ns, const bson* cond);
 
+/**
+ * Initialize a write concern to acknowledgement by the primary alone.
+ * Adjust its fields, then call mongo_write_concern_finish.
+ */
+void mongo_write_concern_init( mongo_write_concern* wc );
+
+/**
+ * Build the getlasterror command for the write concern's current fields.
+ * Call it again after changing them. Safe writes given a write concern
+ * that was never finished finish it themselves.
+ */
+void mongo_write_concern_finish( mongo_write_concern* wc );
+
+/**
+ * Free the command built by mongo_write_concern_finish.
+ */
+void mongo_write_concern_destroy( mongo_write_concern* wc );
+
+/**
+ * Acknowledged versions of mongo_insert, mongo_insert_batch, mongo_update
+ * and mongo_remove.
+ *
+ * The write and a getlasterror query go out in a single writev, and the
+ * result is read straight into conn->lasterrcode and conn->lasterrstr,
+ * so an acknowledged write costs one syscall to send and one round trip.
+ *
+ * @param wc the write concern, or NULL for a plain getlasterror.
+ *
+ * @return MONGO_OK if the server applied the write. MONGO_ERROR with
+ *     conn->err set to MONGO_WRITE_ERROR if the server reported an
+ *     error, to MONGO_COMMAND_FAILED if the getlasterror itself failed,
+ *     or to the error that kept the write from being sent.
+ */
+int mongo_insert_safe( mongo_connection* conn, const char* ns, bson* data,
+    mongo_write_concern* wc );
+int mongo_insert_batch_safe( mongo_connection* conn, const char* ns,
+    bson** data, int num, mongo_write_concern* wc );
+int mongo_update_safe( mongo_connection* conn, const char* ns, const bson* cond,
+    const bson* op, int flags, mongo_write_concern* wc );
+int mongo_remove_safe( mongo_connection* conn, const char* ns, const bson* cond,
+    mongo_write_concern* wc );
+
 /**
  * Find documents in a MongoDB server.
  *
@@ -301,6 +535,15 @@ int mongo_remove(mongo_connection* conn, const char* ns, const bson* cond);
  * @param nToSkip the number of documents to skip.
  * @param options A bitfield containing cursor options.
  *
+ * With MONGO_EXHAUST, the server pushes each batch as soon as the last one
+ * is sent, so no get_more round trips are made. The connection can't be
+ * used for anything else until the cursor is exhausted or destroyed;
+ * destroying it early reads off the rest of the stream.
+ *
+ * With MONGO_SLAVE_OK on a replica set connection that reads from
+ * secondaries (see mongo_replset_set_read_secondaries), the query and its
+ * get_mores run on a secondary; cursor->conn is that member's connection.
+ *
  * @return A cursor object or NULL if an error has occurred. In case of
  *     an error, the err field on the mongo_connection will be set.
  */
@@ -317,7 +560,58 @@ mongo_cursor* mongo_find(mongo_connection* conn, const char* ns, bson* query,
 int mongo_cursor_next(mongo_cursor* cursor);
 
 /**
- * Destroy a cursor object.
+ * Fetch the next batch ahead of time.
+ *
+ * Once the given percentage of the current batch has been returned by
+ * mongo_cursor_next, the OP_GET_MORE for the next batch is sent without
+ * waiting for its reply. The server and the kernel then transfer that batch
+ * into a second buffer while the application works through the current one.
+ * Other operations may still use the connection; a prefetched reply that
+ * arrives first is set aside for the cursor.
+ *
+ * Only one cursor per connection prefetches at a time.
+ *
+ * @param cursor a cursor returned from a call to mongo_find.
+ * @param percent 0 to request the next batch as soon as iteration of the
+ *     current one starts, up to 100 to request it on the last document.
+ *     A negative value turns prefetching off.
+ */
+void mongo_cursor_set_prefetch( mongo_cursor* cursor, int percent );
+
+/**
+ * Set the number of documents requested by each get_more. The first batch
+ * is sized by the nToReturn given to mongo_find.
+ *
+ * @param cursor a cursor returned from a call to mongo_find.
+ * @param batch_size documents per batch, or 0 for the server default.
+ */
+void mongo_cursor_set_batch_size( mongo_cursor* cursor, int batch_size );
+
+/**
+ * Limit the total number of documents the cursor returns. mongo_find
+ * starts with the limit given by nToReturn; batches are never requested
+ * past it, and mongo_cursor_next stops at it even within a batch.
+ *
+ * @param cursor a cursor returned from a call to mongo_find.
+ * @param limit the most documents to return, or 0 for no limit.
+ */
+void mongo_cursor_set_limit( mongo_cursor* cursor, int limit );
+
+/**
+ * Size batches adaptively. Each get_more asks for twice as many documents
+ * as the last batch held, up to as many as fit in the given number of
+ * bytes at the average document size seen so far. Overrides
+ * mongo_cursor_set_batch_size.
+ *
+ * @param cursor a cursor returned from a call to mongo_find.
+ * @param bytes the reply size to aim for, or 0 to turn adaptive sizing off.
+ */
+void mongo_cursor_set_target_reply_size( mongo_cursor* cursor, int bytes );
+
+/**
+ * Destroy a cursor object. A cursor still open on the server is closed
+ * by queueing its id on the connection; see
+ * mongo_conn_set_kill_cursors_batch.
  *
  * @param cursor the cursor to destroy.
  *
@@ -340,6 +634,187 @@ int mongo_cursor_destroy(mongo_cursor* cursor);
 bson_bool_t mongo_find_one(mongo_connection* conn, const char* ns, bson* query,
     bson* fields, bson* out);
 
+/* ----------------------------
+   PREPARED OPERATIONS
+   ------------------------------ */
+
+/**
+ * Prepare a query whose namespace, fields and options don't change between
+ * runs. The part of the OP_QUERY message before the query document is
+ * serialized here once; each mongo_prepared_find sends it, unchanged, with
+ * the query. A prepared query may be run on any connection.
+ *
+ * @param p the mongo_prepared to initialize.
+ * @param ns the namespace.
+ * @param fields a bson document of fields to be returned, or NULL. It is
+ *     copied.
+ * @param nToReturn, nToSkip, options as for mongo_find.
+ */
+void mongo_prepare_find( mongo_prepared* p, const char* ns, bson* fields,
+    int nToReturn, int nToSkip, int options );
+
+/**
+ * Prepare a command on the given database, for mongo_prepared_command.
+ *
+ * @param p the mongo_prepared to initialize.
+ * @param db the name of the database.
+ */
+void mongo_prepare_command( mongo_prepared* p, const char* db );
+
+/**
+ * Run a prepared query, as mongo_find does.
+ *
+ * @param conn a mongo_connection object.
+ * @param p a query from mongo_prepare_find.
+ * @param query the bson query, which may be a bson_template's document.
+ *
+ * @return A cursor object or NULL if an error has occurred. In case of
+ *     an error, the err field on the mongo_connection will be set.
+ */
+mongo_cursor* mongo_prepared_find( mongo_connection* conn, mongo_prepared* p, bson* query );
+
+/**
+ * Run a prepared command, as mongo_run_command does.
+ *
+ * @param conn a mongo_connection object.
+ * @param p a command from mongo_prepare_command.
+ * @param command the BSON command to run.
+ * @param out the BSON result of the command, or NULL.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mongo_prepared_command( mongo_connection* conn, mongo_prepared* p, bson* command, bson* out );
+
+/**
+ * Free a prepared query or command.
+ *
+ * @param p the mongo_prepared to destroy.
+ */
+void mongo_prepared_destroy( mongo_prepared* p );
+
+/* ----------------------------
+   PIPELINING
+   ------------------------------ */
+
+/**
+ * Initialize a pipeline for sending several queries in a single write
+ * and collecting their replies afterwards.
+ *
+ * @param pipe a mongo_pipeline object.
+ * @param conn the connection to send on.
+ */
+void mongo_pipeline_init( mongo_pipeline* pipe, mongo_connection* conn );
+
+/**
+ * Queue a query. The arguments follow mongo_find; query and fields are
+ * copied, so they may be destroyed right away.
+ *
+ * @return the index of the request, to be passed to mongo_pipeline_reply.
+ */
+int mongo_pipeline_find( mongo_pipeline* pipe, const char* ns, bson* query,
+    bson* fields, int nToReturn, int nToSkip, int options );
+
+/**
+ * Queue an OP_GET_MORE for an open cursor.
+ *
+ * @return the index of the request.
+ */
+int mongo_pipeline_get_more( mongo_pipeline* pipe, const char* ns,
+    int64_t cursorID, int nToReturn );
+
+/**
+ * Write every queued request to the connection with one write.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_pipeline_flush( mongo_pipeline* pipe );
+
+/**
+ * Get the reply to a flushed request, reading from the connection until
+ * it arrives. Replies are matched to requests by responseTo.
+ *
+ * @param pipe a mongo_pipeline object.
+ * @param index the index returned when the request was queued.
+ * @param reply set to the reply, which is owned by the pipeline.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_pipeline_reply( mongo_pipeline* pipe, int index, mongo_reply** reply );
+
+/**
+ * Read any replies still outstanding and free the pipeline. The pipeline
+ * can be reused for another batch afterwards.
+ *
+ * @return MONGO_OK or MONGO_ERROR if draining the replies failed.
+ */
+int mongo_pipeline_destroy( mongo_pipeline* pipe );
+
+/* ----------------------------
+   BULK WRITES
+   ------------------------------ */
+
+/**
+ * Initialize a bulk write against one collection.
+ *
+ * Queued inserts are packed into as few OP_INSERT messages as the
+ * server's maxMessageSizeBytes allows, and every message is followed by a
+ * getlasterror so that failures can be traced to the operations that
+ * caused them. The limits come from mongo_cmd_ismaster, which is run on
+ * the first execute if it hasn't been already.
+ *
+ * @param bulk a mongo_bulk object.
+ * @param conn the connection to write on.
+ * @param ns the namespace.
+ * @param ordered if true, writes run in order and stop at the first
+ *     failure; otherwise every write is attempted and several messages
+ *     are kept in flight at once.
+ */
+void mongo_bulk_init( mongo_bulk* bulk, mongo_connection* conn, const char* ns,
+    int ordered );
+
+/**
+ * Queue an insert. The document is copied.
+ *
+ * @return the index of the operation, or MONGO_ERROR with conn->err set
+ *     if the document is not valid for insert.
+ */
+int mongo_bulk_insert( mongo_bulk* bulk, bson* doc );
+
+/**
+ * Queue an update. The arguments follow mongo_update and are copied.
+ *
+ * @return the index of the operation, or MONGO_ERROR.
+ */
+int mongo_bulk_update( mongo_bulk* bulk, const bson* cond, const bson* op,
+    int flags );
+
+/**
+ * Queue a remove. The condition is copied.
+ *
+ * @return the index of the operation.
+ */
+int mongo_bulk_remove( mongo_bulk* bulk, const bson* cond );
+
+/**
+ * Send every queued operation and collect the results into the counts
+ * and errors fields of the bulk. The queue is emptied, so the bulk can be
+ * filled again.
+ *
+ * The server reports at most one error per message, so an error on an
+ * insert covers every document sent in the same OP_INSERT; see
+ * mongo_bulk_error.count. Updates and removes are reported one by one.
+ *
+ * @return MONGO_OK if every write succeeded. Otherwise MONGO_ERROR, with
+ *     conn->err set to MONGO_WRITE_ERROR if the server rejected writes,
+ *     or to the network error that interrupted the bulk.
+ */
+int mongo_bulk_execute( mongo_bulk* bulk );
+
+/**
+ * Free the bulk's queue and results.
+ */
+void mongo_bulk_destroy( mongo_bulk* bulk );
+
 /* MongoDB Helper Functions */
 
 /**
@@ -494,7 +969,8 @@ bson_bool_t mongo_cmd_ismaster(mongo_connection * conn, bson * out);
  * @param out a BSON object containing the error details.
  *
  * @return MONGO_OK if no error and MONGO_ERROR on error. On error, check the values
- *     of conn->lasterrcode and conn->lasterrstr for the error status.
+ *     of conn->lasterrcode and conn->lasterrstr for the error status, or
+ *     conn->err if the command itself failed.
  */
 int mongo_cmd_get_last_error(mongo_connection * conn, const char * db, bson * out);
 
@@ -506,7 +982,8 @@ int mongo_cmd_get_last_error(mongo_connection * conn, const char * db, bson * ou
  * @param out a BSON object containing the error details.
  *
  * @return MONGO_OK if no error and MONGO_ERROR on error. On error, check the values
- *     of conn->lasterrcode and conn->lasterrstr for the error status.
+ *     of conn->lasterrcode and conn->lasterrstr for the error status, or
+ *     conn->err if the command itself failed.
  */
 int mongo_cmd_get_prev_error(mongo_connection * conn, const char * db, bson * out);
 
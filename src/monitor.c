@@ -0,0 +1,347 @@
+/* monitor.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/* clock_gettime and pthread_cond_timedwait */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "monitor.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void mongo_monitor_add_member( mongo_monitor* m, const char* host, int port ) {
+    mongo_member* member;
+    int len = strlen( host );
+    int i;
+
+    for( i=0; i < m->work.count; i++ )
+        if( m->work.members[i].port == port && strcmp( m->work.members[i].host, host ) == 0 )
+            return;
+
+    if( m->work.count == MONGO_MONITOR_MAX_MEMBERS )
+        return;
+
+    member = &m->work.members[m->work.count];
+    if( len >= (int)sizeof( member->host ) )
+        len = sizeof( member->host ) - 1;
+    memcpy( member->host, host, len );
+    member->host[len] = '\0';
+    member->port = port;
+    member->state = MONGO_MEMBER_UNKNOWN;
+    member->rtt_usec = 0;
+    m->member_conns[m->work.count] = NULL;
+    m->work.count++;
+}
+
+void mongo_monitor_init( mongo_monitor* m, mongo_connection* conn ) {
+    mongo_host_port* node;
+
+    m->conn = conn;
+    m->name = (char*)bson_malloc( strlen( conn->replset->name ) + 1 );
+    strcpy( m->name, conn->replset->name );
+    m->interval_ms = 1000;
+    m->timeout_ms = 1000;
+
+    m->work.version = 0;
+    m->work.primary = -1;
+    m->work.count = 0;
+    for( node = conn->replset->seeds; node; node = node->next )
+        mongo_monitor_add_member( m, node->host, node->port );
+    for( node = conn->replset->hosts; node; node = node->next )
+        mongo_monitor_add_member( m, node->host, node->port );
+
+    m->seq = 0;
+    m->published = m->work;
+
+    mongo_mutex_init( &m->mutex );
+    mongo_cond_init( &m->cond );
+    m->running = 0;
+    m->stopping = 0;
+
+    conn->replset->monitor = m;
+}
+
+void mongo_monitor_set_interval( mongo_monitor* m, int interval_ms, int timeout_ms ) {
+    m->interval_ms = interval_ms;
+    m->timeout_ms = timeout_ms;
+}
+
+static void mongo_monitor_close( mongo_monitor* m, int i ) {
+    if( m->member_conns[i] ) {
+        mongo_destroy( m->member_conns[i] );
+        free( m->member_conns[i] );
+        m->member_conns[i] = NULL;
+    }
+}
+
+/* Open connections to the members that have none. The connects run
+ * concurrently, so together they take at most one timeout. */
+static void mongo_monitor_open( mongo_monitor* m ) {
+    int socks[MONGO_MONITOR_MAX_MEMBERS];
+    int next[MONGO_MONITOR_MAX_MEMBERS];
+    int64_t deadline = mongo_now_usec() + (int64_t)m->timeout_ms * 1000;
+    int64_t remaining;
+    mongo_connection* conn;
+    mongo_member* member;
+    int count = m->work.count;
+    int i;
+
+    for( i=0; i < count; i++ ) {
+        member = &m->work.members[i];
+        socks[i] = -1;
+        next[i] = 0;
+        if( !m->member_conns[i] &&
+            mongo_socket_connect_start( member->host, member->port, &next[i], &socks[i] ) != MONGO_OK )
+            member->state = MONGO_MEMBER_DOWN;
+    }
+
+    for( i=0; i < count; i++ ) {
+        member = &m->work.members[i];
+        if( m->member_conns[i] )
+            continue;
+
+        /* Fall back to the member's other addresses while time remains. */
+        while( socks[i] != -1 ) {
+            remaining = deadline - mongo_now_usec();
+            if( remaining > 0 && mongo_socket_wait( socks[i], 1, (int)( ( remaining + 999 ) / 1000 ) ) > 0 &&
+                mongo_socket_connect_finish( socks[i] ) == MONGO_OK )
+                break;
+
+            mongo_close_socket( socks[i] );
+            socks[i] = -1;
+            if( deadline <= mongo_now_usec() ||
+                mongo_socket_connect_start( member->host, member->port, &next[i], &socks[i] ) != MONGO_OK )
+                break;
+        }
+
+        if( socks[i] == -1 ) {
+            member->state = MONGO_MEMBER_DOWN;
+            continue;
+        }
+
+        conn = (mongo_connection*)bson_malloc( sizeof( mongo_connection ) );
+        mongo_conn_adopt_socket( conn, socks[i], m->work.members[i].host, m->work.members[i].port );
+        mongo_conn_set_timeout( conn, m->timeout_ms );
+        m->member_conns[i] = conn;
+    }
+}
+
+/* Run ismaster against one member and record what it says. */
+static void mongo_monitor_check_member( mongo_monitor* m, int i ) {
+    mongo_member* member = &m->work.members[i];
+    mongo_host_port host_port;
+    bson_iterator it, it_sub;
+    int64_t start;
+    bson out;
+    int rtt;
+
+    if( !m->member_conns[i] )
+        return;
+
+    start = mongo_now_usec();
+    if( mongo_simple_int_command( m->member_conns[i], "admin", "ismaster", 1, &out ) != MONGO_OK ) {
+        mongo_monitor_close( m, i );
+        member->state = MONGO_MEMBER_DOWN;
+        return;
+    }
+    rtt = (int)( mongo_now_usec() - start );
+    member->rtt_usec = member->rtt_usec ? ( 4 * member->rtt_usec + rtt ) / 5 : rtt;
+
+    if( bson_find( &it, &out, "setName" ) != BSON_STRING ||
+        strcmp( bson_iterator_string( &it ), m->name ) != 0 ) {
+        bson_destroy( &out );
+        mongo_monitor_close( m, i );
+        member->state = MONGO_MEMBER_DOWN;
+        return;
+    }
+
+    if( bson_find( &it, &out, "ismaster" ) && bson_iterator_bool( &it ) )
+        member->state = MONGO_MEMBER_PRIMARY;
+    else if( bson_find( &it, &out, "secondary" ) && bson_iterator_bool( &it ) )
+        member->state = MONGO_MEMBER_SECONDARY;
+    else
+        member->state = MONGO_MEMBER_OTHER;
+
+    /* New members are connected to on the next check. */
+    if( bson_find( &it, &out, "hosts" ) ) {
+        bson_iterator_init( &it_sub, bson_iterator_value( &it ) );
+        while( bson_iterator_next( &it_sub ) ) {
+            mongo_parse_host( bson_iterator_string( &it_sub ), &host_port );
+            mongo_monitor_add_member( m, host_port.host, host_port.port );
+        }
+    }
+
+    bson_destroy( &out );
+}
+
+/* Publish the work topology. Readers copy it while the sequence number
+ * is even and unchanged, so they never block on the monitor. */
+static void mongo_monitor_publish( mongo_monitor* m ) {
+    m->work.version++;
+
+    mongo_atomic_add( &m->seq, 1 );
+    memcpy( &m->published, &m->work, sizeof( mongo_topology ) );
+    mongo_atomic_add( &m->seq, 1 );
+}
+
+void mongo_monitor_get_topology( mongo_monitor* m, mongo_topology* out ) {
+    int seq;
+
+    do {
+        while( ( seq = mongo_atomic_add( &m->seq, 0 ) ) & 1 )
+            ;
+        memcpy( out, &m->published, sizeof( mongo_topology ) );
+    } while( mongo_atomic_add( &m->seq, 0 ) != seq );
+}
+
+int mongo_monitor_check( mongo_monitor* m ) {
+    int primary;
+    int count;
+    int i;
+
+    mongo_mutex_lock( &m->mutex );
+
+    mongo_monitor_open( m );
+
+    count = m->work.count;
+    m->work.primary = -1;
+    for( i=0; i < count; i++ ) {
+        mongo_monitor_check_member( m, i );
+        if( m->work.members[i].state == MONGO_MEMBER_PRIMARY && m->work.primary < 0 )
+            m->work.primary = i;
+    }
+
+    mongo_monitor_publish( m );
+    primary = m->work.primary;
+
+    mongo_mutex_unlock( &m->mutex );
+
+    return primary >= 0 ? MONGO_OK : MONGO_ERROR;
+}
+
+int mongo_monitor_connect_primary( mongo_monitor* m, mongo_connection* conn ) {
+    mongo_topology topology;
+    mongo_member* primary;
+
+    mongo_monitor_get_topology( m, &topology );
+    if( topology.primary < 0 )
+        return MONGO_ERROR;
+    primary = &topology.members[topology.primary];
+
+    if( mongo_socket_connect( conn, primary->host, primary->port ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( !mongo_cmd_ismaster( conn, NULL ) ) {
+        mongo_disconnect( conn );
+        return MONGO_ERROR;
+    }
+
+    strcpy( conn->primary->host, primary->host );
+    conn->primary->port = primary->port;
+    conn->replset->primary_connected = 1;
+    conn->replset->primary_rtt_usec = primary->rtt_usec;
+
+    return MONGO_OK;
+}
+
+/* Wait on the condition for at most usec microseconds. */
+static void mongo_monitor_wait( mongo_monitor* m, int64_t usec ) {
+#ifdef _WIN32
+    SleepConditionVariableCS( &m->cond, &m->mutex, (DWORD)( usec / 1000 + 1 ) );
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec += ( usec % 1000000 ) * 1000;
+    if( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( &m->cond, &m->mutex, &ts );
+#endif
+}
+
+static void* mongo_monitor_run( void* arg ) {
+    mongo_monitor* m = (mongo_monitor*)arg;
+    int64_t next;
+    int64_t remaining;
+
+    while( 1 ) {
+        mongo_monitor_check( m );
+        next = mongo_now_usec() + (int64_t)m->interval_ms * 1000;
+
+        mongo_mutex_lock( &m->mutex );
+        while( !m->stopping && ( remaining = next - mongo_now_usec() ) > 0 )
+            mongo_monitor_wait( m, remaining );
+        if( m->stopping ) {
+            mongo_mutex_unlock( &m->mutex );
+            break;
+        }
+        mongo_mutex_unlock( &m->mutex );
+    }
+
+    return NULL;
+}
+
+int mongo_monitor_start( mongo_monitor* m ) {
+    if( m->running )
+        return MONGO_OK;
+
+    m->stopping = 0;
+    m->running = 1;
+    if( mongo_thread_create( &m->thread, mongo_monitor_run, m ) != 0 ) {
+        m->running = 0;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+void mongo_monitor_stop( mongo_monitor* m ) {
+    if( !m->running )
+        return;
+
+    mongo_mutex_lock( &m->mutex );
+    m->stopping = 1;
+    mongo_cond_signal( &m->cond );
+    mongo_mutex_unlock( &m->mutex );
+
+    mongo_thread_join( m->thread );
+    m->running = 0;
+}
+
+void mongo_monitor_destroy( mongo_monitor* m ) {
+    int i;
+
+    mongo_monitor_stop( m );
+
+    for( i=0; i < m->work.count; i++ )
+        mongo_monitor_close( m, i );
+
+    if( m->conn->replset && m->conn->replset->monitor == m )
+        m->conn->replset->monitor = NULL;
+
+    free( m->name );
+    m->name = NULL;
+
+    mongo_cond_destroy( &m->cond );
+    mongo_mutex_destroy( &m->mutex );
+}
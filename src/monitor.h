@@ -0,0 +1,137 @@
+/**
+ * @file monitor.h
+ * @brief Background replica set topology monitor.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+
+#ifndef _MONGO_MONITOR_H_
+#define _MONGO_MONITOR_H_
+
+#include "mongo.h"
+#include "thread.h"
+
+MONGO_EXTERN_C_START
+
+#define MONGO_MONITOR_MAX_MEMBERS 12
+
+typedef enum {
+    MONGO_MEMBER_UNKNOWN = 0,  /**< Not checked yet. */
+    MONGO_MEMBER_PRIMARY,
+    MONGO_MEMBER_SECONDARY,
+    MONGO_MEMBER_OTHER,        /**< Answered, but neither primary nor secondary. */
+    MONGO_MEMBER_DOWN          /**< Could not be reached, or is not in the set. */
+} mongo_member_state;
+
+typedef struct {
+    char host[255];
+    int port;
+    mongo_member_state state;
+    int rtt_usec;              /**< ismaster round-trip time, exponentially weighted. */
+} mongo_member;
+
+typedef struct {
+    int version;               /**< Incremented each time the monitor publishes. */
+    int primary;               /**< Index of the primary in members, or -1. */
+    int count;
+    mongo_member members[MONGO_MONITOR_MAX_MEMBERS];
+} mongo_topology;
+
+typedef struct mongo_monitor {
+    mongo_connection* conn;    /**< connection is *not* owned by the monitor */
+    char* name;                /**< Replica set name. */
+    int interval_ms;           /**< Time between checks. */
+    int timeout_ms;            /**< Bound on each connect and ismaster. */
+
+    mongo_topology work;       /**< Being updated by a check. */
+    mongo_connection* member_conns[MONGO_MONITOR_MAX_MEMBERS]; /**< The monitor's own connections. */
+
+    int seq;                   /**< Odd while published is being written. */
+    mongo_topology published;  /**< Read without locking by mongo_monitor_get_topology. */
+
+    mongo_mutex_t mutex;       /**< Serializes checks. */
+    mongo_cond_t cond;
+    mongo_thread_t thread;
+    int running;
+    int stopping;
+} mongo_monitor;
+
+/**
+ * Initialize a monitor for a replica set connection. The monitor starts
+ * from the connection's seeds and the hosts it has discovered, and
+ * learns further members from their ismaster replies. It uses
+ * connections of its own, so it never touches conn's socket.
+ *
+ * Once attached, mongo_reconnect connects straight to the primary the
+ * monitor last saw, instead of running discovery.
+ *
+ * By default members are checked every second, with a one second
+ * timeout.
+ *
+ * @param m a mongo_monitor object.
+ * @param conn a connection set up with mongo_replset_init_conn. The
+ *     monitor must be destroyed before the connection.
+ */
+void mongo_monitor_init( mongo_monitor* m, mongo_connection* conn );
+
+/**
+ * Set the check interval and the timeout for each connect and ismaster.
+ */
+void mongo_monitor_set_interval( mongo_monitor* m, int interval_ms, int timeout_ms );
+
+/**
+ * Check every member once, on the calling thread, and publish the result.
+ *
+ * @return MONGO_OK if a primary was seen, otherwise MONGO_ERROR.
+ */
+int mongo_monitor_check( mongo_monitor* m );
+
+/**
+ * Start a thread that checks the members every interval.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the thread could not be created.
+ */
+int mongo_monitor_start( mongo_monitor* m );
+
+/**
+ * Stop the monitor thread. A check in progress is finished first.
+ */
+void mongo_monitor_stop( mongo_monitor* m );
+
+/**
+ * Copy the latest published topology. This takes no lock, so it is
+ * cheap enough for the request path and never waits for a check.
+ */
+void mongo_monitor_get_topology( mongo_monitor* m, mongo_topology* out );
+
+/**
+ * Connect conn to the primary in the latest topology, after checking
+ * with ismaster that it is still primary.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if no primary is known or it could
+ *     not be reached; conn is left disconnected.
+ */
+int mongo_monitor_connect_primary( mongo_monitor* m, mongo_connection* conn );
+
+/**
+ * Stop the monitor thread, close the monitor's connections and detach
+ * it from the replica set connection.
+ */
+void mongo_monitor_destroy( mongo_monitor* m );
+
+MONGO_EXTERN_C_END
+#endif
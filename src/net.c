@@ -15,113 +15,460 @@
  *    limitations under the License.
  */
 
+/* getaddrinfo and struct sockaddr_storage */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "net.h"
+#include "thread.h"
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
-static int mongo_create_socket( mongo_connection *conn ) {
-    int fd;
+int64_t mongo_now_nsec( void ) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter( &count );
+    QueryPerformanceFrequency( &freq );
+    return (int64_t)( (double)count.QuadPart * 1e9 / (double)freq.QuadPart );
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int64_t mongo_now_usec( void ) {
+    return mongo_now_nsec() / 1000;
+}
+
+int mongo_socket_set_blocking( int sock, int blocking ) {
+#ifdef _WIN32
+    u_long nonblocking = !blocking;
 
-    if( ( fd = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 ) {
-        conn->err = MONGO_CONN_NO_SOCKET;
+    if( ioctlsocket( sock, FIONBIO, &nonblocking ) != 0 )
         return MONGO_ERROR;
-    }
-    conn->sock = fd;
+#else
+    int flags;
+
+    if( ( flags = fcntl( sock, F_GETFL ) ) == -1 )
+        return MONGO_ERROR;
+
+    if( blocking )
+        flags &= ~O_NONBLOCK;
+    else
+        flags |= O_NONBLOCK;
+
+    if( fcntl( sock, F_SETFL, flags ) == -1 )
+        return MONGO_ERROR;
+#endif
 
     return MONGO_OK;
 }
 
-static int mongo_set_blocking_status( mongo_connection *conn ) {
-    int flags;
-    int blocking;
+/* Start a non-blocking connect to one address. */
+static int mongo_socket_start( int family, const struct sockaddr *addr,
+    socklen_t len, int *sock ) {
+    int fd;
 
-    /* For the moment, setting conn_timeout_ms is platform-specific.
-     * So do nothing is this value isn't set.  */
-    blocking = ( conn->conn_timeout_ms == 0 );
-    if( blocking )
-        return MONGO_OK;
-    else {
-        if( ( flags = fcntl( conn->sock, F_GETFL ) ) == -1 ) {
-            conn->err = MONGO_IO_ERROR;
-            mongo_close_socket( conn->sock );
-            return MONGO_ERROR;
-        }
+    if( ( fd = socket( family, SOCK_STREAM, 0 ) ) == -1 )
+        return MONGO_ERROR;
 
-        flags |= O_NONBLOCK;
+    if( mongo_socket_set_blocking( fd, 0 ) != MONGO_OK ) {
+        mongo_close_socket( fd );
+        return MONGO_ERROR;
+    }
 
-        if( ( flags = fcntl( conn->sock, F_SETFL, flags ) ) == -1 ) {
-            conn->err = MONGO_IO_ERROR;
-            mongo_close_socket( conn->sock );
+    if( connect( fd, addr, len ) == -1 ) {
+#ifdef _WIN32
+        if( WSAGetLastError() != WSAEWOULDBLOCK ) {
+#else
+        if( errno != EINPROGRESS ) {
+#endif
+            mongo_close_socket( fd );
             return MONGO_ERROR;
         }
     }
 
+    *sock = fd;
+    return MONGO_OK;
+}
+
+int mongo_socket_wait( int sock, int for_write, int timeout_ms ) {
+#ifdef _WIN32
+    fd_set set;
+    struct timeval tv;
+
+    FD_ZERO( &set );
+    FD_SET( sock, &set );
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = ( timeout_ms % 1000 ) * 1000;
+
+    return select( 0, for_write ? NULL : &set, for_write ? &set : NULL, NULL,
+                   timeout_ms < 0 ? NULL : &tv );
+#else
+    struct pollfd fd;
+
+    fd.fd = sock;
+    fd.events = for_write ? POLLOUT : POLLIN;
+    fd.revents = 0;
+
+    return poll( &fd, 1, timeout_ms );
+#endif
+}
+
+int mongo_socket_connect_finish( int sock ) {
+    int err = 0;
+    int flag = 1;
+    socklen_t len = sizeof( err );
+
+    if( getsockopt( sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len ) == -1 || err )
+        return MONGO_ERROR;
+
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(flag) );
+
     return MONGO_OK;
 }
 
 #ifdef _MONGO_USE_GETADDRINFO
-int mongo_socket_connect( mongo_connection * conn, const char * host, int port ){
 
-    struct addrinfo* addrs = NULL;
+/* Most addresses kept, and raced, for one host. */
+#define MONGO_ADDR_MAX 8
+
+/* Hosts whose addresses are cached. */
+#define MONGO_DNS_CACHE_SIZE 32
+
+/* Head start each address gets before the next one is tried. */
+#define MONGO_CONNECT_STAGGER_MS 250
+
+typedef struct {
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} mongo_addr;
+
+typedef struct {
+    char host[255];
+    int port;
+    int count;
+    mongo_addr addrs[MONGO_ADDR_MAX];
+    int64_t expires_usec;
+} mongo_dns_entry;
+
+static mongo_dns_entry mongo_dns_cache[MONGO_DNS_CACHE_SIZE];
+static int mongo_dns_used = 0;
+static int mongo_dns_ttl_ms = 60000;
+static mongo_mutex_t mongo_dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void mongo_set_dns_cache_ttl( int ttl_ms ) {
+    mongo_mutex_lock( &mongo_dns_mutex );
+    mongo_dns_ttl_ms = ttl_ms;
+    mongo_dns_used = 0;
+    mongo_mutex_unlock( &mongo_dns_mutex );
+}
+
+static mongo_dns_entry* mongo_dns_find( const char *host, int port ) {
+    int i;
+
+    for( i=0; i < mongo_dns_used; i++ )
+        if( mongo_dns_cache[i].port == port && strcmp( mongo_dns_cache[i].host, host ) == 0 )
+            return &mongo_dns_cache[i];
+
+    return NULL;
+}
+
+/* Drop a host whose addresses all failed, so the next connect asks the
+ * resolver again. */
+static void mongo_dns_forget( const char *host, int port ) {
+    mongo_dns_entry *entry;
+
+    mongo_mutex_lock( &mongo_dns_mutex );
+    if( ( entry = mongo_dns_find( host, port ) ) != NULL )
+        *entry = mongo_dns_cache[--mongo_dns_used];
+    mongo_mutex_unlock( &mongo_dns_mutex );
+}
+
+static void mongo_dns_store( const char *host, int port, mongo_addr *addrs, int count ) {
+    mongo_dns_entry *entry;
+    int i;
+
+    if( strlen( host ) >= sizeof( entry->host ) )
+        return;
+
+    mongo_mutex_lock( &mongo_dns_mutex );
+    if( mongo_dns_ttl_ms > 0 ) {
+        if( ( entry = mongo_dns_find( host, port ) ) == NULL ) {
+            if( mongo_dns_used < MONGO_DNS_CACHE_SIZE )
+                entry = &mongo_dns_cache[mongo_dns_used++];
+            else {
+                /* Replace whichever entry expires first. */
+                entry = &mongo_dns_cache[0];
+                for( i=1; i < MONGO_DNS_CACHE_SIZE; i++ )
+                    if( mongo_dns_cache[i].expires_usec < entry->expires_usec )
+                        entry = &mongo_dns_cache[i];
+            }
+        }
+
+        strcpy( entry->host, host );
+        entry->port = port;
+        entry->count = count;
+        memcpy( entry->addrs, addrs, count * sizeof( mongo_addr ) );
+        entry->expires_usec = mongo_now_usec() + (int64_t)mongo_dns_ttl_ms * 1000;
+    }
+    mongo_mutex_unlock( &mongo_dns_mutex );
+}
+
+/* A host starting with '/' is the path of a Unix domain socket. */
+static int mongo_resolve_path( const char *path, mongo_addr *out ) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&out->addr;
+
+    if( strlen( path ) >= sizeof( un->sun_path ) )
+        return 0;
+
+    memset( un, 0, sizeof( *un ) );
+    un->sun_family = AF_UNIX;
+    strcpy( un->sun_path, path );
+
+    out->family = AF_UNIX;
+    out->len = sizeof( *un );
+    return 1;
+}
+
+static void mongo_addr_copy( mongo_addr *out, struct addrinfo *ai ) {
+    out->family = ai->ai_family;
+    out->len = ai->ai_addrlen;
+    memcpy( &out->addr, ai->ai_addr, ai->ai_addrlen );
+}
+
+/* Resolve host to at most MONGO_ADDR_MAX addresses, IPv6 and IPv4
+ * interleaved starting with the family the resolver prefers.
+ * Returns the number of addresses, or 0 if the host didn't resolve. */
+static int mongo_resolve( const char *host, int port, mongo_addr *out ) {
     struct addrinfo hints;
-    int flag = 1;
+    struct addrinfo *addrs = NULL;
+    struct addrinfo *ai;
+    struct addrinfo *first[MONGO_ADDR_MAX];
+    struct addrinfo *second[MONGO_ADDR_MAX];
+    int nfirst = 0, nsecond = 0;
+    mongo_dns_entry *entry;
     char port_str[12];
-    int ret;
+    int count = 0;
+    int i;
 
-    conn->sock = 0;
-    conn->connected = 0;
+    if( host[0] == '/' )
+        return mongo_resolve_path( host, out );
+
+    mongo_mutex_lock( &mongo_dns_mutex );
+    entry = mongo_dns_find( host, port );
+    if( entry && entry->expires_usec > mongo_now_usec() ) {
+        count = entry->count;
+        memcpy( out, entry->addrs, count * sizeof( mongo_addr ) );
+    }
+    mongo_mutex_unlock( &mongo_dns_mutex );
+
+    if( count )
+        return count;
 
     memset( &hints, 0, sizeof( hints ) );
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
     sprintf( port_str, "%d", port );
 
-    if( mongo_create_socket( conn ) != MONGO_OK )
-        return MONGO_ERROR;
+    if( getaddrinfo( host, port_str, &hints, &addrs ) != 0 )
+        return 0;
+
+    /* Alternate between the resolver's preferred family and the other. */
+    for( ai = addrs; ai; ai = ai->ai_next ) {
+        if( ( ai->ai_family != AF_INET && ai->ai_family != AF_INET6 ) ||
+            ai->ai_addrlen > sizeof( struct sockaddr_storage ) )
+            continue;
+        if( ai->ai_family == addrs->ai_family ) {
+            if( nfirst < MONGO_ADDR_MAX )
+                first[nfirst++] = ai;
+        }
+        else if( nsecond < MONGO_ADDR_MAX )
+            second[nsecond++] = ai;
+    }
+
+    for( i=0; i < nfirst || i < nsecond; i++ ) {
+        if( i < nfirst && count < MONGO_ADDR_MAX )
+            mongo_addr_copy( &out[count++], first[i] );
+        if( i < nsecond && count < MONGO_ADDR_MAX )
+            mongo_addr_copy( &out[count++], second[i] );
+    }
+
+    freeaddrinfo( addrs );
+
+    if( count )
+        mongo_dns_store( host, port, out, count );
+
+    return count;
+}
+
+/* Race connects to the addresses: each gets MONGO_CONNECT_STAGGER_MS to
+ * complete before the next one is started alongside it, and the first to
+ * connect wins. timeout_ms bounds the whole race; 0 waits for the system's
+ * connect timeout. Returns the connected socket, or -1. */
+static int mongo_connect_addrs( mongo_addr *addrs, int count, int timeout_ms ) {
+    struct pollfd fds[MONGO_ADDR_MAX];
+    int64_t deadline = timeout_ms ? mongo_now_usec() + (int64_t)timeout_ms * 1000 : 0;
+    int64_t next_start = 0;
+    int64_t now, until;
+    int started = 0;
+    int pending = 0;
+    int winner = -1;
+    int sock;
+    int i, n;
+
+    while( winner < 0 ) {
+        now = mongo_now_usec();
+        if( deadline && now >= deadline )
+            break;
+
+        if( started < count && ( !pending || now >= next_start ) ) {
+            if( mongo_socket_start( addrs[started].family,
+                    (struct sockaddr *)&addrs[started].addr, addrs[started].len, &sock ) == MONGO_OK ) {
+                fds[pending].fd = sock;
+                fds[pending].events = POLLOUT;
+                fds[pending].revents = 0;
+                pending++;
+            }
+            started++;
+            next_start = now + MONGO_CONNECT_STAGGER_MS * 1000;
+            continue;
+        }
+
+        if( !pending )
+            break;
+
+        until = started < count ? next_start : deadline;
+        if( deadline && until > deadline )
+            until = deadline;
+
+        n = poll( fds, pending, until ? (int)( ( until - now + 999 ) / 1000 ) : -1 );
+        if( n < 0 && errno != EINTR )
+            break;
+
+        for( i=0; n > 0 && i < pending; i++ ) {
+            if( !fds[i].revents )
+                continue;
+
+            if( winner < 0 && mongo_socket_connect_finish( fds[i].fd ) == MONGO_OK ) {
+                winner = fds[i].fd;
+                fds[i] = fds[--pending];
+                break;
+            }
 
-    if( getaddrinfo( host, port_str, &hints, &addrs ) != 0 ) {
-        fprintf( stderr, "getaddrinfo failed: %s", gai_strerror( ret ) );
+            /* A refused address hands its turn to the next one at once. */
+            mongo_close_socket( fds[i].fd );
+            fds[i--] = fds[--pending];
+            next_start = 0;
+        }
+    }
+
+    for( i=0; i < pending; i++ )
+        mongo_close_socket( fds[i].fd );
+
+    if( winner >= 0 )
+        mongo_socket_set_blocking( winner, 1 );
+
+    return winner;
+}
+
+int mongo_socket_connect_start( const char *host, int port, int *next, int *sock ) {
+    mongo_addr addrs[MONGO_ADDR_MAX];
+    mongo_addr *addr;
+    int count = mongo_resolve( host, port, addrs );
+
+    while( *next < count ) {
+        addr = &addrs[( *next )++];
+        if( mongo_socket_start( addr->family, (struct sockaddr *)&addr->addr,
+                                addr->len, sock ) == MONGO_OK )
+            return MONGO_OK;
+    }
+
+    /* The host may have moved; resolve it afresh next time. */
+    mongo_dns_forget( host, port );
+    return MONGO_ERROR;
+}
+
+int mongo_socket_connect( mongo_connection *conn, const char *host, int port ) {
+    mongo_addr addrs[MONGO_ADDR_MAX];
+    int count;
+    int sock;
+
+    conn->sock = -1;
+    conn->connected = 0;
+
+    /* Anything read ahead belongs to the previous socket. */
+    conn->rbuf_start = conn->rbuf_end = 0;
+
+    if( ( count = mongo_resolve( host, port, addrs ) ) == 0 ) {
         conn->err = MONGO_CONN_FAIL;
         return MONGO_ERROR;
     }
 
-    if ( connect( conn->sock, addrs->ai_addr, addrs->ai_addrlen ) == -1 ) {
-        mongo_close_socket( conn->sock );
-        freeaddrinfo( addrs );
+    if( ( sock = mongo_connect_addrs( addrs, count, conn->conn_timeout_ms ) ) < 0 ) {
+        mongo_dns_forget( host, port );
         conn->err = MONGO_CONN_FAIL;
-        return MONGO_ERROR:
+        return MONGO_ERROR;
     }
 
-    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag) );
-
+    conn->sock = sock;
     conn->connected = 1;
-    freeaddrinfo( addrs );
+    mongo_conn_set_io_mode( conn );
 
     return MONGO_OK;
 }
 #else
-int mongo_socket_connect( mongo_connection * conn, const char * host, int port ){
+void mongo_set_dns_cache_ttl( int ttl_ms ) {
+    /* Only numeric addresses are supported here. */
+}
+
+int mongo_socket_connect_start( const char *host, int port, int *next, int *sock ) {
     struct sockaddr_in sa;
-    socklen_t addressSize;
-    int flag = 1;
 
-    if( mongo_create_socket( conn ) != MONGO_OK )
+    /* There is only the one address. */
+    if( ( *next )++ > 0 )
         return MONGO_ERROR;
 
     memset( sa.sin_zero , 0 , sizeof( sa.sin_zero ) );
     sa.sin_family = AF_INET;
     sa.sin_port = htons( port );
     sa.sin_addr.s_addr = inet_addr( host );
-    addressSize = sizeof( sa );
 
-    if ( connect( conn->sock, (struct sockaddr *)&sa, addressSize ) == -1 ) {
+    return mongo_socket_start( AF_INET, (struct sockaddr *)&sa, sizeof( sa ), sock );
+}
+
+/* conn_timeout_ms bounds the connect; 0 waits for the system's timeout. */
+int mongo_socket_connect( mongo_connection * conn, const char * host, int port ){
+    int next = 0;
+    int sock;
+
+    conn->sock = -1;
+    conn->connected = 0;
+
+    /* Anything read ahead belongs to the previous socket. */
+    conn->rbuf_start = conn->rbuf_end = 0;
+
+    if( mongo_socket_connect_start( host, port, &next, &sock ) != MONGO_OK ) {
         conn->err = MONGO_CONN_FAIL;
         return MONGO_ERROR;
     }
 
-    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(flag) );
+    if( mongo_socket_wait( sock, 1, conn->conn_timeout_ms ? conn->conn_timeout_ms : -1 ) <= 0 ||
+        mongo_socket_connect_finish( sock ) != MONGO_OK ) {
+        mongo_close_socket( sock );
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
 
+    conn->sock = sock;
     conn->connected = 1;
+    mongo_conn_set_io_mode( conn );
 
     return MONGO_OK;
 }
@@ -28,6 +28,10 @@
 #include <winsock.h>
 #define mongo_close_socket(sock) ( closesocket(sock) )
 typedef int socklen_t;
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} mongo_iovec;
 #else
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -35,8 +39,25 @@ typedef int socklen_t;
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #define mongo_close_socket(sock) ( close(sock) )
+typedef struct iovec mongo_iovec;
+#endif
+
+/* Size of the per-connection read-ahead buffer. */
+#define MONGO_READ_BUFFER_SIZE 16384
+
+/* Maximum number of iovecs handed to a single writev call. */
+#if defined(IOV_MAX)
+#define MONGO_IOV_MAX IOV_MAX
+#elif defined(__linux__) || defined(__APPLE__)
+#define MONGO_IOV_MAX 1024
+#else
+#define MONGO_IOV_MAX 16
 #endif
 
 #ifndef _WIN32
@@ -51,5 +72,220 @@ MONGO_EXTERN_C_START
 
 int mongo_socket_connect( mongo_connection *conn, const char *host, int port );
 
+/**
+ * Nanoseconds on a monotonic clock, for measuring intervals.
+ */
+int64_t mongo_now_nsec( void );
+
+/**
+ * mongo_now_nsec in microseconds.
+ */
+int64_t mongo_now_usec( void );
+
+/**
+ * Switch a socket between blocking and non-blocking mode.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mongo_socket_set_blocking( int sock, int blocking );
+
+/**
+ * Begin a non-blocking connect to the next of the host's addresses. The
+ * socket becomes writable once the connect completes; finish it with
+ * mongo_socket_connect_finish. If that fails, close the socket and call
+ * this again with the same next to fall back to the following address.
+ * Once every address has failed, the cached resolution is dropped.
+ *
+ * @param next the index of the address to try, 0 at first; advanced
+ *     past the address connected to.
+ * @param sock set to the new, non-blocking socket.
+ *
+ * @return MONGO_OK or MONGO_ERROR if no address is left to try.
+ */
+int mongo_socket_connect_start( const char *host, int port, int *next, int *sock );
+
+/**
+ * Check the outcome of a non-blocking connect that has become writable.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the connect failed.
+ */
+int mongo_socket_connect_finish( int sock );
+
+/**
+ * Wait for a socket to become readable, or writable.
+ *
+ * @return 1 once it is ready, 0 on timeout, -1 on error.
+ */
+int mongo_socket_wait( int sock, int for_write, int timeout_ms );
+
+/**
+ * Split a "host:port" string; the port defaults to 27017. A string
+ * starting with '/' is a Unix domain socket path and is not split.
+ */
+void mongo_parse_host( const char *host_string, mongo_host_port *host_port );
+
+/**
+ * Initialize a connection object around a socket that is already
+ * connected to host:port. The socket is switched to blocking mode.
+ */
+void mongo_conn_adopt_socket( mongo_connection *conn, int sock,
+    const char *host, int port );
+
+/* ----------------------------
+   WIRE MESSAGES
+   ------------------------------ */
+
+#define MONGO_MSG_SCRATCH_SIZE 64
+#define MONGO_MSG_INLINE_IOV 8
+
+/**
+ * An outgoing wire message described as a list of iovecs.
+ *
+ * The header and the fixed-width fields are encoded little endian into
+ * the scratch space; namespaces and BSON documents are referenced in place
+ * and are never copied before they reach the socket. A mongo_msg points
+ * into itself, so it must not be copied once initialized.
+ */
+typedef struct {
+    char scratch[MONGO_MSG_SCRATCH_SIZE];     /**< Header and fixed-width fields. */
+    int scratch_len;
+    mongo_iovec inline_iov[MONGO_MSG_INLINE_IOV];
+    mongo_iovec *iov;    /**< inline_iov, or a heap array for large batches. */
+    int iov_count;
+    int iov_alloc;
+    int len;             /**< Total message length, header included. */
+    int id;              /**< Request id of this message. */
+} mongo_msg;
+
+/**
+ * Start a new message with the given opcode.
+ *
+ * @param msg the message to initialize.
+ * @param op one of the mongo_operations constants.
+ */
+void mongo_msg_init( mongo_msg *msg, int op );
+
+/**
+ * Append a 32-bit integer, converted to little endian.
+ */
+void mongo_msg_append32( mongo_msg *msg, const void *data );
+
+/**
+ * Append a 64-bit integer, converted to little endian.
+ */
+void mongo_msg_append64( mongo_msg *msg, const void *data );
+
+/**
+ * Reference len bytes of caller-owned data. The data must stay
+ * valid until the message has been sent or destroyed.
+ */
+void mongo_msg_append_ref( mongo_msg *msg, const void *data, int len );
+
+/**
+ * Write the final message length into the header.
+ */
+void mongo_msg_finish( mongo_msg *msg );
+
+/**
+ * Finish the message and copy its msg->len bytes to out.
+ */
+void mongo_msg_copy( mongo_msg *msg, char *out );
+
+/**
+ * Release any storage held by the message.
+ */
+void mongo_msg_destroy( mongo_msg *msg );
+
+/**
+ * Send a message with as few syscalls as possible, handling partial
+ * writes. Always destroys the message.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_msg_send( mongo_connection *conn, mongo_msg *msg );
+
+/**
+ * Send several messages back to back in as few syscalls as possible.
+ * Always destroys the messages.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_msg_send_many( mongo_connection *conn, mongo_msg *msgs, int count );
+
+/**
+ * Allocate a message of len bytes, header included, whose body the
+ * caller fills in after the header. An id of 0 picks one at random.
+ */
+mongo_message* mongo_message_create( int len, int id, int responseTo, int op );
+
+/**
+ * Send a message made with mongo_message_create. Always frees it.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_message_send( mongo_connection *conn, mongo_message *mm );
+
+/**
+ * Read the next reply on the connection, whichever request it answers.
+ *
+ * @param reply set to the reply, to be freed by the caller.
+ *
+ * @return MONGO_OK or MONGO_ERROR with conn->err set.
+ */
+int mongo_read_response( mongo_connection *conn, mongo_reply **reply );
+
+/**
+ * Milliseconds left before the operation in progress times out, starting
+ * its clock if this is its first I/O.
+ *
+ * @return the time left, 0 once it has run out, or -1 if operations
+ *     on this connection have no timeout.
+ */
+int mongo_conn_remaining_ms( mongo_connection *conn );
+
+/**
+ * Fail the operation in progress with MONGO_OP_TIMEOUT. The socket is
+ * closed, since the rest of the reply may still arrive.
+ */
+void mongo_conn_timed_out( mongo_connection *conn );
+
+/**
+ * Put the socket in the mode the connection's I/O expects: non-blocking
+ * while operations have a timeout, blocking otherwise.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mongo_conn_set_io_mode( mongo_connection *conn );
+
+/* The io_uring transport (uring.c), used instead of plain socket calls
+ * while conn->uring is set. */
+
+/**
+ * Queue a write in the connection's registered buffer and, unless a read
+ * of the reply follows or the ring defers writes, submit it.
+ */
+int mongo_uring_writev( mongo_connection *conn, mongo_iovec *iov, int count, int reply_follows );
+
+/**
+ * Submit a read along with every queued write and wait for it. Reads
+ * into conn->rbuf use the registered buffer.
+ *
+ * @return the number of bytes read, 0 at end of stream, or -1.
+ */
+int mongo_uring_recv( mongo_connection *conn, char *buf, int len );
+
+/**
+ * Wait until the connection's queued writes are written, then forget them.
+ */
+void mongo_uring_drain( mongo_connection *conn );
+
+/* Wire capture (trace.c), while conn->trace is set. */
+
+/**
+ * Append a message, the concatenation of count iovecs in wire byte order,
+ * to the connection's trace.
+ */
+void mongo_trace_record( mongo_connection *conn, const mongo_iovec *iov, int count );
+
 MONGO_EXTERN_C_END
 #endif
@@ -0,0 +1,361 @@
+/* pool.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/* clock_gettime and pthread_cond_timedwait */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "pool.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static char* mongo_pool_strdup( const char* str ) {
+    char* copy = (char*)bson_malloc( strlen( str ) + 1 );
+    strcpy( copy, str );
+    return copy;
+}
+
+void mongo_pool_init( mongo_pool* pool, const char* host, int port,
+    int min_size, int max_size ) {
+
+    pool->seeds = NULL;
+    pool->replset_name = NULL;
+    pool->auth_db = NULL;
+    pool->auth_user = NULL;
+    pool->auth_pass = NULL;
+
+    if( max_size < 1 )
+        max_size = 1;
+    if( min_size > max_size )
+        min_size = max_size;
+
+    pool->min_size = min_size;
+    pool->max_size = max_size;
+    pool->op_timeout_ms = 0;
+    pool->wait_timeout_ms = 0;
+    pool->idle_check_ms = 0;
+
+    pool->idle = (mongo_pool_entry*)bson_malloc( max_size * sizeof( mongo_pool_entry ) );
+    pool->num_idle = 0;
+    pool->num_open = 0;
+
+    mongo_mutex_init( &pool->mutex );
+    mongo_cond_init( &pool->cond );
+    memset( &pool->stats, 0, sizeof( pool->stats ) );
+    pool->err = 0;
+
+    if( host )
+        mongo_pool_add_seed( pool, host, port );
+}
+
+void mongo_pool_init_replset( mongo_pool* pool, const char* name,
+    int min_size, int max_size ) {
+
+    mongo_pool_init( pool, NULL, 0, min_size, max_size );
+    pool->replset_name = mongo_pool_strdup( name );
+}
+
+void mongo_pool_add_seed( mongo_pool* pool, const char* host, int port ) {
+    mongo_host_port* host_port = bson_malloc( sizeof( mongo_host_port ) );
+    mongo_host_port** tail = &pool->seeds;
+
+    strncpy( host_port->host, host, sizeof( host_port->host ) - 1 );
+    host_port->host[sizeof( host_port->host ) - 1] = '\0';
+    host_port->port = port;
+    host_port->next = NULL;
+
+    while( *tail )
+        tail = &(*tail)->next;
+    *tail = host_port;
+}
+
+void mongo_pool_set_auth( mongo_pool* pool, const char* db,
+    const char* user, const char* pass ) {
+
+    free( pool->auth_db );
+    free( pool->auth_user );
+    free( pool->auth_pass );
+
+    pool->auth_db = mongo_pool_strdup( db );
+    pool->auth_user = mongo_pool_strdup( user );
+    pool->auth_pass = mongo_pool_strdup( pass );
+}
+
+void mongo_pool_set_timeouts( mongo_pool* pool, int op_timeout_ms,
+    int wait_timeout_ms, int idle_check_ms ) {
+
+    pool->op_timeout_ms = op_timeout_ms;
+    pool->wait_timeout_ms = wait_timeout_ms;
+    pool->idle_check_ms = idle_check_ms;
+}
+
+/* Open and authenticate a new connection. Runs without the pool lock
+ * so that slow connects never block other threads' checkouts. */
+static mongo_connection* mongo_pool_open( mongo_pool* pool ) {
+    mongo_connection* conn;
+    mongo_host_port* seed;
+    int res;
+
+    if( !pool->seeds ) {
+        mongo_mutex_lock( &pool->mutex );
+        pool->stats.failures++;
+        pool->err = MONGO_CONN_BAD_ARG;
+        mongo_mutex_unlock( &pool->mutex );
+        return NULL;
+    }
+
+    conn = (mongo_connection*)bson_malloc( sizeof( mongo_connection ) );
+    if( pool->replset_name ) {
+        mongo_replset_init_conn( conn, pool->replset_name );
+        for( seed = pool->seeds; seed; seed = seed->next )
+            mongo_replset_add_seed( conn, seed->host, seed->port );
+        res = mongo_replset_connect( conn );
+    }
+    else
+        res = mongo_connect( conn, pool->seeds->host, pool->seeds->port );
+
+    if( res == MONGO_OK && pool->op_timeout_ms )
+        res = mongo_conn_set_timeout( conn, pool->op_timeout_ms );
+
+    if( res == MONGO_OK && pool->auth_user )
+        res = mongo_cmd_authenticate( conn, pool->auth_db, pool->auth_user, pool->auth_pass );
+
+    mongo_mutex_lock( &pool->mutex );
+    if( res == MONGO_OK )
+        pool->stats.created++;
+    else {
+        pool->stats.failures++;
+        pool->err = conn->err ? conn->err : MONGO_CONN_FAIL;
+    }
+    mongo_mutex_unlock( &pool->mutex );
+
+    if( res != MONGO_OK ) {
+        mongo_destroy( conn );
+        free( conn );
+        return NULL;
+    }
+
+    return conn;
+}
+
+static void mongo_pool_close( mongo_connection* conn ) {
+    mongo_destroy( conn );
+    free( conn );
+}
+
+int mongo_pool_connect( mongo_pool* pool ) {
+    mongo_connection* conn;
+    int res = MONGO_OK;
+
+    while( 1 ) {
+        mongo_mutex_lock( &pool->mutex );
+        if( pool->num_open >= pool->min_size ) {
+            mongo_mutex_unlock( &pool->mutex );
+            break;
+        }
+        pool->num_open++;
+        mongo_mutex_unlock( &pool->mutex );
+
+        if( ( conn = mongo_pool_open( pool ) ) == NULL ) {
+            mongo_mutex_lock( &pool->mutex );
+            pool->num_open--;
+            mongo_mutex_unlock( &pool->mutex );
+            res = MONGO_ERROR;
+            break;
+        }
+
+        mongo_pool_checkin( pool, conn );
+    }
+
+    return res;
+}
+
+/* Wait for a checkin. Called with the pool lock held.
+ * Returns MONGO_ERROR once the checkout deadline has passed. */
+static int mongo_pool_wait( mongo_pool* pool, int64_t start ) {
+    int64_t remaining;
+
+    if( !pool->wait_timeout_ms ) {
+        mongo_cond_wait( &pool->cond, &pool->mutex );
+        return MONGO_OK;
+    }
+
+    remaining = start + (int64_t)pool->wait_timeout_ms * 1000 - mongo_now_usec();
+    if( remaining <= 0 )
+        return MONGO_ERROR;
+
+#ifdef _WIN32
+    SleepConditionVariableCS( &pool->cond, &pool->mutex, (DWORD)( remaining / 1000 + 1 ) );
+#else
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_sec += remaining / 1000000;
+        ts.tv_nsec += ( remaining % 1000000 ) * 1000;
+        if( ts.tv_nsec >= 1000000000 ) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait( &pool->cond, &pool->mutex, &ts );
+    }
+#endif
+
+    return MONGO_OK;
+}
+
+static void mongo_pool_record_wait( mongo_pool* pool, int64_t start ) {
+    int64_t waited = mongo_now_usec() - start;
+
+    pool->stats.wait_usec += waited;
+    if( waited > pool->stats.max_wait_usec )
+        pool->stats.max_wait_usec = waited;
+}
+
+/* A connection that sat idle for too long may have been dropped by a
+ * firewall or a failover. Ping it before handing it out. */
+static int mongo_pool_check_idle( mongo_pool* pool, mongo_connection* conn,
+    int64_t idle_since ) {
+
+    if( !pool->idle_check_ms ||
+        mongo_now_usec() - idle_since < (int64_t)pool->idle_check_ms * 1000 )
+        return MONGO_OK;
+
+    return mongo_simple_int_command( conn, "admin", "ping", 1, NULL );
+}
+
+mongo_connection* mongo_pool_checkout( mongo_pool* pool ) {
+    mongo_connection* conn = NULL;
+    int64_t idle_since = 0;
+    int64_t start = 0;
+
+    mongo_mutex_lock( &pool->mutex );
+    while( 1 ) {
+        if( pool->num_idle ) {
+            pool->num_idle--;
+            conn = pool->idle[pool->num_idle].conn;
+            idle_since = pool->idle[pool->num_idle].idle_since;
+            break;
+        }
+
+        /* Reserve a slot; the connection itself is opened unlocked. */
+        if( pool->num_open < pool->max_size ) {
+            pool->num_open++;
+            break;
+        }
+
+        if( !start ) {
+            start = mongo_now_usec();
+            pool->stats.waits++;
+        }
+
+        if( mongo_pool_wait( pool, start ) != MONGO_OK ) {
+            mongo_pool_record_wait( pool, start );
+            pool->stats.timeouts++;
+            pool->err = MONGO_POOL_WAIT_TIMEOUT;
+            mongo_mutex_unlock( &pool->mutex );
+            return NULL;
+        }
+    }
+
+    if( start )
+        mongo_pool_record_wait( pool, start );
+    mongo_mutex_unlock( &pool->mutex );
+
+    if( conn && mongo_pool_check_idle( pool, conn, idle_since ) != MONGO_OK ) {
+        mongo_pool_close( conn );
+        conn = NULL;
+
+        mongo_mutex_lock( &pool->mutex );
+        pool->stats.replaced++;
+        mongo_mutex_unlock( &pool->mutex );
+    }
+
+    if( !conn && ( conn = mongo_pool_open( pool ) ) == NULL ) {
+        mongo_mutex_lock( &pool->mutex );
+        pool->num_open--;
+        mongo_cond_signal( &pool->cond );
+        mongo_mutex_unlock( &pool->mutex );
+        return NULL;
+    }
+
+    conn->err = 0;
+
+    mongo_mutex_lock( &pool->mutex );
+    pool->stats.checkouts++;
+    mongo_mutex_unlock( &pool->mutex );
+
+    return conn;
+}
+
+void mongo_pool_checkin( mongo_pool* pool, mongo_connection* conn ) {
+    int broken = !conn->connected || conn->err == MONGO_IO_ERROR ||
+        conn->err == MONGO_READ_SIZE_ERROR || conn->err == MONGO_RESPONSE_MISMATCH;
+
+    if( broken )
+        mongo_pool_close( conn );
+
+    mongo_mutex_lock( &pool->mutex );
+    if( broken ) {
+        pool->num_open--;
+        pool->stats.replaced++;
+    }
+    else {
+        pool->idle[pool->num_idle].conn = conn;
+        pool->idle[pool->num_idle].idle_since = mongo_now_usec();
+        pool->num_idle++;
+    }
+    mongo_cond_signal( &pool->cond );
+    mongo_mutex_unlock( &pool->mutex );
+}
+
+void mongo_pool_get_stats( mongo_pool* pool, mongo_pool_stats* stats ) {
+    mongo_mutex_lock( &pool->mutex );
+    *stats = pool->stats;
+    stats->size = pool->num_open;
+    stats->idle = pool->num_idle;
+    mongo_mutex_unlock( &pool->mutex );
+}
+
+void mongo_pool_destroy( mongo_pool* pool ) {
+    mongo_host_port* seed;
+
+    while( pool->num_idle )
+        mongo_pool_close( pool->idle[--pool->num_idle].conn );
+    pool->num_open = 0;
+
+    while( pool->seeds ) {
+        seed = pool->seeds;
+        pool->seeds = seed->next;
+        free( seed );
+    }
+
+    free( pool->idle );
+    free( pool->replset_name );
+    free( pool->auth_db );
+    free( pool->auth_user );
+    free( pool->auth_pass );
+    pool->idle = NULL;
+    pool->replset_name = NULL;
+    pool->auth_db = pool->auth_user = pool->auth_pass = NULL;
+
+    mongo_cond_destroy( &pool->cond );
+    mongo_mutex_destroy( &pool->mutex );
+}
@@ -0,0 +1,157 @@
+/**
+ * @file pool.h
+ * @brief Thread-safe connection pool.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_POOL_H_
+#define _MONGO_POOL_H_
+
+#include "mongo.h"
+#include "thread.h"
+
+MONGO_EXTERN_C_START
+
+/** Set on pool->err when a checkout gives up waiting for a connection. */
+#define MONGO_POOL_WAIT_TIMEOUT 100
+
+typedef struct {
+    int size;              /**< Connections currently open, checked out or idle. */
+    int idle;              /**< Connections currently waiting in the pool. */
+    int64_t checkouts;     /**< Successful checkouts. */
+    int64_t waits;         /**< Checkouts that had to wait for a connection. */
+    int64_t wait_usec;     /**< Total time spent waiting, in microseconds. */
+    int64_t max_wait_usec; /**< Longest single wait, in microseconds. */
+    int64_t timeouts;      /**< Checkouts that gave up waiting. */
+    int64_t created;       /**< Connections opened by the pool. */
+    int64_t failures;      /**< Failed attempts to open a connection. */
+    int64_t replaced;      /**< Connections discarded after an I/O error. */
+} mongo_pool_stats;
+
+typedef struct {
+    mongo_connection* conn; /**< An idle, connected connection. */
+    int64_t idle_since;     /**< Checkin time, in microseconds. */
+} mongo_pool_entry;
+
+typedef struct {
+    mongo_host_port* seeds;  /**< Host, or replica set seeds, to connect to. */
+    char* replset_name;      /**< Replica set name, or NULL for a single host. */
+    char* auth_db;           /**< Database to authenticate against, if any. */
+    char* auth_user;
+    char* auth_pass;
+
+    int min_size;            /**< Connections opened by mongo_pool_connect. */
+    int max_size;            /**< Upper bound on open connections. */
+    int op_timeout_ms;       /**< Operation timeout applied to new connections. */
+    int wait_timeout_ms;     /**< Longest a checkout waits; 0 waits forever. */
+    int idle_check_ms;       /**< Ping connections idle longer than this; 0 disables. */
+
+    mongo_pool_entry* idle;  /**< Stack of idle connections, most recent on top. */
+    int num_idle;
+    int num_open;            /**< Connections open or being opened. */
+
+    mongo_mutex_t mutex;
+    mongo_cond_t cond;
+    mongo_pool_stats stats;
+    int err;                 /**< Most recent checkout error. */
+} mongo_pool;
+
+/**
+ * Initialize a pool for a single server.
+ *
+ * @param pool a mongo_pool object.
+ * @param host a numerical network address or a network hostname.
+ * @param port the port to connect to.
+ * @param min_size the number of connections to open up front.
+ * @param max_size the maximum number of open connections.
+ */
+void mongo_pool_init( mongo_pool* pool, const char* host, int port,
+    int min_size, int max_size );
+
+/**
+ * Initialize a pool for a replica set. Add seeds with
+ * mongo_pool_add_seed before calling mongo_pool_connect.
+ *
+ * @param pool a mongo_pool object.
+ * @param name the name of the replica set.
+ * @param min_size the number of connections to open up front.
+ * @param max_size the maximum number of open connections.
+ */
+void mongo_pool_init_replset( mongo_pool* pool, const char* name,
+    int min_size, int max_size );
+
+/**
+ * Add a replica set seed node to the pool.
+ */
+void mongo_pool_add_seed( mongo_pool* pool, const char* host, int port );
+
+/**
+ * Authenticate every connection the pool opens, including
+ * connections that replace broken ones.
+ */
+void mongo_pool_set_auth( mongo_pool* pool, const char* db,
+    const char* user, const char* pass );
+
+/**
+ * Configure pool timeouts.
+ *
+ * @param pool a mongo_pool object.
+ * @param op_timeout_ms operation timeout set on each new connection, or 0.
+ * @param wait_timeout_ms maximum time a checkout waits when the pool is
+ *     exhausted, or 0 to wait forever.
+ * @param idle_check_ms connections that sat idle longer than this are
+ *     pinged before being handed out, or 0 to never ping.
+ */
+void mongo_pool_set_timeouts( mongo_pool* pool, int op_timeout_ms,
+    int wait_timeout_ms, int idle_check_ms );
+
+/**
+ * Open min_size connections so that the first checkouts do not
+ * pay for connection setup.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if any connection failed. The pool
+ *     remains usable and will retry on checkout.
+ */
+int mongo_pool_connect( mongo_pool* pool );
+
+/**
+ * Take a connection from the pool, opening one if the pool is below
+ * max_size, or waiting for a checkin otherwise.
+ *
+ * @return a connection, or NULL with pool->err set.
+ */
+mongo_connection* mongo_pool_checkout( mongo_pool* pool );
+
+/**
+ * Return a connection to the pool. Connections that hit an I/O error
+ * are destroyed and lazily replaced on a later checkout.
+ */
+void mongo_pool_checkin( mongo_pool* pool, mongo_connection* conn );
+
+/**
+ * Copy the pool's counters into stats.
+ */
+void mongo_pool_get_stats( mongo_pool* pool, mongo_pool_stats* stats );
+
+/**
+ * Close all idle connections and free the pool. Every checked out
+ * connection must have been checked back in.
+ */
+void mongo_pool_destroy( mongo_pool* pool );
+
+MONGO_EXTERN_C_END
+#endif
@@ -0,0 +1,369 @@
+/* stats.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "stats.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char* mongo_stats_op_names[MONGO_STATS_OPS] = {
+    "msg", "update", "insert", "query", "getmore", "delete", "killcursors"
+};
+
+static int mongo_stats_op_index( int op ){
+    switch( op ) {
+    case MONGO_OP_MSG: return MONGO_STATS_MSG;
+    case MONGO_OP_UPDATE: return MONGO_STATS_UPDATE;
+    case MONGO_OP_INSERT: return MONGO_STATS_INSERT;
+    case MONGO_OP_QUERY: return MONGO_STATS_QUERY;
+    case MONGO_OP_GET_MORE: return MONGO_STATS_GET_MORE;
+    case MONGO_OP_DELETE: return MONGO_STATS_DELETE;
+    case MONGO_OP_KILL_CURSORS: return MONGO_STATS_KILL_CURSORS;
+    default: return -1;
+    }
+}
+
+/* Histograms */
+
+static int mongo_histogram_bucket( int64_t value ){
+    int shift = 0;
+
+    if( value < 0 )
+        value = 0;
+    if( value >> 40 )
+        return MONGO_HISTOGRAM_BUCKETS - 1;
+
+    while( value >> ( shift + MONGO_HISTOGRAM_SUB_BITS + 1 ) )
+        shift++;
+    if( value < ( 1 << MONGO_HISTOGRAM_SUB_BITS ) )
+        return (int)value;
+
+    /* The top SUB_BITS + 1 bits select the bucket within this power of two. */
+    return ( ( shift + 1 ) << MONGO_HISTOGRAM_SUB_BITS ) +
+        (int)( value >> shift ) - ( 1 << MONGO_HISTOGRAM_SUB_BITS );
+}
+
+/* The highest value counted in a bucket. */
+static int64_t mongo_histogram_bucket_max( int bucket ){
+    int shift, mantissa;
+
+    if( bucket < ( 1 << MONGO_HISTOGRAM_SUB_BITS ) )
+        return bucket;
+
+    shift = ( bucket >> MONGO_HISTOGRAM_SUB_BITS ) - 1;
+    mantissa = ( bucket & ( ( 1 << MONGO_HISTOGRAM_SUB_BITS ) - 1 ) ) + ( 1 << MONGO_HISTOGRAM_SUB_BITS );
+    return ( (int64_t)( mantissa + 1 ) << shift ) - 1;
+}
+
+void mongo_histogram_record( mongo_histogram* h, int64_t value ){
+    h->counts[mongo_histogram_bucket( value )]++;
+    if( !h->count || value < h->min )
+        h->min = value;
+    if( !h->count || value > h->max )
+        h->max = value;
+    h->count++;
+    h->sum += value;
+}
+
+int64_t mongo_histogram_percentile( const mongo_histogram* h, double percentile ){
+    int64_t rank, seen = 0;
+    int64_t value;
+    int i;
+
+    if( !h->count )
+        return 0;
+
+    rank = (int64_t)( percentile / 100.0 * h->count + 0.5 );
+    if( rank < 1 )
+        rank = 1;
+
+    for( i=0; i<MONGO_HISTOGRAM_BUCKETS; i++ ) {
+        seen += h->counts[i];
+        if( seen >= rank )
+            break;
+    }
+
+    /* The last bucket has no upper bound but the largest value. */
+    if( i >= MONGO_HISTOGRAM_BUCKETS - 1 )
+        return h->max;
+
+    value = mongo_histogram_bucket_max( i );
+    return value < h->max ? value : h->max;
+}
+
+static void mongo_histogram_append( bson_buffer* bb, const char* name, const mongo_histogram* h ){
+    bson_append_start_object( bb, name );
+    bson_append_long( bb, "count", h->count );
+    bson_append_long( bb, "min", h->min );
+    bson_append_long( bb, "mean", h->count ? h->sum / h->count : 0 );
+    bson_append_long( bb, "p50", mongo_histogram_percentile( h, 50 ) );
+    bson_append_long( bb, "p99", mongo_histogram_percentile( h, 99 ) );
+    bson_append_long( bb, "p999", mongo_histogram_percentile( h, 99.9 ) );
+    bson_append_long( bb, "max", h->max );
+    bson_append_finish_object( bb );
+}
+
+/* Connection statistics */
+
+void mongo_conn_enable_stats( mongo_connection* conn ){
+    if( !conn->stats ) {
+        conn->stats = (mongo_stats*)bson_malloc( sizeof( mongo_stats ) );
+        memset( conn->stats, 0, sizeof( mongo_stats ) );
+    }
+}
+
+void mongo_conn_disable_stats( mongo_connection* conn ){
+    free( conn->stats );
+    conn->stats = NULL;
+}
+
+void mongo_conn_reset_stats( mongo_connection* conn ){
+    if( conn->stats )
+        memset( conn->stats, 0, sizeof( mongo_stats ) );
+}
+
+int mongo_conn_get_stats( mongo_connection* conn, bson* out ){
+    mongo_stats* stats = conn->stats;
+    bson_buffer bb;
+    char key[16];
+    int i;
+
+    if( !stats )
+        return MONGO_ERROR;
+
+    bson_buffer_init( &bb );
+    bson_append_long( &bb, "bytesSent", stats->bytes_sent );
+    bson_append_long( &bb, "bytesReceived", stats->bytes_received );
+    bson_append_long( &bb, "replies", stats->replies );
+
+    bson_append_start_object( &bb, "ops" );
+    for( i=0; i<MONGO_STATS_OPS; i++ ) {
+        bson_append_start_object( &bb, mongo_stats_op_names[i] );
+        bson_append_long( &bb, "count", stats->ops[i] );
+        bson_append_long( &bb, "bytes", stats->op_bytes[i] );
+        bson_append_finish_object( &bb );
+    }
+    bson_append_finish_object( &bb );
+
+    bson_append_start_array( &bb, "namespaces" );
+    for( i=0; i<stats->ns_count; i++ ) {
+        bson_numstr( key, i );
+        bson_append_start_object( &bb, key );
+        bson_append_string( &bb, "ns", stats->ns[i].ns );
+        bson_append_long( &bb, "count", stats->ns[i].ops );
+        bson_append_long( &bb, "bytes", stats->ns[i].bytes_sent );
+        bson_append_finish_object( &bb );
+    }
+    bson_append_finish_object( &bb );
+    bson_append_long( &bb, "otherNamespaces", stats->other_ns_ops );
+
+    mongo_histogram_append( &bb, "roundTripMicros", &stats->round_trip );
+    mongo_histogram_append( &bb, "sendMicros", &stats->send );
+    mongo_histogram_append( &bb, "waitMicros", &stats->wait );
+    mongo_histogram_append( &bb, "replyBytes", &stats->reply_size );
+
+    bson_from_buffer( out, &bb );
+    return MONGO_OK;
+}
+
+void mongo_stats_record_send( mongo_stats* stats, int op, const char* ns, int bytes ){
+    int i = mongo_stats_op_index( op );
+
+    stats->bytes_sent += bytes;
+    if( i >= 0 ) {
+        stats->ops[i]++;
+        stats->op_bytes[i] += bytes;
+    }
+
+    if( !ns )
+        return;
+
+    for( i=0; i<stats->ns_count; i++ ) {
+        if( !strcmp( stats->ns[i].ns, ns ) )
+            break;
+    }
+    if( i == stats->ns_count ) {
+        if( i == MONGO_STATS_MAX_NS || strlen( ns ) >= sizeof( stats->ns[i].ns ) ) {
+            stats->other_ns_ops++;
+            return;
+        }
+        strcpy( stats->ns[i].ns, ns );
+        stats->ns_count++;
+    }
+    stats->ns[i].ops++;
+    stats->ns[i].bytes_sent += bytes;
+}
+
+void mongo_stats_record_reply( mongo_stats* stats, int bytes ){
+    stats->replies++;
+    stats->bytes_received += bytes;
+    mongo_histogram_record( &stats->reply_size, bytes );
+}
+
+/* Operation hooks */
+
+static mongo_op_hooks op_hooks;
+static int op_hooks_set = 0;
+
+void mongo_set_op_hooks( const mongo_op_hooks* hooks ){
+    if( hooks )
+        op_hooks = *hooks;
+    else
+        memset( &op_hooks, 0, sizeof( op_hooks ) );
+    op_hooks_set = hooks != NULL;
+}
+
+int mongo_ops_hooked( void ){
+    return op_hooks_set;
+}
+
+static void mongo_ops_emit( mongo_op_hook hook, mongo_connection* conn, mongo_pending_op* p,
+    int bytes_received, int64_t elapsed, int err ){
+
+    mongo_op_event event;
+    bson query;
+
+    if( !hook )
+        return;
+
+    event.request_id = p->id;
+    event.op = p->op;
+    event.ns = p->ns[0] ? p->ns : NULL;
+    event.host = conn->primary ? conn->primary->host : NULL;
+    event.port = conn->primary ? conn->primary->port : 0;
+    event.bytes_sent = p->bytes_sent;
+    event.bytes_received = bytes_received;
+    event.elapsed_ns = elapsed;
+    event.err = err;
+    event.query = NULL;
+    if( p->query ) {
+        bson_init( &query, (char*)p->query, 0 );
+        event.query = &query;
+    }
+
+    hook( &event, op_hooks.data );
+}
+
+/* Report a finished op and stop tracking it. */
+static void mongo_ops_finish( mongo_connection* conn, int i, int ok, int bytes_received, int64_t now ){
+    mongo_op_tracker* t = conn->ops;
+    mongo_pending_op* p = &t->ops[i];
+    int64_t elapsed = now - p->start;
+    int err = ok ? 0 : conn->err;
+
+    mongo_ops_emit( ok ? op_hooks.succeeded : op_hooks.failed, conn, p, bytes_received, elapsed, err );
+    if( op_hooks.slow && elapsed >= op_hooks.slow_ns )
+        mongo_ops_emit( op_hooks.slow, conn, p, bytes_received, elapsed, err );
+
+    t->ops[i] = t->ops[--t->count];
+}
+
+void mongo_ops_started( mongo_connection* conn, int op, int id, const char* ns,
+    const char* query, int bytes ){
+
+    mongo_op_tracker* t = conn->ops;
+    mongo_pending_op* p;
+
+    if( !t ) {
+        t = conn->ops = (mongo_op_tracker*)bson_malloc( sizeof( mongo_op_tracker ) );
+        t->count = 0;
+    }
+
+    /* Replies that never came, e.g. to a cursor abandoned mid-prefetch,
+     * make room by dropping the oldest request. */
+    if( t->count == MONGO_OPS_MAX_PENDING ) {
+        memmove( t->ops, t->ops + 1, ( t->count - 1 ) * sizeof( mongo_pending_op ) );
+        t->count--;
+    }
+
+    p = &t->ops[t->count++];
+    p->id = id;
+    p->op = op;
+    p->bytes_sent = bytes;
+    p->written = 0;
+    p->query = query;
+    p->ns[0] = '\0';
+    if( ns ) {
+        strncpy( p->ns, ns, sizeof( p->ns ) - 1 );
+        p->ns[sizeof( p->ns ) - 1] = '\0';
+    }
+
+    p->start = mongo_now_nsec();
+    mongo_ops_emit( op_hooks.started, conn, p, 0, 0, 0 );
+}
+
+void mongo_ops_written( mongo_connection* conn, int res, int reply_follows ){
+    mongo_op_tracker* t = conn->ops;
+    int64_t now;
+    int i = 0;
+
+    if( !t )
+        return;
+
+    if( res != MONGO_OK ) {
+        mongo_ops_failed( conn );
+        return;
+    }
+
+    now = mongo_now_nsec();
+    while( i < t->count ) {
+        mongo_pending_op* p = &t->ops[i];
+        if( p->written ) {
+            i++;
+            continue;
+        }
+        if( p->op != MONGO_OP_QUERY && p->op != MONGO_OP_GET_MORE ) {
+            mongo_ops_finish( conn, i, 1, 0, now );
+            continue;
+        }
+
+        /* The caller's query may be gone by the time a later call reads
+         * the reply. */
+        p->written = 1;
+        if( !reply_follows )
+            p->query = NULL;
+        i++;
+    }
+}
+
+void mongo_ops_replied( mongo_connection* conn, int responseTo, int bytes ){
+    mongo_op_tracker* t = conn->ops;
+    int i;
+
+    if( !t )
+        return;
+
+    for( i=0; i<t->count; i++ ) {
+        if( t->ops[i].id == responseTo ) {
+            mongo_ops_finish( conn, i, 1, bytes, mongo_now_nsec() );
+            return;
+        }
+    }
+}
+
+void mongo_ops_failed( mongo_connection* conn ){
+    mongo_op_tracker* t = conn->ops;
+    int64_t now;
+
+    if( !t )
+        return;
+
+    now = mongo_now_nsec();
+    while( t->count )
+        mongo_ops_finish( conn, t->count - 1, 0, 0, now );
+}
@@ -0,0 +1,219 @@
+/**
+ * @file stats.h
+ * @brief Per-connection operation counters, latency histograms and
+ *     operation hooks.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_STATS_H_
+#define _MONGO_STATS_H_
+
+#include "mongo.h"
+
+MONGO_EXTERN_C_START
+
+/* Values below 2^MONGO_HISTOGRAM_SUB_BITS are counted exactly. Above that,
+ * each power of two is split into as many buckets, so a recorded value is
+ * known to within about 3%. Values from 2^40 up share the last bucket. */
+#define MONGO_HISTOGRAM_SUB_BITS 5
+#define MONGO_HISTOGRAM_BUCKETS ( ( 40 - MONGO_HISTOGRAM_SUB_BITS + 1 ) << MONGO_HISTOGRAM_SUB_BITS )
+
+#define MONGO_STATS_MAX_NS 64
+
+typedef enum {
+    MONGO_STATS_MSG = 0,
+    MONGO_STATS_UPDATE,
+    MONGO_STATS_INSERT,
+    MONGO_STATS_QUERY,
+    MONGO_STATS_GET_MORE,
+    MONGO_STATS_DELETE,
+    MONGO_STATS_KILL_CURSORS,
+    MONGO_STATS_OPS
+} mongo_stats_op;
+
+typedef struct {
+    int64_t counts[MONGO_HISTOGRAM_BUCKETS];
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+} mongo_histogram;
+
+typedef struct {
+    char ns[128];
+    int64_t ops;
+    int64_t bytes_sent;
+} mongo_stats_ns;
+
+typedef struct mongo_stats {
+    int64_t ops[MONGO_STATS_OPS];        /**< Messages sent, by opcode. */
+    int64_t op_bytes[MONGO_STATS_OPS];   /**< Bytes sent, by opcode. */
+    int64_t bytes_sent;
+    int64_t bytes_received;
+    int64_t replies;
+
+    mongo_stats_ns ns[MONGO_STATS_MAX_NS]; /**< Totals for the first namespaces seen. */
+    int ns_count;
+    int64_t other_ns_ops;                /**< Messages to namespaces past those. */
+
+    int64_t request_start;               /**< When the request awaiting a reply was written, or 0. */
+
+    mongo_histogram round_trip;          /**< Request written until its reply is read, in usec. */
+    mongo_histogram send;                /**< Time spent writing to the socket, in usec. */
+    mongo_histogram wait;                /**< Time spent blocked reading each reply, in usec. */
+    mongo_histogram reply_size;          /**< Reply sizes, in bytes. */
+} mongo_stats;
+
+/**
+ * Start keeping statistics for a connection. Until this is called a
+ * connection keeps none and reads no clocks for them. Statistics are kept
+ * across reconnects until mongo_conn_disable_stats or mongo_destroy.
+ *
+ * Like the connection, its statistics belong to the thread using it, so
+ * they are kept without atomic operations or locks.
+ *
+ * @param conn a mongo_connection object.
+ */
+void mongo_conn_enable_stats( mongo_connection* conn );
+
+/**
+ * Stop keeping statistics and free them.
+ *
+ * @param conn a mongo_connection object.
+ */
+void mongo_conn_disable_stats( mongo_connection* conn );
+
+/**
+ * Zero a connection's statistics.
+ *
+ * @param conn a mongo_connection object.
+ */
+void mongo_conn_reset_stats( mongo_connection* conn );
+
+/**
+ * Take a snapshot of a connection's statistics as a BSON document:
+ *
+ *     { bytesSent, bytesReceived, replies,
+ *       ops: { query: { count, bytes }, insert: ..., ... },
+ *       namespaces: [ { ns, count, bytes }, ... ], otherNamespaces,
+ *       roundTripMicros: { count, min, mean, p50, p99, p999, max },
+ *       sendMicros: ..., waitMicros: ..., replyBytes: ... }
+ *
+ * waitMicros is the time spent blocked on the socket for each reply;
+ * the rest of roundTripMicros, less sendMicros, is server time and driver
+ * overhead.
+ *
+ * @param conn a mongo_connection object.
+ * @param out the snapshot, to be freed with bson_destroy.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if statistics are not enabled.
+ */
+int mongo_conn_get_stats( mongo_connection* conn, bson* out );
+
+/**
+ * Count a value in a histogram.
+ */
+void mongo_histogram_record( mongo_histogram* h, int64_t value );
+
+/**
+ * The value below which the given percentage of recorded values fall,
+ * to within the histogram's precision, or 0 if it is empty.
+ *
+ * @param percentile from 0 to 100, e.g. 99.9.
+ */
+int64_t mongo_histogram_percentile( const mongo_histogram* h, double percentile );
+
+/* Used by the driver to record wire traffic. */
+void mongo_stats_record_send( mongo_stats* stats, int op, const char* ns, int bytes );
+void mongo_stats_record_reply( mongo_stats* stats, int bytes );
+
+/* ----------------------------
+   OPERATION HOOKS
+   ------------------------------ */
+
+/* Requests per connection whose replies are tracked for the hooks. */
+#define MONGO_OPS_MAX_PENDING 32
+
+typedef struct {
+    int request_id;
+    int op;                /**< MONGO_OP_* of the request. */
+    const char* ns;        /**< Namespace, or NULL for ops that have none. */
+    const char* host;      /**< Server the connection is to. */
+    int port;
+    int bytes_sent;        /**< Size of the request. */
+    int bytes_received;    /**< Size of the reply, or 0. */
+    int64_t elapsed_ns;    /**< Since the request began to be written; 0 in started. */
+    int err;               /**< The connection's err, in failed. */
+    const bson* query;     /**< Query or command document of an OP_QUERY, or NULL. */
+} mongo_op_event;
+
+typedef void (*mongo_op_hook)( const mongo_op_event* event, void* data );
+
+typedef struct {
+    mongo_op_hook started;   /**< Before a request is written. */
+    mongo_op_hook succeeded; /**< Once its reply is read, or once it is written if no reply comes. */
+    mongo_op_hook failed;    /**< If the write fails or the connection is lost before the reply. */
+    mongo_op_hook slow;      /**< After succeeded or failed, for ops taking slow_ns or more. */
+    int64_t slow_ns;
+    void* data;              /**< Passed to each hook. */
+} mongo_op_hooks;
+
+typedef struct {
+    int id;
+    int op;
+    int bytes_sent;
+    int written;
+    int64_t start;
+    const char* query;
+    char ns[128];
+} mongo_pending_op;
+
+typedef struct mongo_op_tracker {
+    mongo_pending_op ops[MONGO_OPS_MAX_PENDING];
+    int count;
+} mongo_op_tracker;
+
+/**
+ * Call hooks around every request written by any connection: queries,
+ * get_mores, inserts, updates, removes, kill cursors and commands, which
+ * are queries on "db.$cmd". Set the hooks before connections are in use;
+ * the hooks may run on any thread using a connection. Times come from a
+ * monotonic clock.
+ *
+ * An event's pointers are good only during the hook. The query is given
+ * in started, and in later events for queries whose reply is read by the
+ * call that wrote them: mongo_find, mongo_find_one and the commands. It
+ * is NULL after a pipelined query or a prefetched get_more.
+ *
+ * The slow hook lets slow queries be captured: bson_copy the event's
+ * query.
+ *
+ * @param hooks the hooks, which are copied; any may be NULL. NULL
+ *     removes them all.
+ */
+void mongo_set_op_hooks( const mongo_op_hooks* hooks );
+
+/* Used by the driver to track requests for the hooks. */
+int mongo_ops_hooked( void );
+void mongo_ops_started( mongo_connection* conn, int op, int id, const char* ns,
+    const char* query, int bytes );
+void mongo_ops_written( mongo_connection* conn, int res, int reply_follows );
+void mongo_ops_replied( mongo_connection* conn, int responseTo, int bytes );
+void mongo_ops_failed( mongo_connection* conn );
+
+MONGO_EXTERN_C_END
+#endif
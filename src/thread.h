@@ -0,0 +1,74 @@
+/**
+ * @file thread.h
+ * @brief Minimal threading primitives used by the driver.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_THREAD_H_
+#define _MONGO_THREAD_H_
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef CRITICAL_SECTION mongo_mutex_t;
+typedef CONDITION_VARIABLE mongo_cond_t;
+typedef HANDLE mongo_thread_t;
+
+#define mongo_mutex_init(m) ( InitializeCriticalSection(m) )
+#define mongo_mutex_destroy(m) ( DeleteCriticalSection(m) )
+#define mongo_mutex_lock(m) ( EnterCriticalSection(m) )
+#define mongo_mutex_unlock(m) ( LeaveCriticalSection(m) )
+
+#define mongo_cond_init(c) ( InitializeConditionVariable(c) )
+#define mongo_cond_destroy(c) ( (void)(c) )
+#define mongo_cond_wait(c, m) ( SleepConditionVariableCS(c, m, INFINITE) )
+#define mongo_cond_signal(c) ( WakeConditionVariable(c) )
+#define mongo_cond_broadcast(c) ( WakeAllConditionVariable(c) )
+
+#define mongo_thread_create(t, func, arg) \
+    ( ( *(t) = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(func), (arg), 0, NULL) ) ? 0 : -1 )
+#define mongo_thread_join(t) \
+    ( WaitForSingleObject(t, INFINITE), CloseHandle(t) )
+
+/* Atomic add with a full memory barrier; evaluates to the new value. */
+#define mongo_atomic_add(p, n) ( InterlockedExchangeAdd( (volatile LONG*)(p), (n) ) + (n) )
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t mongo_mutex_t;
+typedef pthread_cond_t mongo_cond_t;
+typedef pthread_t mongo_thread_t;
+
+#define mongo_mutex_init(m) ( pthread_mutex_init(m, NULL) )
+#define mongo_mutex_destroy(m) ( pthread_mutex_destroy(m) )
+#define mongo_mutex_lock(m) ( pthread_mutex_lock(m) )
+#define mongo_mutex_unlock(m) ( pthread_mutex_unlock(m) )
+
+#define mongo_cond_init(c) ( pthread_cond_init(c, NULL) )
+#define mongo_cond_destroy(c) ( pthread_cond_destroy(c) )
+#define mongo_cond_wait(c, m) ( pthread_cond_wait(c, m) )
+#define mongo_cond_signal(c) ( pthread_cond_signal(c) )
+#define mongo_cond_broadcast(c) ( pthread_cond_broadcast(c) )
+
+#define mongo_thread_create(t, func, arg) ( pthread_create(t, NULL, func, arg) )
+#define mongo_thread_join(t) ( pthread_join(t, NULL) )
+
+/* Atomic add with a full memory barrier; evaluates to the new value. */
+#define mongo_atomic_add(p, n) ( __sync_add_and_fetch( (p), (n) ) )
+#endif
+
+#endif
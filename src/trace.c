@@ -0,0 +1,142 @@
+/* trace.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "trace.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* stdio buffering for the trace file, so most records cost no syscall. */
+#define MONGO_TRACE_BUFFER_SIZE ( 256 * 1024 )
+
+int mongo_trace_open( mongo_trace* trace, const char* path ){
+    char header[MONGO_TRACE_HEADER_SIZE];
+    int version = MONGO_TRACE_VERSION;
+
+    trace->file = fopen( path, "wb" );
+    if( !trace->file )
+        return MONGO_ERROR;
+    setvbuf( trace->file, NULL, _IOFBF, MONGO_TRACE_BUFFER_SIZE );
+
+    memcpy( header, MONGO_TRACE_MAGIC, 4 );
+    bson_little_endian32( header + 4, &version );
+    if( fwrite( header, sizeof( header ), 1, trace->file ) != 1 ) {
+        fclose( trace->file );
+        trace->file = NULL;
+        return MONGO_ERROR;
+    }
+
+    mongo_mutex_init( &trace->mutex );
+    trace->start = mongo_now_nsec();
+    trace->connections = 0;
+    trace->records = 0;
+    trace->bytes = sizeof( header );
+    trace->err = 0;
+
+    return MONGO_OK;
+}
+
+int mongo_trace_close( mongo_trace* trace ){
+    int err = trace->err;
+
+    if( !trace->file )
+        return MONGO_ERROR;
+
+    if( fclose( trace->file ) != 0 )
+        err = 1;
+    trace->file = NULL;
+    mongo_mutex_destroy( &trace->mutex );
+
+    return err ? MONGO_ERROR : MONGO_OK;
+}
+
+void mongo_conn_set_trace( mongo_connection* conn, mongo_trace* trace ){
+    conn->trace = trace;
+    conn->trace_conn = 0;
+    if( trace ) {
+        mongo_mutex_lock( &trace->mutex );
+        conn->trace_conn = ++trace->connections;
+        mongo_mutex_unlock( &trace->mutex );
+    }
+}
+
+void mongo_trace_record( mongo_connection* conn, const mongo_iovec* iov, int count ){
+    mongo_trace* trace = conn->trace;
+    char record[MONGO_TRACE_RECORD_SIZE];
+    int64_t elapsed;
+    int len = 0;
+    int i;
+
+    for( i=0; i<count; i++ )
+        len += iov[i].iov_len;
+
+    mongo_mutex_lock( &trace->mutex );
+
+    /* Timed under the mutex, so the file is in time order. */
+    elapsed = mongo_now_nsec() - trace->start;
+    bson_little_endian64( record, &elapsed );
+    bson_little_endian32( record + 8, &conn->trace_conn );
+
+    if( !trace->err ) {
+        if( fwrite( record, sizeof( record ), 1, trace->file ) != 1 )
+            trace->err = 1;
+        for( i=0; i<count && !trace->err; i++ )
+            if( iov[i].iov_len && fwrite( iov[i].iov_base, iov[i].iov_len, 1, trace->file ) != 1 )
+                trace->err = 1;
+        trace->records++;
+        trace->bytes += sizeof( record ) + len;
+    }
+
+    mongo_mutex_unlock( &trace->mutex );
+}
+
+int mongo_trace_next( const char* data, int64_t len, int64_t* offset, mongo_trace_entry* entry ){
+    const char* p;
+    int version;
+
+    if( *offset == 0 ) {
+        if( len < MONGO_TRACE_HEADER_SIZE || memcmp( data, MONGO_TRACE_MAGIC, 4 ) != 0 )
+            return MONGO_ERROR;
+        bson_little_endian32( &version, data + 4 );
+        if( version != MONGO_TRACE_VERSION )
+            return MONGO_ERROR;
+        *offset = MONGO_TRACE_HEADER_SIZE;
+    }
+
+    if( len - *offset < MONGO_TRACE_RECORD_SIZE + (int64_t)sizeof( mongo_header ) )
+        return MONGO_ERROR;
+
+    p = data + *offset;
+    bson_little_endian64( &entry->time_ns, p );
+    bson_little_endian32( &entry->conn, p + 8 );
+    p += MONGO_TRACE_RECORD_SIZE;
+    bson_little_endian32( &entry->len, p );
+    bson_little_endian32( &entry->id, p + 4 );
+    bson_little_endian32( &entry->responseTo, p + 8 );
+    bson_little_endian32( &entry->op, p + 12 );
+
+    if( entry->len < (int)sizeof( mongo_header ) ||
+        len - *offset - MONGO_TRACE_RECORD_SIZE < entry->len )
+        return MONGO_ERROR;
+
+    entry->received = entry->op == 1; /* OP_REPLY */
+    entry->msg = p;
+    *offset += MONGO_TRACE_RECORD_SIZE + entry->len;
+
+    return MONGO_OK;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file trace.h
+ * @brief Capture of the messages connections send and receive.
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_TRACE_H_
+#define _MONGO_TRACE_H_
+
+#include "mongo.h"
+#include "thread.h"
+#include <stdio.h>
+
+MONGO_EXTERN_C_START
+
+/* A trace file is the 4 bytes "MTRC" and an int32 version, then one
+ * record per message: an int64 of nanoseconds since the trace was opened,
+ * an int32 connection number and the message exactly as on the wire,
+ * which begins with its own length. All integers are little endian. */
+#define MONGO_TRACE_MAGIC "MTRC"
+#define MONGO_TRACE_VERSION 1
+#define MONGO_TRACE_HEADER_SIZE 8
+#define MONGO_TRACE_RECORD_SIZE 12
+
+typedef struct mongo_trace {
+    FILE* file;
+    mongo_mutex_t mutex;
+    int64_t start;          /**< When the trace was opened, in nsec on a monotonic clock. */
+    int connections;        /**< Connection numbers handed out so far. */
+    int64_t records;        /**< Messages written. */
+    int64_t bytes;          /**< Bytes written, headers included. */
+    int err;                /**< Whether a write to the file has failed. */
+} mongo_trace;
+
+typedef struct {
+    int64_t time_ns;        /**< Since the trace was opened. */
+    int conn;               /**< Connection number, from 1. */
+    int received;           /**< Whether this is a reply rather than a request. */
+    int op;                 /**< Opcode from the message header; 1 for replies. */
+    int id;                 /**< Request id from the message header. */
+    int responseTo;
+    int len;                /**< Length of the message. */
+    const char* msg;        /**< The message as on the wire, header first. */
+} mongo_trace_entry;
+
+/**
+ * Create a trace file, replacing any file at path. Connections given the
+ * trace with mongo_conn_set_trace append every message they write or read
+ * to it, with the time it was written or read.
+ *
+ * One trace may be shared by connections in several threads; records are
+ * appended under a mutex. The async event loop and replica set discovery
+ * probes are not captured.
+ *
+ * @param trace the trace to initialize.
+ * @param path the file to write.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the file cannot be created.
+ */
+int mongo_trace_open( mongo_trace* trace, const char* path );
+
+/**
+ * Flush and close the file. Every connection using the trace must have
+ * been given another one, or NULL, first.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if any write to the file failed.
+ */
+int mongo_trace_close( mongo_trace* trace );
+
+/**
+ * Capture a connection's messages in a trace, or stop with NULL. The
+ * connection is given a number, new for each call, that its records in
+ * the trace carry. It keeps the trace across reconnects.
+ *
+ * @param conn a mongo_connection object.
+ * @param trace an open trace, not owned by the connection, or NULL.
+ */
+void mongo_conn_set_trace( mongo_connection* conn, mongo_trace* trace );
+
+/**
+ * Step through a trace file that has been read into memory.
+ *
+ * @param data the file's contents.
+ * @param len the length of data.
+ * @param offset where to read from: 0 to begin, then as left by the
+ *     previous call.
+ * @param entry set to the record read, which points into data.
+ *
+ * @return MONGO_OK, or MONGO_ERROR at the end of the file or if it is not
+ *     a trace or is cut short.
+ */
+int mongo_trace_next( const char* data, int64_t len, int64_t* offset, mongo_trace_entry* entry );
+
+MONGO_EXTERN_C_END
+#endif
@@ -0,0 +1,588 @@
+/* uring.c */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/* syscall() */
+#if defined(MONGO_USE_IO_URING) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+#include "net.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MONGO_USE_IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Writes each connection can queue before it has to wait for the kernel. */
+#define MONGO_URING_WRITE_BUFFER_SIZE 65536
+
+/* A completion's user_data holds the slot index above the operation. */
+#define MONGO_URING_WRITE 1
+#define MONGO_URING_READ 2
+#define MONGO_URING_TIMEOUT 3
+#define MONGO_URING_DIRECT 4
+#define MONGO_URING_OP_BITS 3
+
+/* The kernel updates the ring indexes concurrently. */
+static unsigned mongo_uring_load( unsigned* p ) {
+    unsigned v = *(volatile unsigned*)p;
+    __sync_synchronize();
+    return v;
+}
+
+static void mongo_uring_store( unsigned* p, unsigned v ) {
+    __sync_synchronize();
+    *(volatile unsigned*)p = v;
+}
+
+static int mongo_uring_enter( mongo_uring* ring, unsigned min_complete ) {
+    int res;
+
+    do {
+        res = (int)syscall( __NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                            min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+    } while( res == -1 && errno == EINTR );
+
+    if( res == -1 )
+        return MONGO_ERROR;
+
+    ring->to_submit -= res;
+    return MONGO_OK;
+}
+
+/* Make room for count entries, submitting what is queued if need be,
+ * so that linked entries always go to the kernel together. */
+static int mongo_uring_reserve( mongo_uring* ring, unsigned count ) {
+    if( *ring->sq_entries - ( *ring->sq_tail - mongo_uring_load( ring->sq_head ) ) >= count )
+        return MONGO_OK;
+
+    return mongo_uring_enter( ring, 0 );
+}
+
+static struct io_uring_sqe* mongo_uring_get_sqe( mongo_uring* ring ) {
+    struct io_uring_sqe* sqe;
+    unsigned index;
+
+    if( mongo_uring_reserve( ring, 1 ) != MONGO_OK )
+        return NULL;
+
+    index = *ring->sq_tail & *ring->sq_mask;
+    sqe = (struct io_uring_sqe*)ring->sqes + index;
+    memset( sqe, 0, sizeof( *sqe ) );
+    ring->sq_array[index] = index;
+
+    return sqe;
+}
+
+static void mongo_uring_push( mongo_uring* ring ) {
+    mongo_uring_store( ring->sq_tail, *ring->sq_tail + 1 );
+    ring->to_submit++;
+}
+
+static void mongo_uring_prep( struct io_uring_sqe* sqe, int opcode, mongo_uring_slot* slot,
+    int op, const void* addr, int len ) {
+
+    sqe->opcode = opcode;
+    sqe->fd = slot->conn->sock;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->user_data = ( (unsigned long)( slot - slot->ring->slots ) << MONGO_URING_OP_BITS ) | op;
+}
+
+static void mongo_uring_fail( mongo_uring_slot* slot ) {
+    slot->failed = 1;
+    slot->wbuf_len = slot->wbuf_sent = 0;
+    slot->conn->err = MONGO_IO_ERROR;
+}
+
+/* Report a queued write that failed since the last operation. */
+static int mongo_uring_check( mongo_uring_slot* slot ) {
+    if( !slot->failed )
+        return MONGO_OK;
+
+    slot->failed = 0;
+    slot->conn->err = MONGO_IO_ERROR;
+    return MONGO_ERROR;
+}
+
+static void mongo_uring_complete( mongo_uring* ring, struct io_uring_cqe* cqe ) {
+    mongo_uring_slot* slot = ring->slots + ( cqe->user_data >> MONGO_URING_OP_BITS );
+
+    switch( (int)( cqe->user_data & ( ( 1 << MONGO_URING_OP_BITS ) - 1 ) ) ) {
+    case MONGO_URING_WRITE:
+        slot->writing = 0;
+        if( cqe->res <= 0 )
+            mongo_uring_fail( slot );
+        else if( ( slot->wbuf_sent += cqe->res ) == slot->wbuf_len )
+            slot->wbuf_sent = slot->wbuf_len = 0;
+        break;
+    case MONGO_URING_READ:
+        slot->reading = 0;
+        slot->read_res = cqe->res;
+        break;
+    case MONGO_URING_DIRECT:
+        slot->direct = 0;
+        slot->direct_res = cqe->res;
+        break;
+    }
+}
+
+/* Queue a write for every connection with unsent data and none in flight.
+ * A short write leaves the rest to be picked up here on the next pass. */
+static int mongo_uring_prep_writes( mongo_uring* ring ) {
+    struct io_uring_sqe* sqe;
+    mongo_uring_slot* slot;
+    int i;
+
+    for( i=0; i<ring->num_slots; i++ ) {
+        slot = ring->slots + i;
+        if( !slot->conn || slot->writing || slot->wbuf_sent == slot->wbuf_len )
+            continue;
+
+        if( ( sqe = mongo_uring_get_sqe( ring ) ) == NULL )
+            return MONGO_ERROR;
+        mongo_uring_prep( sqe, IORING_OP_WRITE_FIXED, slot, MONGO_URING_WRITE,
+                          slot->wbuf + slot->wbuf_sent, slot->wbuf_len - slot->wbuf_sent );
+        sqe->buf_index = 0;
+        mongo_uring_push( ring );
+        slot->writing = 1;
+    }
+
+    return MONGO_OK;
+}
+
+/* Submit everything queued on the ring, across all connections, in one
+ * syscall; wait for at least min_complete completions and process every
+ * completion that is available. */
+static int mongo_uring_wait( mongo_uring* ring, unsigned min_complete ) {
+    unsigned head, tail;
+
+    if( mongo_uring_prep_writes( ring ) != MONGO_OK ||
+        mongo_uring_enter( ring, min_complete ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    head = *ring->cq_head;
+    tail = mongo_uring_load( ring->cq_tail );
+    while( head != tail ) {
+        mongo_uring_complete( ring, (struct io_uring_cqe*)ring->cqes + ( head & *ring->cq_mask ) );
+        head++;
+    }
+    mongo_uring_store( ring->cq_head, head );
+
+    return MONGO_OK;
+}
+
+static int mongo_uring_busy( mongo_uring_slot* slot ) {
+    return slot->wbuf_len || slot->writing || slot->direct;
+}
+
+/* Writes too large to queue are sent straight from the caller's
+ * buffers once everything queued before them has gone out. */
+static int mongo_uring_write_direct( mongo_uring_slot* slot, mongo_iovec* iov, int count ) {
+    mongo_uring* ring = slot->ring;
+    struct io_uring_sqe* sqe;
+    int sent;
+
+    while( mongo_uring_busy( slot ) && !slot->failed ) {
+        if( mongo_uring_wait( ring, 1 ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+    if( mongo_uring_check( slot ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    while( count ) {
+        if( ( sqe = mongo_uring_get_sqe( ring ) ) == NULL )
+            return MONGO_ERROR;
+        mongo_uring_prep( sqe, IORING_OP_WRITEV, slot, MONGO_URING_DIRECT,
+                          iov, count > MONGO_IOV_MAX ? MONGO_IOV_MAX : count );
+        mongo_uring_push( ring );
+        slot->direct = 1;
+
+        while( slot->direct ) {
+            if( mongo_uring_wait( ring, 1 ) != MONGO_OK )
+                return MONGO_ERROR;
+        }
+
+        if( ( sent = slot->direct_res ) <= 0 )
+            return MONGO_ERROR;
+
+        while( count && sent >= (int)iov->iov_len ) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if( count ) {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_uring_writev( mongo_connection* conn, mongo_iovec* iov, int count, int reply_follows ) {
+    mongo_uring_slot* slot = conn->uring;
+    mongo_uring* ring = slot->ring;
+    int total = 0;
+    int i;
+
+    if( mongo_uring_check( slot ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    for( i=0; i<count; i++ )
+        total += iov[i].iov_len;
+
+    if( total > MONGO_URING_WRITE_BUFFER_SIZE ) {
+        if( mongo_uring_write_direct( slot, iov, count ) != MONGO_OK ) {
+            conn->err = MONGO_IO_ERROR;
+            return MONGO_ERROR;
+        }
+        return MONGO_OK;
+    }
+
+    /* Make room behind whatever is queued or in flight. */
+    while( MONGO_URING_WRITE_BUFFER_SIZE - slot->wbuf_len < total ) {
+        if( !slot->writing && slot->wbuf_sent ) {
+            memmove( slot->wbuf, slot->wbuf + slot->wbuf_sent, slot->wbuf_len - slot->wbuf_sent );
+            slot->wbuf_len -= slot->wbuf_sent;
+            slot->wbuf_sent = 0;
+        }
+        else if( mongo_uring_wait( ring, 1 ) != MONGO_OK ) {
+            conn->err = MONGO_IO_ERROR;
+            return MONGO_ERROR;
+        }
+        else if( mongo_uring_check( slot ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    for( i=0; i<count; i++ ) {
+        memcpy( slot->wbuf + slot->wbuf_len, iov[i].iov_base, iov[i].iov_len );
+        slot->wbuf_len += iov[i].iov_len;
+    }
+
+    /* The read of the reply submits the write along with it. */
+    if( reply_follows || ( ring->flags & MONGO_URING_DEFER ) )
+        return MONGO_OK;
+
+    if( mongo_uring_wait( ring, 0 ) != MONGO_OK ) {
+        conn->err = MONGO_IO_ERROR;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_uring_recv( mongo_connection* conn, char* buf, int len ) {
+    mongo_uring_slot* slot = conn->uring;
+    mongo_uring* ring = slot->ring;
+    struct io_uring_sqe* sqe;
+    int remaining;
+
+    if( ( remaining = mongo_conn_remaining_ms( conn ) ) == 0 ) {
+        mongo_conn_timed_out( conn );
+        return -1;
+    }
+
+    if( mongo_uring_check( slot ) != MONGO_OK ||
+        mongo_uring_reserve( ring, 2 ) != MONGO_OK ||
+        ( sqe = mongo_uring_get_sqe( ring ) ) == NULL )
+        return -1;
+
+    if( buf >= slot->rbuf && buf + len <= slot->rbuf + MONGO_READ_BUFFER_SIZE ) {
+        mongo_uring_prep( sqe, IORING_OP_READ_FIXED, slot, MONGO_URING_READ, buf, len );
+        sqe->buf_index = 0;
+    }
+    else
+        mongo_uring_prep( sqe, IORING_OP_RECV, slot, MONGO_URING_READ, buf, len );
+
+    /* Bound the read by what is left of the operation's deadline. */
+    if( remaining > 0 ) {
+        sqe->flags |= IOSQE_IO_LINK;
+        mongo_uring_push( ring );
+
+        slot->timeout[0] = remaining / 1000;
+        slot->timeout[1] = (int64_t)( remaining % 1000 ) * 1000000;
+        sqe = mongo_uring_get_sqe( ring );
+        mongo_uring_prep( sqe, IORING_OP_LINK_TIMEOUT, slot, MONGO_URING_TIMEOUT, slot->timeout, 1 );
+    }
+    mongo_uring_push( ring );
+    slot->reading = 1;
+
+    while( slot->reading ) {
+        if( mongo_uring_wait( ring, 1 ) != MONGO_OK )
+            return -1;
+    }
+
+    if( slot->read_res == -ECANCELED && remaining > 0 ) {
+        mongo_conn_timed_out( conn );
+        return -1;
+    }
+
+    if( mongo_uring_check( slot ) != MONGO_OK || slot->read_res < 0 )
+        return -1;
+
+    return slot->read_res;
+}
+
+void mongo_uring_drain( mongo_connection* conn ) {
+    mongo_uring_slot* slot = conn->uring;
+
+    while( mongo_uring_busy( slot ) && !slot->failed ) {
+        if( mongo_uring_wait( slot->ring, 1 ) != MONGO_OK )
+            break;
+    }
+
+    slot->wbuf_len = slot->wbuf_sent = 0;
+    slot->failed = 0;
+}
+
+static void mongo_uring_release( mongo_uring* ring ) {
+    if( ring->sqes )
+        munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_map && ring->cq_map != ring->sq_map )
+        munmap( ring->cq_map, ring->cq_map_size );
+    if( ring->sq_map )
+        munmap( ring->sq_map, ring->sq_map_size );
+    if( ring->fd >= 0 )
+        close( ring->fd );
+
+    free( ring->buffers );
+    free( ring->slots );
+    memset( ring, 0, sizeof( *ring ) );
+    ring->fd = -1;
+}
+
+static void* mongo_uring_map( mongo_uring* ring, int size, unsigned long offset ) {
+    void* p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, offset );
+    return p == MAP_FAILED ? NULL : p;
+}
+
+int mongo_uring_init( mongo_uring* ring, int max_conns, int flags ) {
+    const int slot_size = MONGO_READ_BUFFER_SIZE + MONGO_URING_WRITE_BUFFER_SIZE;
+    struct io_uring_params p;
+    struct iovec region;
+    char* sq;
+    char* cq;
+    int i;
+
+    memset( ring, 0, sizeof( *ring ) );
+    if( max_conns < 1 )
+        max_conns = 1;
+
+    /* Each connection has at most a write, a read and its timer in flight. */
+    memset( &p, 0, sizeof( p ) );
+    ring->fd = (int)syscall( __NR_io_uring_setup, 4 * max_conns, &p );
+    if( ring->fd < 0 ) {
+        ring->fd = -1;
+        return MONGO_ERROR;
+    }
+    ring->flags = flags;
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    if( ( p.features & IORING_FEAT_SINGLE_MMAP ) && ring->cq_map_size > ring->sq_map_size )
+        ring->sq_map_size = ring->cq_map_size;
+
+    if( ( ring->sq_map = mongo_uring_map( ring, ring->sq_map_size, IORING_OFF_SQ_RING ) ) == NULL )
+        goto fail;
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+        ring->cq_map = ring->sq_map;
+    else if( ( ring->cq_map = mongo_uring_map( ring, ring->cq_map_size, IORING_OFF_CQ_RING ) ) == NULL )
+        goto fail;
+
+    ring->sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+    if( ( ring->sqes = mongo_uring_map( ring, ring->sqes_size, IORING_OFF_SQES ) ) == NULL )
+        goto fail;
+
+    sq = (char*)ring->sq_map;
+    cq = (char*)ring->cq_map;
+    ring->sq_head = (unsigned*)( sq + p.sq_off.head );
+    ring->sq_tail = (unsigned*)( sq + p.sq_off.tail );
+    ring->sq_mask = (unsigned*)( sq + p.sq_off.ring_mask );
+    ring->sq_entries = (unsigned*)( sq + p.sq_off.ring_entries );
+    ring->sq_array = (unsigned*)( sq + p.sq_off.array );
+    ring->cq_head = (unsigned*)( cq + p.cq_off.head );
+    ring->cq_tail = (unsigned*)( cq + p.cq_off.tail );
+    ring->cq_mask = (unsigned*)( cq + p.cq_off.ring_mask );
+    ring->cqes = cq + p.cq_off.cqes;
+
+    /* One region holds every slot's read and write buffers, so the
+     * fixed reads and writes all use buffer index 0. */
+    ring->buffers = (char*)bson_malloc( max_conns * slot_size );
+    region.iov_base = ring->buffers;
+    region.iov_len = max_conns * slot_size;
+    if( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &region, 1 ) == -1 )
+        goto fail;
+
+    ring->slots = (mongo_uring_slot*)bson_malloc( max_conns * sizeof( mongo_uring_slot ) );
+    memset( ring->slots, 0, max_conns * sizeof( mongo_uring_slot ) );
+    for( i=0; i<max_conns; i++ ) {
+        ring->slots[i].ring = ring;
+        ring->slots[i].rbuf = ring->buffers + i * slot_size;
+        ring->slots[i].wbuf = ring->slots[i].rbuf + MONGO_READ_BUFFER_SIZE;
+    }
+    ring->num_slots = max_conns;
+
+    return MONGO_OK;
+
+fail:
+    mongo_uring_release( ring );
+    return MONGO_ERROR;
+}
+
+int mongo_uring_attach( mongo_uring* ring, mongo_connection* conn ) {
+    mongo_uring_slot* slot = NULL;
+    int buffered = 0;
+    int i;
+
+    if( conn->uring && conn->uring->ring == ring )
+        return MONGO_OK;
+
+    for( i=0; i<ring->num_slots && !slot; i++ ) {
+        if( !ring->slots[i].conn )
+            slot = ring->slots + i;
+    }
+    if( !slot )
+        return MONGO_ERROR;
+
+    mongo_uring_detach( conn );
+
+    /* Carry over anything already read ahead. */
+    if( conn->rbuf ) {
+        buffered = conn->rbuf_end - conn->rbuf_start;
+        memcpy( slot->rbuf, conn->rbuf + conn->rbuf_start, buffered );
+        free( conn->rbuf );
+    }
+    conn->rbuf = slot->rbuf;
+    conn->rbuf_start = 0;
+    conn->rbuf_end = buffered;
+
+    slot->conn = conn;
+    slot->wbuf_len = slot->wbuf_sent = 0;
+    slot->writing = slot->direct = slot->reading = 0;
+    slot->failed = 0;
+    conn->uring = slot;
+
+    /* io_uring waits on the socket itself. */
+    if( conn->connected )
+        mongo_conn_set_io_mode( conn );
+
+    return MONGO_OK;
+}
+
+void mongo_uring_detach( mongo_connection* conn ) {
+    mongo_uring_slot* slot = conn->uring;
+    int buffered;
+
+    if( !slot )
+        return;
+
+    mongo_uring_drain( conn );
+
+    buffered = conn->rbuf_end - conn->rbuf_start;
+    if( buffered ) {
+        conn->rbuf = (char*)bson_malloc( MONGO_READ_BUFFER_SIZE );
+        memcpy( conn->rbuf, slot->rbuf + conn->rbuf_start, buffered );
+    }
+    else
+        conn->rbuf = NULL;
+    conn->rbuf_start = 0;
+    conn->rbuf_end = buffered;
+
+    slot->conn = NULL;
+    conn->uring = NULL;
+
+    if( conn->connected )
+        mongo_conn_set_io_mode( conn );
+}
+
+int mongo_uring_flush( mongo_uring* ring ) {
+    int res = MONGO_OK;
+    int i;
+
+    for( i=0; i<ring->num_slots; i++ ) {
+        mongo_uring_slot* slot = ring->slots + i;
+        if( !slot->conn )
+            continue;
+
+        while( mongo_uring_busy( slot ) && !slot->failed ) {
+            if( mongo_uring_wait( ring, 1 ) != MONGO_OK )
+                return MONGO_ERROR;
+        }
+        if( mongo_uring_check( slot ) != MONGO_OK )
+            res = MONGO_ERROR;
+    }
+
+    return res;
+}
+
+void mongo_uring_destroy( mongo_uring* ring ) {
+    int i;
+
+    for( i=0; i<ring->num_slots; i++ ) {
+        if( ring->slots[i].conn )
+            mongo_uring_detach( ring->slots[i].conn );
+    }
+
+    mongo_uring_release( ring );
+}
+
+#else
+
+/* Built without io_uring: rings can't be created and connections keep
+ * using plain socket calls. */
+
+int mongo_uring_init( mongo_uring* ring, int max_conns, int flags ) {
+    memset( ring, 0, sizeof( *ring ) );
+    ring->fd = -1;
+    return MONGO_ERROR;
+}
+
+int mongo_uring_attach( mongo_uring* ring, mongo_connection* conn ) {
+    return MONGO_ERROR;
+}
+
+void mongo_uring_detach( mongo_connection* conn ) {
+}
+
+int mongo_uring_flush( mongo_uring* ring ) {
+    return MONGO_OK;
+}
+
+void mongo_uring_destroy( mongo_uring* ring ) {
+}
+
+int mongo_uring_writev( mongo_connection* conn, mongo_iovec* iov, int count, int reply_follows ) {
+    conn->err = MONGO_IO_ERROR;
+    return MONGO_ERROR;
+}
+
+int mongo_uring_recv( mongo_connection* conn, char* buf, int len ) {
+    return -1;
+}
+
+void mongo_uring_drain( mongo_connection* conn ) {
+}
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * @file uring.h
+ * @brief io_uring transport for blocking connections (Linux).
+ */
+
+/*    Copyright 2009-2011 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef _MONGO_URING_H_
+#define _MONGO_URING_H_
+
+#include "mongo.h"
+
+MONGO_EXTERN_C_START
+
+/**
+ * Ring flag: keep writes that expect no reply queued until the next
+ * submission on the ring, from any attached connection, or until
+ * mongo_uring_flush. Without it every such write is submitted at once.
+ */
+#define MONGO_URING_DEFER 1
+
+struct mongo_uring;
+
+typedef struct mongo_uring_slot {
+    struct mongo_uring* ring;
+    mongo_connection* conn;   /**< Attached connection, or NULL if the slot is free. */
+    char* rbuf;               /**< Registered read-ahead buffer lent to conn. */
+    char* wbuf;               /**< Registered buffer holding queued writes. */
+    int wbuf_len;             /**< Bytes queued in wbuf. */
+    int wbuf_sent;            /**< Bytes of wbuf the kernel has written. */
+    int writing;              /**< Whether a write from wbuf is in flight. */
+    int direct;               /**< Whether a write of caller data is in flight. */
+    int direct_res;
+    int reading;              /**< Whether a read is in flight. */
+    int read_res;
+    int failed;               /**< A queued write failed; reported by the next operation. */
+    int64_t timeout[2];       /**< Read timeout handed to the kernel. */
+} mongo_uring_slot;
+
+typedef struct mongo_uring {
+    int fd;                   /**< io_uring descriptor. */
+    int flags;                /**< MONGO_URING_DEFER or 0. */
+
+    void* sq_map;             /**< Submission queue ring. */
+    int sq_map_size;
+    void* cq_map;             /**< Completion queue ring; may equal sq_map. */
+    int cq_map_size;
+    void* sqes;               /**< Submission queue entries. */
+    int sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_entries;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    unsigned to_submit;       /**< Entries prepared but not yet handed to the kernel. */
+
+    char* buffers;            /**< Registered storage backing every slot's buffers. */
+    mongo_uring_slot* slots;
+    int num_slots;
+} mongo_uring;
+
+/**
+ * Create a ring that up to max_conns connections can share. Reads and
+ * queued writes go through buffers registered with the kernel once, so
+ * the kernel does not map pages for each operation.
+ *
+ * A ring, like a connection, must only be used by one thread at a time.
+ *
+ * @param flags MONGO_URING_DEFER or 0.
+ *
+ * @return MONGO_OK, or MONGO_ERROR when io_uring is unavailable: the
+ *     driver was built without it, or the kernel lacks or forbids it.
+ *     Connections then keep using plain socket calls.
+ */
+int mongo_uring_init( mongo_uring* ring, int max_conns, int flags );
+
+/**
+ * Move a connected mongo_connection's I/O onto the ring. The connection
+ * stays attached across reconnects until mongo_uring_detach or
+ * mongo_destroy. Do not also hand it to an async loop.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if every slot is taken, in which
+ *     case the connection keeps using plain socket calls.
+ */
+int mongo_uring_attach( mongo_uring* ring, mongo_connection* conn );
+
+/**
+ * Write out anything the connection has queued and return it to plain
+ * socket calls.
+ */
+void mongo_uring_detach( mongo_connection* conn );
+
+/**
+ * Submit the queued writes of every attached connection with a single
+ * syscall and wait until they have been written.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if a write failed; the err field of
+ *     each affected connection is set.
+ */
+int mongo_uring_flush( mongo_uring* ring );
+
+/**
+ * Detach any remaining connections and release the ring.
+ */
+void mongo_uring_destroy( mongo_uring* ring );
+
+MONGO_EXTERN_C_END
+#endif
@@ -0,0 +1,200 @@
+/* async.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "net.h"
+#include "async.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_CONNS 4
+#define NUM_DOCS 500
+
+static int inserted = 0;
+static int found = 0;
+static int commands = 0;
+
+static void on_insert( mongo_async_conn* aconn, int status, const mongo_reply* reply, void* arg ) {
+    ASSERT( status == MONGO_OK );
+    ASSERT( reply == NULL );
+    inserted++;
+}
+
+static void on_batch( mongo_async_conn* aconn, int status, const mongo_reply* reply, void* arg ) {
+    ASSERT( status == MONGO_OK );
+    found += reply->fields.num;
+
+    if( reply->fields.cursorID )
+        mongo_async_get_more( aconn, "test.async", reply->fields.cursorID, 0, on_batch, arg );
+}
+
+static void on_count( mongo_async_conn* aconn, int status, const mongo_reply* reply, void* arg ) {
+    bson out;
+    bson_iterator it;
+
+    ASSERT( status == MONGO_OK );
+    ASSERT( reply->fields.num == 1 );
+
+    bson_init( &out, (char*)&reply->objs, 0 );
+    ASSERT( bson_find( &it, &out, "n" ) );
+    ASSERT( bson_iterator_int( &it ) == *(int*)arg );
+    commands++;
+}
+
+static void on_status( mongo_async_conn* aconn, int status, const mongo_reply* reply, void* arg ) {
+    *(int*)arg = status == MONGO_OK ? 1 : -1;
+}
+
+static void read_message( int sock, char* buf, int* id ) {
+    int len, got, n;
+
+    for( got=0; got<16; got+=n )
+        ASSERT( ( n = recv( sock, buf + got, 16 - got, 0 ) ) > 0 );
+    bson_little_endian32( &len, buf );
+    bson_little_endian32( id, buf + 4 );
+    ASSERT( len <= 1024 );
+    for( ; got<len; got+=n )
+        ASSERT( ( n = recv( sock, buf + got, len - got, 0 ) ) > 0 );
+}
+
+/* A reply that arrives together with the close is still delivered; only
+ * the request left unanswered fails. */
+int test_reply_then_close( void ) {
+    mongo_connection conn[1];
+    mongo_async_conn aconn[1];
+    mongo_async_loop loop[1];
+    bson_buffer bb;
+    bson cmd, ok;
+    char buf[1024];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof( addr );
+    int listener, server;
+    int first = 0, second = 0;
+    int id, len, zero = 0, one = 1, op = 1;
+    int64_t cursor = 0;
+
+    /* Stand in for the server on an ephemeral loopback port. */
+    listener = socket( AF_INET, SOCK_STREAM, 0 );
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    ASSERT( bind( listener, (struct sockaddr*)&addr, sizeof( addr ) ) == 0 );
+    ASSERT( getsockname( listener, (struct sockaddr*)&addr, &addr_len ) == 0 );
+    ASSERT( listen( listener, 1 ) == 0 );
+    ASSERT( mongo_connect( conn, "127.0.0.1", ntohs( addr.sin_port ) ) == MONGO_OK );
+    ASSERT( ( server = accept( listener, NULL, NULL ) ) >= 0 );
+    mongo_close_socket( listener );
+    ASSERT( mongo_async_loop_init( loop ) == MONGO_OK );
+    ASSERT( mongo_async_conn_init( aconn, loop, conn ) == MONGO_OK );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "ping", 1 );
+    bson_from_buffer( &cmd, &bb );
+    ASSERT( mongo_async_run_command( aconn, "test", &cmd, on_status, &first ) == MONGO_OK );
+    ASSERT( mongo_async_run_command( aconn, "test", &cmd, on_status, &second ) == MONGO_OK );
+    mongo_async_loop_run_once( loop, 100 );
+
+    read_message( server, buf, &id );
+
+    bson_buffer_init( &bb );
+    bson_append_double( &bb, "ok", 1 );
+    bson_from_buffer( &ok, &bb );
+    len = 36 + bson_size( &ok );
+    bson_little_endian32( buf, &len );
+    bson_little_endian32( buf + 4, &one );
+    bson_little_endian32( buf + 8, &id );
+    bson_little_endian32( buf + 12, &op );
+    bson_little_endian32( buf + 16, &zero );
+    bson_little_endian64( buf + 20, &cursor );
+    bson_little_endian32( buf + 28, &zero );
+    bson_little_endian32( buf + 32, &one );
+    memcpy( buf + 36, ok.data, bson_size( &ok ) );
+    ASSERT( send( server, buf, len, 0 ) == len );
+    mongo_close_socket( server );
+
+    mongo_async_loop_run( loop );
+    ASSERT( first == 1 );
+    ASSERT( second == -1 );
+
+    /* The connection stays failed rather than queueing into the void. */
+    ASSERT( mongo_async_run_command( aconn, "test", &cmd, on_status, &first ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_IO_ERROR );
+    ASSERT( loop->pending == 0 );
+
+    bson_destroy( &cmd );
+    bson_destroy( &ok );
+    mongo_async_conn_destroy( aconn );
+    mongo_destroy( conn );
+    mongo_async_loop_destroy( loop );
+    return 0;
+}
+
+int main() {
+    mongo_connection conns[NUM_CONNS];
+    mongo_async_conn aconns[NUM_CONNS];
+    mongo_async_loop loop[1];
+    bson_buffer bb;
+    bson b, cmd;
+    int expected = NUM_DOCS;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    ASSERT( mongo_async_loop_init( loop ) == MONGO_OK );
+
+    for( i=0; i<NUM_CONNS; i++ ) {
+        if( mongo_connect( &conns[i], TEST_SERVER, 27017 ) != MONGO_OK ) {
+            printf( "failed to connect\n" );
+            exit( 1 );
+        }
+        ASSERT( mongo_async_conn_init( &aconns[i], loop, &conns[i] ) == MONGO_OK );
+    }
+
+    mongo_cmd_drop_collection( &conns[0], "test", "async", NULL );
+
+    /* Queue every insert before running the loop so they are batched. */
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_async_insert( &aconns[0], "test.async", &b, on_insert, NULL ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+
+    ASSERT( mongo_async_loop_run( loop ) == MONGO_OK );
+    ASSERT( inserted == NUM_DOCS );
+
+    bson_buffer_init( &bb );
+    bson_append_string( &bb, "count", "async" );
+    bson_from_buffer( &cmd, &bb );
+
+    /* Replies come back on the same connection the inserts went out on,
+     * so the count sees every document. */
+    ASSERT( mongo_async_run_command( &aconns[0], "test", &cmd, on_count, &expected ) == MONGO_OK );
+    ASSERT( mongo_async_loop_run( loop ) == MONGO_OK );
+
+    for( i=0; i<NUM_CONNS; i++ ) {
+        ASSERT( mongo_async_find( &aconns[i], "test.async", bson_empty( &b ), NULL,
+                                  0, 0, 0, on_batch, NULL ) == MONGO_OK );
+        ASSERT( mongo_async_run_command( &aconns[i], "test", &cmd, on_count, &expected ) == MONGO_OK );
+    }
+
+    ASSERT( mongo_async_loop_run( loop ) == MONGO_OK );
+    ASSERT( found == NUM_CONNS * NUM_DOCS );
+    ASSERT( commands == NUM_CONNS + 1 );
+
+    bson_destroy( &cmd );
+
+    for( i=0; i<NUM_CONNS; i++ ) {
+        mongo_async_conn_destroy( &aconns[i] );
+        if( i == 0 )
+            mongo_cmd_drop_collection( &conns[0], "test", "async", NULL );
+        mongo_destroy( &conns[i] );
+    }
+
+    mongo_async_loop_destroy( loop );
+
+    test_reply_then_close();
+    return 0;
+}
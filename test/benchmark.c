@@ -2,6 +2,7 @@
 
 #include "test.h"
 #include "mongo.h"
+#include "mock_server.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -147,7 +148,7 @@ static void single_insert_large_test(){
 static void index_insert_small_test(){
     int i;
     bson b;
-    ASSERT(mongo_create_simple_index(conn, DB ".index.small", "x", 0, NULL));
+    ASSERT(mongo_create_simple_index(conn, DB ".index.small", "x", 0, NULL) == MONGO_OK);
     for (i=0; i<PER_TRIAL; i++){
         make_small(&b, i);
         mongo_insert(conn, DB ".index.small", &b);
@@ -158,7 +159,7 @@ static void index_insert_small_test(){
 static void index_insert_medium_test(){
     int i;
     bson b;
-    ASSERT(mongo_create_simple_index(conn, DB ".index.medium", "x", 0, NULL));
+    ASSERT(mongo_create_simple_index(conn, DB ".index.medium", "x", 0, NULL) == MONGO_OK);
     for (i=0; i<PER_TRIAL; i++){
         make_medium(&b, i);
         mongo_insert(conn, DB ".index.medium", &b);
@@ -169,7 +170,7 @@ static void index_insert_medium_test(){
 static void index_insert_large_test(){
     int i;
     bson b;
-    ASSERT(mongo_create_simple_index(conn, DB ".index.large", "x", 0, NULL));
+    ASSERT(mongo_create_simple_index(conn, DB ".index.large", "x", 0, NULL) == MONGO_OK);
     for (i=0; i<PER_TRIAL; i++){
         make_large(&b, i);
         mongo_insert(conn, DB ".index.large", &b);
@@ -243,7 +244,7 @@ static void find_one(const char* ns){
     int i;
     for (i=0; i < PER_TRIAL; i++){
         make_query(&b);
-        ASSERT(mongo_find_one(conn, ns, &b, NULL, NULL));
+        ASSERT(mongo_find_one(conn, ns, &b, NULL, NULL) == MONGO_OK);
         bson_destroy(&b);
     }
 }
@@ -265,7 +266,7 @@ static void find(const char* ns){
         cursor = mongo_find(conn, ns, &b, NULL, 0,0,0);
         ASSERT(cursor);
 
-        while(mongo_cursor_next(cursor))
+        while(mongo_cursor_next(cursor) == MONGO_OK)
         {}
 
         mongo_cursor_destroy(cursor);
@@ -301,7 +302,7 @@ static void find_range(const char* ns){
         cursor = mongo_find(conn, ns, &b, NULL, 0,0,0);
         ASSERT(cursor);
 
-        while(mongo_cursor_next(cursor)) {
+        while(mongo_cursor_next(cursor) == MONGO_OK) {
             j++;
         }
         ASSERT(j == BATCH_SIZE-1);
@@ -352,7 +353,7 @@ static void time_it(nullary func, const char* name, bson_bool_t gle){
 
 static void clean(){
     bson b;
-    if (!mongo_cmd_drop_db(conn, DB)){
+    if (mongo_cmd_drop_db(conn, DB) != MONGO_OK){
         printf("failed to drop db\n");
         exit(1);
     }
@@ -362,10 +363,19 @@ static void clean(){
     ASSERT(!mongo_cmd_get_last_error(conn, DB, NULL));
 }
 
-int main(){
+int main(int argc, char** argv){
+    mock_server server[1];
+    int mock = argc > 1 && !strcmp(argv[1], "--mock");
+
     INIT_SOCKETS_FOR_WINDOWS;
 
-    if (mongo_connect( conn, TEST_SERVER, 27017 )){
+    /* With --mock, run against an in-process server to time the driver alone. */
+    if (mock){
+        if (mock_server_start(server) != MONGO_OK || mock_server_connect(server, conn) != MONGO_OK){
+            printf("failed to start the mock server\n");
+            exit(1);
+        }
+    } else if (mongo_connect( conn, TEST_SERVER, 27017 )){
         printf("failed to connect\n");
         exit(1);
     }
@@ -423,6 +433,8 @@ int main(){
 
 
     mongo_destroy(conn);
+    if (mock)
+        mock_server_stop(server);
 
     return 0;
 }
@@ -0,0 +1,119 @@
+/* bulk.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 2000
+
+static mongo_connection conn[1];
+static char padding[1024];
+
+static void queue_insert( mongo_bulk* bulk, int id ) {
+    bson_buffer bb;
+    bson b;
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", id );
+    bson_append_string( &bb, "padding", padding );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_bulk_insert( bulk, &b ) >= 0 );
+    bson_destroy( &b );
+}
+
+int test_split_and_results( void ) {
+    mongo_bulk bulk[1];
+    bson_buffer bb;
+    bson cond, op;
+    int i;
+
+    mongo_cmd_drop_collection( conn, "test", "bulk", NULL );
+    mongo_bulk_init( bulk, conn, "test.bulk", 1 );
+
+    /* About 2MB of inserts, well past the server's message size. */
+    for( i=0; i<NUM_DOCS; i++ )
+        queue_insert( bulk, i );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", 7 );
+    bson_from_buffer( &cond, &bb );
+    bson_buffer_init( &bb );
+    bson_append_start_object( &bb, "$set" );
+    bson_append_int( &bb, "seven", 1 );
+    bson_append_finish_object( &bb );
+    bson_from_buffer( &op, &bb );
+
+    ASSERT( mongo_bulk_update( bulk, &cond, &op, 0 ) == NUM_DOCS );
+    ASSERT( mongo_bulk_remove( bulk, &cond ) == NUM_DOCS + 1 );
+
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+    ASSERT( conn->max_msg_size > 0 );
+    ASSERT( bulk->n_errors == 0 );
+    ASSERT( bulk->n_inserted == NUM_DOCS );
+    ASSERT( bulk->n_matched == 1 );
+    ASSERT( bulk->n_removed == 1 );
+    ASSERT( mongo_count( conn, "test", "bulk", NULL ) == NUM_DOCS - 1 );
+
+    bson_destroy( &cond );
+    bson_destroy( &op );
+    mongo_bulk_destroy( bulk );
+    return 0;
+}
+
+int test_errors( int ordered ) {
+    mongo_bulk bulk[1];
+    int i;
+
+    mongo_cmd_drop_collection( conn, "test", "bulk", NULL );
+    mongo_bulk_init( bulk, conn, "test.bulk", ordered );
+
+    for( i=0; i<NUM_DOCS; i++ )
+        queue_insert( bulk, i == NUM_DOCS / 2 ? 0 : i );
+
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( bulk->n_errors == 1 );
+    ASSERT( bulk->errors[0].code == 11000 );
+    ASSERT( bulk->errors[0].index <= NUM_DOCS / 2 );
+    ASSERT( bulk->errors[0].index + bulk->errors[0].count > NUM_DOCS / 2 );
+
+    /* Ordered stops at the duplicate; unordered inserts everything else. */
+    if( ordered )
+        ASSERT( mongo_count( conn, "test", "bulk", NULL ) == NUM_DOCS / 2 );
+    else
+        ASSERT( mongo_count( conn, "test", "bulk", NULL ) == NUM_DOCS - 1 );
+
+    /* The bulk can be refilled after an execute. */
+    queue_insert( bulk, NUM_DOCS );
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+    ASSERT( bulk->n_inserted == 1 );
+
+    mongo_bulk_destroy( bulk );
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    memset( padding, 'x', sizeof( padding ) - 1 );
+
+    test_split_and_results();
+
+    /* Shrink the message size so that the duplicate lands mid-stream. */
+    mongo_cmd_ismaster( conn, NULL );
+    conn->max_msg_size = 64 * 1024;
+    test_errors( 1 );
+    test_errors( 0 );
+
+    mongo_cmd_drop_collection( conn, "test", "bulk", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* coalesce.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "coalesce.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_DOCS 1050
+
+static mongo_connection conn[1];
+
+static void insert_docs( mongo_coalescer* c, int n ) {
+    bson_buffer bb;
+    bson b;
+    int i;
+
+    for( i=0; i<n; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_coalescer_insert( c, &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+}
+
+int test_thresholds( void ) {
+    mongo_coalescer c[1];
+
+    mongo_cmd_drop_collection( conn, "test", "coalesce", NULL );
+
+    mongo_coalescer_init( c, conn, "test.coalesce" );
+    mongo_coalescer_set_limits( c, 1024 * 1024, 100, 0 );
+
+    insert_docs( c, NUM_DOCS );
+    ASSERT( c->flushes == NUM_DOCS / 100 );
+    ASSERT( c->count == NUM_DOCS % 100 );
+
+    /* The barrier writes the remainder and waits for all of it. */
+    ASSERT( mongo_coalescer_barrier( c ) == MONGO_OK );
+    ASSERT( c->flushes == NUM_DOCS / 100 + 1 );
+    ASSERT( c->flushed_docs == NUM_DOCS );
+    ASSERT( mongo_count( conn, "test", "coalesce", NULL ) == NUM_DOCS );
+
+    /* A byte threshold splits batches too. */
+    mongo_coalescer_set_limits( c, 1024, 100000, 0 );
+    insert_docs( c, 200 );
+    ASSERT( c->flushes > NUM_DOCS / 100 + 1 );
+    ASSERT( c->buf_len < 1024 );
+
+    mongo_coalescer_destroy( c );
+    ASSERT( mongo_count( conn, "test", "coalesce", NULL ) == NUM_DOCS + 200 );
+
+    /* Nothing is confirmed once the connection is gone. */
+    mongo_coalescer_init( c, conn, "test.coalesce" );
+    mongo_disconnect( conn );
+    ASSERT( mongo_coalescer_barrier( c ) == MONGO_ERROR );
+    mongo_coalescer_destroy( c );
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    return 0;
+}
+
+int test_flush_thread( void ) {
+    mongo_coalescer c[1];
+    time_t start;
+    int64_t flushes = 0;
+
+    mongo_cmd_drop_collection( conn, "test", "coalesce", NULL );
+
+    mongo_coalescer_init( c, conn, "test.coalesce" );
+    mongo_coalescer_set_limits( c, 1024 * 1024, 100000, 20 );
+    ASSERT( mongo_coalescer_start( c ) == MONGO_OK );
+
+    insert_docs( c, 10 );
+
+    /* The deadline flushes without any further inserts. */
+    start = time( NULL );
+    while( !flushes && time( NULL ) - start < 5 ) {
+        mongo_mutex_lock( &c->mutex );
+        flushes = c->flushes;
+        mongo_mutex_unlock( &c->mutex );
+    }
+    ASSERT( flushes == 1 );
+
+    insert_docs( c, 10 );
+    ASSERT( mongo_coalescer_stop( c ) == MONGO_OK );
+    ASSERT( c->flushed_docs == 20 );
+    ASSERT( mongo_count( conn, "test", "coalesce", NULL ) == 20 );
+
+    mongo_coalescer_destroy( c );
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    test_thresholds();
+    test_flush_thread();
+
+    mongo_cmd_drop_collection( conn, "test", "coalesce", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
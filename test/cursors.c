@@ -65,6 +65,92 @@ int test_multiple_getmore( mongo_connection *conn ) {
     return 0;
 }
 
+int test_exhaust( mongo_connection *conn ) {
+    mongo_cursor *cursor;
+    bson b;
+    int count;
+
+    insert_sample_data( conn, 10000 );
+
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 0, 0, MONGO_EXHAUST );
+
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK )
+        count++;
+
+    ASSERT( count == 10000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+
+    /* Destroying mid-stream leaves the connection usable. */
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 0, 0, MONGO_EXHAUST );
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( cursor->reply->fields.cursorID );
+    ASSERT( mongo_cursor_destroy( cursor ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 10000 );
+
+    remove_sample_data( conn );
+    return 0;
+}
+
+int test_batch_size_and_limit( mongo_connection *conn ) {
+    mongo_cursor *cursor;
+    bson b;
+    int count, max_batch;
+
+    insert_sample_data( conn, 10000 );
+
+    /* nToReturn is a limit that holds across get_mores. */
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 250, 0, 0 );
+    mongo_cursor_set_batch_size( cursor, 100 );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( count < 250 || cursor->reply->fields.num <= 100 );
+        count++;
+    }
+    ASSERT( count == 250 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 0, 0, 0 );
+    mongo_cursor_set_batch_size( cursor, 1000 );
+    mongo_cursor_set_limit( cursor, 2500 );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( cursor->reply->fields.num <= 1000 );
+        count++;
+    }
+    ASSERT( count == 2500 );
+    mongo_cursor_destroy( cursor );
+
+    /* A limit below the first batch stops inside that batch. */
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 0, 0, 0 );
+    mongo_cursor_set_limit( cursor, 10 );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK )
+        count++;
+    ASSERT( count == 10 );
+    ASSERT( cursor->reply->fields.num > 10 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+
+    /* Adaptive batches grow past the default first batch. */
+    cursor = mongo_find( conn, "test.cursors", bson_empty( &b ), bson_empty( &b ), 0, 0, 0 );
+    mongo_cursor_set_target_reply_size( cursor, 256 * 1024 );
+    count = max_batch = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( cursor->reply->fields.num > max_batch )
+            max_batch = cursor->reply->fields.num;
+        count++;
+    }
+    ASSERT( count == 10000 );
+    ASSERT( max_batch > 1000 );
+    mongo_cursor_destroy( cursor );
+
+    remove_sample_data( conn );
+    return 0;
+}
+
 int test_tailable( mongo_connection *conn ) {
     mongo_cursor *cursor;
     bson_buffer bb;
@@ -125,6 +211,8 @@ int main() {
 
     remove_sample_data( conn );
     test_multiple_getmore( conn );
+    test_exhaust( conn );
+    test_batch_size_and_limit( conn );
     test_tailable( conn );
 
     return 0;
@@ -0,0 +1,121 @@
+/* kill_cursors.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 20
+
+static mongo_connection conn[1];
+static mongo_connection observer[1];
+
+static int open_cursors( void ) {
+    bson out, cursors;
+    bson_iterator it;
+    int n;
+
+    ASSERT( mongo_simple_int_command( observer, "admin", "serverStatus", 1, &out ) == MONGO_OK );
+    ASSERT( bson_find( &it, &out, "cursors" ) );
+    bson_iterator_subobject( &it, &cursors );
+    ASSERT( bson_find( &it, &cursors, "totalOpen" ) );
+    n = bson_iterator_int( &it );
+    bson_destroy( &out );
+
+    return n;
+}
+
+/* Open cursors, reading one document from each so the server holds the
+ * rest. Opening goes over the wire and would carry any queued ids. */
+static void open_some( mongo_cursor** cursors, int count ) {
+    bson empty;
+    int i;
+
+    for( i=0; i<count; i++ ) {
+        cursors[i] = mongo_find( conn, "test.kill_cursors", bson_empty( &empty ), NULL, 2, 0, 0 );
+        ASSERT( cursors[i] );
+        ASSERT( mongo_cursor_next( cursors[i] ) == MONGO_OK );
+    }
+}
+
+static void destroy_some( mongo_cursor** cursors, int count ) {
+    int i;
+
+    for( i=0; i<count; i++ )
+        ASSERT( mongo_cursor_destroy( cursors[i] ) == MONGO_OK );
+}
+
+int main() {
+    bson_buffer bb;
+    bson b;
+    mongo_cursor* cursors[5];
+    int i, before;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ||
+        mongo_connect( observer, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "kill_cursors", NULL );
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.kill_cursors", &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+
+    before = open_cursors();
+
+    /* Destroying does no I/O; the ids wait on the connection. */
+    mongo_conn_set_kill_cursors_batch( conn, 100, 60000 );
+    open_some( cursors, 5 );
+    destroy_some( cursors, 5 );
+    ASSERT( conn->dead_cursor_count == 5 );
+    ASSERT( open_cursors() == before + 5 );
+
+    /* They go out ahead of the next request. */
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( conn->dead_cursor_count == 0 );
+    ASSERT( open_cursors() == before );
+
+    /* A full batch is sent by the destroy that fills it. */
+    mongo_conn_set_kill_cursors_batch( conn, 3, 60000 );
+    open_some( cursors, 3 );
+    destroy_some( cursors, 2 );
+    ASSERT( conn->dead_cursor_count == 2 );
+    ASSERT( open_cursors() == before + 3 );
+    destroy_some( cursors + 2, 1 );
+    ASSERT( conn->dead_cursor_count == 0 );
+    /* The kills have no reply; a round trip makes sure they were handled. */
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( open_cursors() == before );
+
+    /* An idle connection can be flushed by hand. */
+    open_some( cursors, 1 );
+    destroy_some( cursors, 1 );
+    ASSERT( open_cursors() == before + 1 );
+    ASSERT( mongo_conn_flush_kill_cursors( conn ) == MONGO_OK );
+    ASSERT( conn->dead_cursor_count == 0 );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( open_cursors() == before );
+    ASSERT( mongo_conn_flush_kill_cursors( conn ) == MONGO_OK );
+
+    /* A batch of one restores the old behaviour. */
+    mongo_conn_set_kill_cursors_batch( conn, 1, 0 );
+    open_some( cursors, 1 );
+    destroy_some( cursors, 1 );
+    ASSERT( conn->dead_cursor_count == 0 );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( open_cursors() == before );
+
+    mongo_cmd_drop_collection( conn, "test", "kill_cursors", NULL );
+    mongo_destroy( conn );
+    mongo_destroy( observer );
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/* mock.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "mock_server.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_DOCS 250
+
+static void insert_docs( mongo_connection* conn ) {
+    bson* docs[NUM_DOCS];
+    bson_buffer bb;
+    int i;
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_append_string( &bb, "parity", i % 2 ? "odd" : "even" );
+        docs[i] = (bson*)malloc( sizeof( bson ) );
+        bson_from_buffer( docs[i], &bb );
+    }
+    ASSERT( mongo_insert_batch( conn, "test.mock", docs, NUM_DOCS ) == MONGO_OK );
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_destroy( docs[i] );
+        free( docs[i] );
+    }
+}
+
+static int count_all( mongo_connection* conn, bson* query ) {
+    mongo_cursor* cursor = mongo_find( conn, "test.mock", query, NULL, 0, 0, 0 );
+    int n = 0;
+
+    ASSERT( cursor );
+    while( mongo_cursor_next( cursor ) == MONGO_OK )
+        n++;
+    mongo_cursor_destroy( cursor );
+    return n;
+}
+
+int main() {
+    mock_server server[1];
+    mongo_connection conn[1], tcp[1];
+    mongo_cursor* cursor;
+    bson_buffer bb;
+    bson b, out;
+    bson_iterator it;
+    time_t start;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    ASSERT( mock_server_start( server ) == MONGO_OK );
+    ASSERT( mock_server_connect( server, conn ) == MONGO_OK );
+    ASSERT( mongo_connect( tcp, "127.0.0.1", server->port ) == MONGO_OK );
+
+    ASSERT( mongo_cmd_ismaster( conn, NULL ) );
+    ASSERT( conn->max_bson_size == 16 * 1024 * 1024 );
+
+    insert_docs( conn );
+    ASSERT( mongo_insert_safe( conn, "test.mock", bson_empty( &b ), NULL ) == MONGO_OK );
+    ASSERT( server->inserts == 2 );
+    ASSERT( mongo_count( tcp, "test", "mock", NULL ) == NUM_DOCS + 1 );
+
+    /* Queries match on equality and ranges. */
+    bson_buffer_init( &bb );
+    bson_append_string( &bb, "parity", "odd" );
+    bson_append_start_object( &bb, "i" );
+    bson_append_int( &bb, "$gte", 10 );
+    bson_append_double( &bb, "$lt", 20 );
+    bson_append_finish_object( &bb );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_count( conn, "test", "mock", &b ) == 5 );
+    ASSERT( count_all( conn, &b ) == 5 );
+    bson_destroy( &b );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "i", 7 );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_find_one( tcp, "test.mock", &b, NULL, &out ) == MONGO_OK );
+    ASSERT( bson_find( &it, &out, "parity" ) && !strcmp( bson_iterator_string( &it ), "odd" ) );
+    bson_destroy( &out );
+    bson_destroy( &b );
+
+    /* Batches hold batch_size documents, or fewer past max_reply_bytes. */
+    server->batch_size = 10;
+    i = server->get_mores;
+    ASSERT( count_all( conn, bson_empty( &b ) ) == NUM_DOCS + 1 );
+    ASSERT( server->get_mores - i == NUM_DOCS / 10 );
+
+    server->batch_size = 101;
+    server->max_reply_bytes = 1000;
+    cursor = mongo_find( conn, "test.mock", bson_empty( &b ), NULL, 0, 0, 0 );
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( cursor->reply->head.len <= 1000 && cursor->reply->fields.num > 1 );
+    ASSERT( cursor->reply->fields.cursorID != 0 );
+    i = server->kill_cursors;
+    mongo_cursor_destroy( cursor );
+    ASSERT( mongo_conn_flush_kill_cursors( conn ) == MONGO_OK );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( server->kill_cursors == i + 1 && server->num_cursors == 0 );
+    server->max_reply_bytes = 4 * 1024 * 1024;
+
+    /* Injected latency delays every reply. */
+    server->latency_usec = 400 * 1000;
+    start = time( NULL );
+    for( i=0; i<5; i++ )
+        ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( time( NULL ) - start >= 1 );
+    server->latency_usec = 0;
+
+    ASSERT( mongo_cmd_drop_collection( conn, "test", "mock", NULL ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "mock", NULL ) == 0 );
+
+    /* Stopping returns with connections still open on the client side. */
+    mock_server_stop( server );
+    mongo_destroy( conn );
+    mongo_destroy( tcp );
+    return 0;
+}
@@ -0,0 +1,614 @@
+/* mock_server.c */
+
+/* nanosleep, socketpair */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "mock_server.h"
+#include "net.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MOCK_MAX_MESSAGE ( 48 * 1000 * 1000 )
+#define MOCK_CURSOR_NOT_FOUND 1
+
+typedef struct {
+    char* data;
+    int len;
+    int alloc;
+} mock_buf;
+
+typedef struct {
+    mock_server* server;
+    int sock;
+} mock_serve_arg;
+
+static void mock_buf_append( mock_buf* b, const void* data, int len ) {
+    if( b->len + len > b->alloc ) {
+        b->alloc = b->alloc ? b->alloc : 256;
+        while( b->len + len > b->alloc )
+            b->alloc *= 2;
+        b->data = (char*)bson_realloc( b->data, b->alloc );
+    }
+    memcpy( b->data + b->len, data, len );
+    b->len += len;
+}
+
+static void mock_buf_append32( mock_buf* b, int value ) {
+    char le[4];
+    bson_little_endian32( le, &value );
+    mock_buf_append( b, le, 4 );
+}
+
+static void mock_buf_append64( mock_buf* b, int64_t value ) {
+    char le[8];
+    bson_little_endian64( le, &value );
+    mock_buf_append( b, le, 8 );
+}
+
+static int mock_doc_size( const char* doc ) {
+    int size;
+    bson_little_endian32( &size, doc );
+    return size;
+}
+
+static void mock_sleep_usec( int usec ) {
+#ifdef _WIN32
+    Sleep( usec / 1000 );
+#else
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = ( usec % 1000000 ) * 1000;
+    nanosleep( &ts, NULL );
+#endif
+}
+
+/* Store */
+
+static mock_collection* mock_collection_find( mock_server* server, const char* ns, int create ) {
+    mock_collection* c;
+    int i;
+
+    for( i=0; i<server->num_collections; i++ )
+        if( !strcmp( server->collections[i].ns, ns ) )
+            return &server->collections[i];
+
+    if( !create || strlen( ns ) >= sizeof( c->ns ) )
+        return NULL;
+
+    server->collections = (mock_collection*)bson_realloc( server->collections,
+        ( server->num_collections + 1 ) * sizeof( mock_collection ) );
+    c = &server->collections[server->num_collections++];
+    memset( c, 0, sizeof( *c ) );
+    strcpy( c->ns, ns );
+    return c;
+}
+
+/* Drop the collection ns, or every collection of a database when ns is
+ * "db." */
+static void mock_collection_drop( mock_server* server, const char* ns ) {
+    int len = strlen( ns );
+    int prefix = len && ns[len - 1] == '.';
+    int i = 0;
+
+    while( i < server->num_collections ) {
+        mock_collection* c = &server->collections[i];
+        if( prefix ? !strncmp( c->ns, ns, len ) : !strcmp( c->ns, ns ) ) {
+            free( c->docs );
+            *c = server->collections[--server->num_collections];
+        } else
+            i++;
+    }
+}
+
+static void mock_cursor_remove( mock_server* server, int index ) {
+    free( server->cursors[index].docs );
+    server->cursors[index] = server->cursors[--server->num_cursors];
+}
+
+/* Matching */
+
+static int mock_number( const bson_iterator* it, double* out ) {
+    switch( bson_iterator_type( it ) ) {
+    case BSON_INT:
+    case BSON_LONG:
+    case BSON_DOUBLE:
+        *out = bson_iterator_double( it );
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int mock_value_matches( const bson_iterator* d, const bson_iterator* q ) {
+    double dn, qn;
+
+    if( bson_iterator_type( q ) == BSON_OBJECT ) {
+        bson_iterator op;
+        int ops = 0;
+
+        bson_iterator_init( &op, bson_iterator_value( q ) );
+        while( bson_iterator_next( &op ) ) {
+            const char* name = bson_iterator_key( &op );
+            if( name[0] != '$' )
+                break;
+            ops++;
+            if( !mock_number( d, &dn ) || !mock_number( &op, &qn ) )
+                return 0;
+            if( !strcmp( name, "$gt" ) ? !( dn > qn ) :
+                !strcmp( name, "$gte" ) ? !( dn >= qn ) :
+                !strcmp( name, "$lt" ) ? !( dn < qn ) :
+                !strcmp( name, "$lte" ) ? !( dn <= qn ) : 1 )
+                return 0;
+        }
+        if( ops )
+            return 1;
+    }
+
+    if( mock_number( d, &dn ) && mock_number( q, &qn ) )
+        return dn == qn;
+    if( bson_iterator_type( d ) != bson_iterator_type( q ) )
+        return 0;
+
+    switch( bson_iterator_type( q ) ) {
+    case BSON_STRING:
+        return !strcmp( bson_iterator_string( d ), bson_iterator_string( q ) );
+    case BSON_OID:
+        return !memcmp( bson_iterator_oid( d ), bson_iterator_oid( q ), 12 );
+    case BSON_BOOL:
+        return bson_iterator_bool( d ) == bson_iterator_bool( q );
+    default:
+        return 0;
+    }
+}
+
+static int mock_matches( const char* doc, const char* query ) {
+    bson_iterator q, d;
+    bson b;
+
+    bson_init( &b, (char*)doc, 0 );
+    bson_iterator_init( &q, query );
+    while( bson_iterator_next( &q ) ) {
+        if( bson_iterator_key( &q )[0] == '$' )
+            continue;
+        if( !bson_find( &d, &b, bson_iterator_key( &q ) ) ||
+            !mock_value_matches( &d, &q ) )
+            return 0;
+    }
+    return 1;
+}
+
+/* Copy the documents of ns matching query, after the first skip, to out,
+ * stopping after limit of them unless limit is 0. */
+static int mock_select( mock_server* server, const char* ns, const char* query,
+    int skip, int limit, mock_buf* out ) {
+
+    mock_collection* c = mock_collection_find( server, ns, 0 );
+    int offset, size, count = 0;
+
+    if( !c )
+        return 0;
+    for( offset=0; offset<c->len && ( !limit || count < limit ); offset+=size ) {
+        size = mock_doc_size( c->docs + offset );
+        if( !mock_matches( c->docs + offset, query ) )
+            continue;
+        if( skip ) {
+            skip--;
+            continue;
+        }
+        if( out )
+            mock_buf_append( out, c->docs + offset, size );
+        count++;
+    }
+    return count;
+}
+
+/* Replies */
+
+static void mock_reply_start( mock_server* server, mock_buf* reply, int responseTo,
+    int flags, int64_t cursor_id ) {
+
+    mock_buf_append32( reply, 0 );   /* length, set by mock_reply_finish */
+    mock_buf_append32( reply, ++server->replies );
+    mock_buf_append32( reply, responseTo );
+    mock_buf_append32( reply, 1 );   /* OP_REPLY */
+    mock_buf_append32( reply, flags );
+    mock_buf_append64( reply, cursor_id );
+    mock_buf_append32( reply, 0 );   /* starting from */
+    mock_buf_append32( reply, 0 );   /* number returned */
+}
+
+static void mock_reply_finish( mock_buf* reply, int64_t cursor_id, int num ) {
+    bson_little_endian32( reply->data, &reply->len );
+    bson_little_endian64( reply->data + 20, &cursor_id );
+    bson_little_endian32( reply->data + 32, &num );
+}
+
+/* Move up to n documents (any number if 0) of docs, from *offset, into
+ * the reply, as far as the reply size allows. */
+static int mock_reply_batch( mock_server* server, mock_buf* reply, const char* docs,
+    int len, int* offset, int n ) {
+
+    int num = 0, size;
+
+    if( !n )
+        n = server->batch_size;
+    while( *offset < len && num < n ) {
+        size = mock_doc_size( docs + *offset );
+        if( num && reply->len + size > server->max_reply_bytes )
+            break;
+        mock_buf_append( reply, docs + *offset, size );
+        *offset += size;
+        num++;
+    }
+    return num;
+}
+
+static void mock_reply_bson( mock_server* server, mock_buf* reply, int responseTo, bson* b ) {
+    mock_reply_start( server, reply, responseTo, 0, 0 );
+    mock_buf_append( reply, b->data, bson_size( b ) );
+    mock_reply_finish( reply, 0, 1 );
+    bson_destroy( b );
+}
+
+/* Requests */
+
+static void mock_command( mock_server* server, mock_buf* reply, int responseTo,
+    const char* ns, const char* query ) {
+
+    char db[128], target[256];
+    const char* name;
+    bson_buffer bb;
+    bson b, q;
+    bson_iterator it;
+    int len = strchr( ns, '.' ) - ns;
+
+    memcpy( db, ns, len );
+    db[len] = '\0';
+
+    bson_iterator_init( &it, query );
+    bson_iterator_next( &it );
+    name = bson_iterator_key( &it );
+    if( bson_iterator_type( &it ) == BSON_STRING &&
+        strlen( db ) + strlen( bson_iterator_string( &it ) ) + 2 <= sizeof( target ) )
+        sprintf( target, "%s.%s", db, bson_iterator_string( &it ) );
+    else
+        target[0] = '\0';
+
+    bson_buffer_init( &bb );
+    if( !strcmp( name, "ismaster" ) || !strcmp( name, "isMaster" ) ) {
+        bson_append_bool( &bb, "ismaster", 1 );
+        bson_append_int( &bb, "maxBsonObjectSize", 16 * 1024 * 1024 );
+        bson_append_int( &bb, "maxMessageSizeBytes", MOCK_MAX_MESSAGE );
+    } else if( !strcmp( name, "getlasterror" ) || !strcmp( name, "getLastError" ) ) {
+        bson_append_null( &bb, "err" );
+        bson_append_int( &bb, "n", 0 );
+    } else if( !strcmp( name, "count" ) ) {
+        bson_init( &q, (char*)query, 0 );
+        if( bson_find( &it, &q, "query" ) == BSON_OBJECT )
+            bson_append_double( &bb, "n", mock_select( server, target, bson_iterator_value( &it ), 0, 0, NULL ) );
+        else
+            bson_append_double( &bb, "n", mock_select( server, target, bson_empty( &q )->data, 0, 0, NULL ) );
+    } else if( !strcmp( name, "drop" ) ) {
+        mock_collection_drop( server, target );
+    } else if( !strcmp( name, "dropDatabase" ) ) {
+        strcat( db, "." );
+        mock_collection_drop( server, db );
+    }
+    bson_append_double( &bb, "ok", 1 );
+    bson_from_buffer( &b, &bb );
+
+    mock_reply_bson( server, reply, responseTo, &b );
+}
+
+static void mock_query( mock_server* server, mock_buf* reply, int responseTo,
+    const char* body ) {
+
+    const char* ns = body + 4;
+    const char* p = ns + strlen( ns ) + 1;
+    const char* query = p + 8;
+    mock_buf docs = { NULL, 0, 0 };
+    mock_cursor* cursor;
+    bson_iterator it;
+    bson q;
+    int skip, n, num, single, offset = 0;
+    int64_t id = 0;
+
+    bson_little_endian32( &skip, p );
+    bson_little_endian32( &n, p + 4 );
+    server->queries++;
+
+    if( strlen( ns ) > 5 && !strcmp( ns + strlen( ns ) - 5, ".$cmd" ) ) {
+        mock_command( server, reply, responseTo, ns, query );
+        return;
+    }
+
+    bson_init( &q, (char*)query, 0 );
+    if( bson_find( &it, &q, "$query" ) == BSON_OBJECT )
+        query = bson_iterator_value( &it );
+
+    /* A negative count or 1 asks for a single batch. */
+    single = n < 0 || n == 1;
+    mock_select( server, ns, query, skip, single ? ( n < 0 ? -n : n ) : 0, &docs );
+
+    mock_reply_start( server, reply, responseTo, 0, 0 );
+    num = mock_reply_batch( server, reply, docs.data, docs.len, &offset, n < 0 ? -n : n );
+
+    if( offset < docs.len && !single ) {
+        server->cursors = (mock_cursor*)bson_realloc( server->cursors,
+            ( server->num_cursors + 1 ) * sizeof( mock_cursor ) );
+        cursor = &server->cursors[server->num_cursors++];
+        cursor->id = id = ++server->next_cursor;
+        cursor->docs = docs.data;
+        cursor->len = docs.len;
+        cursor->offset = offset;
+    } else
+        free( docs.data );
+
+    mock_reply_finish( reply, id, num );
+}
+
+static void mock_get_more( mock_server* server, mock_buf* reply, int responseTo,
+    const char* body ) {
+
+    const char* p = body + 4 + strlen( body + 4 ) + 1;
+    mock_cursor* cursor;
+    int64_t id;
+    int n, num, i;
+
+    bson_little_endian32( &n, p );
+    bson_little_endian64( &id, p + 4 );
+    server->get_mores++;
+
+    for( i=0; i<server->num_cursors; i++ )
+        if( server->cursors[i].id == id )
+            break;
+    if( i == server->num_cursors ) {
+        mock_reply_start( server, reply, responseTo, MOCK_CURSOR_NOT_FOUND, 0 );
+        mock_reply_finish( reply, 0, 0 );
+        return;
+    }
+
+    cursor = &server->cursors[i];
+    mock_reply_start( server, reply, responseTo, 0, id );
+    num = mock_reply_batch( server, reply, cursor->docs, cursor->len, &cursor->offset, n < 0 ? -n : n );
+    if( cursor->offset == cursor->len ) {
+        mock_cursor_remove( server, i );
+        id = 0;
+    }
+    mock_reply_finish( reply, id, num );
+}
+
+static void mock_insert( mock_server* server, const char* body, int len ) {
+    const char* ns = body + 4;
+    const char* doc = ns + strlen( ns ) + 1;
+    const char* end = body + len;
+    mock_collection* c = mock_collection_find( server, ns, 1 );
+    int size;
+
+    server->inserts++;
+    if( !c )
+        return;
+
+    while( doc + 4 <= end && doc + ( size = mock_doc_size( doc ) ) <= end && size >= 5 ) {
+        if( c->len + size > c->alloc ) {
+            c->alloc = c->alloc ? c->alloc : 4096;
+            while( c->len + size > c->alloc )
+                c->alloc *= 2;
+            c->docs = (char*)bson_realloc( c->docs, c->alloc );
+        }
+        memcpy( c->docs + c->len, doc, size );
+        c->len += size;
+        c->count++;
+        doc += size;
+    }
+}
+
+static void mock_kill_cursors( mock_server* server, const char* body, int len ) {
+    int64_t id;
+    int n, i, j;
+
+    bson_little_endian32( &n, body + 4 );
+    server->kill_cursors++;
+    for( i=0; i<n && 8 + ( i + 1 ) * 8 <= len; i++ ) {
+        bson_little_endian64( &id, body + 8 + i * 8 );
+        for( j=0; j<server->num_cursors; j++ )
+            if( server->cursors[j].id == id ) {
+                mock_cursor_remove( server, j );
+                break;
+            }
+    }
+}
+
+/* Connections */
+
+static int mock_recv( int sock, char* buf, int len ) {
+    while( len > 0 ) {
+        int got = recv( sock, buf, len, 0 );
+        if( got <= 0 )
+            return -1;
+        buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int mock_send( int sock, const char* buf, int len ) {
+    while( len > 0 ) {
+        int sent = send( sock, buf, len, 0 );
+        if( sent <= 0 )
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static void* mock_serve( void* data ) {
+    mock_serve_arg* arg = (mock_serve_arg*)data;
+    mock_server* server = arg->server;
+    int sock = arg->sock;
+    mock_buf msg = { NULL, 0, 0 };
+    mock_buf reply = { NULL, 0, 0 };
+    mongo_header head;
+    int len, id, op;
+
+    free( arg );
+
+    while( mock_recv( sock, (char*)&head, sizeof( head ) ) == 0 ) {
+        bson_little_endian32( &len, &head.len );
+        bson_little_endian32( &id, &head.id );
+        bson_little_endian32( &op, &head.op );
+        if( len < (int)sizeof( head ) + 4 || len > MOCK_MAX_MESSAGE )
+            break;
+
+        len -= sizeof( head );
+        if( msg.alloc < len ) {
+            msg.data = (char*)bson_realloc( msg.data, len );
+            msg.alloc = len;
+        }
+        if( mock_recv( sock, msg.data, len ) != 0 )
+            break;
+
+        reply.len = 0;
+        mongo_mutex_lock( &server->mutex );
+        switch( op ) {
+        case MONGO_OP_QUERY:
+            mock_query( server, &reply, id, msg.data );
+            break;
+        case MONGO_OP_GET_MORE:
+            mock_get_more( server, &reply, id, msg.data );
+            break;
+        case MONGO_OP_INSERT:
+            mock_insert( server, msg.data, len );
+            break;
+        case MONGO_OP_KILL_CURSORS:
+            mock_kill_cursors( server, msg.data, len );
+            break;
+        default:
+            break;
+        }
+        mongo_mutex_unlock( &server->mutex );
+
+        if( reply.len ) {
+            if( server->latency_usec )
+                mock_sleep_usec( server->latency_usec );
+            if( mock_send( sock, reply.data, reply.len ) != 0 )
+                break;
+        }
+    }
+
+    free( msg.data );
+    free( reply.data );
+    return NULL;
+}
+
+static void mock_serve_socket( mock_server* server, int sock ) {
+    mock_serve_arg* arg = (mock_serve_arg*)bson_malloc( sizeof( mock_serve_arg ) );
+    mock_conn* conn;
+
+    arg->server = server;
+    arg->sock = sock;
+
+    mongo_mutex_lock( &server->mutex );
+    server->conns = (mock_conn*)bson_realloc( server->conns,
+        ( server->num_conns + 1 ) * sizeof( mock_conn ) );
+    conn = &server->conns[server->num_conns++];
+    conn->sock = sock;
+    mongo_thread_create( &conn->thread, mock_serve, arg );
+    mongo_mutex_unlock( &server->mutex );
+}
+
+static void* mock_accept( void* data ) {
+    mock_server* server = (mock_server*)data;
+    int sock;
+
+    while( 1 ) {
+        sock = accept( server->listen_sock, NULL, NULL );
+        if( server->stopping ) {
+            if( sock >= 0 )
+                mongo_close_socket( sock );
+            break;
+        }
+        if( sock >= 0 )
+            mock_serve_socket( server, sock );
+    }
+    return NULL;
+}
+
+int mock_server_start( mock_server* server ) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof( addr );
+
+    memset( server, 0, sizeof( *server ) );
+    server->batch_size = 101;
+    server->max_reply_bytes = 4 * 1024 * 1024;
+    mongo_mutex_init( &server->mutex );
+
+    server->listen_sock = socket( AF_INET, SOCK_STREAM, 0 );
+    if( server->listen_sock < 0 )
+        return MONGO_ERROR;
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = 0;
+    if( bind( server->listen_sock, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 ||
+        getsockname( server->listen_sock, (struct sockaddr*)&addr, &addr_len ) != 0 ||
+        listen( server->listen_sock, 64 ) != 0 ) {
+        mongo_close_socket( server->listen_sock );
+        return MONGO_ERROR;
+    }
+    server->port = ntohs( addr.sin_port );
+
+    mongo_thread_create( &server->accept_thread, mock_accept, server );
+    return MONGO_OK;
+}
+
+int mock_server_connect( mock_server* server, mongo_connection* conn ) {
+#ifdef _WIN32
+    return mongo_connect( conn, "127.0.0.1", server->port );
+#else
+    int socks[2];
+
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, socks ) != 0 )
+        return MONGO_ERROR;
+    mock_serve_socket( server, socks[1] );
+
+    /* A reconnect goes over loopback TCP. */
+    mongo_conn_adopt_socket( conn, socks[0], "127.0.0.1", server->port );
+    return MONGO_OK;
+#endif
+}
+
+void mock_server_stop( mock_server* server ) {
+    mongo_connection wake[1];
+    int i;
+
+    /* Wake the accept thread with a connection of our own. */
+    server->stopping = 1;
+    mongo_connect( wake, "127.0.0.1", server->port );
+    mongo_destroy( wake );
+    mongo_thread_join( server->accept_thread );
+    mongo_close_socket( server->listen_sock );
+
+    /* No more connections are added, so the list can be walked unlocked. */
+    for( i=0; i<server->num_conns; i++ )
+        shutdown( server->conns[i].sock, 2 );
+    for( i=0; i<server->num_conns; i++ ) {
+        mongo_thread_join( server->conns[i].thread );
+        mongo_close_socket( server->conns[i].sock );
+    }
+    free( server->conns );
+
+    for( i=0; i<server->num_collections; i++ )
+        free( server->collections[i].docs );
+    free( server->collections );
+    while( server->num_cursors )
+        mock_cursor_remove( server, 0 );
+    free( server->cursors );
+    mongo_mutex_destroy( &server->mutex );
+}
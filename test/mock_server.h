@@ -0,0 +1,91 @@
+/* mock_server.h */
+
+/* An in-process stand-in for mongod, so that tests and benchmarks can
+ * run without a server and measure the driver alone.
+ *
+ * It speaks OP_QUERY, OP_GET_MORE, OP_INSERT and OP_KILL_CURSORS and
+ * answers with OP_REPLY from an in-memory store. Commands understood are
+ * ismaster, getlasterror, count, drop and dropDatabase; any other command
+ * succeeds with { ok: 1 }. Queries match top-level fields by equality
+ * (numbers, strings, oids and booleans) or with $gt, $gte, $lt and $lte
+ * on numbers. Updates and removes are read and ignored. Every connection
+ * is served by a thread of its own. */
+
+#ifndef _MOCK_SERVER_H_
+#define _MOCK_SERVER_H_
+
+#include "mongo.h"
+#include "thread.h"
+
+typedef struct {
+    char ns[128];
+    char* docs;           /* Documents back to back. */
+    int len;
+    int alloc;
+    int count;
+} mock_collection;
+
+typedef struct {
+    int64_t id;
+    char* docs;           /* Copies of the documents not yet returned. */
+    int len;
+    int offset;
+} mock_cursor;
+
+typedef struct {
+    int sock;             /* The server's end. */
+    mongo_thread_t thread;
+} mock_conn;
+
+typedef struct {
+    /* Settings; change them before connecting. */
+    int batch_size;       /* Documents per batch when the client asks for any number; 101. */
+    int max_reply_bytes;  /* Documents stop being added to a reply past this size; 4MB. */
+    int latency_usec;     /* Delay before each reply is sent; 0. */
+
+    /* Counts of what was received and sent, for tests. */
+    int queries;
+    int get_mores;
+    int inserts;
+    int kill_cursors;
+    int replies;
+
+    int port;             /* Loopback port listened on, once started. */
+
+    int listen_sock;
+    mongo_thread_t accept_thread;
+    int stopping;
+
+    mongo_mutex_t mutex;  /* Guards everything below and the counts. */
+    mock_collection* collections;
+    int num_collections;
+    mock_cursor* cursors;
+    int num_cursors;
+    int64_t next_cursor;
+    mock_conn* conns;
+    int num_conns;
+} mock_server;
+
+/**
+ * Listen on an ephemeral loopback port, set in server->port, for
+ * connections made with mongo_connect.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mock_server_start( mock_server* server );
+
+/**
+ * Connect to the server over a socketpair, which skips the TCP stack, or
+ * over loopback TCP where socketpair is missing.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mock_server_connect( mock_server* server, mongo_connection* conn );
+
+/**
+ * Close every connection, stop listening and free the store.
+ * Connections to the server see their sockets closed.
+ */
+void mock_server_stop( mock_server* server );
+
+#endif
@@ -0,0 +1,96 @@
+/* monitor.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "monitor.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef SEED_START_PORT
+#define SEED_START_PORT 30000
+#endif
+
+int test_check( void ) {
+    mongo_connection conn[1];
+    mongo_monitor monitor[1];
+    mongo_topology topology;
+    int secondaries = 0;
+    int i;
+
+    mongo_replset_init_conn( conn, "test-rs" );
+    mongo_replset_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+    mongo_monitor_init( monitor, conn );
+
+    mongo_monitor_get_topology( monitor, &topology );
+    ASSERT( topology.version == 0 );
+    ASSERT( topology.primary == -1 );
+    ASSERT( topology.count == 1 );
+
+    /* The first check learns the members from the seed, the second
+     * reaches them. */
+    mongo_monitor_check( monitor );
+    ASSERT( mongo_monitor_check( monitor ) == MONGO_OK );
+
+    mongo_monitor_get_topology( monitor, &topology );
+    ASSERT( topology.version == 2 );
+    ASSERT( topology.primary >= 0 );
+    ASSERT( topology.count >= 2 );
+    ASSERT( topology.members[topology.primary].state == MONGO_MEMBER_PRIMARY );
+    for( i=0; i < topology.count; i++ ) {
+        if( topology.members[i].state == MONGO_MEMBER_SECONDARY )
+            secondaries++;
+        if( topology.members[i].state != MONGO_MEMBER_DOWN )
+            ASSERT( topology.members[i].rtt_usec > 0 );
+    }
+    ASSERT( secondaries >= 1 );
+
+    mongo_monitor_destroy( monitor );
+    ASSERT( conn->replset->monitor == NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
+
+int test_reconnect_from_topology( void ) {
+    mongo_connection conn[1];
+    mongo_monitor monitor[1];
+    mongo_topology topology;
+
+    mongo_replset_init_conn( conn, "test-rs" );
+    mongo_replset_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+    ASSERT( mongo_replset_connect( conn ) == MONGO_OK );
+
+    mongo_monitor_init( monitor, conn );
+    mongo_monitor_set_interval( monitor, 50, 1000 );
+    ASSERT( mongo_monitor_start( monitor ) == MONGO_OK );
+
+    sleep( 1 );
+    mongo_monitor_get_topology( monitor, &topology );
+    ASSERT( topology.version >= 3 );
+    ASSERT( topology.primary >= 0 );
+
+    /* The reconnect goes straight to the primary the monitor saw. */
+    mongo_disconnect( conn );
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    ASSERT( conn->replset->primary_connected );
+    ASSERT( strcmp( conn->primary->host, topology.members[topology.primary].host ) == 0 );
+    ASSERT( conn->primary->port == topology.members[topology.primary].port );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    mongo_monitor_stop( monitor );
+    mongo_monitor_destroy( monitor );
+    mongo_destroy( conn );
+
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_check();
+    test_reconnect_from_topology();
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* op_hooks.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 300
+#define MAX_EVENTS 1024
+
+typedef struct {
+    int kind;
+    mongo_op_event event;
+    char ns[128];
+    int has_query;
+} recorded;
+
+enum { STARTED, SUCCEEDED, FAILED, SLOW };
+
+static recorded events[MAX_EVENTS];
+static int num_events;
+static bson slow_query;
+
+static void record( int kind, const mongo_op_event* e ) {
+    recorded* r;
+
+    ASSERT( num_events < MAX_EVENTS );
+    r = &events[num_events++];
+    r->kind = kind;
+    r->event = *e;
+    r->ns[0] = '\0';
+    if( e->ns )
+        strcpy( r->ns, e->ns );
+    r->has_query = e->query != NULL;
+    r->event.ns = NULL;
+    r->event.query = NULL;
+    r->event.host = NULL;
+
+    ASSERT( e->host && !strcmp( e->host, TEST_SERVER ) && e->port == 27017 );
+}
+
+static void on_started( const mongo_op_event* e, void* data ) {
+    ASSERT( data == events );
+    ASSERT( e->elapsed_ns == 0 );
+    record( STARTED, e );
+}
+
+static void on_succeeded( const mongo_op_event* e, void* data ) {
+    ASSERT( e->elapsed_ns > 0 && e->err == 0 );
+    record( SUCCEEDED, e );
+}
+
+static void on_failed( const mongo_op_event* e, void* data ) {
+    record( FAILED, e );
+}
+
+static void on_slow( const mongo_op_event* e, void* data ) {
+    record( SLOW, e );
+    if( e->query && !slow_query.data )
+        bson_copy( &slow_query, e->query );
+}
+
+static int count( int kind, int op ) {
+    int i, n = 0;
+
+    for( i=0; i<num_events; i++ )
+        if( events[i].kind == kind && events[i].event.op == op )
+            n++;
+    return n;
+}
+
+/* The event of the given kind for the request that started at index i. */
+static recorded* find( int kind, int i ) {
+    int j;
+
+    for( j=i+1; j<num_events; j++ )
+        if( events[j].kind == kind && events[j].event.request_id == events[i].event.request_id )
+            return &events[j];
+    return NULL;
+}
+
+int main() {
+    mongo_connection conn[1];
+    mongo_op_hooks hooks;
+    mongo_cursor* cursor;
+    bson_buffer bb;
+    bson b;
+    bson_iterator it;
+    recorded* r;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+    mongo_cmd_drop_collection( conn, "test", "op_hooks", NULL );
+
+    memset( &hooks, 0, sizeof( hooks ) );
+    hooks.started = on_started;
+    hooks.succeeded = on_succeeded;
+    hooks.failed = on_failed;
+    hooks.slow = on_slow;
+    hooks.slow_ns = (int64_t)1000 * 1000 * 1000 * 1000;
+    hooks.data = events;
+    mongo_set_op_hooks( &hooks );
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.op_hooks", &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+    ASSERT( mongo_count( conn, "test", "op_hooks", NULL ) == NUM_DOCS );
+
+    /* Inserts get no reply, so they succeed once written. */
+    ASSERT( count( STARTED, MONGO_OP_INSERT ) == NUM_DOCS );
+    ASSERT( count( SUCCEEDED, MONGO_OP_INSERT ) == NUM_DOCS );
+    ASSERT( events[0].kind == STARTED && !strcmp( events[0].ns, "test.op_hooks" ) );
+    ASSERT( events[0].event.bytes_sent > 0 );
+    r = find( SUCCEEDED, 0 );
+    ASSERT( r && r->event.bytes_received == 0 && r->event.bytes_sent == events[0].event.bytes_sent );
+
+    /* The count command is a query on test.$cmd, which has a reply. */
+    i = 2 * NUM_DOCS;
+    ASSERT( events[i].kind == STARTED && events[i].event.op == MONGO_OP_QUERY );
+    ASSERT( !strcmp( events[i].ns, "test.$cmd" ) && events[i].has_query );
+    r = find( SUCCEEDED, i );
+    ASSERT( r && r->event.bytes_received > 0 && r->has_query );
+    ASSERT( count( SLOW, MONGO_OP_QUERY ) == 0 );
+    ASSERT( num_events == 2 * NUM_DOCS + 2 );
+
+    /* With a threshold every op passes, the query is captured. */
+    hooks.slow_ns = 1;
+    mongo_set_op_hooks( &hooks );
+    num_events = 0;
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "i", 7 );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_find_one( conn, "test.op_hooks", &b, NULL, NULL ) == MONGO_OK );
+    bson_destroy( &b );
+    ASSERT( num_events == 3 );
+    ASSERT( events[1].kind == SUCCEEDED && events[2].kind == SLOW );
+    ASSERT( events[2].event.elapsed_ns == events[1].event.elapsed_ns );
+    ASSERT( slow_query.data );
+    ASSERT( bson_find( &it, &slow_query, "i" ) && bson_iterator_int( &it ) == 7 );
+    bson_destroy( &slow_query );
+    hooks.slow_ns = (int64_t)1000 * 1000 * 1000 * 1000;
+    mongo_set_op_hooks( &hooks );
+
+    /* A prefetched get_more whose reply dies with the connection fails. */
+    num_events = 0;
+    cursor = mongo_find( conn, "test.op_hooks", bson_empty( &b ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    mongo_cursor_set_prefetch( cursor, 0 );
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( count( STARTED, MONGO_OP_GET_MORE ) == 1 );
+    ASSERT( count( SUCCEEDED, MONGO_OP_GET_MORE ) == 0 );
+    mongo_disconnect( conn );
+    ASSERT( count( FAILED, MONGO_OP_GET_MORE ) == 1 );
+    r = &events[num_events - 1];
+    ASSERT( r->kind == FAILED && !strcmp( r->ns, "test.op_hooks" ) && !r->has_query );
+    mongo_cursor_destroy( cursor );
+
+    /* Without hooks nothing is reported. */
+    mongo_set_op_hooks( NULL );
+    num_events = 0;
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    mongo_cmd_drop_collection( conn, "test", "op_hooks", NULL );
+    ASSERT( num_events == 0 );
+
+    mongo_destroy( conn );
+    return 0;
+}
@@ -0,0 +1,119 @@
+/* pipeline.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "net.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 50
+
+/* A reply to some other request leaves the stream out of step, so the
+ * connection is closed rather than reused. */
+int test_mismatch_disconnects( void ) {
+    mongo_connection conn[1];
+    bson_buffer bb;
+    bson ok;
+    char buf[256];
+    int fds[2];
+    int len, zero = 0, one = 1, op = 1, other = 12345;
+    int64_t cursor = 0;
+
+    ASSERT( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == 0 );
+    mongo_conn_adopt_socket( conn, fds[0], "localhost", 27017 );
+
+    /* Queue the stray reply before the command goes out. */
+    bson_buffer_init( &bb );
+    bson_append_double( &bb, "ok", 1 );
+    bson_from_buffer( &ok, &bb );
+    len = 36 + bson_size( &ok );
+    bson_little_endian32( buf, &len );
+    bson_little_endian32( buf + 4, &one );
+    bson_little_endian32( buf + 8, &other );
+    bson_little_endian32( buf + 12, &op );
+    bson_little_endian32( buf + 16, &zero );
+    bson_little_endian64( buf + 20, &cursor );
+    bson_little_endian32( buf + 28, &zero );
+    bson_little_endian32( buf + 32, &one );
+    memcpy( buf + 36, ok.data, bson_size( &ok ) );
+    ASSERT( send( fds[1], buf, len, 0 ) == len );
+
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_RESPONSE_MISMATCH );
+    ASSERT( !conn->connected );
+
+    bson_destroy( &ok );
+    mongo_destroy( conn );
+    mongo_close_socket( fds[1] );
+    return 0;
+}
+
+int main() {
+    mongo_connection conn[1];
+    mongo_pipeline pipe[1];
+    mongo_reply* reply;
+    int index[NUM_DOCS];
+    bson_buffer bb;
+    bson b, out;
+    bson_iterator it;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "pipeline", NULL );
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "_id", i );
+        bson_append_int( &bb, "square", i * i );
+        bson_from_buffer( &b, &bb );
+        mongo_insert( conn, "test.pipeline", &b );
+        bson_destroy( &b );
+    }
+
+    mongo_pipeline_init( pipe, conn );
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "_id", i );
+        bson_from_buffer( &b, &bb );
+        index[i] = mongo_pipeline_find( pipe, "test.pipeline", &b, NULL, 1, 0, 0 );
+        bson_destroy( &b );
+    }
+
+    ASSERT( mongo_pipeline_flush( pipe ) == MONGO_OK );
+
+    /* Collect in reverse to exercise out-of-order matching. */
+    for( i=NUM_DOCS-1; i>=0; i-- ) {
+        ASSERT( mongo_pipeline_reply( pipe, index[i], &reply ) == MONGO_OK );
+        ASSERT( reply->fields.num == 1 );
+
+        bson_init( &out, &reply->objs, 0 );
+        ASSERT( bson_find( &it, &out, "square" ) );
+        ASSERT( bson_iterator_int( &it ) == i * i );
+    }
+
+    ASSERT( mongo_pipeline_destroy( pipe ) == MONGO_OK );
+
+    /* Uncollected replies are drained on destroy. */
+    mongo_pipeline_init( pipe, conn );
+    mongo_pipeline_find( pipe, "test.pipeline", bson_empty( &b ), NULL, 1, 0, 0 );
+    mongo_pipeline_find( pipe, "test.pipeline", bson_empty( &b ), NULL, 1, 0, 0 );
+    ASSERT( mongo_pipeline_flush( pipe ) == MONGO_OK );
+    ASSERT( mongo_pipeline_destroy( pipe ) == MONGO_OK );
+
+    ASSERT( mongo_count( conn, "test", "pipeline", NULL ) == NUM_DOCS );
+
+    mongo_cmd_drop_collection( conn, "test", "pipeline", NULL );
+    mongo_destroy( conn );
+
+    test_mismatch_disconnects();
+
+    return 0;
+}
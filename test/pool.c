@@ -0,0 +1,128 @@
+/* pool.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_THREADS 8
+#define PER_THREAD 200
+
+static mongo_pool pool[1];
+
+static void* worker( void* arg ) {
+    mongo_connection* conn;
+    bson_buffer bb;
+    bson b;
+    int i;
+
+    for( i=0; i<PER_THREAD; i++ ) {
+        conn = mongo_pool_checkout( pool );
+        ASSERT( conn );
+
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.pool", &b ) == MONGO_OK );
+        ASSERT( mongo_cmd_get_last_error( conn, "test", NULL ) == MONGO_OK );
+        bson_destroy( &b );
+
+        mongo_pool_checkin( pool, conn );
+    }
+
+    return NULL;
+}
+
+int test_concurrent_checkout( void ) {
+    mongo_thread_t threads[NUM_THREADS];
+    mongo_pool_stats stats;
+    mongo_connection* conn;
+    int i;
+
+    mongo_pool_init( pool, TEST_SERVER, 27017, 2, 4 );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+
+    mongo_pool_get_stats( pool, &stats );
+    ASSERT( stats.size == 2 );
+    ASSERT( stats.idle == 2 );
+
+    conn = mongo_pool_checkout( pool );
+    mongo_cmd_drop_collection( conn, "test", "pool", NULL );
+    mongo_pool_checkin( pool, conn );
+
+    for( i=0; i<NUM_THREADS; i++ )
+        ASSERT( mongo_thread_create( &threads[i], worker, NULL ) == 0 );
+    for( i=0; i<NUM_THREADS; i++ )
+        mongo_thread_join( threads[i] );
+
+    mongo_pool_get_stats( pool, &stats );
+    ASSERT( stats.size <= 4 );
+    ASSERT( stats.created <= 4 );
+    ASSERT( stats.checkouts == NUM_THREADS * PER_THREAD + 1 );
+
+    conn = mongo_pool_checkout( pool );
+    ASSERT( mongo_count( conn, "test", "pool", NULL ) == NUM_THREADS * PER_THREAD );
+    mongo_cmd_drop_collection( conn, "test", "pool", NULL );
+    mongo_pool_checkin( pool, conn );
+
+    mongo_pool_destroy( pool );
+    return 0;
+}
+
+int test_wait_timeout( void ) {
+    mongo_connection* conn;
+    mongo_pool_stats stats;
+
+    mongo_pool_init( pool, TEST_SERVER, 27017, 0, 1 );
+    mongo_pool_set_timeouts( pool, 0, 50, 0 );
+
+    conn = mongo_pool_checkout( pool );
+    ASSERT( conn );
+    ASSERT( mongo_pool_checkout( pool ) == NULL );
+    ASSERT( pool->err == MONGO_POOL_WAIT_TIMEOUT );
+
+    mongo_pool_get_stats( pool, &stats );
+    ASSERT( stats.timeouts == 1 );
+    ASSERT( stats.max_wait_usec >= 50000 );
+
+    mongo_pool_checkin( pool, conn );
+    mongo_pool_destroy( pool );
+    return 0;
+}
+
+int test_replace_broken( void ) {
+    mongo_connection* conn;
+    mongo_pool_stats stats;
+
+    mongo_pool_init( pool, TEST_SERVER, 27017, 1, 1 );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+
+    conn = mongo_pool_checkout( pool );
+    mongo_disconnect( conn );
+    conn->err = MONGO_IO_ERROR;
+    mongo_pool_checkin( pool, conn );
+
+    conn = mongo_pool_checkout( pool );
+    ASSERT( conn );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    mongo_pool_checkin( pool, conn );
+
+    mongo_pool_get_stats( pool, &stats );
+    ASSERT( stats.replaced == 1 );
+    ASSERT( stats.created == 2 );
+
+    mongo_pool_destroy( pool );
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_concurrent_checkout();
+    test_wait_timeout();
+    test_replace_broken();
+
+    return 0;
+}
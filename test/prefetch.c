@@ -0,0 +1,89 @@
+/* prefetch.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 1000
+
+static mongo_connection conn[1];
+
+static int scan( int percent, int interleave ) {
+    mongo_cursor* cursor;
+    bson empty;
+    bson_iterator it;
+    int i = 0;
+
+    cursor = mongo_find( conn, "test.prefetch", bson_empty( &empty ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    mongo_cursor_set_prefetch( cursor, percent );
+
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( &it, &cursor->current, "i" ) );
+        ASSERT( bson_iterator_int( &it ) == i );
+        i++;
+
+        /* Other requests may share the connection while a batch is in flight. */
+        if( interleave && i % 150 == 0 )
+            ASSERT( mongo_count( conn, "test", "prefetch", NULL ) == NUM_DOCS );
+    }
+
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+
+    return i;
+}
+
+int test_destroy_in_flight( void ) {
+    mongo_cursor* cursor;
+    bson empty;
+
+    cursor = mongo_find( conn, "test.prefetch", bson_empty( &empty ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    mongo_cursor_set_prefetch( cursor, 0 );
+
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( cursor->prefetch_id );
+    ASSERT( mongo_cursor_destroy( cursor ) == MONGO_OK );
+
+    /* The connection is still in step. */
+    ASSERT( mongo_count( conn, "test", "prefetch", NULL ) == NUM_DOCS );
+    return 0;
+}
+
+int main() {
+    bson_buffer bb;
+    bson b;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "prefetch", NULL );
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        mongo_insert( conn, "test.prefetch", &b );
+        bson_destroy( &b );
+    }
+
+    ASSERT( scan( -1, 0 ) == NUM_DOCS );
+    ASSERT( scan( 0, 0 ) == NUM_DOCS );
+    ASSERT( scan( 50, 0 ) == NUM_DOCS );
+    ASSERT( scan( 100, 1 ) == NUM_DOCS );
+    ASSERT( scan( 0, 1 ) == NUM_DOCS );
+    test_destroy_in_flight();
+
+    mongo_cmd_drop_collection( conn, "test", "prefetch", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* prepared.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 50
+
+static mongo_connection conn[1];
+
+static int count_results( mongo_cursor* cursor, int user_id ) {
+    bson_iterator it;
+    int n = 0;
+
+    ASSERT( cursor );
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( &it, &cursor->current, "user_id" ) );
+        ASSERT( bson_iterator_int( &it ) == user_id );
+        n++;
+    }
+    mongo_cursor_destroy( cursor );
+
+    return n;
+}
+
+int main() {
+    mongo_connection other[1];
+    mongo_prepared find, count;
+    bson_template query;
+    bson_buffer bb;
+    bson b, out;
+    bson_iterator it;
+    int user_id, i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ||
+        mongo_connect( other, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "prepared", NULL );
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "user_id", i % 5 );
+        bson_append_int( &bb, "ts", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.prepared", &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+
+    /* { user_id: X, ts: { $gt: Y } } with X and Y patched per run. */
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "user_id", 0 );
+    bson_append_start_object( &bb, "ts" );
+        bson_append_int( &bb, "$gt", 0 );
+    bson_append_finish_object( &bb );
+    bson_from_buffer( &b, &bb );
+    bson_template_init( &query, &b );
+    bson_destroy( &b );
+    user_id = bson_template_add_slot( &query, "user_id" );
+    ASSERT( user_id == 0 );
+    ASSERT( bson_template_add_slot( &query, "ts.$gt" ) == 1 );
+
+    mongo_prepare_find( &find, "test.prepared", NULL, 0, 0, 0 );
+    for( i=0; i<5; i++ ) {
+        bson_template_set_int( &query, &query.doc, user_id, i );
+        bson_template_set_int( &query, &query.doc, 1, 24 );
+        ASSERT( count_results( mongo_prepared_find( conn, &find, &query.doc ), i ) == 5 );
+        ASSERT( count_results( mongo_find( conn, "test.prepared", &query.doc,
+                                           NULL, 0, 0, 0 ), i ) == 5 );
+    }
+    /* The same prepared query runs on any connection. */
+    ASSERT( count_results( mongo_prepared_find( other, &find, &query.doc ), 4 ) == 5 );
+    mongo_prepared_destroy( &find );
+
+    /* Skip, limit and fields are part of the prepared prefix. */
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "user_id", 1 );
+    bson_from_buffer( &b, &bb );
+    mongo_prepare_find( &find, "test.prepared", &b, 3, 2, 0 );
+    bson_destroy( &b );
+    bson_template_set_int( &query, &query.doc, 1, -1 );
+    bson_template_set_int( &query, &query.doc, user_id, 2 );
+    ASSERT( count_results( mongo_prepared_find( conn, &find, &query.doc ), 2 ) == 3 );
+    mongo_prepared_destroy( &find );
+
+    bson_buffer_init( &bb );
+    bson_append_string( &bb, "count", "prepared" );
+    bson_from_buffer( &b, &bb );
+    mongo_prepare_command( &count, "test" );
+    for( i=0; i<3; i++ ) {
+        ASSERT( mongo_prepared_command( conn, &count, &b, &out ) == MONGO_OK );
+        ASSERT( bson_find( &it, &out, "n" ) );
+        ASSERT( bson_iterator_int( &it ) == NUM_DOCS );
+        bson_destroy( &out );
+    }
+    ASSERT( mongo_prepared_command( conn, &count, &b, NULL ) == MONGO_OK );
+    bson_destroy( &b );
+    mongo_prepared_destroy( &count );
+
+    bson_template_destroy( &query );
+    mongo_cmd_drop_collection( conn, "test", "prepared", NULL );
+    mongo_destroy( conn );
+    mongo_destroy( other );
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+/* replay.c */
+
+/* Re-issue the requests in a trace written with mongo_trace_open against
+ * a server, one connection for each connection captured, and report the
+ * throughput and latency seen.
+ *
+ *     replay [-h host] [-p port] [-s speed] trace
+ *
+ * With -s 1, the default, requests go out at the offsets they were
+ * captured at; -s 2 replays twice as fast, and -s 0 as fast as each
+ * connection can go. A connection reads a reply wherever its captured
+ * counterpart did, so pipelining and request concurrency are kept. Cursor
+ * ids in get_mores and kill cursors are mapped to those of the server
+ * replayed against. */
+
+/* nanosleep */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "test.h"
+#include "mongo.h"
+#include "net.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef TEST_SERVER
+#define TEST_SERVER "127.0.0.1"
+#endif
+
+/* Requests per connection whose send times are kept for latency. */
+#define MAX_PENDING 256
+
+typedef struct {
+    int num;                      /* Connection number in the trace. */
+    mongo_trace_entry* entries;   /* Its records, in order. */
+    int count;
+
+    mongo_connection conn[1];
+    mongo_thread_t thread;
+
+    int64_t* cursor_from;         /* Captured cursor ids ... */
+    int64_t* cursor_to;           /* ... and the ids they are replayed as. */
+    int cursors;
+    int cursor_alloc;
+
+    int pending_id[MAX_PENDING];
+    int64_t pending_sent[MAX_PENDING];
+    int next_pending;
+
+    int64_t requests;
+    int64_t replies;
+    int64_t errors;
+    int64_t bytes_sent;
+    int64_t bytes_received;
+    mongo_histogram latency;      /* Request written until its reply is read, in usec. */
+} replayer;
+
+static const char* host = TEST_SERVER;
+static int port = 27017;
+static double speed = 1;
+static int64_t replay_start;
+static int64_t trace_start;
+
+static void sleep_until( int64_t when ) {
+    int64_t left = when - mongo_now_nsec();
+
+    if( left <= 0 )
+        return;
+#ifdef _WIN32
+    Sleep( (DWORD)( left / 1000000 ) );
+#else
+    {
+        struct timespec ts;
+        ts.tv_sec = left / 1000000000;
+        ts.tv_nsec = left % 1000000000;
+        nanosleep( &ts, NULL );
+    }
+#endif
+}
+
+static int64_t* find_cursor( replayer* r, int64_t id ) {
+    int i;
+
+    for( i=0; i<r->cursors; i++ )
+        if( r->cursor_from[i] == id )
+            return &r->cursor_to[i];
+    return NULL;
+}
+
+static void map_cursor( replayer* r, int64_t from, int64_t to ) {
+    int64_t* mapped = find_cursor( r, from );
+
+    if( mapped ) {
+        *mapped = to;
+        return;
+    }
+    if( r->cursors == r->cursor_alloc ) {
+        r->cursor_alloc = r->cursor_alloc ? r->cursor_alloc * 2 : 16;
+        r->cursor_from = (int64_t*)bson_realloc( r->cursor_from, r->cursor_alloc * sizeof( int64_t ) );
+        r->cursor_to = (int64_t*)bson_realloc( r->cursor_to, r->cursor_alloc * sizeof( int64_t ) );
+    }
+    r->cursor_from[r->cursors] = from;
+    r->cursor_to[r->cursors++] = to;
+}
+
+/* Replace a little endian cursor id in a message with the one it maps to. */
+static void patch_cursor( replayer* r, char* at ) {
+    int64_t id;
+    int64_t* mapped;
+
+    bson_little_endian64( &id, at );
+    if( ( mapped = find_cursor( r, id ) ) )
+        bson_little_endian64( at, mapped );
+}
+
+static void send_request( replayer* r, mongo_trace_entry* e ) {
+    mongo_message* mm = mongo_message_create( e->len, e->id, e->responseTo, e->op );
+    char* body = (char*)mm + sizeof( mongo_header );
+    int body_len = e->len - sizeof( mongo_header );
+    int i, n;
+
+    memcpy( body, e->msg + sizeof( mongo_header ), body_len );
+
+    if( e->op == MONGO_OP_GET_MORE )
+        patch_cursor( r, body + 4 + strlen( body + 4 ) + 1 + 4 );
+    else if( e->op == MONGO_OP_KILL_CURSORS ) {
+        bson_little_endian32( &n, body + 4 );
+        for( i=0; i<n && 8 + ( i + 1 ) * 8 <= body_len; i++ )
+            patch_cursor( r, body + 8 + i * 8 );
+    }
+
+    r->pending_id[r->next_pending] = e->id;
+    r->pending_sent[r->next_pending] = mongo_now_nsec();
+    r->next_pending = ( r->next_pending + 1 ) % MAX_PENDING;
+
+    r->requests++;
+    r->bytes_sent += e->len;
+    if( mongo_message_send( r->conn, mm ) != MONGO_OK ) {
+        r->errors++;
+        mongo_reconnect( r->conn );
+    }
+}
+
+static void read_reply( replayer* r, mongo_trace_entry* e ) {
+    mongo_reply* reply;
+    int64_t captured_cursor;
+    int i;
+
+    if( mongo_read_response( r->conn, &reply ) != MONGO_OK ) {
+        r->errors++;
+        mongo_reconnect( r->conn );
+        return;
+    }
+
+    r->replies++;
+    r->bytes_received += reply->head.len;
+
+    for( i=0; i<MAX_PENDING; i++ ) {
+        if( r->pending_id[i] == reply->head.responseTo && r->pending_sent[i] ) {
+            mongo_histogram_record( &r->latency, ( mongo_now_nsec() - r->pending_sent[i] ) / 1000 );
+            break;
+        }
+    }
+
+    bson_little_endian64( &captured_cursor, e->msg + sizeof( mongo_header ) + 4 );
+    if( captured_cursor )
+        map_cursor( r, captured_cursor, reply->fields.cursorID );
+
+    free( reply );
+}
+
+static void* replay_connection( void* arg ) {
+    replayer* r = (replayer*)arg;
+    mongo_trace_entry* e;
+    int i;
+
+    for( i=0; i<r->count; i++ ) {
+        e = &r->entries[i];
+        if( speed > 0 )
+            sleep_until( replay_start + (int64_t)( ( e->time_ns - trace_start ) / speed ) );
+
+        if( e->received )
+            read_reply( r, e );
+        else
+            send_request( r, e );
+    }
+
+    return NULL;
+}
+
+static char* read_file( const char* path, int64_t* len ) {
+    FILE* f = fopen( path, "rb" );
+    char* data;
+
+    if( !f )
+        return NULL;
+    fseek( f, 0, SEEK_END );
+    *len = ftell( f );
+    fseek( f, 0, SEEK_SET );
+    data = (char*)bson_malloc( *len ? *len : 1 );
+    if( *len && fread( data, *len, 1, f ) != 1 ) {
+        free( data );
+        data = NULL;
+    }
+    fclose( f );
+    return data;
+}
+
+static void merge( mongo_histogram* into, const mongo_histogram* h ) {
+    int i;
+
+    if( !h->count )
+        return;
+    for( i=0; i<MONGO_HISTOGRAM_BUCKETS; i++ )
+        into->counts[i] += h->counts[i];
+    if( !into->count || h->min < into->min )
+        into->min = h->min;
+    if( h->max > into->max )
+        into->max = h->max;
+    into->count += h->count;
+    into->sum += h->sum;
+}
+
+static void usage( void ) {
+    printf( "usage: replay [-h host] [-p port] [-s speed] trace\n" );
+    exit( 1 );
+}
+
+int main( int argc, char** argv ) {
+    const char* path = NULL;
+    char* data;
+    int64_t len, offset = 0;
+    mongo_trace_entry e;
+    replayer* replayers;
+    mongo_histogram* latency;
+    int num_conns = 0;
+    int64_t total = 0, requests = 0, replies = 0, errors = 0, sent = 0, received = 0;
+    double secs;
+    int i;
+
+    for( i=1; i<argc; i++ ) {
+        if( !strcmp( argv[i], "-h" ) && i + 1 < argc )
+            host = argv[++i];
+        else if( !strcmp( argv[i], "-p" ) && i + 1 < argc )
+            port = atoi( argv[++i] );
+        else if( !strcmp( argv[i], "-s" ) && i + 1 < argc )
+            speed = atof( argv[++i] );
+        else if( argv[i][0] != '-' && !path )
+            path = argv[i];
+        else
+            usage();
+    }
+    if( !path || speed < 0 )
+        usage();
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( !( data = read_file( path, &len ) ) ) {
+        printf( "failed to read %s\n", path );
+        exit( 1 );
+    }
+
+    /* Count each connection's records, then gather them. */
+    while( mongo_trace_next( data, len, &offset, &e ) == MONGO_OK ) {
+        if( !total++ )
+            trace_start = e.time_ns;
+        if( e.conn > num_conns )
+            num_conns = e.conn;
+    }
+    if( offset != len )
+        printf( "warning: %s is not a trace or is cut short; replaying %ld records\n",
+            path, (long)total );
+
+    replayers = (replayer*)bson_malloc( ( num_conns + 1 ) * sizeof( replayer ) );
+    memset( replayers, 0, ( num_conns + 1 ) * sizeof( replayer ) );
+    offset = 0;
+    while( mongo_trace_next( data, len, &offset, &e ) == MONGO_OK )
+        replayers[e.conn].count++;
+    for( i=0; i<=num_conns; i++ ) {
+        replayers[i].num = i;
+        replayers[i].entries = (mongo_trace_entry*)bson_malloc(
+            ( replayers[i].count ? replayers[i].count : 1 ) * sizeof( mongo_trace_entry ) );
+        replayers[i].count = 0;
+    }
+    offset = 0;
+    while( mongo_trace_next( data, len, &offset, &e ) == MONGO_OK )
+        replayers[e.conn].entries[replayers[e.conn].count++] = e;
+
+    for( i=0; i<=num_conns; i++ ) {
+        if( !replayers[i].count )
+            continue;
+        if( mongo_connect( replayers[i].conn, host, port ) != MONGO_OK ) {
+            printf( "failed to connect to %s:%d\n", host, port );
+            exit( 1 );
+        }
+    }
+
+    replay_start = mongo_now_nsec();
+    for( i=0; i<=num_conns; i++ )
+        if( replayers[i].count )
+            mongo_thread_create( &replayers[i].thread, replay_connection, &replayers[i] );
+    for( i=0; i<=num_conns; i++ )
+        if( replayers[i].count )
+            mongo_thread_join( replayers[i].thread );
+    secs = ( mongo_now_nsec() - replay_start ) / 1e9;
+
+    latency = (mongo_histogram*)bson_malloc( sizeof( mongo_histogram ) );
+    memset( latency, 0, sizeof( mongo_histogram ) );
+    for( i=0; i<=num_conns; i++ ) {
+        replayer* r = &replayers[i];
+        requests += r->requests;
+        replies += r->replies;
+        errors += r->errors;
+        sent += r->bytes_sent;
+        received += r->bytes_received;
+        merge( latency, &r->latency );
+        if( r->count )
+            mongo_destroy( r->conn );
+        free( r->entries );
+        free( r->cursor_from );
+        free( r->cursor_to );
+    }
+
+    printf( "replayed %ld requests on %d connections in %.3f s", (long)requests, num_conns, secs );
+    if( speed > 0 )
+        printf( " at %gx speed\n", speed );
+    else
+        printf( " as fast as possible\n" );
+    printf( "%.1f requests/s, %.1f MB sent, %.1f MB received, %ld replies, %ld errors\n",
+        secs > 0 ? requests / secs : 0.0, sent / 1e6, received / 1e6, (long)replies, (long)errors );
+    printf( "latency usec: p50 %ld p99 %ld p999 %ld max %ld\n",
+        (long)mongo_histogram_percentile( latency, 50 ),
+        (long)mongo_histogram_percentile( latency, 99 ),
+        (long)mongo_histogram_percentile( latency, 99.9 ),
+        (long)latency->max );
+
+    free( latency );
+    free( replayers );
+    free( data );
+    return errors ? 1 : 0;
+}
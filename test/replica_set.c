@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifndef SEED_START_PORT
 #define SEED_START_PORT 30000
@@ -32,6 +33,95 @@ int test_connect( const char* set_name ) {
     return res;
 }
 
+/* A seed that never answers must not hold up discovery: the other
+ * members are probed while its connect is still pending. */
+int test_connect_dead_seed( void ) {
+
+    mongo_connection conn[1];
+    time_t start;
+    int res;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replset_init_conn( conn, "test-rs" );
+    conn->conn_timeout_ms = 5000;
+    mongo_replset_add_seed( conn, "10.255.255.1", SEED_START_PORT );
+    mongo_replset_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+
+    start = time( NULL );
+    res = mongo_replset_connect( conn );
+
+    ASSERT( res == MONGO_OK );
+    ASSERT( time( NULL ) - start < 5 );
+    ASSERT( conn->replset->primary_connected );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    mongo_destroy( conn );
+
+    return 0;
+}
+
+int test_secondary_reads( void ) {
+
+    mongo_connection conn[1];
+    mongo_secondary* secondary;
+    mongo_cursor* cursor;
+    bson b;
+    int i, count;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replset_init_conn( conn, "test-rs" );
+    mongo_replset_set_read_secondaries( conn, 1000 );
+    mongo_replset_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+
+    ASSERT( mongo_replset_connect( conn ) == MONGO_OK );
+    ASSERT( conn->replset->secondaries );
+
+    for( secondary = conn->replset->secondaries; secondary; secondary = secondary->next ) {
+        ASSERT( secondary->rtt_usec > 0 );
+        ASSERT( secondary->conn->connected );
+    }
+
+    /* Slave-ok reads go to the secondaries, the rest to the primary. */
+    for( i=0; i<4; i++ ) {
+        cursor = mongo_find( conn, "test.secondary_reads", bson_empty( &b ), NULL, 0, 0, MONGO_SLAVE_OK );
+        ASSERT( cursor );
+        ASSERT( cursor->conn != conn );
+        mongo_cursor_destroy( cursor );
+    }
+
+    cursor = mongo_find( conn, "test.secondary_reads", bson_empty( &b ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    ASSERT( cursor->conn == conn );
+    mongo_cursor_destroy( cursor );
+
+    ASSERT( mongo_replset_ping( conn ) == MONGO_OK );
+    ASSERT( conn->replset->primary_rtt_usec > 0 );
+    ASSERT( conn->replset->secondaries );
+
+    /* A secondary that drops out is opened again by a later ping. */
+    count = 0;
+    for( secondary = conn->replset->secondaries; secondary; secondary = secondary->next )
+        count++;
+    mongo_disconnect( conn->replset->secondaries->conn );
+    ASSERT( mongo_replset_ping( conn ) == MONGO_OK );
+    for( secondary = conn->replset->secondaries; secondary; secondary = secondary->next ) {
+        ASSERT( secondary->conn->connected );
+        count--;
+    }
+    ASSERT( count == 0 );
+
+    /* Secondaries follow the connection's operation timeout. */
+    ASSERT( mongo_conn_set_timeout( conn, 500 ) == MONGO_OK );
+    for( secondary = conn->replset->secondaries; secondary; secondary = secondary->next )
+        ASSERT( secondary->conn->op_timeout_ms == 500 );
+
+    mongo_destroy( conn );
+
+    return 0;
+}
+
 int test_reconnect( const char* set_name ) {
 
     mongo_connection conn[1];
@@ -74,6 +164,8 @@ int test_reconnect( const char* set_name ) {
 int main() {
     ASSERT( test_connect( "test-rs" ) == MONGO_OK );
     ASSERT( test_connect( "test-foobar" ) == MONGO_CONN_BAD_SET_NAME );
+    ASSERT( test_connect_dead_seed() == 0 );
+    ASSERT( test_secondary_reads() == 0 );
 
     /*
     ASSERT( test_reconnect( "test-rs" ) == 0 );
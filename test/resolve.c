@@ -0,0 +1,77 @@
+/* resolve.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "net.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+int test_connect_by_name( void ) {
+    mongo_connection conn[1];
+    int i;
+
+    /* localhost usually resolves to ::1 as well as 127.0.0.1; whichever
+     * the server listens on must win the race. */
+    for( i=0; i<3; i++ ) {
+        ASSERT( mongo_connect( conn, "localhost", 27017 ) == MONGO_OK );
+        ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+        ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+        ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+        mongo_destroy( conn );
+    }
+
+    /* Without the cache every connect resolves. */
+    mongo_set_dns_cache_ttl( 0 );
+    ASSERT( mongo_connect( conn, "localhost", 27017 ) == MONGO_OK );
+    mongo_destroy( conn );
+    mongo_set_dns_cache_ttl( 60000 );
+
+    return 0;
+}
+
+int test_connect_failures( void ) {
+    mongo_connection conn[1];
+
+    ASSERT( mongo_connect( conn, "nonexistent.invalid", 27017 ) == MONGO_ERROR );
+    ASSERT( (int)conn->err == MONGO_CONN_FAIL );
+    mongo_destroy( conn );
+
+    /* Nothing listens on the port, so every address is refused. */
+    ASSERT( mongo_connect( conn, "localhost", 1 ) == MONGO_ERROR );
+    ASSERT( (int)conn->err == MONGO_CONN_FAIL );
+    mongo_destroy( conn );
+
+    return 0;
+}
+
+int test_connect_start( void ) {
+    int next = 0;
+    int sock;
+
+    /* Each refused address hands over to the next until none are left. */
+    while( mongo_socket_connect_start( "localhost", 1, &next, &sock ) == MONGO_OK ) {
+        ASSERT( mongo_socket_wait( sock, 1, 1000 ) > 0 );
+        ASSERT( mongo_socket_connect_finish( sock ) == MONGO_ERROR );
+        mongo_close_socket( sock );
+    }
+    ASSERT( next > 0 );
+
+    next = 0;
+    ASSERT( mongo_socket_connect_start( "localhost", 27017, &next, &sock ) == MONGO_OK );
+    ASSERT( mongo_socket_wait( sock, 1, 1000 ) > 0 );
+    ASSERT( mongo_socket_connect_finish( sock ) == MONGO_OK );
+    mongo_close_socket( sock );
+
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_connect_by_name();
+    test_connect_failures();
+    test_connect_start();
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/* stats.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 250
+
+static int64_t get_long( bson* obj, const char* path ) {
+    bson_iterator it;
+    bson sub;
+    char name[64];
+    const char* dot = strchr( path, '.' );
+
+    if( !dot ) {
+        ASSERT( bson_find( &it, obj, path ) );
+        return bson_iterator_long( &it );
+    }
+
+    memcpy( name, path, dot - path );
+    name[dot - path] = '\0';
+    ASSERT( bson_find( &it, obj, name ) );
+    bson_iterator_subobject( &it, &sub );
+    return get_long( &sub, dot + 1 );
+}
+
+static void check_histogram( bson* stats, const char* name ) {
+    char key[64];
+    int64_t p50, p99, p999, max;
+
+    sprintf( key, "%s.p50", name );
+    p50 = get_long( stats, key );
+    sprintf( key, "%s.p99", name );
+    p99 = get_long( stats, key );
+    sprintf( key, "%s.p999", name );
+    p999 = get_long( stats, key );
+    sprintf( key, "%s.max", name );
+    max = get_long( stats, key );
+
+    ASSERT( p50 <= p99 && p99 <= p999 && p999 <= max );
+}
+
+int test_histogram( void ) {
+    mongo_histogram h;
+    int64_t p;
+    int i;
+
+    memset( &h, 0, sizeof( h ) );
+    ASSERT( mongo_histogram_percentile( &h, 50 ) == 0 );
+
+    for( i=1; i<=10000; i++ )
+        mongo_histogram_record( &h, i );
+
+    ASSERT( h.count == 10000 && h.min == 1 && h.max == 10000 );
+    p = mongo_histogram_percentile( &h, 50 );
+    ASSERT( p >= 5000 && p <= 5000 * 103 / 100 );
+    p = mongo_histogram_percentile( &h, 99.9 );
+    ASSERT( p >= 9990 && p <= 10000 );
+    ASSERT( mongo_histogram_percentile( &h, 100 ) == 10000 );
+
+    /* Small values are exact; huge ones are clamped, not lost. */
+    memset( &h, 0, sizeof( h ) );
+    mongo_histogram_record( &h, 7 );
+    ASSERT( mongo_histogram_percentile( &h, 50 ) == 7 );
+    mongo_histogram_record( &h, (int64_t)1 << 50 );
+    ASSERT( mongo_histogram_percentile( &h, 100 ) == (int64_t)1 << 50 );
+
+    return 0;
+}
+
+int main() {
+    mongo_connection conn[1];
+    mongo_cursor* cursor;
+    bson_buffer bb;
+    bson b, stats;
+    bson_iterator it;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_histogram();
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    ASSERT( mongo_conn_get_stats( conn, &stats ) == MONGO_ERROR );
+    mongo_conn_enable_stats( conn );
+
+    mongo_cmd_drop_collection( conn, "test", "stats", NULL );
+    mongo_conn_reset_stats( conn );
+
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.stats", &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+
+    cursor = mongo_find( conn, "test.stats", bson_empty( &b ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    mongo_cursor_set_batch_size( cursor, 10 );
+    for( i=0; mongo_cursor_next( cursor ) == MONGO_OK; i++ );
+    ASSERT( i == NUM_DOCS );
+    mongo_cursor_destroy( cursor );
+
+    ASSERT( mongo_count( conn, "test", "stats", NULL ) == NUM_DOCS );
+
+    ASSERT( mongo_conn_get_stats( conn, &stats ) == MONGO_OK );
+    ASSERT( get_long( &stats, "ops.insert.count" ) == NUM_DOCS );
+    ASSERT( get_long( &stats, "ops.query.count" ) == 2 );
+    ASSERT( get_long( &stats, "ops.getmore.count" ) >= 1 );
+    ASSERT( get_long( &stats, "ops.killcursors.count" ) == 0 );
+    ASSERT( get_long( &stats, "replies" ) == 2 + get_long( &stats, "ops.getmore.count" ) );
+    ASSERT( get_long( &stats, "bytesSent" ) > get_long( &stats, "ops.insert.bytes" ) );
+    ASSERT( get_long( &stats, "bytesReceived" ) > 0 );
+    ASSERT( get_long( &stats, "roundTripMicros.count" ) == get_long( &stats, "replies" ) );
+    ASSERT( get_long( &stats, "waitMicros.count" ) == get_long( &stats, "replies" ) );
+    ASSERT( get_long( &stats, "replyBytes.count" ) == get_long( &stats, "replies" ) );
+    ASSERT( get_long( &stats, "sendMicros.count" ) == NUM_DOCS + 2 +
+            get_long( &stats, "ops.getmore.count" ) );
+    check_histogram( &stats, "roundTripMicros" );
+    check_histogram( &stats, "waitMicros" );
+    check_histogram( &stats, "replyBytes" );
+
+    /* Inserts, the query and its get_mores name the collection; count
+     * goes to test.$cmd. */
+    ASSERT( bson_find( &it, &stats, "namespaces" ) );
+    bson_iterator_subobject( &it, &b );
+    ASSERT( bson_find( &it, &b, "0" ) );
+    {
+        bson ns;
+        bson_iterator_subobject( &it, &ns );
+        ASSERT( bson_find( &it, &ns, "ns" ) );
+        ASSERT( !strcmp( bson_iterator_string( &it ), "test.stats" ) );
+        ASSERT( get_long( &ns, "count" ) == get_long( &stats, "ops.insert.count" ) + 1 +
+                get_long( &stats, "ops.getmore.count" ) );
+    }
+    ASSERT( bson_find( &it, &b, "1" ) );
+    ASSERT( !bson_find( &it, &b, "2" ) );
+    ASSERT( get_long( &stats, "otherNamespaces" ) == 0 );
+    bson_destroy( &stats );
+
+    mongo_conn_reset_stats( conn );
+    ASSERT( mongo_conn_get_stats( conn, &stats ) == MONGO_OK );
+    ASSERT( get_long( &stats, "bytesSent" ) == 0 );
+    ASSERT( get_long( &stats, "roundTripMicros.count" ) == 0 );
+    bson_destroy( &stats );
+
+    mongo_cmd_drop_collection( conn, "test", "stats", NULL );
+    mongo_conn_disable_stats( conn );
+    ASSERT( mongo_conn_get_stats( conn, &stats ) == MONGO_ERROR );
+
+    mongo_destroy( conn );
+    return 0;
+}
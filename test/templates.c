@@ -0,0 +1,87 @@
+#include "test.h"
+#include "bson.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* The same document built with bson_append_*, to compare against. */
+static void build( bson* out, int user_id, int64_t ts, double score,
+                   bson_oid_t* oid, bson_bool_t active ){
+    bson_buffer bb;
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "user_id", user_id );
+    bson_append_start_object( &bb, "ts" );
+        bson_append_date( &bb, "$gt", ts );
+    bson_append_finish_object( &bb );
+    bson_append_string( &bb, "name", "x" );
+    bson_append_start_array( &bb, "a" );
+        bson_append_double( &bb, "0", score );
+        bson_append_oid( &bb, "1", oid );
+    bson_append_finish_object( &bb );
+    bson_append_bool( &bb, "active", active );
+    bson_from_buffer( out, &bb );
+}
+
+int main(){
+    bson_template t;
+    bson b, copy, expected;
+    bson_oid_t oid, oid2;
+    int64_t when = (int64_t)1300000 * 1000000;
+    int user_id, ts, score, id, active;
+
+    bson_oid_gen( &oid );
+    bson_oid_gen( &oid2 );
+
+    build( &b, 0, 0, 0.0, &oid, 0 );
+    ASSERT( bson_template_init( &t, &b ) == BSON_OK );
+    bson_destroy( &b );
+
+    user_id = bson_template_add_slot( &t, "user_id" );
+    ts = bson_template_add_slot( &t, "ts.$gt" );
+    score = bson_template_add_slot( &t, "a.0" );
+    id = bson_template_add_slot( &t, "a.1" );
+    active = bson_template_add_slot( &t, "active" );
+    ASSERT( user_id == 0 && ts == 1 && score == 2 && id == 3 && active == 4 );
+
+    /* Missing fields and variable-width values can't be slots. */
+    ASSERT( bson_template_add_slot( &t, "missing" ) == BSON_ERROR );
+    ASSERT( bson_template_add_slot( &t, "ts.$lt" ) == BSON_ERROR );
+    ASSERT( bson_template_add_slot( &t, "user_id.x" ) == BSON_ERROR );
+    ASSERT( bson_template_add_slot( &t, "name" ) == BSON_ERROR );
+    ASSERT( bson_template_add_slot( &t, "ts" ) == BSON_ERROR );
+
+    /* Patch a copy; the template keeps its values. */
+    bson_template_copy( &t, &copy );
+    ASSERT( bson_template_set_int( &t, &copy, user_id, 42 ) == BSON_OK );
+    ASSERT( bson_template_set_date( &t, &copy, ts, when ) == BSON_OK );
+    ASSERT( bson_template_set_double( &t, &copy, score, 2.5 ) == BSON_OK );
+    ASSERT( bson_template_set_oid( &t, &copy, id, &oid2 ) == BSON_OK );
+    ASSERT( bson_template_set_bool( &t, &copy, active, 7 ) == BSON_OK );
+
+    build( &expected, 42, when, 2.5, &oid2, 1 );
+    ASSERT( bson_size( &copy ) == bson_size( &expected ) );
+    ASSERT( !memcmp( copy.data, expected.data, bson_size( &copy ) ) );
+    bson_destroy( &expected );
+    bson_destroy( &copy );
+
+    build( &expected, 0, 0, 0.0, &oid, 0 );
+    ASSERT( !memcmp( t.doc.data, expected.data, bson_size( &expected ) ) );
+    bson_destroy( &expected );
+
+    /* Patch in place. */
+    ASSERT( bson_template_set_int( &t, &t.doc, user_id, -1 ) == BSON_OK );
+    build( &expected, -1, 0, 0.0, &oid, 0 );
+    ASSERT( !memcmp( t.doc.data, expected.data, bson_size( &expected ) ) );
+    bson_destroy( &expected );
+
+    /* The value's type must match the slot's. */
+    ASSERT( bson_template_set_long( &t, &t.doc, user_id, 1 ) == BSON_ERROR );
+    ASSERT( bson_template_set_int( &t, &t.doc, ts, 1 ) == BSON_ERROR );
+    ASSERT( bson_template_set_int( &t, &t.doc, 5, 1 ) == BSON_ERROR );
+    ASSERT( bson_template_set_int( &t, &t.doc, -1, 1 ) == BSON_ERROR );
+
+    bson_template_destroy( &t );
+
+    return 0;
+}
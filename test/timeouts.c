@@ -10,7 +10,6 @@
 int main() {
 
     mongo_connection conn[1];
-    bson_buffer bb;
     bson b;
     int res;
     time_t t1, t2;
@@ -29,11 +28,22 @@ int main() {
     mongo_conn_set_timeout( conn, 50 );
 
     ASSERT( conn->err == 0 );
+    t1 = time( NULL );
     res = mongo_simple_str_command( conn, "test", "$eval",
             "for(i=0; i<100000; i++) { db.foo.find() }", &b );
+    t2 = time( NULL );
 
+    /* The deadline covers the whole operation, and the connection
+     * is closed rather than left with a half-read reply. */
     ASSERT( res == MONGO_ERROR );
-    ASSERT( conn->err == MONGO_IO_ERROR );
+    ASSERT( conn->err == MONGO_OP_TIMEOUT );
+    ASSERT( t2 - t1 <= 1 );
+    ASSERT( !conn->connected );
 
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    mongo_conn_set_timeout( conn, 0 );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    mongo_destroy( conn );
     return 0;
 }
@@ -0,0 +1,154 @@
+/* trace.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 150
+#define TRACE_FILE "trace.out"
+
+static char* read_file( const char* path, int64_t* len ) {
+    FILE* f = fopen( path, "rb" );
+    char* data;
+
+    ASSERT( f );
+    fseek( f, 0, SEEK_END );
+    *len = ftell( f );
+    fseek( f, 0, SEEK_SET );
+    data = (char*)malloc( *len );
+    ASSERT( fread( data, *len, 1, f ) == 1 );
+    fclose( f );
+    return data;
+}
+
+int main() {
+    mongo_connection conn[1], other[1];
+    mongo_pipeline pipe[1];
+    mongo_reply* reply;
+    mongo_cursor* cursor;
+    mongo_trace trace[1];
+    mongo_trace_entry e;
+    bson* docs[NUM_DOCS];
+    bson_buffer bb;
+    bson b;
+    bson_iterator it;
+    char* data;
+    int64_t len, offset, last;
+    int64_t records;
+    int requests[3][8], replies[3];
+    int ids[64], conns[64], num_ids = 0;
+    int i, j;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ||
+        mongo_connect( other, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    ASSERT( mongo_trace_open( trace, TRACE_FILE ) == MONGO_OK );
+    mongo_conn_set_trace( conn, trace );
+    mongo_conn_set_trace( other, trace );
+    ASSERT( conn->trace_conn == 1 && other->trace_conn == 2 );
+
+    /* A command, an insert, and a query with one get_more. */
+    mongo_cmd_drop_collection( conn, "test", "trace", NULL );
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        docs[i] = (bson*)malloc( sizeof( bson ) );
+        bson_from_buffer( docs[i], &bb );
+    }
+    ASSERT( mongo_insert_batch( conn, "test.trace", docs, NUM_DOCS ) == MONGO_OK );
+    for( i=0; i<NUM_DOCS; i++ ) {
+        bson_destroy( docs[i] );
+        free( docs[i] );
+    }
+
+    cursor = mongo_find( conn, "test.trace", bson_empty( &b ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    for( i=0; mongo_cursor_next( cursor ) == MONGO_OK; i++ );
+    ASSERT( i == NUM_DOCS );
+    mongo_cursor_destroy( cursor );
+
+    /* Two pipelined queries on the other connection. */
+    mongo_pipeline_init( pipe, other );
+    for( i=0; i<2; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        mongo_pipeline_find( pipe, "test.trace", &b, NULL, 1, 0, 0 );
+        bson_destroy( &b );
+    }
+    ASSERT( mongo_pipeline_flush( pipe ) == MONGO_OK );
+    ASSERT( mongo_pipeline_reply( pipe, 1, &reply ) == MONGO_OK );
+    mongo_pipeline_destroy( pipe );
+
+    /* Nothing more is captured once the connections stop tracing. */
+    mongo_conn_set_trace( conn, NULL );
+    mongo_conn_set_trace( other, NULL );
+    records = trace->records;
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    ASSERT( trace->records == records );
+    ASSERT( mongo_trace_close( trace ) == MONGO_OK );
+
+    data = read_file( TRACE_FILE, &len );
+    memset( requests, 0, sizeof( requests ) );
+    memset( replies, 0, sizeof( replies ) );
+    offset = last = 0;
+
+    while( mongo_trace_next( data, len, &offset, &e ) == MONGO_OK ) {
+        ASSERT( e.conn == 1 || e.conn == 2 );
+        ASSERT( e.time_ns >= last );
+        last = e.time_ns;
+        records--;
+
+        if( !e.received ) {
+            ASSERT( e.op >= MONGO_OP_UPDATE && e.op <= MONGO_OP_KILL_CURSORS );
+            requests[e.conn][e.op - MONGO_OP_UPDATE]++;
+            ASSERT( num_ids < 64 );
+            ids[num_ids] = e.id;
+            conns[num_ids++] = e.conn;
+            continue;
+        }
+
+        /* Each reply answers a request captured before it. */
+        replies[e.conn]++;
+        for( j=0; j<num_ids; j++ )
+            if( ids[j] == e.responseTo && conns[j] == e.conn )
+                break;
+        ASSERT( j < num_ids );
+
+        /* The first batch of the find holds the documents in order. */
+        if( e.conn == 1 && replies[1] == 2 ) {
+            bson_init( &b, (char*)e.msg + 36, 0 );
+            ASSERT( bson_find( &it, &b, "i" ) && bson_iterator_int( &it ) == 0 );
+        }
+    }
+    ASSERT( offset == len && records == 0 );
+
+    ASSERT( requests[1][MONGO_OP_QUERY - MONGO_OP_UPDATE] == 2 );
+    ASSERT( requests[1][MONGO_OP_INSERT - MONGO_OP_UPDATE] == 1 );
+    ASSERT( requests[1][MONGO_OP_GET_MORE - MONGO_OP_UPDATE] == 1 );
+    ASSERT( replies[1] == 3 );
+    ASSERT( requests[2][MONGO_OP_QUERY - MONGO_OP_UPDATE] == 2 );
+    ASSERT( replies[2] == 2 );
+
+    /* A cut-off record ends the trace. */
+    offset = 0;
+    for( i=0; mongo_trace_next( data, len - 1, &offset, &e ) == MONGO_OK; i++ );
+    ASSERT( i == 10 );
+    offset = 0;
+    ASSERT( mongo_trace_next( "MTRX\1\0\0\0", 8, &offset, &e ) == MONGO_ERROR );
+
+    free( data );
+    remove( TRACE_FILE );
+    mongo_cmd_drop_collection( conn, "test", "trace", NULL );
+    mongo_destroy( conn );
+    mongo_destroy( other );
+    return 0;
+}
@@ -0,0 +1,46 @@
+/* unix_socket.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef TEST_SOCKET
+#define TEST_SOCKET "/tmp/mongodb-27017.sock"
+#endif
+
+int main() {
+    mongo_connection conn[1];
+    bson_buffer bb;
+    bson b;
+
+    if( mongo_connect( conn, TEST_SOCKET, 0 ) != MONGO_OK ) {
+        printf( "failed to connect to %s\n", TEST_SOCKET );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "unix_socket", NULL );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "a", 1 );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_insert( conn, "test.unix_socket", &b ) == MONGO_OK );
+    bson_destroy( &b );
+
+    ASSERT( mongo_count( conn, "test", "unix_socket", NULL ) == 1 );
+
+    /* Reconnects go back over the socket path. */
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "unix_socket", NULL ) == 1 );
+
+    mongo_cmd_drop_collection( conn, "test", "unix_socket", NULL );
+    mongo_destroy( conn );
+
+    /* A path that doesn't exist fails like an unreachable host. */
+    ASSERT( mongo_connect( conn, "/nonexistent/mongodb.sock", 0 ) == MONGO_ERROR );
+    ASSERT( (int)conn->err == MONGO_CONN_FAIL );
+    mongo_destroy( conn );
+
+    return 0;
+}
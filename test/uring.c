@@ -0,0 +1,100 @@
+/* uring.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "uring.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NUM_DOCS 200
+#define BIG_SIZE (100*1024)
+
+static void insert_docs( mongo_connection* conn, int count ) {
+    bson_buffer bb;
+    bson b;
+    int i;
+
+    for( i=0; i<count; i++ ) {
+        bson_buffer_init( &bb );
+        bson_append_int( &bb, "i", i );
+        bson_from_buffer( &b, &bb );
+        ASSERT( mongo_insert( conn, "test.uring", &b ) == MONGO_OK );
+        bson_destroy( &b );
+    }
+}
+
+int test_round_trips( mongo_uring* ring ) {
+    mongo_connection conns[2];
+    mongo_connection extra[1];
+    bson_buffer bb;
+    bson b;
+    char* big;
+    int i;
+
+    for( i=0; i<2; i++ ) {
+        ASSERT( mongo_connect( &conns[i], TEST_SERVER, 27017 ) == MONGO_OK );
+        ASSERT( mongo_uring_attach( ring, &conns[i] ) == MONGO_OK );
+    }
+
+    /* Every slot is taken; this one stays on plain socket calls. */
+    ASSERT( mongo_connect( extra, TEST_SERVER, 27017 ) == MONGO_OK );
+    ASSERT( mongo_uring_attach( ring, extra ) == MONGO_ERROR );
+    ASSERT( extra->uring == NULL );
+
+    mongo_cmd_drop_collection( &conns[0], "test", "uring", NULL );
+
+    insert_docs( &conns[0], NUM_DOCS );
+    insert_docs( &conns[1], NUM_DOCS );
+
+    /* Too large for the registered buffer, so written directly. */
+    big = (char*)bson_malloc( BIG_SIZE );
+    memset( big, 'x', BIG_SIZE - 1 );
+    big[BIG_SIZE - 1] = '\0';
+    bson_buffer_init( &bb );
+    bson_append_string( &bb, "big", big );
+    bson_from_buffer( &b, &bb );
+    ASSERT( mongo_insert( &conns[1], "test.uring", &b ) == MONGO_OK );
+    bson_destroy( &b );
+    free( big );
+
+    ASSERT( mongo_uring_flush( ring ) == MONGO_OK );
+
+    /* Flushed means written, not applied; conns[1]'s inserts may still
+     * be in flight when another connection counts. */
+    ASSERT( mongo_cmd_get_last_error( &conns[1], "test", NULL ) == MONGO_OK );
+    ASSERT( mongo_count( &conns[0], "test", "uring", NULL ) == 2 * NUM_DOCS + 1 );
+    ASSERT( mongo_count( &conns[1], "test", "uring", NULL ) == 2 * NUM_DOCS + 1 );
+    ASSERT( mongo_count( extra, "test", "uring", NULL ) == 2 * NUM_DOCS + 1 );
+
+    /* Detaching hands back plain socket calls. */
+    mongo_uring_detach( &conns[1] );
+    ASSERT( conns[1].uring == NULL );
+    ASSERT( mongo_simple_int_command( &conns[1], "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    mongo_cmd_drop_collection( &conns[0], "test", "uring", NULL );
+
+    mongo_destroy( &conns[0] );
+    mongo_destroy( &conns[1] );
+    mongo_destroy( extra );
+    return 0;
+}
+
+int main() {
+    mongo_uring ring[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_uring_init( ring, 2, 0 ) != MONGO_OK ) {
+        printf( "io_uring unavailable; skipping\n" );
+        return 0;
+    }
+    test_round_trips( ring );
+    mongo_uring_destroy( ring );
+
+    ASSERT( mongo_uring_init( ring, 2, MONGO_URING_DEFER ) == MONGO_OK );
+    test_round_trips( ring );
+    mongo_uring_destroy( ring );
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+/* write_concern.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static mongo_connection conn[1];
+static const char* ns = "test.write_concern";
+
+int main() {
+    mongo_write_concern wc;
+    bson_buffer bb;
+    bson b, cond, op;
+    bson* batch[2];
+    bson other;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    if( mongo_connect( conn, TEST_SERVER, 27017 ) != MONGO_OK ) {
+        printf( "failed to connect\n" );
+        exit( 1 );
+    }
+
+    mongo_cmd_drop_collection( conn, "test", "write_concern", NULL );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", 1 );
+    bson_from_buffer( &b, &bb );
+
+    /* Plain getlasterror. */
+    ASSERT( mongo_insert_safe( conn, ns, &b, NULL ) == MONGO_OK );
+    ASSERT( conn->lasterrcode == 0 );
+    ASSERT( conn->lasterrstr == NULL );
+
+    ASSERT( mongo_insert_safe( conn, ns, &b, NULL ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( conn->lasterrstr );
+
+    /* A write concern is finished on first use. */
+    mongo_write_concern_init( &wc );
+    wc.j = 1;
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", 2 );
+    bson_from_buffer( &other, &bb );
+    batch[0] = &other;
+    batch[1] = &b;
+    ASSERT( mongo_insert_batch_safe( conn, ns, batch, 2, &wc ) == MONGO_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( wc.cmd.data );
+    ASSERT( mongo_count( conn, "test", "write_concern", NULL ) == 2 );
+
+    bson_buffer_init( &bb );
+    bson_append_start_object( &bb, "$inc" );
+    bson_append_int( &bb, "x", 1 );
+    bson_append_finish_object( &bb );
+    bson_from_buffer( &op, &bb );
+
+    ASSERT( mongo_update_safe( conn, ns, &b, &op, 0, &wc ) == MONGO_OK );
+    ASSERT( conn->lasterrstr == NULL );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", 3 );
+    bson_from_buffer( &cond, &bb );
+    ASSERT( mongo_update_safe( conn, ns, &cond, &op, MONGO_UPDATE_UPSERT, &wc ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "write_concern", NULL ) == 3 );
+
+    ASSERT( mongo_remove_safe( conn, ns, &cond, &wc ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "write_concern", NULL ) == 2 );
+
+    /* A getlasterror the server refuses fails the write, however it
+     * answers. */
+    bson_destroy( &wc.cmd );
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "getlasterror", 1 );
+    bson_append_string( &bb, "wtimeout", "bogus" );
+    bson_from_buffer( &wc.cmd, &bb );
+
+    bson_buffer_init( &bb );
+    bson_append_int( &bb, "_id", 4 );
+    bson_from_buffer( &cond, &bb );
+    ASSERT( mongo_insert_safe( conn, ns, &cond, &wc ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_COMMAND_FAILED );
+    ASSERT( conn->lasterrstr );
+
+    bson_destroy( &b );
+    bson_destroy( &other );
+    bson_destroy( &cond );
+    bson_destroy( &op );
+    mongo_write_concern_destroy( &wc );
+
+    mongo_cmd_drop_collection( conn, "test", "write_concern", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}